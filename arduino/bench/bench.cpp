@@ -0,0 +1,137 @@
+/**
+ * @file bench.cpp
+ * @brief Host-side benchmark suite for the firmware hot paths.
+ *
+ * Build and run with:
+ *   pio run -e bench && .pio/build/bench/program
+ *
+ * Every benchmark reports the average time per call and the number of heap
+ * allocations per call, counted by the native HAL.
+ */
+
+#include <chrono>
+#include <stdio.h>
+#include "hal.h"
+#include "device_config.h"
+#include "state.h"
+#include "commands.h"
+#include "loop_profiler.h"
+
+#ifndef BENCH_ITERATIONS
+#define BENCH_ITERATIONS 20000
+#endif
+
+DeviceConfigProvider deviceConfigProvider;
+MqttTopics mqttTopics;
+GlobalStateProvider stateProvider(mqttTopics);
+DeviceConfig deviceConfig;
+StatusTelemetry statusTelemetry;
+AdcSampler adcSampler;
+PinStreamer pinStreamer(adcSampler);
+EdgeRules edgeRules(mqttTopics);
+ConfigReloader configReloader(deviceConfig, deviceConfigProvider);
+bool rebootOnNextLoop = false;
+CommandsProvider commandsProvider(deviceConfigProvider, configReloader, statusTelemetry, adcSampler, pinStreamer, rebootOnNextLoop);
+char payloadBuffer[MQTT_PAYLOAD_BUFFER_SIZE];
+MQTTClient mqttClient;
+MockClient mqttNetClient;
+LoopProfiler loopProfiler;
+
+template <typename TFunction>
+void runBenchmark(const char *name, unsigned long iterations, TFunction function)
+{
+    // Warm up once, so lazy initializations are not counted
+    function();
+
+    HalMock::resetAllocations();
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+        function();
+    }
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    size_t allocations = HalMock::allocations();
+
+    double nsPerCall = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+
+    printf("%-40s %12.1f ns/call %10.2f allocs/call\n", name, nsPerCall, (double)allocations / iterations);
+}
+
+int main()
+{
+    HalMock::reset();
+
+    deviceConfigProvider.resetToDefault();
+    deviceConfig = deviceConfigProvider.readFromEEprom();
+
+    IPAddress localIp(192, 168, 1, 50);
+
+    mqttClient.begin("localhost", mqttNetClient);
+    mqttClient.connect("bench");
+
+    printf("%-40s %20s %22s\n", "benchmark", "time", "heap");
+
+    runBenchmark("processIncomingMessage WRITE_DIGITAL", BENCH_ITERATIONS, []()
+                 {
+                     char result[COMMAND_RESULT_SIZE];
+                     commandsProvider.processIncomingMessage("SERIAL", "{\"command\":\"WRITE_DIGITAL\",\"arguments\":\"LED_BUILTIN:1\"}", result, sizeof(result)); });
+
+    runBenchmark("processIncomingMessage READ_DIGITAL", BENCH_ITERATIONS, []()
+                 {
+                     char result[COMMAND_RESULT_SIZE];
+                     commandsProvider.processIncomingMessage("SERIAL", "{\"command\":\"READ_DIGITAL\",\"arguments\":\"13\"}", result, sizeof(result)); });
+
+    runBenchmark("handleCommand WRITE_DIGITAL", BENCH_ITERATIONS, []()
+                 {
+                     char result[COMMAND_RESULT_SIZE];
+                     commandsProvider.handleCommand("WRITE_DIGITAL", "13:1", result, sizeof(result)); });
+
+    runBenchmark("handleCommand READ_ANALOG", BENCH_ITERATIONS, []()
+                 {
+                     char result[COMMAND_RESULT_SIZE];
+                     commandsProvider.handleCommand("READ_ANALOG", "3", result, sizeof(result)); });
+
+    runBenchmark("GlobalStateProvider::writeJsonState", BENCH_ITERATIONS, [&localIp]()
+                 {
+                     BufferPrint payload(payloadBuffer, sizeof(payloadBuffer));
+                     stateProvider.writeJsonState(payload, deviceConfig, localIp, freeMemory()); });
+
+    runBenchmark("GlobalStateProvider::writeState msgpack", BENCH_ITERATIONS, [&localIp]()
+                 {
+                     BufferPrint payload(payloadBuffer, sizeof(payloadBuffer));
+                     stateProvider.writeState(payload, PayloadEncoding::MSGPACK_ENCODING, deviceConfig, localIp, freeMemory()); });
+
+    runBenchmark("GlobalStateProvider::measureJsonState", BENCH_ITERATIONS, [&localIp]()
+                 { stateProvider.measureJsonState(deviceConfig, localIp, freeMemory()); });
+
+    runBenchmark("GlobalStateProvider::writeJsonAdvertise", BENCH_ITERATIONS, [&localIp]()
+                 {
+                     BufferPrint payload(payloadBuffer, sizeof(payloadBuffer));
+                     stateProvider.writeJsonAdvertise(payload, deviceConfig, localIp); });
+
+    runBenchmark("GlobalStateProvider::computeStateChanges", BENCH_ITERATIONS, []()
+                 { stateProvider.computeStateChanges(mqttClient, deviceConfig); });
+
+    // A toggling pin with a write rule: the scan reports and reacts to an edge every call
+    DeviceConfig rulesConfig = deviceConfig;
+    rulesConfig.RULES[0] = {RULE_CHANGE, 30, 0, RULE_WRITE, 40, HIGH, 0};
+    edgeRules.compile(rulesConfig);
+
+    runBenchmark("computeStateChanges with EdgeRules", BENCH_ITERATIONS, [&rulesConfig]()
+                 {
+                     HalMock::setDigitalInput(30, !HalMock::digitalOutput(30));
+                     stateProvider.computeStateChanges(mqttClient, rulesConfig, &edgeRules); });
+
+    runBenchmark("DeviceConfigProvider::readFromEEprom", BENCH_ITERATIONS, []()
+                 { deviceConfigProvider.readFromEEprom(); });
+
+    runBenchmark("LoopProfiler::lap", BENCH_ITERATIONS, []()
+                 {
+                     HalMock::advanceMicros(300);
+                     loopProfiler.lap(STAGE_HTTP, micros() - 300); });
+
+    return 0;
+}
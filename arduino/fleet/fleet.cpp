@@ -0,0 +1,307 @@
+/**
+ * @file fleet.cpp
+ * @brief Load test of a broker and its backend with a simulated fleet.
+ *
+ * Runs N instances of the firmware loop() on the host (see
+ * SimulatedDevice), with scripted pin activity, against the in-process
+ * broker or a real one, while FleetController sends commands and HTTP
+ * requests. Build and run with:
+ *
+ *   pio run -e fleet && .pio/build/fleet/program --devices 200 --seconds 30
+ *   .pio/build/fleet/program --broker localhost:1883 --devices 500
+ *
+ * The report gives the command round trip, the messages per second by
+ * topic and the bytes per device.
+ */
+
+#include <chrono>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "hal.h"
+#include "in_process_broker.h"
+#include "socket_broker.h"
+#include "pin_script.h"
+#include "simulated_device.h"
+#include "fleet_controller.h"
+
+struct FleetOptions
+{
+    unsigned int devices = 100;
+    double seconds = 10;
+    // Empty for the in-process broker
+    std::string brokerHost;
+    uint16_t brokerPort = 1883;
+    std::string prefix = "fleet";
+    // Over the whole fleet, per second
+    double commandRate = 50;
+    double httpRate = 10;
+    unsigned int statusInterval = 5;
+    unsigned int metricsInterval = 30;
+    bool msgpack = false;
+    const char *scriptPath = nullptr;
+};
+
+static void usage()
+{
+    printf("usage: fleet [options]\n"
+           "  --devices N          simulated devices (100)\n"
+           "  --seconds S          duration of the run (10)\n"
+           "  --broker HOST[:PORT] real broker, the in-process one otherwise\n"
+           "  --prefix P           topic prefix of the fleet (fleet)\n"
+           "  --commands R         MQTT commands per second, whole fleet (50)\n"
+           "  --http R             GET /status per second, whole fleet (10)\n"
+           "  --status S           status interval of the devices in seconds (5)\n"
+           "  --metrics S          metrics interval of the devices in seconds (30)\n"
+           "  --msgpack            devices publish MessagePack\n"
+           "  --script FILE        pin activity script (see pin_script.h)\n");
+}
+
+static bool parseOptions(int argc, char **argv, FleetOptions &options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string option = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+        bool takesValue = option != "--msgpack";
+
+        if (takesValue && value == nullptr)
+        {
+            return false;
+        }
+
+        if (option == "--devices")
+            options.devices = (unsigned int)atoi(value);
+        else if (option == "--seconds")
+            options.seconds = atof(value);
+        else if (option == "--broker")
+        {
+            std::string broker = value;
+            size_t colon = broker.rfind(':');
+
+            options.brokerHost = broker.substr(0, colon);
+            options.brokerPort = colon == std::string::npos ? 1883 : (uint16_t)atoi(broker.c_str() + colon + 1);
+        }
+        else if (option == "--prefix")
+            options.prefix = value;
+        else if (option == "--commands")
+            options.commandRate = atof(value);
+        else if (option == "--http")
+            options.httpRate = atof(value);
+        else if (option == "--status")
+            options.statusInterval = (unsigned int)atoi(value);
+        else if (option == "--metrics")
+            options.metricsInterval = (unsigned int)atoi(value);
+        else if (option == "--msgpack")
+            options.msgpack = true;
+        else if (option == "--script")
+            options.scriptPath = value;
+        else
+            return false;
+
+        i += takesValue ? 1 : 0;
+    }
+
+    return options.devices > 0 && options.seconds > 0 && options.statusInterval > 0 && options.metricsInterval > 0;
+}
+
+static void report(const FleetOptions &options, std::vector<std::unique_ptr<SimulatedDevice>> &devices, FleetController &controller,
+                   double elapsed, unsigned long sweeps, unsigned int ready)
+{
+    unsigned long published = 0;
+    unsigned long publishedBytes = 0;
+    unsigned long receivedBytes = 0;
+    unsigned long minBytes = (unsigned long)-1;
+    unsigned long maxBytes = 0;
+    unsigned long pinWrites = 0;
+    unsigned long droppedReplies = 0;
+
+    for (auto &device : devices)
+    {
+        published += device->mqtt.publishedMessages;
+        publishedBytes += device->mqtt.publishedBytes;
+        receivedBytes += device->mqtt.receivedBytes;
+        minBytes = std::min(minBytes, device->mqtt.publishedBytes);
+        maxBytes = std::max(maxBytes, device->mqtt.publishedBytes);
+        pinWrites += device->getPinWrites();
+        droppedReplies += device->getDroppedReplies();
+    }
+
+    printf("\n%u devices, %.1f s, %s broker, %s payloads, %u connected at the end\n", options.devices, elapsed,
+           options.brokerHost.empty() ? "in-process" : options.brokerHost.c_str(), options.msgpack ? "msgpack" : "json", ready);
+    printf("%lu loop() passes per device, %.1f us per pass over the fleet, %lu scripted pin writes\n\n",
+           sweeps, elapsed * 1e6 / sweeps, pinWrites);
+
+    printf("%-12s %12s %12s %14s\n", "topic", "messages", "msg/s", "bytes/msg");
+
+    unsigned long delivered = 0;
+
+    for (const auto &entry : controller.getTraffic())
+    {
+        delivered += entry.second.messages;
+        printf("%-12s %12lu %12.1f %14.1f\n", entry.first.c_str(), entry.second.messages, entry.second.messages / elapsed,
+               (double)entry.second.bytes / entry.second.messages);
+    }
+
+    printf("%-12s %12lu %12.1f %14.1f\n", "published", published, published / elapsed, published ? (double)publishedBytes / published : 0.0);
+    printf("%-12s %12lu\n\n", "delivered", delivered);
+
+    printf("bytes per device: %.0f published (min %lu, max %lu), %.0f received, %.1f B/s published\n\n",
+           (double)publishedBytes / devices.size(), minBytes, maxBytes, (double)receivedBytes / devices.size(),
+           publishedBytes / elapsed / devices.size());
+
+    printf("%-10s %8s %8s %10s %10s %10s %10s\n", "round trip", "sent", "done", "p50 ms", "p95 ms", "p99 ms", "max ms");
+    printf("%-10s %8lu %8zu %10.3f %10.3f %10.3f %10.3f\n", "mqtt", controller.getCommandsSent(), controller.commandLatencies.size(),
+           controller.commandLatencies.percentile(0.5), controller.commandLatencies.percentile(0.95),
+           controller.commandLatencies.percentile(0.99), controller.commandLatencies.percentile(1));
+    printf("%-10s %8lu %8zu %10.3f %10.3f %10.3f %10.3f\n", "http", controller.getHttpSent(), controller.httpLatencies.size(),
+           controller.httpLatencies.percentile(0.5), controller.httpLatencies.percentile(0.95),
+           controller.httpLatencies.percentile(0.99), controller.httpLatencies.percentile(1));
+
+    printf("\ncommands: %lu without reply, %lu failed, %lu replies dropped by full queues\n",
+           controller.getMissingReplies(), controller.getFailedReplies(), droppedReplies);
+    printf("http: %lu skipped (previous request running), %lu errors, %.0f bytes per response\n",
+           controller.getHttpBusy(), controller.getHttpErrors(),
+           controller.httpLatencies.size() ? (double)controller.getHttpBytes() / controller.httpLatencies.size() : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+    FleetOptions options;
+    PinScript script = PinScript::defaultScript();
+
+    if (!parseOptions(argc, argv, options))
+    {
+        usage();
+        return 2;
+    }
+
+    if (options.scriptPath != nullptr && !script.load(options.scriptPath))
+    {
+        fprintf(stderr, "Invalid pin script %s\n", options.scriptPath);
+        return 2;
+    }
+
+    std::unique_ptr<MockBroker> broker;
+    const char *host = options.brokerHost.empty() ? "localhost" : options.brokerHost.c_str();
+
+    if (options.brokerHost.empty())
+    {
+        broker.reset(new InProcessBroker());
+    }
+    else
+    {
+        broker.reset(new SocketBroker(options.brokerPort));
+    }
+
+    typedef FleetController::Clock Clock;
+    Clock::time_point started = Clock::now();
+    auto nowMicros = [&]()
+    {
+        return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - started).count();
+    };
+
+    std::vector<std::unique_ptr<SimulatedDevice>> devices;
+
+    for (unsigned int i = 0; i < options.devices; i++)
+    {
+        char overrides[256];
+
+        snprintf(overrides, sizeof(overrides),
+                 "{\"mqtt\":{\"id\":\"sim-%04u\",\"host\":\"%s\",\"prefix\":\"%s\",\"encoding\":%d},"
+                 "\"status\":{\"interval\":%u},\"metrics\":{\"interval\":%u}}",
+                 i, host, options.prefix.c_str(),
+                 options.msgpack ? PayloadEncoding::MSGPACK_ENCODING : PayloadEncoding::JSON_ENCODING,
+                 options.statusInterval, options.metricsInterval);
+
+        devices.emplace_back(new SimulatedDevice(script));
+
+        if (!devices.back()->boot(i, *broker, overrides, nowMicros()))
+        {
+            fprintf(stderr, "The configuration of device %u was rejected: %s\n", i, overrides);
+            return 1;
+        }
+    }
+
+    HalMock::select(nullptr);
+
+    FleetController controller;
+
+    if (!controller.connect(*broker, host, options.prefix.c_str(), devices.size()))
+    {
+        fprintf(stderr, "The controller cannot connect to the broker\n");
+        return 1;
+    }
+
+    printf("Running %u devices for %.1f s\n", options.devices, options.seconds);
+
+    unsigned long sweeps = 0;
+    unsigned long commandsDue = 0;
+    unsigned long httpDue = 0;
+    size_t nextTarget = 0;
+    double elapsed = 0;
+
+    while ((elapsed = nowMicros() / 1e6) < options.seconds)
+    {
+        // Requests keep their rate even when a pass over the fleet is slow
+        unsigned long commands = (unsigned long)(elapsed * options.commandRate) - commandsDue;
+        unsigned long requests = (unsigned long)(elapsed * options.httpRate) - httpDue;
+
+        for (unsigned long i = 0; i < commands + requests; i++)
+        {
+            size_t index = nextTarget++ % devices.size();
+            SimulatedDevice &device = *devices[index];
+
+            // Only the connected devices receive commands
+            if (i < commands && device.isReady())
+            {
+                controller.sendCommand(device);
+            }
+            else if (i >= commands)
+            {
+                controller.sendHttp(device, index);
+            }
+        }
+
+        commandsDue += commands;
+        httpDue += requests;
+
+        for (auto &device : devices)
+        {
+            device->enter(nowMicros());
+            device->runLoop();
+        }
+
+        HalMock::select(nullptr);
+        controller.poll();
+        sweeps++;
+    }
+
+    // Let the replies in flight arrive
+    Clock::time_point drainUntil = Clock::now() + std::chrono::milliseconds(500);
+
+    while (Clock::now() < drainUntil && controller.getMissingReplies() > 0)
+    {
+        for (auto &device : devices)
+        {
+            device->enter(nowMicros());
+            device->runLoop();
+        }
+
+        HalMock::select(nullptr);
+        controller.poll();
+    }
+
+    unsigned int ready = 0;
+
+    for (auto &device : devices)
+    {
+        ready += device->isReady() ? 1 : 0;
+    }
+
+    report(options, devices, controller, elapsed, sweeps, ready);
+
+    return 0;
+}
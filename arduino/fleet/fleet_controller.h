@@ -0,0 +1,274 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <MQTT.h>
+#include "simulated_device.h"
+
+/**
+ * Latencies of one kind of request, in milliseconds.
+ */
+class LatencySamples
+{
+private:
+    std::vector<double> samples;
+
+public:
+    void add(double milliseconds)
+    {
+        samples.push_back(milliseconds);
+    }
+
+    /**
+     * @param ratio 0.5 for the median, 0.99 for the 99th percentile
+     */
+    double percentile(double ratio)
+    {
+        if (samples.empty())
+        {
+            return 0;
+        }
+
+        std::sort(samples.begin(), samples.end());
+
+        return samples[(size_t)(ratio * (samples.size() - 1))];
+    }
+
+    size_t size() const
+    {
+        return samples.size();
+    }
+};
+
+/**
+ * The backend side of the load test: an MQTT client on the same broker as
+ * the fleet, subscribed to <prefix>/#, that sends commands with a
+ * correlation id and times their replies, and an HTTP client probing the
+ * devices. Every message published by the devices is counted per topic
+ * leaf, as a backend would receive it.
+ */
+class FleetController
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Traffic
+    {
+        unsigned long messages = 0;
+        unsigned long bytes = 0;
+    };
+
+private:
+    struct HttpProbe
+    {
+        MockClient socket;
+        Clock::time_point sent;
+        bool busy = false;
+    };
+
+    MQTTClient mqtt{MQTT_CLIENT_BUFFER_SIZE};
+    MockClient netClient;
+    std::string prefix;
+
+    std::unordered_map<unsigned long, Clock::time_point> pendingCommands;
+    unsigned long nextCommandId = 1;
+    unsigned long commandsSent = 0;
+    unsigned long failedReplies = 0;
+    unsigned long unknownReplies = 0;
+
+    std::vector<HttpProbe> httpProbes;
+    unsigned long httpSent = 0;
+    unsigned long httpBusy = 0;
+    unsigned long httpErrors = 0;
+    unsigned long httpBytes = 0;
+
+    std::map<std::string, Traffic> traffic;
+
+    static inline FleetController *instance = nullptr;
+
+    static double elapsedMillis(Clock::time_point since)
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+    }
+
+    /**
+     * @return The leaf of a device topic, "status" for both
+     * <prefix>/<id>/status and <prefix>/<id>/status/msgpack
+     */
+    static std::string leafOf(const char *topic)
+    {
+        std::string path(topic);
+        size_t end = path.size();
+
+        if (path.size() > 8 && path.compare(path.size() - 8, 8, "/msgpack") == 0)
+        {
+            end -= 8;
+        }
+
+        size_t start = path.rfind('/', end - 1);
+
+        return path.substr(start == std::string::npos ? 0 : start + 1, end - (start == std::string::npos ? 0 : start + 1));
+    }
+
+    static void onMessage(MQTTClient *client, char topic[], char bytes[], int length)
+    {
+        instance->received(topic, bytes, length);
+    }
+
+    void received(const char *topic, const char *payload, int length)
+    {
+        std::string leaf = leafOf(topic);
+
+        // Our own commands come back through the wildcard
+        if (leaf == "receive")
+        {
+            return;
+        }
+
+        Traffic &counters = traffic[leaf];
+        counters.messages++;
+        counters.bytes += length;
+
+        if (leaf != "response")
+        {
+            return;
+        }
+
+        // {"id":42,"ok":true,"result":"Success"}
+        const char *id = strstr(payload, "\"id\":");
+        auto pending = id != nullptr ? pendingCommands.find(strtoul(id + 5, nullptr, 10)) : pendingCommands.end();
+
+        if (pending == pendingCommands.end())
+        {
+            unknownReplies++;
+            return;
+        }
+
+        commandLatencies.add(elapsedMillis(pending->second));
+        pendingCommands.erase(pending);
+
+        if (strstr(payload, "\"ok\":true") == nullptr)
+        {
+            failedReplies++;
+        }
+    }
+
+public:
+    LatencySamples commandLatencies;
+    LatencySamples httpLatencies;
+
+    /**
+     * @return false if the broker refused the connection
+     */
+    bool connect(MockBroker &broker, const char *host, const char *topicPrefix, size_t devices)
+    {
+        instance = this;
+        prefix = topicPrefix;
+        httpProbes = std::vector<HttpProbe>(devices);
+
+        mqtt.begin(host, netClient);
+        mqtt.setKeepAlive(60);
+        mqtt.onMessageAdvanced(&FleetController::onMessage);
+        mqtt.attach(&broker);
+
+        return mqtt.connect("fleet-controller") && mqtt.subscribe((prefix + "/#").c_str());
+    }
+
+    /**
+     * Publishes a command with a correlation id on the commands topic of a
+     * device, alternating between a write and a read.
+     */
+    void sendCommand(SimulatedDevice &device)
+    {
+        char payload[96];
+        unsigned long id = nextCommandId++;
+
+        if (id % 2 == 0)
+        {
+            snprintf(payload, sizeof(payload), "{\"id\":%lu,\"command\":\"WRITE_DIGITAL\",\"arguments\":\"LED_BUILTIN:%lu\"}", id, (id / 2) % 2);
+        }
+        else
+        {
+            snprintf(payload, sizeof(payload), "{\"id\":%lu,\"command\":\"READ_DIGITAL\",\"arguments\":\"30\"}", id);
+        }
+
+        pendingCommands[id] = Clock::now();
+        commandsSent++;
+
+        mqtt.publish(device.topic(TOPIC_RECEIVE), payload, (int)strlen(payload));
+    }
+
+    /**
+     * Opens an HTTP connection to a device and sends a GET /status, unless
+     * the previous request to that device is still running.
+     */
+    void sendHttp(SimulatedDevice &device, size_t index)
+    {
+        HttpProbe &probe = httpProbes[index];
+
+        if (probe.busy)
+        {
+            httpBusy++;
+            return;
+        }
+
+        probe.socket.clearOutput();
+        probe.socket.inject("GET /status HTTP/1.1\r\nAccept: application/json\r\nConnection: close\r\n\r\n");
+
+        if (!device.acceptHttp(probe.socket))
+        {
+            httpErrors++;
+            return;
+        }
+
+        probe.sent = Clock::now();
+        probe.busy = true;
+        httpSent++;
+    }
+
+    /**
+     * Receives the replies and collects the finished HTTP requests.
+     */
+    void poll()
+    {
+        mqtt.loop();
+
+        for (HttpProbe &probe : httpProbes)
+        {
+            // The front end closes the socket once the response is written
+            if (!probe.busy || probe.socket.connected())
+            {
+                continue;
+            }
+
+            probe.busy = false;
+
+            if (probe.socket.txLength < 12 || strncmp(probe.socket.tx, "HTTP/1.1 200", 12) != 0)
+            {
+                httpErrors++;
+                continue;
+            }
+
+            httpLatencies.add(elapsedMillis(probe.sent));
+            httpBytes += probe.socket.txLength;
+        }
+    }
+
+    const std::map<std::string, Traffic> &getTraffic() const
+    {
+        return traffic;
+    }
+
+    unsigned long getCommandsSent() const { return commandsSent; }
+    unsigned long getMissingReplies() const { return pendingCommands.size(); }
+    unsigned long getFailedReplies() const { return failedReplies; }
+    unsigned long getUnknownReplies() const { return unknownReplies; }
+    unsigned long getHttpSent() const { return httpSent; }
+    unsigned long getHttpBusy() const { return httpBusy; }
+    unsigned long getHttpErrors() const { return httpErrors; }
+    unsigned long getHttpBytes() const { return httpBytes; }
+};
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <MQTT.h>
+
+/**
+ * @return true if an MQTT topic matches a subscription filter, with the
+ * '+' (one level) and '#' (remaining levels) wildcards
+ */
+inline bool topicMatches(const char *filter, const char *topic)
+{
+    while (*filter != 0)
+    {
+        if (*filter == '#')
+        {
+            return true;
+        }
+
+        if (*filter == '+')
+        {
+            while (*topic != 0 && *topic != '/')
+            {
+                topic++;
+            }
+
+            filter++;
+            continue;
+        }
+
+        if (*filter != *topic)
+        {
+            // "a/#" also matches "a"
+            return *topic == 0 && filter[0] == '/' && filter[1] == '#' && filter[2] == 0;
+        }
+
+        filter++;
+        topic++;
+    }
+
+    return *topic == 0;
+}
+
+/**
+ * Broker running inside the harness process, the default network of the
+ * simulated fleet.
+ *
+ * A publish is copied into the inbox of every session with a matching
+ * subscription, and handed to the client on its next loop(), as a real
+ * broker would deliver it over the socket. Filters without wildcards (the
+ * command topics of the devices) are found through a hash map, so routing
+ * does not grow with the size of the fleet.
+ */
+class InProcessBroker : public MockBroker
+{
+private:
+    struct Message
+    {
+        std::string topic;
+        std::string payload;
+    };
+
+    struct Session
+    {
+        bool connected = false;
+        std::vector<std::string> filters;
+        std::deque<Message> inbox;
+    };
+
+    std::unordered_map<MQTTClient *, Session> sessions;
+    std::unordered_map<std::string, std::vector<MQTTClient *>> exactRoutes;
+    std::vector<std::pair<std::string, MQTTClient *>> wildcardRoutes;
+
+    unsigned long routedMessages = 0;
+
+    static bool hasWildcard(const std::string &filter)
+    {
+        return filter.find_first_of("+#") != std::string::npos;
+    }
+
+    void removeRoute(MQTTClient &client, const std::string &filter)
+    {
+        if (hasWildcard(filter))
+        {
+            for (auto it = wildcardRoutes.begin(); it != wildcardRoutes.end(); ++it)
+            {
+                if (it->first == filter && it->second == &client)
+                {
+                    wildcardRoutes.erase(it);
+                    return;
+                }
+            }
+
+            return;
+        }
+
+        std::vector<MQTTClient *> &clients = exactRoutes[filter];
+
+        for (auto it = clients.begin(); it != clients.end(); ++it)
+        {
+            if (*it == &client)
+            {
+                clients.erase(it);
+                return;
+            }
+        }
+    }
+
+    void enqueue(MQTTClient *client, const char *topic, const char *payload, int length)
+    {
+        Session &session = sessions[client];
+
+        if (session.connected)
+        {
+            session.inbox.push_back({topic, std::string(payload, length)});
+            routedMessages++;
+        }
+    }
+
+public:
+    bool connect(MQTTClient &client, const char *host, const char *clientId) override
+    {
+        // A clean session: the previous subscriptions are dropped
+        disconnect(client);
+        sessions[&client].connected = true;
+
+        return true;
+    }
+
+    void disconnect(MQTTClient &client) override
+    {
+        Session &session = sessions[&client];
+
+        for (const std::string &filter : session.filters)
+        {
+            removeRoute(client, filter);
+        }
+
+        session.filters.clear();
+        session.inbox.clear();
+        session.connected = false;
+    }
+
+    bool connected(MQTTClient &client) override
+    {
+        return sessions[&client].connected;
+    }
+
+    bool publish(MQTTClient &client, const char *topic, const char *payload, int length) override
+    {
+        auto exact = exactRoutes.find(topic);
+
+        if (exact != exactRoutes.end())
+        {
+            for (MQTTClient *subscriber : exact->second)
+            {
+                enqueue(subscriber, topic, payload, length);
+            }
+        }
+
+        for (const auto &route : wildcardRoutes)
+        {
+            if (topicMatches(route.first.c_str(), topic))
+            {
+                enqueue(route.second, topic, payload, length);
+            }
+        }
+
+        return true;
+    }
+
+    bool subscribe(MQTTClient &client, const char *topic) override
+    {
+        Session &session = sessions[&client];
+
+        for (const std::string &filter : session.filters)
+        {
+            if (filter == topic)
+            {
+                return true;
+            }
+        }
+
+        session.filters.push_back(topic);
+
+        if (hasWildcard(topic))
+        {
+            wildcardRoutes.push_back({topic, &client});
+        }
+        else
+        {
+            exactRoutes[topic].push_back(&client);
+        }
+
+        return true;
+    }
+
+    bool unsubscribe(MQTTClient &client, const char *topic) override
+    {
+        Session &session = sessions[&client];
+
+        for (auto it = session.filters.begin(); it != session.filters.end(); ++it)
+        {
+            if (*it == topic)
+            {
+                removeRoute(client, *it);
+                session.filters.erase(it);
+                break;
+            }
+        }
+
+        return true;
+    }
+
+    void loop(MQTTClient &client) override
+    {
+        Session &session = sessions[&client];
+
+        // Only the messages queued so far, the callbacks may publish more
+        size_t pending = session.inbox.size();
+
+        while (pending-- > 0 && session.connected && !session.inbox.empty())
+        {
+            Message message = std::move(session.inbox.front());
+            session.inbox.pop_front();
+
+            client.deliver(message.topic.c_str(), message.payload.data(), (int)message.payload.size());
+        }
+    }
+
+    unsigned long getRoutedMessages() const
+    {
+        return routedMessages;
+    }
+};
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <stdio.h>
+#include <vector>
+#include "hal.h"
+
+/**
+ * Scripted activity on the input pins of a simulated device.
+ *
+ * A script is a list of "<ms> <pin> <value>" lines, e.g.
+ *
+ *   # a push button on pin 30, a door contact on pin 31
+ *   0    30 1
+ *   150  30 0
+ *   1000 31 1
+ *   period 4000
+ *
+ * replayed every period (the last time plus one second when "period" is
+ * not given). Every device runs it from its own offset, so the fleet does
+ * not toggle its pins in lockstep.
+ */
+class PinScript
+{
+public:
+    struct Event
+    {
+        unsigned long at;
+        uint8_t pin;
+        uint8_t value;
+    };
+
+    /**
+     * Position of one device in the script.
+     */
+    struct Cursor
+    {
+        unsigned long cycleStart = 0;
+        size_t next = 0;
+    };
+
+private:
+    std::vector<Event> events;
+    unsigned long period = 0;
+
+public:
+    /**
+     * Two pins toggled every few hundred milliseconds.
+     */
+    static PinScript defaultScript()
+    {
+        PinScript script;
+
+        script.events = {{0, 30, 1}, {250, 31, 1}, {500, 30, 0}, {750, 31, 0}};
+        script.period = 2000;
+
+        return script;
+    }
+
+    /**
+     * @return false if the file cannot be read or a line is invalid
+     */
+    bool load(const char *path)
+    {
+        FILE *file = fopen(path, "r");
+        char line[128];
+
+        if (file == nullptr)
+        {
+            return false;
+        }
+
+        events.clear();
+        period = 0;
+
+        bool valid = true;
+
+        while (valid && fgets(line, sizeof(line), file) != nullptr)
+        {
+            unsigned long at = 0;
+            unsigned int pin = 0;
+            unsigned int value = 0;
+            char first = 0;
+
+            if (sscanf(line, " %c", &first) != 1 || first == '#')
+            {
+                continue;
+            }
+
+            if (sscanf(line, " period %lu", &period) == 1)
+            {
+                continue;
+            }
+
+            valid = sscanf(line, "%lu %u %u", &at, &pin, &value) == 3 && pin < NUM_DIGITAL_PINS && value <= 1 &&
+                    (events.empty() || at >= events.back().at);
+
+            if (valid)
+            {
+                events.push_back({at, (uint8_t)pin, (uint8_t)value});
+            }
+        }
+
+        fclose(file);
+
+        if (period == 0 && !events.empty())
+        {
+            period = events.back().at + 1000;
+        }
+
+        return valid && !events.empty() && period > events.back().at;
+    }
+
+    Cursor start(unsigned long now, unsigned long offset) const
+    {
+        Cursor cursor;
+
+        cursor.cycleStart = now + (period > 0 ? offset % period : 0);
+
+        return cursor;
+    }
+
+    /**
+     * Applies the events that are due on the selected board.
+     *
+     * @return The number of pins written
+     */
+    unsigned int apply(Cursor &cursor, unsigned long now) const
+    {
+        unsigned int applied = 0;
+
+        while (!events.empty() && (long)(now - cursor.cycleStart - events[cursor.next].at) >= 0)
+        {
+            HalMock::setDigitalInput(events[cursor.next].pin, events[cursor.next].value);
+            applied++;
+
+            if (++cursor.next == events.size())
+            {
+                cursor.next = 0;
+                cursor.cycleStart += period;
+            }
+        }
+
+        return applied;
+    }
+
+    size_t size() const
+    {
+        return events.size();
+    }
+};
@@ -0,0 +1,432 @@
+#pragma once
+
+#include <string>
+#include "hal.h"
+#include "device_config.h"
+#include "config_reload.h"
+#include "state.h"
+#include "telemetry.h"
+#include "commands.h"
+#include "command_replies.h"
+#include "mqtt_connection.h"
+#include "http_front_end.h"
+#include "memory_metrics.h"
+#include "telemetry_scheduler.h"
+#include "pin_script.h"
+
+/**
+ * One ardumi board simulated on the host.
+ *
+ * It owns the objects main.cpp declares as globals, a board of the native
+ * HAL and an MQTT client attached to the harness broker. runLoop() is the
+ * body of loop(), with the TaskScheduler tasks replaced by deadlines. The
+ * aWOT router is replaced by the few routes the harness requests, served
+ * through the same HttpFrontEnd.
+ *
+ * The firmware callbacks are plain function pointers, so they reach the
+ * device through SimulatedDevice::running, set while its loop runs.
+ */
+class SimulatedDevice
+{
+private:
+    MockBoard board;
+    uint8_t uniqueId[UniqueIDsize];
+
+    DeviceConfigProvider configProvider;
+    ConfigReloader configReloader{config, configProvider};
+    MqttTopics topics;
+    GlobalStateProvider stateProvider{topics};
+    StatusTelemetry statusTelemetry;
+    MemoryMetricsProvider memoryMetrics;
+    AdcSampler adcSampler;
+    PinStreamer pinStreamer{adcSampler};
+    EdgeRules edgeRules{topics};
+    TelemetryScheduler telemetryScheduler;
+    bool rebootOnNextLoop = false;
+    CommandsProvider commandsProvider{configProvider, configReloader, statusTelemetry, adcSampler, pinStreamer, rebootOnNextLoop};
+    CommandReplyQueue commandReplies;
+
+    MockClient mqttNetClient;
+    MqttConnectionProvider mqttConnection{mqtt, topics, &SimulatedDevice::advertise};
+    HttpFrontEnd<MockClientHandle> httpFrontEnd{&SimulatedDevice::serveHttp};
+
+    char payloadBuffer[MQTT_PAYLOAD_BUFFER_SIZE];
+    IPAddress localIp;
+
+    const PinScript &script;
+    PinScript::Cursor scriptCursor;
+
+    // Next runs of the main.cpp tasks, in milliseconds
+    unsigned long nextConnectionStep = 0;
+    unsigned long nextScan = 0;
+    unsigned long nextStatus = 0;
+    unsigned long nextMetrics = 0;
+
+    unsigned long pinWrites = 0;
+
+    static bool isDue(unsigned long deadline, unsigned long now)
+    {
+        return (long)(now - deadline) >= 0;
+    }
+
+    static void mqttMessage(MQTTClient *client, char topic[], char bytes[], int length)
+    {
+        CommandReply reply;
+        PayloadEncoding encoding = isMsgPackTopic(topic) ? PayloadEncoding::MSGPACK_ENCODING : PayloadEncoding::JSON_ENCODING;
+
+        running->commandsProvider.processIncomingMessage(topic, bytes, length, encoding, reply);
+        running->commandReplies.push(reply);
+    }
+
+    static void advertise()
+    {
+        SimulatedDevice &device = *running;
+        BufferPrint payload(device.payloadBuffer, sizeof(device.payloadBuffer));
+
+        device.stateProvider.writeAdvertise(payload, (PayloadEncoding)device.config.PAYLOAD_ENCODING, device.config, device.localIp);
+        device.mqtt.publish(device.topics.get(TOPIC_ADVERTISE), payload.c_str(), payload.length());
+        device.telemetryScheduler.resetBackoff();
+    }
+
+    static void configSaved()
+    {
+        running->stateProvider.invalidateFragments();
+    }
+
+    static void respond(MockClientHandle &client, int status, const char *contentType, size_t length)
+    {
+        client.print(F("HTTP/1.1 "));
+        client.print(status);
+        client.print(status == 200 ? F(" OK") : status == 400 ? F(" Bad Request") : F(" Not Found"));
+        client.print(F("\r\nContent-Type: "));
+        client.print(contentType);
+        client.print(F("\r\nContent-Length: "));
+        client.print((unsigned int)length);
+        client.print(F("\r\n\r\n"));
+    }
+
+    /**
+     * Routes of main.cpp used by the harness: GET /status, GET /metrics
+     * and POST /commands, in JSON.
+     */
+    static bool serveHttp(HttpRequestStream &request, MockClientHandle &client, bool keepAlive)
+    {
+        SimulatedDevice &device = *running;
+        char line[32];
+        size_t length = 0;
+        int c;
+
+        while (length + 1 < sizeof(line) && (c = request.read()) >= 0 && c != '\r')
+        {
+            line[length++] = (char)c;
+        }
+
+        line[length] = 0;
+
+        // Skip the headers, the body follows the empty line
+        for (int newlines = 0; newlines < 2 && (c = request.read()) >= 0;)
+        {
+            newlines = c == '\n' ? newlines + 1 : (c == '\r' ? newlines : 0);
+        }
+
+        if (strncmp(line, "GET /status ", 12) == 0)
+        {
+            int freeBytes = freeMemory();
+            size_t size = device.stateProvider.measureState(PayloadEncoding::JSON_ENCODING, device.config, device.localIp, freeBytes);
+
+            respond(client, 200, JSON_CONTENT_TYPE, size);
+            device.stateProvider.writeState(client, PayloadEncoding::JSON_ENCODING, device.config, device.localIp, freeBytes);
+        }
+        else if (strncmp(line, "GET /metrics ", 13) == 0)
+        {
+            MemorySnapshot snapshot = device.sampleMetrics();
+
+            respond(client, 200, JSON_CONTENT_TYPE, device.memoryMetrics.measureMetrics(PayloadEncoding::JSON_ENCODING, snapshot));
+            device.memoryMetrics.writeMetrics(client, PayloadEncoding::JSON_ENCODING, snapshot);
+        }
+        else if (strncmp(line, "POST /commands ", 15) == 0)
+        {
+            char result[COMMAND_RESULT_SIZE];
+            bool success = device.commandsProvider.processIncomingMessage("HTTP", request, PayloadEncoding::JSON_ENCODING, result, sizeof(result));
+
+            respond(client, success ? 200 : 400, "text/plain", strlen(result));
+            client.print(result);
+        }
+        else
+        {
+            respond(client, 404, "text/plain", 0);
+        }
+
+        // Every response has a Content-Length
+        return true;
+    }
+
+    /**
+     * Same as applyConfigChanges() in main.cpp, without the HTTP port: the
+     * simulated server is not bound to one.
+     */
+    void applyConfigChanges(uint8_t changes, unsigned long now)
+    {
+        if (changes & CONFIG_CHANGED_MQTT_OPTIONS)
+        {
+            mqtt.setKeepAlive(config.MQTT_KEEPALIVE);
+            mqtt.setTimeout(config.MQTT_TIMEOUT);
+        }
+
+        if (changes & CONFIG_CHANGED_MQTT_SERVER)
+        {
+            mqttConnection.reconnect();
+            mqtt.begin(config.MQTT_SERVER_HOST, mqttNetClient);
+            nextConnectionStep = now;
+        }
+        else if (changes & CONFIG_CHANGED_MQTT_TOPICS)
+        {
+            mqttConnection.resubscribe();
+            nextConnectionStep = now;
+        }
+
+        if (changes & CONFIG_CHANGED_TELEMETRY)
+        {
+            telemetryScheduler.configure(config);
+            nextStatus = now + telemetryScheduler.nextDelay(TELEMETRY_STATUS, now);
+            nextMetrics = now + telemetryScheduler.nextDelay(TELEMETRY_METRICS, now);
+            statusTelemetry.requestKeyframe();
+        }
+
+        if (changes & CONFIG_CHANGED_ANALOG)
+        {
+            adcSampler.begin(config);
+        }
+
+        if (changes & CONFIG_CHANGED_RULES)
+        {
+            edgeRules.compile(config);
+        }
+    }
+
+    void broadcastStatus(unsigned long now)
+    {
+        BufferPrint payload(payloadBuffer, sizeof(payloadBuffer));
+        PayloadEncoding encoding = (PayloadEncoding)config.PAYLOAD_ENCODING;
+        bool delta = config.STATUS_MODE == StatusTelemetryMode::DELTA_STATUS;
+
+        if (delta)
+        {
+            statusTelemetry.writeStatus(payload, encoding, stateProvider, config, localIp, freeMemory());
+        }
+        else
+        {
+            stateProvider.writeState(payload, encoding, config, localIp, freeMemory());
+        }
+
+        bool success = !payload.overflowed() && mqtt.publish(topics.get(TOPIC_STATUS), payload.c_str(), payload.length());
+
+        if (delta)
+        {
+            statusTelemetry.published(success);
+        }
+
+        telemetryScheduler.published(TELEMETRY_STATUS, success || payload.overflowed());
+        nextStatus = now + telemetryScheduler.nextDelay(TELEMETRY_STATUS, now);
+    }
+
+    MemorySnapshot sampleMetrics()
+    {
+        MemorySnapshot snapshot = memoryMetrics.sample();
+
+        snapshot.adcOverruns = adcSampler.droppedSamples();
+
+        return snapshot;
+    }
+
+    void broadcastMetrics(unsigned long now)
+    {
+        BufferPrint payload(payloadBuffer, sizeof(payloadBuffer));
+
+        memoryMetrics.writeMetrics(payload, (PayloadEncoding)config.PAYLOAD_ENCODING, sampleMetrics());
+
+        telemetryScheduler.published(TELEMETRY_METRICS, mqtt.publish(topics.get(TOPIC_METRICS), payload.c_str(), payload.length()));
+        nextMetrics = now + telemetryScheduler.nextDelay(TELEMETRY_METRICS, now);
+    }
+
+public:
+    static inline SimulatedDevice *running = nullptr;
+
+    DeviceConfig config;
+    MQTTClient mqtt{MQTT_CLIENT_BUFFER_SIZE};
+
+    SimulatedDevice(const PinScript &script) : script(script)
+    {
+    }
+
+    /**
+     * Routes the HAL and the firmware callbacks to this device, with the
+     * board clock at the harness time.
+     */
+    void enter(unsigned long nowMicros)
+    {
+        HalMock::select(&board);
+        memcpy(UniqueID, uniqueId, sizeof(uniqueId));
+
+        // The firmware also moves the clock, e.g. with delay()
+        if ((long)(nowMicros - board.microseconds) > 0)
+        {
+            board.microseconds = nowMicros;
+        }
+
+        running = this;
+    }
+
+    /**
+     * The setup() of main.cpp, on a blank board.
+     *
+     * @param index Position in the fleet, makes the unique id and the ip
+     * @param overrides Partial JSON configuration applied over the defaults
+     * @return false if the overrides were rejected
+     */
+    bool boot(unsigned int index, MockBroker &broker, const char *overrides, unsigned long nowMicros)
+    {
+        HalMock::select(&board);
+        HalMock::reset();
+
+        for (size_t i = 0; i < UniqueIDsize; i++)
+        {
+            uniqueId[i] = (uint8_t)((index * 2654435761UL) >> (8 * (i % 4))) ^ (uint8_t)i;
+        }
+
+        enter(nowMicros);
+
+        localIp = IPAddress(10, 0, (index >> 8) & 0xFF, index & 0xFF);
+
+        configProvider.onSaved(&SimulatedDevice::configSaved);
+        config = configProvider.readFromEEprom();
+
+        JsonDocument json;
+
+        if (deserializeJson(json, overrides) || !configReloader.update(json.as<JsonVariantConst>()))
+        {
+            return false;
+        }
+
+        // Applied below, as setup() would
+        configReloader.takeChanges();
+
+        adcSampler.begin(config);
+        edgeRules.compile(config);
+        telemetryScheduler.configure(config);
+
+        mqtt.begin(config.MQTT_SERVER_HOST, mqttNetClient);
+        mqtt.setKeepAlive(config.MQTT_KEEPALIVE);
+        mqtt.setTimeout(config.MQTT_TIMEOUT);
+        mqtt.onMessageAdvanced(&SimulatedDevice::mqttMessage);
+        mqtt.attach(&broker);
+        MqttConnectionProvider::seedJitter();
+
+        unsigned long now = millis();
+
+        nextConnectionStep = now;
+        nextScan = now;
+        nextStatus = now + telemetryScheduler.phase(TELEMETRY_STATUS);
+        nextMetrics = now + telemetryScheduler.phase(TELEMETRY_METRICS);
+        scriptCursor = script.start(now, telemetryScheduler.phase(TELEMETRY_STATUS));
+
+        return true;
+    }
+
+    /**
+     * One pass of loop(). The device must be entered first.
+     */
+    void runLoop()
+    {
+        unsigned long now = millis();
+        unsigned long loopStarted = micros();
+
+        if (rebootOnNextLoop)
+        {
+            // A reboot keeps the EEPROM, the session is opened again
+            rebootOnNextLoop = false;
+            mqttConnection.reconnect();
+        }
+
+        if (configReloader.hasChanges())
+        {
+            applyConfigChanges(configReloader.takeChanges(), now);
+        }
+
+        pinWrites += script.apply(scriptCursor, now);
+
+        if (isDue(nextConnectionStep, now))
+        {
+            nextConnectionStep = now + mqttConnection.step(config);
+        }
+
+        if (isDue(nextScan, now))
+        {
+            uint8_t changes = stateProvider.computeStateChanges(mqtt, config, &edgeRules);
+            changes += stateProvider.publishAnalogChanges(mqtt, config, adcSampler, &edgeRules);
+
+            if (changes > 0 && telemetryScheduler.onPinActivity(now))
+            {
+                nextStatus = now + telemetryScheduler.nextDelay(TELEMETRY_STATUS, now);
+            }
+
+            if (edgeRules.hasScheduled())
+            {
+                edgeRules.runDue(now);
+            }
+
+            nextScan = now + telemetryScheduler.getScanInterval();
+        }
+
+        if (isDue(nextStatus, now))
+        {
+            broadcastStatus(now);
+        }
+
+        if (isDue(nextMetrics, now))
+        {
+            broadcastMetrics(now);
+        }
+
+        httpFrontEnd.poll();
+
+        if (mqtt.connected())
+        {
+            mqtt.loop();
+            commandReplies.flush(mqtt, topics, payloadBuffer, sizeof(payloadBuffer));
+            pinStreamer.flush(mqtt, mqttNetClient, topics.get(TOPIC_STREAM), payloadBuffer, sizeof(payloadBuffer));
+        }
+
+        telemetryScheduler.recordLoop(micros() - loopStarted);
+    }
+
+    /**
+     * Hands a client socket to the HTTP server, as ethServer.accept() would.
+     *
+     * @return false if every connection slot is busy
+     */
+    bool acceptHttp(MockClient &socket)
+    {
+        return httpFrontEnd.accept(MockClientHandle(&socket));
+    }
+
+    bool isReady() const
+    {
+        return mqttConnection.isReady();
+    }
+
+    const char *topic(MqttTopic topic) const
+    {
+        return topics.get(topic);
+    }
+
+    unsigned long getPinWrites() const
+    {
+        return pinWrites;
+    }
+
+    unsigned long getDroppedReplies() const
+    {
+        return commandReplies.droppedReplies();
+    }
+};
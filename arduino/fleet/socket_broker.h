@@ -0,0 +1,358 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <MQTT.h>
+
+#define SOCKET_BROKER_CONNECT_TIMEOUT 3000
+#define SOCKET_BROKER_SEND_TIMEOUT 1000
+
+/**
+ * Real broker reached over TCP (mosquitto, EMQX, ...), one socket per
+ * simulated device, so the load lands on the broker and on whatever the
+ * backend subscribes.
+ *
+ * Only what the firmware uses of MQTT 3.1.1 is spoken: CONNECT with a
+ * clean session, QoS 0 PUBLISH, SUBSCRIBE, UNSUBSCRIBE, PINGREQ and
+ * DISCONNECT. The host of every client is the one given to
+ * MQTTClient::begin(), so the devices connect where their configuration
+ * says.
+ */
+class SocketBroker : public MockBroker
+{
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Connection
+    {
+        int socket = -1;
+        uint16_t keepAlive = 0;
+        uint16_t nextPacketId = 1;
+        std::vector<uint8_t> received;
+        Clock::time_point lastSent;
+    };
+
+    uint16_t port;
+    std::unordered_map<MQTTClient *, Connection> connections;
+
+    static void writeLength(std::vector<uint8_t> &packet, size_t length)
+    {
+        do
+        {
+            uint8_t digit = length % 128;
+            length /= 128;
+            packet.push_back(length > 0 ? (digit | 0x80) : digit);
+        } while (length > 0);
+    }
+
+    static void writeString(std::vector<uint8_t> &packet, const char *str, size_t length)
+    {
+        packet.push_back((uint8_t)(length >> 8));
+        packet.push_back((uint8_t)length);
+        packet.insert(packet.end(), str, str + length);
+    }
+
+    /**
+     * @return The packet, fixed header included
+     */
+    static std::vector<uint8_t> packet(uint8_t type, const std::vector<uint8_t> &body)
+    {
+        std::vector<uint8_t> out;
+
+        out.push_back(type);
+        writeLength(out, body.size());
+        out.insert(out.end(), body.begin(), body.end());
+
+        return out;
+    }
+
+    static bool waitFor(int socket, short events, int timeout)
+    {
+        pollfd descriptor = {socket, events, 0};
+        return poll(&descriptor, 1, timeout) > 0 && (descriptor.revents & events);
+    }
+
+    void close(Connection &connection)
+    {
+        if (connection.socket >= 0)
+        {
+            ::close(connection.socket);
+        }
+
+        connection.socket = -1;
+        connection.received.clear();
+    }
+
+    bool send(Connection &connection, const std::vector<uint8_t> &bytes)
+    {
+        size_t sent = 0;
+
+        while (connection.socket >= 0 && sent < bytes.size())
+        {
+            ssize_t count = ::send(connection.socket, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+
+            if (count > 0)
+            {
+                sent += count;
+            }
+            else if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                // The broker does not keep up, this is part of the measure
+                if (!waitFor(connection.socket, POLLOUT, SOCKET_BROKER_SEND_TIMEOUT))
+                {
+                    close(connection);
+                }
+            }
+            else
+            {
+                close(connection);
+            }
+        }
+
+        connection.lastSent = Clock::now();
+
+        return connection.socket >= 0;
+    }
+
+    int open(const char *host)
+    {
+        addrinfo hints = {};
+        addrinfo *addresses = nullptr;
+        char service[8];
+
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(service, sizeof(service), "%u", (unsigned int)port);
+
+        if (getaddrinfo(host, service, &hints, &addresses) != 0)
+        {
+            return -1;
+        }
+
+        int fd = -1;
+
+        for (addrinfo *address = addresses; address != nullptr && fd < 0; address = address->ai_next)
+        {
+            fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+
+            if (fd >= 0 && ::connect(fd, address->ai_addr, address->ai_addrlen) != 0)
+            {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+
+        freeaddrinfo(addresses);
+
+        if (fd >= 0)
+        {
+            int noDelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        }
+
+        return fd;
+    }
+
+    /**
+     * Hands the complete PUBLISH packets received so far to the client.
+     */
+    void dispatch(MQTTClient &client, Connection &connection)
+    {
+        std::vector<uint8_t> &rx = connection.received;
+        size_t offset = 0;
+
+        while (rx.size() - offset >= 2)
+        {
+            size_t length = 0;
+            size_t header = 1;
+            uint32_t multiplier = 1;
+            bool complete = false;
+
+            while (header < 5 && offset + header < rx.size())
+            {
+                uint8_t digit = rx[offset + header++];
+                length += (digit & 0x7F) * multiplier;
+                multiplier *= 128;
+
+                if (!(digit & 0x80))
+                {
+                    complete = true;
+                    break;
+                }
+            }
+
+            if (!complete || rx.size() - offset < header + length)
+            {
+                break;
+            }
+
+            const uint8_t *body = rx.data() + offset + header;
+            uint8_t type = rx[offset] >> 4;
+
+            if (type == 3 && length >= 2)
+            {
+                size_t topicLength = (body[0] << 8) | body[1];
+                size_t payloadStart = 2 + topicLength + (((rx[offset] >> 1) & 0x03) > 0 ? 2 : 0);
+
+                if (payloadStart <= length)
+                {
+                    std::string topic((const char *)body + 2, topicLength);
+                    client.deliver(topic.c_str(), (const char *)body + payloadStart, (int)(length - payloadStart));
+                }
+            }
+
+            // SUBACK, UNSUBACK and PINGRESP need no action
+            offset += header + length;
+        }
+
+        rx.erase(rx.begin(), rx.begin() + offset);
+    }
+
+public:
+    explicit SocketBroker(uint16_t port) : port(port)
+    {
+    }
+
+    ~SocketBroker()
+    {
+        for (auto &entry : connections)
+        {
+            close(entry.second);
+        }
+    }
+
+    bool connect(MQTTClient &client, const char *host, const char *clientId) override
+    {
+        Connection &connection = connections[&client];
+
+        close(connection);
+        connection.socket = open(host != nullptr ? host : "localhost");
+
+        if (connection.socket < 0)
+        {
+            return false;
+        }
+
+        std::vector<uint8_t> body;
+
+        connection.keepAlive = client.keepAlive;
+        writeString(body, "MQTT", 4);
+        body.push_back(4);
+        // Clean session
+        body.push_back(0x02);
+        body.push_back((uint8_t)(connection.keepAlive >> 8));
+        body.push_back((uint8_t)connection.keepAlive);
+        writeString(body, clientId, strlen(clientId));
+
+        uint8_t connack[4];
+
+        if (!send(connection, packet(0x10, body)) ||
+            !waitFor(connection.socket, POLLIN, SOCKET_BROKER_CONNECT_TIMEOUT) ||
+            recv(connection.socket, connack, sizeof(connack), MSG_WAITALL) != sizeof(connack) ||
+            connack[0] != 0x20 || connack[3] != 0)
+        {
+            close(connection);
+            return false;
+        }
+
+        fcntl(connection.socket, F_SETFL, fcntl(connection.socket, F_GETFL) | O_NONBLOCK);
+
+        return true;
+    }
+
+    void disconnect(MQTTClient &client) override
+    {
+        Connection &connection = connections[&client];
+
+        send(connection, {0xE0, 0x00});
+        close(connection);
+    }
+
+    bool connected(MQTTClient &client) override
+    {
+        return connections[&client].socket >= 0;
+    }
+
+    bool publish(MQTTClient &client, const char *topic, const char *payload, int length) override
+    {
+        std::vector<uint8_t> body;
+
+        writeString(body, topic, strlen(topic));
+        body.insert(body.end(), payload, payload + length);
+
+        return send(connections[&client], packet(0x30, body));
+    }
+
+    bool subscribe(MQTTClient &client, const char *topic) override
+    {
+        Connection &connection = connections[&client];
+        std::vector<uint8_t> body;
+        uint16_t packetId = connection.nextPacketId++;
+
+        body.push_back((uint8_t)(packetId >> 8));
+        body.push_back((uint8_t)packetId);
+        writeString(body, topic, strlen(topic));
+        // QoS 0
+        body.push_back(0);
+
+        return send(connection, packet(0x82, body));
+    }
+
+    bool unsubscribe(MQTTClient &client, const char *topic) override
+    {
+        Connection &connection = connections[&client];
+        std::vector<uint8_t> body;
+        uint16_t packetId = connection.nextPacketId++;
+
+        body.push_back((uint8_t)(packetId >> 8));
+        body.push_back((uint8_t)packetId);
+        writeString(body, topic, strlen(topic));
+
+        return send(connection, packet(0xA2, body));
+    }
+
+    void loop(MQTTClient &client) override
+    {
+        Connection &connection = connections[&client];
+        uint8_t buffer[1024];
+        bool closed = false;
+
+        while (connection.socket >= 0)
+        {
+            ssize_t count = recv(connection.socket, buffer, sizeof(buffer), 0);
+
+            if (count > 0)
+            {
+                connection.received.insert(connection.received.end(), buffer, buffer + count);
+                continue;
+            }
+
+            // 0 when closed by the broker
+            closed = count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+            break;
+        }
+
+        dispatch(client, connection);
+
+        if (closed)
+        {
+            close(connection);
+        }
+
+        if (connection.socket >= 0 && connection.keepAlive > 0 &&
+            Clock::now() - connection.lastSent >= std::chrono::seconds(connection.keepAlive) / 2)
+        {
+            send(connection, {0xC0, 0x00});
+        }
+    }
+};
@@ -0,0 +1,288 @@
+#pragma once
+
+/**
+ * @file Arduino.h
+ * @brief In-memory replacement of the Arduino core for the native environment.
+ *
+ * Only the subset of the Arduino API used by the firmware core is provided.
+ * Hardware state (pins, clock, serial) lives in memory and can be driven
+ * from tests and benchmarks through HalMock (see hal_mock.h).
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+// Same pin layout as the Arduino Mega 2560
+#define NUM_DIGITAL_PINS 70
+#define NUM_ANALOG_INPUTS 16
+#define LED_BUILTIN 13
+#define PIN_A0 54
+
+// Program memory is plain memory on the host
+#define PROGMEM
+#define PGM_P const char *
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+#define pgm_read_float(addr) (*(const float *)(addr))
+#define pgm_read_ptr(addr) (*(void *const *)(addr))
+#define strlen_P strlen
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strstr_P strstr
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define memcmp_P memcmp
+#define memcpy_P memcpy
+#define snprintf_P snprintf
+
+size_t strlcpy_P(char *destination, const char *source, size_t size);
+
+// avr-libc provides strlcpy, glibc only since 2.38
+#if defined(__APPLE__) || (defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 38)))
+#define MOCK_HAS_STRLCPY
+#else
+size_t strlcpy(char *destination, const char *source, size_t size);
+#endif
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(string_literal))
+
+/* ---------------------------------------------------------------------------
+ * Pins and clock
+ * ------------------------------------------------------------------------- */
+
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t value);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+
+// Simulated port layout: 8 consecutive pins per port, starting from port 1
+#define NOT_A_PORT 0
+#define MOCK_PORT_COUNT 10
+
+uint8_t digitalPinToPort(uint8_t pin);
+uint8_t digitalPinToBitMask(uint8_t pin);
+volatile uint8_t *portInputRegister(uint8_t port);
+volatile uint8_t *portOutputRegister(uint8_t port);
+
+// There are no interrupts on the native environment
+#define noInterrupts()
+#define interrupts()
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// Deterministic pseudo random generator, restarted by HalMock::reset()
+void randomSeed(unsigned long seed);
+long random(long howBig);
+long random(long howSmall, long howBig);
+
+/* ---------------------------------------------------------------------------
+ * String
+ * ------------------------------------------------------------------------- */
+
+class String
+{
+private:
+    char *buffer;
+    unsigned int capacity;
+    unsigned int len;
+
+    void invalidate();
+    bool grow(unsigned int size);
+    String &copy(const char *cstr, unsigned int length);
+
+public:
+    String(const char *cstr = "");
+    String(const __FlashStringHelper *str);
+    String(const String &str);
+    String(String &&str);
+    explicit String(char c);
+    explicit String(unsigned char value, unsigned char base = DEC);
+    explicit String(int value, unsigned char base = DEC);
+    explicit String(unsigned int value, unsigned char base = DEC);
+    explicit String(long value, unsigned char base = DEC);
+    explicit String(unsigned long value, unsigned char base = DEC);
+    ~String();
+
+    String &operator=(const String &rhs);
+    String &operator=(String &&rhs);
+    String &operator=(const char *cstr);
+    String &operator=(const __FlashStringHelper *str);
+
+    bool reserve(unsigned int size);
+    bool concat(const String &str);
+    bool concat(const char *cstr);
+    bool concat(const char *cstr, unsigned int length);
+    bool concat(char c);
+    bool concat(int value);
+    bool concat(unsigned long value);
+    bool concat(const __FlashStringHelper *str);
+
+    String &operator+=(const String &rhs) { concat(rhs); return *this; }
+    String &operator+=(const char *cstr) { concat(cstr); return *this; }
+    String &operator+=(char c) { concat(c); return *this; }
+    String &operator+=(int value) { concat(value); return *this; }
+    String &operator+=(const __FlashStringHelper *str) { concat(str); return *this; }
+
+    bool equals(const String &str) const;
+    bool equals(const char *cstr) const;
+    bool operator==(const String &rhs) const { return equals(rhs); }
+    bool operator==(const char *cstr) const { return equals(cstr); }
+    bool operator==(const __FlashStringHelper *str) const { return equals(reinterpret_cast<const char *>(str)); }
+    bool operator!=(const String &rhs) const { return !equals(rhs); }
+    bool operator!=(const char *cstr) const { return !equals(cstr); }
+
+    unsigned int length() const { return len; }
+    const char *c_str() const { return buffer; }
+    char charAt(unsigned int index) const;
+    char operator[](unsigned int index) const { return charAt(index); }
+    int indexOf(char c, unsigned int fromIndex = 0) const;
+    String substring(unsigned int beginIndex) const { return substring(beginIndex, len); }
+    String substring(unsigned int beginIndex, unsigned int endIndex) const;
+    long toInt() const;
+};
+
+/* ---------------------------------------------------------------------------
+ * Print, Printable, Stream, Client
+ * ------------------------------------------------------------------------- */
+
+class Print;
+
+class Printable
+{
+public:
+    virtual ~Printable() {}
+    virtual size_t printTo(Print &p) const = 0;
+};
+
+class Print
+{
+private:
+    size_t printNumber(unsigned long value, uint8_t base);
+
+public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    // As in the AVR core: 0 when the free space is not known
+    virtual int availableForWrite() { return 0; }
+    size_t write(const char *str) { return str == nullptr ? 0 : write((const uint8_t *)str, strlen(str)); }
+    size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+
+    size_t print(const __FlashStringHelper *str) { return write(reinterpret_cast<const char *>(str)); }
+    size_t print(const String &str) { return write(str.c_str(), str.length()); }
+    size_t print(const char *str) { return write(str); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char value, int base = DEC) { return print((unsigned long)value, base); }
+    size_t print(int value, int base = DEC) { return print((long)value, base); }
+    size_t print(unsigned int value, int base = DEC) { return print((unsigned long)value, base); }
+    size_t print(long value, int base = DEC);
+    size_t print(unsigned long value, int base = DEC);
+    size_t print(double value, int digits = 2);
+    size_t print(const Printable &printable) { return printable.printTo(*this); }
+
+    size_t println() { return write("\r\n"); }
+    template <typename T>
+    size_t println(const T &value) { return print(value) + println(); }
+    template <typename T>
+    size_t println(const T &value, int format) { return print(value, format) + println(); }
+};
+
+class Stream : public Print
+{
+protected:
+    unsigned long timeout = 1000;
+
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() {}
+
+    void setTimeout(unsigned long ms) { timeout = ms; }
+    size_t readBytes(char *buffer, size_t length);
+    size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); }
+    String readString();
+};
+
+class IPAddress : public Printable
+{
+private:
+    uint8_t octets[4];
+
+public:
+    IPAddress() : octets{0, 0, 0, 0} {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : octets{a, b, c, d} {}
+
+    uint8_t operator[](int index) const { return octets[index]; }
+    uint8_t &operator[](int index) { return octets[index]; }
+    bool operator==(const IPAddress &rhs) const { return memcmp(octets, rhs.octets, 4) == 0; }
+
+    size_t printTo(Print &p) const override;
+};
+
+class Client : public Stream
+{
+public:
+    virtual int connect(IPAddress ip, uint16_t port) = 0;
+    virtual int connect(const char *host, uint16_t port) = 0;
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int read(uint8_t *buffer, size_t size) = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+    virtual void stop() = 0;
+    virtual uint8_t connected() = 0;
+    virtual operator bool() = 0;
+
+    using Print::write;
+};
+
+/* ---------------------------------------------------------------------------
+ * Serial
+ * ------------------------------------------------------------------------- */
+
+class HardwareSerial : public Stream
+{
+public:
+    void begin(unsigned long baud) { (void)baud; }
+    void end() {}
+    operator bool() { return true; }
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+
+    using Print::write;
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,12 @@
+#pragma once
+
+/**
+ * @file ArduinoUniqueID.h
+ * @brief Native replacement of ArduinoUniqueID, the id bytes are set through HalMock.
+ */
+
+#include <Arduino.h>
+
+#define UniqueIDsize 9
+
+extern uint8_t UniqueID[UniqueIDsize];
@@ -0,0 +1,25 @@
+#pragma once
+
+/**
+ * @file EEPROM.h
+ * @brief In-memory EEPROM for the native environment (same size as the Mega 2560).
+ */
+
+#include <Arduino.h>
+
+#define MOCK_EEPROM_SIZE 4096
+
+class EEPROMClass
+{
+public:
+    // The AVR library returns iterators here, the firmware only uses them as no-op calls
+    void begin() {}
+    void end() {}
+
+    uint8_t read(int address);
+    void write(int address, uint8_t value);
+    void update(int address, uint8_t value);
+    uint16_t length() { return MOCK_EEPROM_SIZE; }
+};
+
+extern EEPROMClass EEPROM;
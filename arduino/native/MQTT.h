@@ -0,0 +1,217 @@
+#pragma once
+
+/**
+ * @file MQTT.h
+ * @brief In-memory replacement of the 256dpi MQTTClient for the native environment.
+ *
+ * By default nothing leaves the process: publishes are counted and the last
+ * one is kept in a fixed buffer, so recording a message does not allocate.
+ * Incoming messages are injected with deliver(). A MockBroker attached with
+ * attach() carries the messages instead (see fleet/).
+ */
+
+#include <Arduino.h>
+#include "hal_mock.h"
+
+#define MOCK_MQTT_TOPIC_SIZE 128
+#define MOCK_MQTT_PAYLOAD_SIZE 2048
+
+class MQTTClient;
+
+typedef void (*MQTTClientCallbackSimple)(String &topic, String &payload);
+typedef void (*MQTTClientCallbackAdvanced)(MQTTClient *client, char topic[], char bytes[], int length);
+
+/**
+ * Network behind MQTTClient, e.g. a broker running in the process or a
+ * real one over TCP. Messages for a client are handed back to it with
+ * MQTTClient::deliver() during its loop().
+ */
+class MockBroker
+{
+public:
+    virtual ~MockBroker() {}
+
+    virtual bool connect(MQTTClient &client, const char *host, const char *clientId) = 0;
+    virtual void disconnect(MQTTClient &client) = 0;
+    virtual bool connected(MQTTClient &client) = 0;
+    virtual bool publish(MQTTClient &client, const char *topic, const char *payload, int length) = 0;
+    virtual bool subscribe(MQTTClient &client, const char *topic) = 0;
+    virtual bool unsubscribe(MQTTClient &client, const char *topic) = 0;
+    virtual void loop(MQTTClient &client) = 0;
+};
+
+class MQTTClient
+{
+private:
+    Client *netClient = nullptr;
+    MQTTClientCallbackSimple callback = nullptr;
+    MQTTClientCallbackAdvanced advancedCallback = nullptr;
+    bool isConnected = false;
+    bool acceptConnections = true;
+    MockBroker *broker = nullptr;
+    const char *host = nullptr;
+
+public:
+    int keepAlive = 10;
+    int timeout = 1000;
+    unsigned long connections = 0;
+    unsigned long publishedMessages = 0;
+    unsigned long publishedBytes = 0;
+    unsigned long receivedMessages = 0;
+    unsigned long receivedBytes = 0;
+    unsigned long subscriptions = 0;
+    unsigned long unsubscriptions = 0;
+    char lastSubscription[MOCK_MQTT_TOPIC_SIZE] = {0};
+    char lastTopic[MOCK_MQTT_TOPIC_SIZE] = {0};
+    char lastPayload[MOCK_MQTT_PAYLOAD_SIZE] = {0};
+    size_t lastPayloadLength = 0;
+
+    MQTTClient(int bufSize = 128) { (void)bufSize; }
+
+    void begin(const char hostname[], Client &client)
+    {
+        host = hostname;
+        netClient = &client;
+    }
+
+    void onMessage(MQTTClientCallbackSimple cb) { callback = cb; }
+    void onMessageAdvanced(MQTTClientCallbackAdvanced cb) { advancedCallback = cb; }
+    void setKeepAlive(int keepAlive) { this->keepAlive = keepAlive; }
+    void setCleanSession(bool cleanSession) { (void)cleanSession; }
+    void setTimeout(int timeout) { this->timeout = timeout; }
+    void dropOverflow(bool enabled) { (void)enabled; }
+
+    /**
+     * Makes the next connect() calls fail or succeed, to simulate a broker outage.
+     */
+    void setBrokerAvailable(bool available) { acceptConnections = available; }
+
+    /**
+     * Sends the messages through a broker, nullptr to only record them.
+     */
+    void attach(MockBroker *broker) { this->broker = broker; }
+
+    bool connect(const char clientId[], bool skip = false)
+    {
+        (void)clientId;
+        (void)skip;
+        isConnected = acceptConnections && (broker == nullptr || broker->connect(*this, host, clientId));
+        connections++;
+        return isConnected;
+    }
+
+    bool publish(const char topic[], const char payload[], int length, bool retained = false, int qos = 0)
+    {
+        (void)retained;
+        (void)qos;
+
+        if (!connected() || (broker != nullptr && !broker->publish(*this, topic, payload, length)))
+        {
+            return false;
+        }
+
+        publishedMessages++;
+        publishedBytes += length;
+
+        strncpy(lastTopic, topic, sizeof(lastTopic) - 1);
+        lastPayloadLength = (size_t)length < sizeof(lastPayload) ? length : sizeof(lastPayload) - 1;
+        memcpy(lastPayload, payload, lastPayloadLength);
+        lastPayload[lastPayloadLength] = 0;
+
+        return true;
+    }
+
+    bool publish(const char topic[], const char payload[]) { return publish(topic, payload, (int)strlen(payload)); }
+    bool publish(const char topic[], const String &payload) { return publish(topic, payload.c_str(), (int)payload.length()); }
+    bool publish(const String &topic, const String &payload) { return publish(topic.c_str(), payload.c_str(), (int)payload.length()); }
+
+    bool subscribe(const char topic[], int qos = 0)
+    {
+        (void)qos;
+        strncpy(lastSubscription, topic, sizeof(lastSubscription) - 1);
+        subscriptions++;
+        return connected() && (broker == nullptr || broker->subscribe(*this, topic));
+    }
+
+    bool subscribe(const String &topic, int qos = 0) { return subscribe(topic.c_str(), qos); }
+
+    bool unsubscribe(const char topic[])
+    {
+        unsubscriptions++;
+        return connected() && (broker == nullptr || broker->unsubscribe(*this, topic));
+    }
+
+    bool loop()
+    {
+        if (connected() && broker != nullptr)
+        {
+            broker->loop(*this);
+        }
+
+        return connected();
+    }
+
+    bool connected()
+    {
+        // A broker may drop the session on its side
+        if (isConnected && broker != nullptr && !broker->connected(*this))
+        {
+            isConnected = false;
+        }
+
+        return isConnected;
+    }
+
+    int lastError() { return isConnected ? 0 : -3; }
+
+    bool disconnect()
+    {
+        if (isConnected && broker != nullptr)
+        {
+            broker->disconnect(*this);
+        }
+
+        isConnected = false;
+        return true;
+    }
+
+    /**
+     * Simulates a message arriving from the broker.
+     */
+    void deliver(const char topic[], const char payload[])
+    {
+        deliver(topic, payload, (int)strlen(payload));
+    }
+
+    /**
+     * Simulates a binary message arriving from the broker.
+     */
+    void deliver(const char topic[], const char payload[], int length)
+    {
+        static char topicBuffer[MOCK_MQTT_TOPIC_SIZE];
+        static char payloadBuffer[MOCK_MQTT_PAYLOAD_SIZE];
+
+        receivedMessages++;
+        receivedBytes += length;
+
+        if (advancedCallback != nullptr)
+        {
+            strncpy(topicBuffer, topic, sizeof(topicBuffer) - 1);
+            length = length < (int)sizeof(payloadBuffer) - 1 ? length : (int)sizeof(payloadBuffer) - 1;
+            memcpy(payloadBuffer, payload, length);
+            payloadBuffer[length] = 0;
+
+            advancedCallback(this, topicBuffer, payloadBuffer, length);
+            return;
+        }
+
+        if (callback == nullptr)
+        {
+            return;
+        }
+
+        String topicStr(topic);
+        String payloadStr(payload);
+        callback(topicStr, payloadStr);
+    }
+};
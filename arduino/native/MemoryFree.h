@@ -0,0 +1,8 @@
+#pragma once
+
+/**
+ * @file MemoryFree.h
+ * @brief Native replacement of MemoryFree. The value is set through HalMock.
+ */
+
+int freeMemory();
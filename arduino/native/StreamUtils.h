@@ -0,0 +1,56 @@
+#pragma once
+
+/**
+ * @file StreamUtils.h
+ * @brief Native replacement of the StreamUtils EepromStream, backed by the mocked EEPROM.
+ */
+
+#include <Arduino.h>
+#include <EEPROM.h>
+
+class EepromStream : public Stream
+{
+private:
+    size_t readAddress;
+    size_t writeAddress;
+    size_t end;
+
+public:
+    EepromStream(size_t address, size_t size)
+        : readAddress(address), writeAddress(address), end(address + size) {}
+
+    int available() override { return (int)(end - readAddress); }
+
+    int read() override
+    {
+        if (readAddress >= end)
+        {
+            return -1;
+        }
+
+        return EEPROM.read((int)readAddress++);
+    }
+
+    int peek() override
+    {
+        if (readAddress >= end)
+        {
+            return -1;
+        }
+
+        return EEPROM.read((int)readAddress);
+    }
+
+    size_t write(uint8_t c) override
+    {
+        if (writeAddress >= end)
+        {
+            return 0;
+        }
+
+        EEPROM.update((int)writeAddress++, c);
+        return 1;
+    }
+
+    using Print::write;
+};
@@ -0,0 +1,238 @@
+#pragma once
+
+/**
+ * @file hal_mock.h
+ * @brief Control surface of the in-memory HAL used by the native environment.
+ *
+ * Tests and benchmarks use HalMock to drive the simulated board: set input
+ * pins, read back outputs, move the clock forward, feed the serial port and
+ * count heap allocations.
+ */
+
+#include <Arduino.h>
+#include <EEPROM.h>
+
+#define MOCK_SERIAL_BUFFER_SIZE 512
+#define MOCK_CLIENT_BUFFER_SIZE 2048
+
+// Simulated SRAM of an ATmega2560
+#define MOCK_RAM_SIZE 8192
+#define MOCK_HEAP_START 0x0800
+#define MOCK_STACK_START (MOCK_RAM_SIZE - 256)
+#define MOCK_MALLOC_MARGIN 128
+#define MOCK_FREE_BLOCKS 4
+
+/**
+ * Memory layout read by MemoryMetricsProvider in place of the avr-libc
+ * symbols. Offsets are relative to bytes.
+ */
+struct MockRam
+{
+    uint8_t bytes[MOCK_RAM_SIZE];
+    // __heap_start, __brkval and SP
+    size_t heapStart;
+    size_t heapEnd;
+    size_t stackPointer;
+    // Sizes of the blocks in the malloc free list
+    size_t freeBlocks[MOCK_FREE_BLOCKS];
+    uint8_t freeBlockCount;
+};
+
+struct MockBoard
+{
+    uint8_t pinModes[NUM_DIGITAL_PINS];
+    uint8_t digitalValues[NUM_DIGITAL_PINS];
+    volatile uint8_t portInputs[MOCK_PORT_COUNT];
+    int analogValues[NUM_DIGITAL_PINS];
+    uint8_t eeprom[MOCK_EEPROM_SIZE];
+    size_t eepromWrites;
+    unsigned long microseconds;
+    unsigned long randomState;
+    int freeMemory;
+    MockRam ram;
+
+    char serialInput[MOCK_SERIAL_BUFFER_SIZE];
+    size_t serialInputHead;
+    size_t serialInputTail;
+    size_t serialBytesWritten;
+    bool serialEcho;
+};
+
+class HalMock
+{
+public:
+    /**
+     * Restores the board to power-on state: every pin LOW, erased EEPROM
+     * (0xFF), clock at zero and empty serial buffers.
+     */
+    static void reset();
+
+    static MockBoard &board();
+
+    /**
+     * Routes the HAL to another board, nullptr for the default one, so a
+     * process can simulate several devices (see fleet/). A new board must
+     * be reset() once selected.
+     */
+    static void select(MockBoard *board);
+
+    static void setDigitalInput(uint8_t pin, int value);
+    static int digitalOutput(uint8_t pin);
+    static void setAnalogInput(uint8_t pin, int value);
+    static int analogOutput(uint8_t pin);
+
+    /**
+     * Number of EEPROM cells written since reset(), to check wear.
+     */
+    static size_t eepromWrites();
+
+    static void advanceMicros(unsigned long us);
+    static void advanceMillis(unsigned long ms) { advanceMicros(ms * 1000UL); }
+
+    static void feedSerial(const char *data);
+    static void feedSerial(const char *data, size_t length);
+    static size_t serialBytesWritten();
+    static void setSerialEcho(bool enabled);
+
+    /**
+     * Number of heap allocations (malloc, calloc, realloc and operator new)
+     * since the last resetAllocations().
+     */
+    static size_t allocations();
+    static void resetAllocations();
+};
+
+/**
+ * Network client with in-memory receive and transmit buffers.
+ */
+class MockClient : public Client
+{
+private:
+    uint8_t rx[MOCK_CLIENT_BUFFER_SIZE];
+    size_t rxHead = 0;
+    size_t rxTail = 0;
+    bool isConnected = false;
+
+public:
+    char tx[MOCK_CLIENT_BUFFER_SIZE];
+    size_t txLength = 0;
+    // Milliseconds stop() would wait for the peer, as in EthernetClient
+    uint16_t connectionTimeout = 1000;
+    // Free space of the socket transmit buffer, set by the test
+    int writeSpace = 0;
+
+    /**
+     * Queues bytes as if they were received from the remote peer.
+     */
+    void inject(const char *data)
+    {
+        isConnected = true;
+
+        while (*data != 0 && rxTail < sizeof(rx))
+        {
+            rx[rxTail++] = (uint8_t)*data++;
+        }
+    }
+
+    void clearOutput() { txLength = 0; }
+    void setConnectionTimeout(uint16_t timeout) { connectionTimeout = timeout; }
+    int availableForWrite() override { return writeSpace; }
+
+    int connect(IPAddress ip, uint16_t port) override
+    {
+        (void)ip;
+        (void)port;
+        isConnected = true;
+        return 1;
+    }
+
+    int connect(const char *host, uint16_t port) override
+    {
+        (void)host;
+        (void)port;
+        isConnected = true;
+        return 1;
+    }
+
+    size_t write(uint8_t c) override
+    {
+        if (txLength >= sizeof(tx))
+        {
+            return 0;
+        }
+
+        tx[txLength++] = (char)c;
+        return 1;
+    }
+
+    size_t write(const uint8_t *buffer, size_t size) override
+    {
+        size_t written = 0;
+
+        while (written < size && write(buffer[written]) == 1)
+        {
+            written++;
+        }
+
+        return written;
+    }
+
+    int available() override { return (int)(rxTail - rxHead); }
+    int read() override { return rxHead < rxTail ? rx[rxHead++] : -1; }
+    int peek() override { return rxHead < rxTail ? rx[rxHead] : -1; }
+
+    int read(uint8_t *buffer, size_t size) override
+    {
+        size_t count = 0;
+
+        while (count < size && rxHead < rxTail)
+        {
+            buffer[count++] = rx[rxHead++];
+        }
+
+        return (int)count;
+    }
+
+    void flush() override {}
+
+    void stop() override
+    {
+        isConnected = false;
+        rxHead = rxTail = 0;
+    }
+
+    uint8_t connected() override { return isConnected; }
+    operator bool() override { return isConnected; }
+
+    using Print::write;
+};
+
+/**
+ * Copyable handle to a MockClient, like EthernetClient is to a socket,
+ * for the code that stores clients by value (HttpFrontEnd).
+ */
+class MockClientHandle : public Client
+{
+public:
+    MockClient *socket = nullptr;
+
+    MockClientHandle() {}
+    MockClientHandle(MockClient *socket) : socket(socket) {}
+
+    int connect(IPAddress ip, uint16_t port) override { return socket->connect(ip, port); }
+    int connect(const char *host, uint16_t port) override { return socket->connect(host, port); }
+    size_t write(uint8_t c) override { return socket->write(c); }
+    size_t write(const uint8_t *buffer, size_t size) override { return socket->write(buffer, size); }
+    int availableForWrite() override { return socket->availableForWrite(); }
+    int available() override { return socket->available(); }
+    int read() override { return socket->read(); }
+    int read(uint8_t *buffer, size_t size) override { return socket->read(buffer, size); }
+    int peek() override { return socket->peek(); }
+    void flush() override {}
+    void stop() override { socket->stop(); }
+    void setConnectionTimeout(uint16_t timeout) { socket->setConnectionTimeout(timeout); }
+    uint8_t connected() override { return socket->connected(); }
+    operator bool() override { return socket != nullptr; }
+
+    using Print::write;
+};
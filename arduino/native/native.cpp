@@ -0,0 +1,826 @@
+/**
+ * @file native.cpp
+ * @brief Implementation of the in-memory Arduino core used by the native environment.
+ */
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <MemoryFree.h>
+#include <ArduinoUniqueID.h>
+#include "hal_mock.h"
+#include "memory_metrics.h"
+#include <stdio.h>
+
+/* ---------------------------------------------------------------------------
+ * Heap allocation counting (glibc)
+ * ------------------------------------------------------------------------- */
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void __libc_free(void *ptr);
+
+static size_t heapAllocations = 0;
+
+// Same counters as the board build (memory_hooks.cpp)
+HeapCounters heapCounters;
+
+static void *countAllocation(void *ptr)
+{
+    heapAllocations++;
+
+    if (ptr == nullptr)
+    {
+        heapCounters.failures++;
+    }
+    else
+    {
+        heapCounters.allocations++;
+    }
+
+    return ptr;
+}
+
+extern "C" void *malloc(size_t size)
+{
+    return countAllocation(__libc_malloc(size));
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    return countAllocation(__libc_calloc(count, size));
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    return countAllocation(__libc_realloc(ptr, size));
+}
+
+extern "C" void free(void *ptr)
+{
+    if (ptr != nullptr)
+    {
+        heapCounters.frees++;
+    }
+
+    __libc_free(ptr);
+}
+
+/* ---------------------------------------------------------------------------
+ * Board state
+ * ------------------------------------------------------------------------- */
+
+static MockBoard defaultBoard;
+static MockBoard *currentBoard = nullptr;
+
+MockBoard &HalMock::board()
+{
+    if (currentBoard == nullptr)
+    {
+        currentBoard = &defaultBoard;
+        reset();
+    }
+
+    return *currentBoard;
+}
+
+void HalMock::select(MockBoard *board)
+{
+    currentBoard = board != nullptr ? board : &defaultBoard;
+}
+
+void HalMock::reset()
+{
+    MockBoard &b = board();
+
+    memset(b.pinModes, INPUT, sizeof(b.pinModes));
+    memset(b.digitalValues, LOW, sizeof(b.digitalValues));
+    memset(b.analogValues, 0, sizeof(b.analogValues));
+
+    for (int i = 0; i < MOCK_PORT_COUNT; i++)
+    {
+        b.portInputs[i] = 0;
+    }
+    memset(b.eeprom, 0xFF, sizeof(b.eeprom));
+
+    b.eepromWrites = 0;
+    b.microseconds = 0;
+    b.randomState = 1;
+    b.freeMemory = 4096;
+
+    memset(b.ram.bytes, 0, sizeof(b.ram.bytes));
+    b.ram.heapStart = MOCK_HEAP_START;
+    b.ram.heapEnd = MOCK_HEAP_START;
+    b.ram.stackPointer = MOCK_STACK_START;
+    b.ram.freeBlockCount = 0;
+    b.serialInputHead = 0;
+    b.serialInputTail = 0;
+    b.serialBytesWritten = 0;
+    b.serialEcho = false;
+}
+
+void HalMock::setDigitalInput(uint8_t pin, int value)
+{
+    if (pin >= NUM_DIGITAL_PINS)
+    {
+        return;
+    }
+
+    MockBoard &b = board();
+
+    b.digitalValues[pin] = value ? HIGH : LOW;
+
+    // Keep the simulated port input register in sync
+    if (value)
+    {
+        b.portInputs[digitalPinToPort(pin)] |= digitalPinToBitMask(pin);
+    }
+    else
+    {
+        b.portInputs[digitalPinToPort(pin)] &= ~digitalPinToBitMask(pin);
+    }
+}
+
+int HalMock::digitalOutput(uint8_t pin)
+{
+    if (pin >= NUM_DIGITAL_PINS)
+    {
+        return LOW;
+    }
+
+    // Read back through the port register, which also sees direct port writes
+    return (board().portInputs[digitalPinToPort(pin)] & digitalPinToBitMask(pin)) ? HIGH : LOW;
+}
+
+void HalMock::setAnalogInput(uint8_t pin, int value)
+{
+    if (pin < NUM_DIGITAL_PINS)
+    {
+        board().analogValues[pin] = value;
+    }
+}
+
+int HalMock::analogOutput(uint8_t pin)
+{
+    return pin < NUM_DIGITAL_PINS ? board().analogValues[pin] : 0;
+}
+
+void HalMock::advanceMicros(unsigned long us)
+{
+    board().microseconds += us;
+}
+
+void HalMock::feedSerial(const char *data)
+{
+    feedSerial(data, strlen(data));
+}
+
+void HalMock::feedSerial(const char *data, size_t length)
+{
+    MockBoard &b = board();
+
+    while (length > 0 && b.serialInputTail < sizeof(b.serialInput))
+    {
+        b.serialInput[b.serialInputTail++] = *data++;
+        length--;
+    }
+}
+
+size_t HalMock::eepromWrites()
+{
+    return board().eepromWrites;
+}
+
+size_t HalMock::serialBytesWritten()
+{
+    return board().serialBytesWritten;
+}
+
+void HalMock::setSerialEcho(bool enabled)
+{
+    board().serialEcho = enabled;
+}
+
+size_t HalMock::allocations()
+{
+    return heapAllocations;
+}
+
+void HalMock::resetAllocations()
+{
+    heapAllocations = 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Pins, clock, memory and ids
+ * ------------------------------------------------------------------------- */
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+    if (pin < NUM_DIGITAL_PINS)
+    {
+        HalMock::board().pinModes[pin] = mode;
+    }
+}
+
+int digitalRead(uint8_t pin)
+{
+    return HalMock::digitalOutput(pin);
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+    HalMock::setDigitalInput(pin, value);
+}
+
+int analogRead(uint8_t pin)
+{
+    return HalMock::analogOutput(pin);
+}
+
+void analogWrite(uint8_t pin, int value)
+{
+    HalMock::setAnalogInput(pin, value);
+}
+
+uint8_t digitalPinToPort(uint8_t pin)
+{
+    return pin < NUM_DIGITAL_PINS ? pin / 8 + 1 : NOT_A_PORT;
+}
+
+uint8_t digitalPinToBitMask(uint8_t pin)
+{
+    return 1 << (pin % 8);
+}
+
+volatile uint8_t *portInputRegister(uint8_t port)
+{
+    return port < MOCK_PORT_COUNT ? &HalMock::board().portInputs[port] : nullptr;
+}
+
+volatile uint8_t *portOutputRegister(uint8_t port)
+{
+    // Simulated pins loop back: writing the output register changes the input register
+    return portInputRegister(port);
+}
+
+unsigned long millis()
+{
+    return HalMock::board().microseconds / 1000UL;
+}
+
+unsigned long micros()
+{
+    return HalMock::board().microseconds;
+}
+
+void delay(unsigned long ms)
+{
+    HalMock::advanceMillis(ms);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    HalMock::advanceMicros(us);
+}
+
+void randomSeed(unsigned long seed)
+{
+    if (seed != 0)
+    {
+        HalMock::board().randomState = seed;
+    }
+}
+
+long random(long howBig)
+{
+    if (howBig <= 0)
+    {
+        return 0;
+    }
+
+    // Plain LCG: reproducible across runs, which is all the tests need
+    unsigned long &state = HalMock::board().randomState;
+    state = state * 1103515245UL + 12345UL;
+
+    return (long)((state >> 1) % (unsigned long)howBig);
+}
+
+long random(long howSmall, long howBig)
+{
+    if (howSmall >= howBig)
+    {
+        return howSmall;
+    }
+
+    return howSmall + random(howBig - howSmall);
+}
+
+int freeMemory()
+{
+    return HalMock::board().freeMemory;
+}
+
+uint8_t UniqueID[UniqueIDsize] = {0x1E, 0x98, 0x01, 0x55, 0x36, 0x31, 0x32, 0x30, 0x0C};
+
+EEPROMClass EEPROM;
+
+uint8_t EEPROMClass::read(int address)
+{
+    return (address >= 0 && address < MOCK_EEPROM_SIZE) ? HalMock::board().eeprom[address] : 0xFF;
+}
+
+void EEPROMClass::write(int address, uint8_t value)
+{
+    if (address >= 0 && address < MOCK_EEPROM_SIZE)
+    {
+        HalMock::board().eeprom[address] = value;
+        HalMock::board().eepromWrites++;
+    }
+}
+
+void EEPROMClass::update(int address, uint8_t value)
+{
+    if (read(address) != value)
+    {
+        write(address, value);
+    }
+}
+
+#ifndef MOCK_HAS_STRLCPY
+size_t strlcpy(char *destination, const char *source, size_t size)
+{
+    return strlcpy_P(destination, source, size);
+}
+#endif
+
+size_t strlcpy_P(char *destination, const char *source, size_t size)
+{
+    size_t length = strlen(source);
+
+    if (size > 0)
+    {
+        size_t count = length < size - 1 ? length : size - 1;
+        memcpy(destination, source, count);
+        destination[count] = 0;
+    }
+
+    return length;
+}
+
+/* ---------------------------------------------------------------------------
+ * Serial
+ * ------------------------------------------------------------------------- */
+
+HardwareSerial Serial;
+
+int HardwareSerial::available()
+{
+    MockBoard &b = HalMock::board();
+    return (int)(b.serialInputTail - b.serialInputHead);
+}
+
+int HardwareSerial::read()
+{
+    MockBoard &b = HalMock::board();
+
+    if (b.serialInputHead >= b.serialInputTail)
+    {
+        b.serialInputHead = b.serialInputTail = 0;
+        return -1;
+    }
+
+    return (uint8_t)b.serialInput[b.serialInputHead++];
+}
+
+int HardwareSerial::peek()
+{
+    MockBoard &b = HalMock::board();
+    return b.serialInputHead < b.serialInputTail ? (uint8_t)b.serialInput[b.serialInputHead] : -1;
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+    MockBoard &b = HalMock::board();
+
+    b.serialBytesWritten++;
+
+    if (b.serialEcho)
+    {
+        fputc(c, stdout);
+    }
+
+    return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+    MockBoard &b = HalMock::board();
+
+    b.serialBytesWritten += size;
+
+    if (b.serialEcho)
+    {
+        fwrite(buffer, 1, size, stdout);
+    }
+
+    return size;
+}
+
+/* ---------------------------------------------------------------------------
+ * Print, Stream, IPAddress
+ * ------------------------------------------------------------------------- */
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+    size_t n = 0;
+
+    while (size--)
+    {
+        if (write(*buffer++) == 0)
+        {
+            break;
+        }
+
+        n++;
+    }
+
+    return n;
+}
+
+size_t Print::printNumber(unsigned long value, uint8_t base)
+{
+    char buf[8 * sizeof(long) + 1];
+    char *str = &buf[sizeof(buf) - 1];
+
+    *str = 0;
+
+    if (base < 2)
+    {
+        base = 10;
+    }
+
+    do
+    {
+        char digit = value % base;
+        value /= base;
+        *--str = digit < 10 ? digit + '0' : digit + 'A' - 10;
+    } while (value);
+
+    return write(str);
+}
+
+size_t Print::print(long value, int base)
+{
+    if (base == DEC && value < 0)
+    {
+        return print('-') + printNumber(-(unsigned long)value, DEC);
+    }
+
+    return printNumber((unsigned long)value, base);
+}
+
+size_t Print::print(unsigned long value, int base)
+{
+    return printNumber(value, base);
+}
+
+size_t Print::print(double value, int digits)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.*f", digits, value);
+    return write(buf);
+}
+
+size_t Stream::readBytes(char *buffer, size_t length)
+{
+    size_t count = 0;
+
+    while (count < length)
+    {
+        int c = read();
+
+        if (c < 0)
+        {
+            break;
+        }
+
+        buffer[count++] = (char)c;
+    }
+
+    return count;
+}
+
+String Stream::readString()
+{
+    String result;
+    int c;
+
+    while ((c = read()) >= 0)
+    {
+        result += (char)c;
+    }
+
+    return result;
+}
+
+size_t IPAddress::printTo(Print &p) const
+{
+    size_t n = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        n += p.print(octets[i], DEC);
+
+        if (i < 3)
+        {
+            n += p.print('.');
+        }
+    }
+
+    return n;
+}
+
+/* ---------------------------------------------------------------------------
+ * String
+ * ------------------------------------------------------------------------- */
+
+static char emptyString[1] = {0};
+
+void String::invalidate()
+{
+    if (buffer != emptyString)
+    {
+        free(buffer);
+    }
+
+    buffer = emptyString;
+    capacity = 0;
+    len = 0;
+}
+
+bool String::grow(unsigned int size)
+{
+    if (size <= capacity)
+    {
+        return true;
+    }
+
+    char *newBuffer = (char *)realloc(buffer == emptyString ? nullptr : buffer, size + 1);
+
+    if (newBuffer == nullptr)
+    {
+        return false;
+    }
+
+    if (buffer == emptyString)
+    {
+        newBuffer[0] = 0;
+    }
+
+    buffer = newBuffer;
+    capacity = size;
+    return true;
+}
+
+String &String::copy(const char *cstr, unsigned int length)
+{
+    if (length == 0)
+    {
+        if (buffer != emptyString)
+        {
+            buffer[0] = 0;
+        }
+
+        len = 0;
+        return *this;
+    }
+
+    if (!grow(length))
+    {
+        invalidate();
+        return *this;
+    }
+
+    memmove(buffer, cstr, length);
+    buffer[length] = 0;
+    len = length;
+    return *this;
+}
+
+String::String(const char *cstr) : buffer(emptyString), capacity(0), len(0)
+{
+    if (cstr != nullptr)
+    {
+        copy(cstr, strlen(cstr));
+    }
+}
+
+String::String(const __FlashStringHelper *str) : String(reinterpret_cast<const char *>(str)) {}
+
+String::String(const String &str) : buffer(emptyString), capacity(0), len(0)
+{
+    copy(str.buffer, str.len);
+}
+
+String::String(String &&str) : buffer(str.buffer), capacity(str.capacity), len(str.len)
+{
+    str.buffer = emptyString;
+    str.capacity = 0;
+    str.len = 0;
+}
+
+String::String(char c) : buffer(emptyString), capacity(0), len(0)
+{
+    copy(&c, 1);
+}
+
+String::String(unsigned char value, unsigned char base) : String((unsigned long)value, base) {}
+
+String::String(int value, unsigned char base) : String((long)value, base) {}
+
+String::String(unsigned int value, unsigned char base) : String((unsigned long)value, base) {}
+
+String::String(long value, unsigned char base) : buffer(emptyString), capacity(0), len(0)
+{
+    char buf[2 + 8 * sizeof(long)];
+
+    if (base == DEC)
+    {
+        snprintf(buf, sizeof(buf), "%ld", value);
+    }
+    else
+    {
+        snprintf(buf, sizeof(buf), base == HEX ? "%lx" : "%lo", (unsigned long)value);
+    }
+
+    copy(buf, strlen(buf));
+}
+
+String::String(unsigned long value, unsigned char base) : buffer(emptyString), capacity(0), len(0)
+{
+    char buf[2 + 8 * sizeof(long)];
+    snprintf(buf, sizeof(buf), base == HEX ? "%lx" : (base == OCT ? "%lo" : "%lu"), value);
+    copy(buf, strlen(buf));
+}
+
+String::~String()
+{
+    invalidate();
+}
+
+String &String::operator=(const String &rhs)
+{
+    if (this != &rhs)
+    {
+        copy(rhs.buffer, rhs.len);
+    }
+
+    return *this;
+}
+
+String &String::operator=(String &&rhs)
+{
+    if (this != &rhs)
+    {
+        invalidate();
+        buffer = rhs.buffer;
+        capacity = rhs.capacity;
+        len = rhs.len;
+        rhs.buffer = emptyString;
+        rhs.capacity = 0;
+        rhs.len = 0;
+    }
+
+    return *this;
+}
+
+String &String::operator=(const char *cstr)
+{
+    if (cstr == nullptr)
+    {
+        invalidate();
+        return *this;
+    }
+
+    return copy(cstr, strlen(cstr));
+}
+
+String &String::operator=(const __FlashStringHelper *str)
+{
+    return operator=(reinterpret_cast<const char *>(str));
+}
+
+bool String::reserve(unsigned int size)
+{
+    return grow(size);
+}
+
+bool String::concat(const char *cstr, unsigned int length)
+{
+    if (cstr == nullptr)
+    {
+        return false;
+    }
+
+    if (length == 0)
+    {
+        return true;
+    }
+
+    if (!grow(len + length))
+    {
+        return false;
+    }
+
+    memmove(buffer + len, cstr, length);
+    len += length;
+    buffer[len] = 0;
+    return true;
+}
+
+bool String::concat(const String &str)
+{
+    return concat(str.buffer, str.len);
+}
+
+bool String::concat(const char *cstr)
+{
+    return cstr != nullptr && concat(cstr, strlen(cstr));
+}
+
+bool String::concat(char c)
+{
+    return concat(&c, 1);
+}
+
+bool String::concat(int value)
+{
+    return concat(String(value));
+}
+
+bool String::concat(unsigned long value)
+{
+    return concat(String(value));
+}
+
+bool String::concat(const __FlashStringHelper *str)
+{
+    return concat(reinterpret_cast<const char *>(str));
+}
+
+bool String::equals(const String &str) const
+{
+    return len == str.len && memcmp(buffer, str.buffer, len) == 0;
+}
+
+bool String::equals(const char *cstr) const
+{
+    return cstr != nullptr ? strcmp(buffer, cstr) == 0 : len == 0;
+}
+
+char String::charAt(unsigned int index) const
+{
+    return index < len ? buffer[index] : 0;
+}
+
+int String::indexOf(char c, unsigned int fromIndex) const
+{
+    if (fromIndex >= len)
+    {
+        return -1;
+    }
+
+    const char *found = strchr(buffer + fromIndex, c);
+    return found == nullptr ? -1 : (int)(found - buffer);
+}
+
+String String::substring(unsigned int beginIndex, unsigned int endIndex) const
+{
+    if (beginIndex > endIndex)
+    {
+        unsigned int temp = endIndex;
+        endIndex = beginIndex;
+        beginIndex = temp;
+    }
+
+    String result;
+
+    if (beginIndex >= len)
+    {
+        return result;
+    }
+
+    if (endIndex > len)
+    {
+        endIndex = len;
+    }
+
+    result.copy(buffer + beginIndex, endIndex - beginIndex);
+    return result;
+}
+
+long String::toInt() const
+{
+    return atol(buffer);
+}
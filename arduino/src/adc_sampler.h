@@ -0,0 +1,323 @@
+#pragma once
+
+#include "hal.h"
+#include "default_constants.h"
+#include "device_config.h"
+
+// ADC inputs of the ATmega2560, A0 to A15
+#define ADC_CHANNEL_COUNT NUM_ANALOG_INPUTS
+#define ADC_CHANNEL_MASK ((uint16_t)((1UL << ADC_CHANNEL_COUNT) - 1))
+
+/**
+ * A monitored channel that moved by more than the deadband.
+ */
+struct AdcChange
+{
+    uint8_t channel;
+    uint16_t previous;
+    uint16_t current;
+};
+
+/**
+ * Background sampling of the analog inputs.
+ *
+ * The ADC runs in free running mode with its conversion interrupt
+ * enabled, cycling through the channels set in ANALOG_CHANNELS: loop()
+ * never waits for the ~110us of an analogRead(). Each channel sums
+ * ANALOG_OVERSAMPLING conversions, and the average (the decimated sample)
+ * replaces the latest value of the channel and marks it fresh. The scan
+ * task reads the fresh channels with nextChange(). A change is reported
+ * only when the value moved by more than ANALOG_DEADBAND from the last
+ * reported one, so noise does not flood the broker.
+ *
+ * With the defaults the interrupt decimates ~600 samples per second, far
+ * more than one per channel and scan: only the newest one is compared to
+ * the deadband, so no buffer could keep up or is needed. The samples
+ * replaced before the scan read them are counted in droppedSamples().
+ *
+ * In free running mode the next conversion starts as soon as one
+ * completes, with the multiplexer latched at that moment: the channel
+ * selected in the interrupt is the one converted after the next.
+ */
+class AdcSampler
+{
+private:
+    uint16_t channels = 0;
+    uint8_t oversamplingShift = 0;
+    uint16_t deadband = 0;
+
+    // Written by the interrupt only
+    uint8_t currentChannel = 0;
+    uint8_t pendingChannel = 0;
+    bool discardConversion = false;
+    uint16_t sums[ADC_CHANNEL_COUNT];
+    uint8_t conversions[ADC_CHANNEL_COUNT];
+    volatile uint16_t values[ADC_CHANNEL_COUNT];
+    volatile uint32_t overruns = 0;
+
+    // Channels with a sample not read by nextChange() yet, set by the
+    // interrupt and cleared by the scan
+    volatile uint16_t freshChannels = 0;
+
+    // Last value reported for each channel, and the channels that have one
+    uint16_t reported[ADC_CHANNEL_COUNT];
+    uint16_t reportedChannels = 0;
+
+    uint8_t nextChannel(uint8_t channel) const
+    {
+        do
+        {
+            channel = (channel + 1) % ADC_CHANNEL_COUNT;
+        } while (!(channels & (1U << channel)));
+
+        return channel;
+    }
+
+    static void selectChannel(uint8_t channel)
+    {
+#ifndef ARDUMI_NATIVE
+        // AVcc reference, channels 8-15 use the MUX5 bit of ADCSRB
+        ADMUX = _BV(REFS0) | (channel & 0x07);
+        ADCSRB = (channel & 0x08) ? _BV(MUX5) : 0;
+#else
+        (void)channel;
+#endif
+    }
+
+    /**
+     * Starts the free running conversions of the first monitored channel.
+     */
+    void start()
+    {
+        currentChannel = nextChannel(ADC_CHANNEL_COUNT - 1);
+        pendingChannel = currentChannel;
+        selectChannel(currentChannel);
+
+        // The first two conversions both use the first channel, keep one
+        discardConversion = true;
+
+#ifndef ARDUMI_NATIVE
+        // Free running (ADTS = 0 in ADCSRB), interrupt on completion, 16MHz / 128 = 125kHz ADC clock
+        ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADATE) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+#endif
+    }
+
+    /**
+     * Stops the conversions, leaving the ADC enabled for analogRead().
+     */
+    void stop()
+    {
+#ifndef ARDUMI_NATIVE
+        ADCSRA &= ~(_BV(ADATE) | _BV(ADIE));
+
+        // Let the conversion in progress end
+        while (ADCSRA & _BV(ADSC))
+        {
+        }
+#endif
+    }
+
+public:
+    AdcSampler()
+    {
+        memset(sums, 0, sizeof(sums));
+        memset(conversions, 0, sizeof(conversions));
+        memset((void *)values, 0, sizeof(values));
+        memset(reported, 0, sizeof(reported));
+    }
+
+    /**
+     * Applies the analog settings of the configuration and starts the
+     * engine if any channel is monitored.
+     */
+    void begin(const DeviceConfig &config)
+    {
+        if (isRunning())
+        {
+            stop();
+        }
+
+        channels = config.ANALOG_CHANNELS & ADC_CHANNEL_MASK;
+        deadband = config.ANALOG_DEADBAND;
+        oversamplingShift = 0;
+
+        while ((1 << (oversamplingShift + 1)) <= config.ANALOG_OVERSAMPLING &&
+               (1 << (oversamplingShift + 1)) <= ADC_MAX_OVERSAMPLING)
+        {
+            oversamplingShift++;
+        }
+
+        memset(sums, 0, sizeof(sums));
+        memset(conversions, 0, sizeof(conversions));
+        reportedChannels = 0;
+        freshChannels = 0;
+
+        if (isRunning())
+        {
+            start();
+        }
+    }
+
+    bool isRunning() const
+    {
+        return channels != 0;
+    }
+
+    bool isMonitored(uint8_t channel) const
+    {
+        return channel < ADC_CHANNEL_COUNT && (channels & (1U << channel));
+    }
+
+    /**
+     * Handles a completed conversion. Called from ISR(ADC_vect) with the
+     * ADC data register.
+     */
+    void onConversion(uint16_t conversion)
+    {
+        uint8_t channel = currentChannel;
+
+        // The conversion that just started uses pendingChannel, queue the one after it
+        currentChannel = pendingChannel;
+        pendingChannel = nextChannel(pendingChannel);
+        selectChannel(pendingChannel);
+
+        if (discardConversion)
+        {
+            discardConversion = false;
+            return;
+        }
+
+        sums[channel] += conversion;
+
+        if (++conversions[channel] < (1 << oversamplingShift))
+        {
+            return;
+        }
+
+        uint16_t value = sums[channel] >> oversamplingShift;
+
+        sums[channel] = 0;
+        conversions[channel] = 0;
+        values[channel] = value;
+
+        if (freshChannels & (1U << channel))
+        {
+            overruns++;
+        }
+
+        freshChannels |= (1U << channel);
+    }
+
+    /**
+     * Reads the fresh channels until one moved by more than the deadband.
+     * The first sample of a channel is its baseline and is not reported.
+     *
+     * @return false once no channel is fresh
+     */
+    bool nextChange(AdcChange &change)
+    {
+        noInterrupts();
+        uint16_t fresh = freshChannels;
+        interrupts();
+
+        for (uint8_t channel = 0; fresh != 0; channel++)
+        {
+            if (!(fresh & (1U << channel)))
+            {
+                continue;
+            }
+
+            fresh &= ~(1U << channel);
+
+            noInterrupts();
+            uint16_t value = values[channel];
+            freshChannels &= ~(1U << channel);
+            interrupts();
+
+            if (!(reportedChannels & (1U << channel)))
+            {
+                reportedChannels |= (1U << channel);
+                reported[channel] = value;
+                continue;
+            }
+
+            uint16_t delta = value > reported[channel] ? value - reported[channel] : reported[channel] - value;
+
+            if (delta <= deadband)
+            {
+                continue;
+            }
+
+            change.channel = channel;
+            change.previous = reported[channel];
+            change.current = value;
+            reported[channel] = value;
+
+            return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * Reads an analog input without disturbing the engine: the latest
+     * decimated sample of a monitored channel, otherwise an analogRead()
+     * with the engine paused around it.
+     *
+     * @param pin Channel number or pin (A0...), like analogRead()
+     */
+    int read(uint8_t pin)
+    {
+        uint8_t channel = pin >= PIN_A0 ? pin - PIN_A0 : pin;
+
+        if (isMonitored(channel))
+        {
+            noInterrupts();
+            uint16_t value = values[channel];
+            interrupts();
+
+            return value;
+        }
+
+        if (!isRunning())
+        {
+            return analogRead(pin);
+        }
+
+        stop();
+        int value = analogRead(pin);
+        start();
+
+        return value;
+    }
+
+    /**
+     * @return The latest decimated sample of a monitored channel. Without
+     * the interrupt masking of read(), for the other interrupt handlers.
+     */
+    uint16_t latest(uint8_t channel) const
+    {
+        return values[channel];
+    }
+
+    /**
+     * @return The number of samples replaced by a newer one before the scan
+     * read them: excursions shorter than a scan are not reported
+     */
+    uint32_t droppedSamples() const
+    {
+        noInterrupts();
+        uint32_t count = overruns;
+        interrupts();
+
+        return count;
+    }
+
+    /**
+     * @return The pin of an ADC channel
+     */
+    static int channelPin(uint8_t channel)
+    {
+        return PIN_A0 + channel;
+    }
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <limits.h>
+#include "hal.h"
+
+/**
+ * Allocation-free tokenizer for command arguments.
+ *
+ * Every function works on a cursor over the argument string (usually pointing
+ * straight into the JSON document), advancing it past the consumed characters.
+ * Nothing is copied.
+ */
+class CommandParser
+{
+public:
+    /**
+     * Parses a decimal integer with an optional leading minus sign.
+     * On failure the cursor is left untouched.
+     *
+     * @param cursor Position to read from, moved after the last digit
+     * @param value Parsed value
+     * @return true if at least one digit was found and the value fits in an int
+     */
+    static bool parseInt(const char *&cursor, int &value)
+    {
+        const char *start = cursor;
+        const char *digits = cursor;
+        bool negative = false;
+        long result = 0;
+
+        if (*digits == '-')
+        {
+            negative = true;
+            digits++;
+        }
+
+        const char *current = digits;
+
+        while (*current >= '0' && *current <= '9')
+        {
+            result = result * 10 + (*current - '0');
+
+            if (result > (long)INT_MAX)
+            {
+                cursor = start;
+                return false;
+            }
+
+            current++;
+        }
+
+        if (current == digits)
+        {
+            cursor = start;
+            return false;
+        }
+
+        value = negative ? (int)-result : (int)result;
+        cursor = current;
+        return true;
+    }
+
+    /**
+     * Parses a pin identifier: either a pin number or LED_BUILTIN.
+     *
+     * @param cursor Position to read from, moved after the pin
+     * @param pin Parsed pin number
+     * @return true if the pin is valid for this board
+     */
+    static bool parsePin(const char *&cursor, int &pin)
+    {
+        static const char ledBuiltin[] PROGMEM = "LED_BUILTIN";
+
+        if (strncmp_P(cursor, ledBuiltin, sizeof(ledBuiltin) - 1) == 0)
+        {
+            pin = LED_BUILTIN;
+            cursor += sizeof(ledBuiltin) - 1;
+            return true;
+        }
+
+        const char *start = cursor;
+
+        if (!parseInt(cursor, pin) || pin < 0 || pin >= NUM_DIGITAL_PINS)
+        {
+            cursor = start;
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Consumes the expected character.
+     *
+     * @return true if the character under the cursor matched
+     */
+    static bool expect(const char *&cursor, char expected)
+    {
+        if (*cursor != expected)
+        {
+            return false;
+        }
+
+        cursor++;
+        return true;
+    }
+
+    /**
+     * @return true if the whole argument has been consumed
+     */
+    static bool atEnd(const char *cursor)
+    {
+        return *cursor == 0;
+    }
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "hal.h"
+#include "default_constants.h"
+#include "commands.h"
+#include "json_writer.h"
+#include "msgpack_writer.h"
+#include "mqtt_topics.h"
+#include "payload_encoding.h"
+
+/**
+ * Replies to MQTT commands that carry a correlation id.
+ *
+ * A controller adds an "id" to its command, and gets back on the response
+ * topic, in the encoding of the command:
+ *
+ *   {"id":"a1","ok":true,"result":"Success"}
+ *
+ * so it can send many commands without waiting, and match the replies as
+ * they arrive. The MQTT client cannot publish from its message callback,
+ * so replies are queued there and published by flush() after
+ * mqttClient.loop(). Commands without an id get no reply.
+ */
+class CommandReplyQueue
+{
+private:
+    CommandReply replies[MQTT_REPLY_QUEUE_SIZE];
+    uint8_t head = 0;
+    uint8_t count = 0;
+    unsigned long dropped = 0;
+
+public:
+    /**
+     * Queues a reply, if the command had a correlation id.
+     *
+     * @return false if the queue was full and the reply was dropped
+     */
+    bool push(const CommandReply &reply)
+    {
+        if (reply.correlationId[0] == 0)
+        {
+            return true;
+        }
+
+        if (count == MQTT_REPLY_QUEUE_SIZE)
+        {
+            dropped++;
+            return false;
+        }
+
+        replies[(head + count) % MQTT_REPLY_QUEUE_SIZE] = reply;
+        count++;
+
+        return true;
+    }
+
+    /**
+     * Publishes the queued replies, oldest first. A reply that cannot be
+     * published stays queued for the next call.
+     *
+     * @param buffer Scratch buffer for the payloads
+     * @return The number of replies published
+     */
+    uint8_t flush(MQTTClient &client, const MqttTopics &topics, char *buffer, size_t bufferSize)
+    {
+        uint8_t published = 0;
+
+        while (count > 0)
+        {
+            const CommandReply &reply = replies[head];
+            BufferPrint payload(buffer, bufferSize);
+            Print &out = payload;
+            const char *topic = topics.get(reply.encoding == PayloadEncoding::MSGPACK_ENCODING ? TOPIC_RESPONSE_MSGPACK : TOPIC_RESPONSE);
+
+            writeReply(out, reply);
+
+            if (!client.publish(topic, payload.c_str(), payload.length()))
+            {
+                break;
+            }
+
+            head = (head + 1) % MQTT_REPLY_QUEUE_SIZE;
+            count--;
+            published++;
+        }
+
+        return published;
+    }
+
+    size_t writeReply(Print &out, const CommandReply &reply)
+    {
+        if (reply.encoding == PayloadEncoding::MSGPACK_ENCODING)
+        {
+            MsgPackWriter writer(out);
+            return writeReply(writer, reply);
+        }
+
+        JsonWriter writer(out);
+        return writeReply(writer, reply);
+    }
+
+    template <typename TWriter>
+    size_t writeReply(TWriter &writer, const CommandReply &reply)
+    {
+        writer.beginObject(3);
+
+        if (reply.numericId)
+        {
+            writer.member(F("id"), atol(reply.correlationId));
+        }
+        else
+        {
+            writer.member(F("id"), reply.correlationId);
+        }
+
+        writer.member(F("ok"), reply.success);
+        writer.member(F("result"), reply.result);
+        writer.endObject();
+
+        return writer.size();
+    }
+
+    uint8_t pending() const
+    {
+        return count;
+    }
+
+    /**
+     * @return The number of replies dropped because the queue was full
+     */
+    unsigned long droppedReplies() const
+    {
+        return dropped;
+    }
+};
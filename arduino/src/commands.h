@@ -0,0 +1,697 @@
+#pragma once
+
+#include <ArduinoJson.h>
+#include "hal.h"
+#include "device_config.h"
+#include "config_reload.h"
+#include "telemetry.h"
+#include "adc_sampler.h"
+#include "pin_stream.h"
+#include "payload_encoding.h"
+#include "command_parser.h"
+#include "static_allocator.h"
+
+#define COMMAND_NAME_SIZE 16
+
+/**
+ * Shape of the "arguments" string expected by a command.
+ */
+enum CommandSchema : uint8_t
+{
+    NO_ARGUMENTS,
+    PIN_ARGUMENT,       // "13" or "LED_BUILTIN"
+    PIN_VALUE_ARGUMENTS, // "13:1"
+    RATE_PINS_ARGUMENTS  // "200:13,54,55" or "0"
+};
+
+/**
+ * Arguments already parsed according to the command schema.
+ */
+struct CommandArguments
+{
+    int pin;
+    int value;
+    // Pin list of RATE_PINS_ARGUMENTS
+    uint8_t pins[STREAM_MAX_PINS];
+    uint8_t pinCount;
+};
+
+class CommandsProvider;
+
+typedef bool (*CommandHandler)(CommandsProvider &provider, const CommandArguments &arguments, char *result, size_t resultSize);
+
+/**
+ * Entry of the command table. The whole table lives in PROGMEM.
+ */
+struct CommandDescriptor
+{
+    uint32_t hash;
+    char name[COMMAND_NAME_SIZE];
+    CommandSchema schema;
+    CommandHandler handler;
+};
+
+/**
+ * FNV-1a hash of a command name. It is evaluated at compile time for the
+ * table entries and once per incoming message for the lookup.
+ */
+constexpr uint32_t commandHash(const char *name, uint32_t hash = 2166136261UL)
+{
+    return *name == 0 ? hash : commandHash(name + 1, (hash ^ (uint8_t)*name) * 16777619UL);
+}
+
+#define COMMAND_ENTRY(name, schema, handler) {commandHash(name), name, schema, handler}
+
+/**
+ * Checks at compile time that the table is sorted by strictly increasing
+ * hash, which the binary search of findCommand() relies on. A collision
+ * between two names fails the check too.
+ */
+constexpr bool commandHashesAscending(const CommandDescriptor *table, size_t count)
+{
+    return count < 2 || (table[0].hash < table[1].hash && commandHashesAscending(table + 1, count - 1));
+}
+
+/**
+ * Outcome of a message, with the correlation id supplied by the sender
+ * ("id" member of the message), to be sent back as a reply.
+ */
+struct CommandReply
+{
+    // Empty when the message had no id
+    char correlationId[COMMAND_CORRELATION_ID_SIZE];
+    // The id was a number, and is echoed as such
+    bool numericId;
+    bool success;
+    PayloadEncoding encoding;
+    char result[COMMAND_RESULT_SIZE];
+};
+
+class CommandsProvider
+{
+private:
+    DeviceConfigProvider &configProvider;
+    ConfigReloader &configReloader;
+    StatusTelemetry &statusTelemetry;
+    AdcSampler &adcSampler;
+    PinStreamer &pinStreamer;
+    bool &rebootOnNextLoop;
+
+    // Incoming messages are parsed inside this buffer, never on the heap
+    StaticPoolAllocator<COMMAND_JSON_POOL_SIZE> jsonAllocator;
+
+    static bool writeResult(char *result, size_t resultSize, const char *message, bool success)
+    {
+        strlcpy_P(result, message, resultSize);
+        return success;
+    }
+
+    static bool writeResult(char *result, size_t resultSize, int value)
+    {
+        snprintf_P(result, resultSize, PSTR("%d"), value);
+        return true;
+    }
+
+    static bool readDigital(CommandsProvider &provider, const CommandArguments &arguments, char *result, size_t resultSize)
+    {
+        return writeResult(result, resultSize, digitalRead(arguments.pin));
+    }
+
+    static bool readAnalog(CommandsProvider &provider, const CommandArguments &arguments, char *result, size_t resultSize)
+    {
+        // analogRead() would race with the background conversions
+        return writeResult(result, resultSize, provider.adcSampler.read(arguments.pin));
+    }
+
+    static bool writeDigital(CommandsProvider &provider, const CommandArguments &arguments, char *result, size_t resultSize)
+    {
+        switch (arguments.value)
+        {
+        case 0:
+            digitalWrite(arguments.pin, LOW);
+            break;
+        case 1:
+            digitalWrite(arguments.pin, HIGH);
+            break;
+        default:
+            return writeResult(result, resultSize, PSTR("ERROR: Invalid digital write value. Assure the number is either 0 or 1"), false);
+        }
+
+        return writeResult(result, resultSize, PSTR("Success"), true);
+    }
+
+    static bool writeAnalog(CommandsProvider &provider, const CommandArguments &arguments, char *result, size_t resultSize)
+    {
+        if (arguments.value < 0 || arguments.value > 255)
+        {
+            return writeResult(result, resultSize, PSTR("ERROR: Invalid analog write value. Assure the number is between 0 and 255"), false);
+        }
+
+        analogWrite(arguments.pin, arguments.value);
+
+        return writeResult(result, resultSize, PSTR("Success"), true);
+    }
+
+    static bool reset(CommandsProvider &provider, const CommandArguments &arguments, char *result, size_t resultSize)
+    {
+        provider.configProvider.resetToDefault();
+        provider.rebootOnNextLoop = true;
+
+        return writeResult(result, resultSize, PSTR("Success"), true);
+    }
+
+    static bool reboot(CommandsProvider &provider, const CommandArguments &arguments, char *result, size_t resultSize)
+    {
+        provider.rebootOnNextLoop = true;
+
+        return writeResult(result, resultSize, PSTR("Success"), true);
+    }
+
+    static bool statusKeyframe(CommandsProvider &provider, const CommandArguments &arguments, char *result, size_t resultSize)
+    {
+        provider.statusTelemetry.requestKeyframe();
+
+        return writeResult(result, resultSize, PSTR("Success"), true);
+    }
+
+    static bool stream(CommandsProvider &provider, const CommandArguments &arguments, char *result, size_t resultSize)
+    {
+#if PIN_STREAMER
+        if (arguments.value == 0)
+        {
+            provider.pinStreamer.stop();
+            return writeResult(result, resultSize, PSTR("Success"), true);
+        }
+
+        if (arguments.value > STREAM_MAX_RATE || arguments.pinCount == 0)
+        {
+            return writeResult(result, resultSize, PSTR("ERROR: Invalid stream. Assure the rate is supported and pins are given"), false);
+        }
+
+        // The granted rate, lower than the requested one when the link is too slow
+        return writeResult(result, resultSize, provider.pinStreamer.start(arguments.value, arguments.pins, arguments.pinCount));
+#else
+        (void)provider;
+        (void)arguments;
+
+        return writeResult(result, resultSize, PSTR("ERROR: Streaming is not compiled in (PIN_STREAMER)"), false);
+#endif
+    }
+
+    /**
+     * The command registry. Adding a command only requires a new entry here
+     * and its handler above. Entries are ordered by the hash of their name
+     * (noted next to each one); the build fails when the order is wrong.
+     *
+     * @param count Number of entries in the table
+     * @return The table, stored in PROGMEM
+     */
+    static const CommandDescriptor *commandTable(size_t &count)
+    {
+        static constexpr CommandDescriptor table[] PROGMEM = {
+            COMMAND_ENTRY("RESET", NO_ARGUMENTS, &CommandsProvider::reset), // 0x0d76d520
+            COMMAND_ENTRY("READ_DIGITAL", PIN_ARGUMENT, &CommandsProvider::readDigital), // 0x1307a526
+            COMMAND_ENTRY("REBOOT", NO_ARGUMENTS, &CommandsProvider::reboot), // 0x2a320c78
+            COMMAND_ENTRY("STREAM", RATE_PINS_ARGUMENTS, &CommandsProvider::stream), // 0x3db90ea5
+            COMMAND_ENTRY("WRITE_ANALOG", PIN_VALUE_ARGUMENTS, &CommandsProvider::writeAnalog), // 0x49a0ff15
+            COMMAND_ENTRY("STATUS_KEYFRAME", NO_ARGUMENTS, &CommandsProvider::statusKeyframe), // 0xcde174f4
+            COMMAND_ENTRY("READ_ANALOG", PIN_ARGUMENT, &CommandsProvider::readAnalog), // 0xd133260a
+            COMMAND_ENTRY("WRITE_DIGITAL", PIN_VALUE_ARGUMENTS, &CommandsProvider::writeDigital), // 0xf27a1387
+        };
+
+        static_assert(commandHashesAscending(table, sizeof(table) / sizeof(table[0])), "Order the command table by hash");
+
+        count = sizeof(table) / sizeof(table[0]);
+        return table;
+    }
+
+    /**
+     * Looks up a command by name: binary search over the precomputed hashes,
+     * then the name itself is checked once on a hash match.
+     *
+     * @param name The command name
+     * @param descriptor Filled with a RAM copy of the matching entry
+     * @return true if the command exists
+     */
+    static bool findCommand(const char *name, CommandDescriptor &descriptor)
+    {
+        size_t count = 0;
+        const CommandDescriptor *table = commandTable(count);
+        uint32_t hash = commandHash(name);
+        size_t low = 0;
+        size_t high = count;
+
+        while (low < high)
+        {
+            size_t middle = (low + high) / 2;
+            uint32_t entryHash = pgm_read_dword(&table[middle].hash);
+
+            if (entryHash < hash)
+            {
+                low = middle + 1;
+            }
+            else if (entryHash > hash)
+            {
+                high = middle;
+            }
+            else
+            {
+                if (strcmp_P(name, table[middle].name) != 0)
+                {
+                    return false;
+                }
+
+                memcpy_P(&descriptor, &table[middle], sizeof(CommandDescriptor));
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    static bool parseArguments(CommandSchema schema, const char *argument, CommandArguments &arguments, char *result, size_t resultSize)
+    {
+        const char *cursor = argument;
+
+        switch (schema)
+        {
+        case NO_ARGUMENTS:
+            return true;
+        case PIN_ARGUMENT:
+            if (!CommandParser::parsePin(cursor, arguments.pin) || !CommandParser::atEnd(cursor))
+            {
+                return writeResult(result, resultSize, PSTR("ERROR: Invalid pin. Assure the number is an integer"), false);
+            }
+
+            return true;
+        case PIN_VALUE_ARGUMENTS:
+            if (!CommandParser::parsePin(cursor, arguments.pin) || !CommandParser::expect(cursor, ':'))
+            {
+                return writeResult(result, resultSize, PSTR("ERROR: Invalid pin. Assure the number is an integer"), false);
+            }
+
+            if (!CommandParser::parseInt(cursor, arguments.value) || !CommandParser::atEnd(cursor))
+            {
+                return writeResult(result, resultSize, PSTR("ERROR: Invalid value. Assure the number is an integer"), false);
+            }
+
+            return true;
+        case RATE_PINS_ARGUMENTS:
+            if (!CommandParser::parseInt(cursor, arguments.value) || arguments.value < 0)
+            {
+                return writeResult(result, resultSize, PSTR("ERROR: Invalid rate. Assure the number is a positive integer"), false);
+            }
+
+            arguments.pinCount = 0;
+
+            if (CommandParser::expect(cursor, ':'))
+            {
+                do
+                {
+                    if (arguments.pinCount >= STREAM_MAX_PINS || !CommandParser::parsePin(cursor, arguments.pin))
+                    {
+                        return writeResult(result, resultSize, PSTR("ERROR: Invalid pin list. Assure the pins are integers separated by ','"), false);
+                    }
+
+                    arguments.pins[arguments.pinCount++] = arguments.pin;
+                } while (CommandParser::expect(cursor, ','));
+            }
+
+            if (!CommandParser::atEnd(cursor))
+            {
+                return writeResult(result, resultSize, PSTR("ERROR: Invalid pin list. Assure the pins are integers separated by ','"), false);
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * Appends text to the aggregated result of a batch, truncating it to the buffer.
+     */
+    static void appendResult(char *result, size_t resultSize, size_t &length, const char *text)
+    {
+        if (length + 1 >= resultSize)
+        {
+            return;
+        }
+
+        length += strlcpy(result + length, text, resultSize - length);
+
+        if (length >= resultSize)
+        {
+            length = resultSize - 1;
+        }
+    }
+
+    /**
+     * Puts "<executed>/<total> " in front of the aggregated result.
+     */
+    static void prependSummary(char *result, size_t resultSize, size_t executed, size_t total)
+    {
+        char summary[16];
+        size_t summaryLength = snprintf_P(summary, sizeof(summary), PSTR("%u/%u "), (unsigned int)executed, (unsigned int)total);
+        size_t length = strlen(result);
+
+        if (summaryLength >= resultSize)
+        {
+            return;
+        }
+
+        if (summaryLength + length >= resultSize)
+        {
+            length = resultSize - 1 - summaryLength;
+        }
+
+        memmove(result + summaryLength, result, length);
+        memcpy(result, summary, summaryLength);
+        result[summaryLength + length] = 0;
+    }
+
+    /**
+     * Runs the commands of a batch in order, stopping at the first failure.
+     * The result is "<executed>/<total> " followed by the result of every
+     * executed command, separated by ';':
+     *
+     *   3/3 Success;1;512
+     *   1/3 Success;ERROR: Invalid command
+     */
+    bool executeBatch(JsonArrayConst commands, char *result, size_t resultSize)
+    {
+        char commandResult[COMMAND_RESULT_SIZE];
+        size_t length = 0;
+        size_t executed = 0;
+        bool success = true;
+
+        result[0] = 0;
+
+        for (JsonVariantConst entry : commands)
+        {
+            success = handleCommand(entry[F("command")] | "", entry[F("arguments")] | "", commandResult, sizeof(commandResult));
+
+            if (length > 0)
+            {
+                appendResult(result, resultSize, length, ";");
+            }
+
+            appendResult(result, resultSize, length, commandResult);
+
+            if (!success)
+            {
+                break;
+            }
+
+            executed++;
+        }
+
+        prependSummary(result, resultSize, executed, commands.size());
+
+        return success;
+    }
+
+    /**
+     * Applies a batch of WRITE_DIGITAL commands all at once. The whole batch
+     * is validated first, so an invalid command leaves every pin untouched.
+     * Then the pins of each port are switched by a single write of the port
+     * output register, with interrupts disabled: no other code ever sees a
+     * partially applied batch.
+     *
+     * The port register is written directly, so a pin driven by
+     * analogWrite() keeps its PWM output.
+     */
+    bool applyDigitalWrites(JsonArrayConst commands, char *result, size_t resultSize)
+    {
+        uint8_t setMasks[STATE_PORT_COUNT] = {0};
+        uint8_t clearMasks[STATE_PORT_COUNT] = {0};
+
+        for (JsonVariantConst entry : commands)
+        {
+            CommandArguments arguments = {-1, -1};
+            const char *command = entry[F("command")] | "";
+
+            if (strcmp_P(command, PSTR("WRITE_DIGITAL")) != 0)
+            {
+                writeResult(result, resultSize, PSTR("ERROR: Atomic batches only accept WRITE_DIGITAL"), false);
+                prependSummary(result, resultSize, 0, commands.size());
+                return false;
+            }
+
+            if (!parseArguments(PIN_VALUE_ARGUMENTS, entry[F("arguments")] | "", arguments, result, resultSize))
+            {
+                prependSummary(result, resultSize, 0, commands.size());
+                return false;
+            }
+
+            uint8_t port = arguments.pin >= 0 ? digitalPinToPort(arguments.pin) : NOT_A_PORT;
+
+            if (port == NOT_A_PORT || port >= STATE_PORT_COUNT)
+            {
+                writeResult(result, resultSize, PSTR("ERROR: Invalid pin. Assure the number is an integer"), false);
+                prependSummary(result, resultSize, 0, commands.size());
+                return false;
+            }
+
+            if (arguments.value != 0 && arguments.value != 1)
+            {
+                writeResult(result, resultSize, PSTR("ERROR: Invalid digital write value. Assure the number is either 0 or 1"), false);
+                prependSummary(result, resultSize, 0, commands.size());
+                return false;
+            }
+
+            // The last write of a pin wins, as when executed in order
+            uint8_t bitMask = digitalPinToBitMask(arguments.pin);
+
+            setMasks[port] = arguments.value ? setMasks[port] | bitMask : setMasks[port] & ~bitMask;
+            clearMasks[port] = arguments.value ? clearMasks[port] & ~bitMask : clearMasks[port] | bitMask;
+        }
+
+        noInterrupts();
+
+        for (uint8_t port = 0; port < STATE_PORT_COUNT; port++)
+        {
+            if ((setMasks[port] | clearMasks[port]) != 0)
+            {
+                volatile uint8_t *out = portOutputRegister(port);
+                *out = (*out & ~clearMasks[port]) | setMasks[port];
+            }
+        }
+
+        interrupts();
+
+        writeResult(result, resultSize, PSTR("Success"), true);
+        prependSummary(result, resultSize, commands.size(), commands.size());
+
+        return true;
+    }
+
+    /**
+     * Copies the "id" member of a message, a string or an integer, into the reply.
+     */
+    static void readCorrelationId(JsonVariantConst json, CommandReply &reply)
+    {
+        reply.correlationId[0] = 0;
+        reply.numericId = json[F("id")].is<long>();
+
+        if (reply.numericId)
+        {
+            snprintf_P(reply.correlationId, sizeof(reply.correlationId), PSTR("%ld"), json[F("id")].as<long>());
+        }
+        else
+        {
+            strlcpy(reply.correlationId, json[F("id")] | "", sizeof(reply.correlationId));
+        }
+    }
+
+    DeserializationError parseMessage(JsonDocument &json, const char *topic, const char *payload, size_t length, PayloadEncoding encoding)
+    {
+        // Print some basic informations
+        Serial.print(F("Received message from topic "));
+        Serial.print(topic);
+
+        if (encoding == PayloadEncoding::JSON_ENCODING)
+        {
+            Serial.print(F(" - content: "));
+            Serial.println(payload);
+        }
+        else
+        {
+            Serial.print(F(" - msgpack bytes: "));
+            Serial.println(length);
+        }
+
+        return encoding == PayloadEncoding::MSGPACK_ENCODING
+                   ? deserializeMsgPack(json, payload, length)
+                   : deserializeJson(json, payload, length);
+    }
+
+    /**
+     * Executes a parsed message: a single command, an array of commands,
+     * {"atomic": true, "commands": [...]}, or {"config": {...}}, a partial
+     * configuration applied without a reboot.
+     */
+    bool executeMessage(JsonVariantConst json, DeserializationError error, char *result, size_t resultSize)
+    {
+        if (error == DeserializationError::NoMemory)
+        {
+            return writeResult(result, resultSize, PSTR("ERROR: Payload larger than COMMAND_JSON_POOL_SIZE"), false);
+        }
+
+        if (error)
+        {
+            return writeResult(result, resultSize, PSTR("ERROR: Invalid payload received"), false);
+        }
+
+        if (json[F("config")].is<JsonObjectConst>())
+        {
+            return configReloader.update(json[F("config")])
+                       ? writeResult(result, resultSize, PSTR("Success"), true)
+                       : writeResult(result, resultSize, PSTR("ERROR: Invalid configuration"), false);
+        }
+
+        JsonArrayConst commands = json.is<JsonArrayConst>() ? json.as<JsonArrayConst>() : json[F("commands")].as<JsonArrayConst>();
+
+        // The pool is sized for COMMAND_BATCH_MAX, a longer batch would only fit on the host
+        if (commands.size() > COMMAND_BATCH_MAX)
+        {
+            return writeResult(result, resultSize, PSTR("ERROR: Batch larger than COMMAND_BATCH_MAX"), false);
+        }
+
+        if (json.is<JsonArrayConst>())
+        {
+            return executeBatch(commands, result, resultSize);
+        }
+
+        if (json[F("commands")].is<JsonArrayConst>())
+        {
+            return (json[F("atomic")] | false)
+                       ? applyDigitalWrites(commands, result, resultSize)
+                       : executeBatch(commands, result, resultSize);
+        }
+
+        const char *command = json[F("command")] | "";
+        const char *arguments = json[F("arguments")] | "";
+
+        return handleCommand(command, arguments, result, resultSize);
+    }
+
+public:
+    /**
+     * @param configProvider Used by the RESET command
+     * @param configReloader Applies the "config" messages
+     * @param statusTelemetry Used by the STATUS_KEYFRAME command
+     * @param rebootOnNextLoop Flag raised by the commands that need a reboot
+     */
+    CommandsProvider(DeviceConfigProvider &configProvider, ConfigReloader &configReloader, StatusTelemetry &statusTelemetry, AdcSampler &adcSampler, PinStreamer &pinStreamer, bool &rebootOnNextLoop)
+        : configProvider(configProvider), configReloader(configReloader), statusTelemetry(statusTelemetry), adcSampler(adcSampler), pinStreamer(pinStreamer), rebootOnNextLoop(rebootOnNextLoop)
+    {
+    }
+
+    /**
+     * Executes a command without any heap allocation.
+     *
+     * @param command The command name, e.g. "WRITE_DIGITAL"
+     * @param argument The raw arguments, e.g. "13" or "LED_BUILTIN:1"
+     * @param result Caller-provided buffer receiving the textual result
+     * @param resultSize Size of the result buffer
+     * @return true if the command succeeded
+     */
+    bool handleCommand(const char *command, const char *argument, char *result, size_t resultSize)
+    {
+        CommandDescriptor descriptor;
+        CommandArguments arguments = {-1, -1};
+
+        if (!findCommand(command, descriptor))
+        {
+            return writeResult(result, resultSize, PSTR("ERROR: Invalid command"), false);
+        }
+
+        if (!parseArguments(descriptor.schema, argument, arguments, result, resultSize))
+        {
+            return false;
+        }
+
+        return descriptor.handler(*this, arguments, result, resultSize);
+    }
+
+    /**
+     * This function handles all the logic for parsing incoming commands to the device.
+     * The message is parsed inside a fixed buffer, so no heap allocation happens.
+     *
+     * A message holds one command, as in command-example.json, or a batch:
+     * an array of commands, parsed once and executed in order. A batch
+     * written as {"atomic": true, "commands": [...]} may only contain
+     * WRITE_DIGITAL commands, and applies all of them at once or none.
+     *
+     * @param topic The topic on which the message was sent
+     * @param payload The content of the message
+     * @param length Length of the payload, which may contain null bytes when binary
+     * @param encoding Whether the payload is JSON or MessagePack
+     * @param result Caller-provided buffer receiving the textual result
+     * @param resultSize Size of the result buffer
+     * @return true if the command succeeded
+     */
+    bool processIncomingMessage(
+        const char *topic,
+        const char *payload,
+        size_t length,
+        PayloadEncoding encoding,
+        char *result,
+        size_t resultSize)
+    {
+        jsonAllocator.reset();
+
+        JsonDocument json(&jsonAllocator);
+        DeserializationError error = parseMessage(json, topic, payload, length, encoding);
+
+        return executeMessage(json.as<JsonVariantConst>(), error, result, resultSize);
+    }
+
+    /**
+     * Processes a message and fills the reply to send back, with the
+     * correlation id of the message if it has one.
+     *
+     * @return true if the command succeeded
+     */
+    bool processIncomingMessage(const char *topic, const char *payload, size_t length, PayloadEncoding encoding, CommandReply &reply)
+    {
+        jsonAllocator.reset();
+
+        JsonDocument json(&jsonAllocator);
+        DeserializationError error = parseMessage(json, topic, payload, length, encoding);
+
+        readCorrelationId(json.as<JsonVariantConst>(), reply);
+        reply.encoding = encoding;
+        reply.success = executeMessage(json.as<JsonVariantConst>(), error, reply.result, sizeof(reply.result));
+
+        return reply.success;
+    }
+
+    /**
+     * Processes a message read from a stream, e.g. the body of an HTTP request.
+     */
+    bool processIncomingMessage(const char *topic, Stream &payload, PayloadEncoding encoding, char *result, size_t resultSize)
+    {
+        Serial.print(F("Received message from "));
+        Serial.println(topic);
+
+        jsonAllocator.reset();
+
+        JsonDocument json(&jsonAllocator);
+
+        DeserializationError error = encoding == PayloadEncoding::MSGPACK_ENCODING
+                                         ? deserializeMsgPack(json, payload)
+                                         : deserializeJson(json, payload);
+
+        return executeMessage(json.as<JsonVariantConst>(), error, result, resultSize);
+    }
+
+    /**
+     * Processes a null terminated JSON message.
+     */
+    bool processIncomingMessage(const char *topic, const char *payload, char *result, size_t resultSize)
+    {
+        return processIncomingMessage(topic, payload, strlen(payload), PayloadEncoding::JSON_ENCODING, result, resultSize);
+    }
+};
@@ -31,37 +31,9 @@ struct RestContext
 {
   IPAddress ip;
   Request::MethodType method;
-  char path[100];
+  bool keepAlive;
+  // Header values: aWOT keeps the pointers until the headers are written
+  char contentLength[8];
+  char connection[11];
+  bool lengthSet;
 };
-
-enum Commands
-{
-  READ_DIGITAL,
-  READ_ANALOG,
-  WRITE_DIGITAL,
-  WRITE_ANALOG,
-  RESET,
-  REBOOT,
-};
-
-class StringsHelper
-{
-public:
-  static String semiSplit(String data, char separator, int index)
-  {
-    int found = 0;
-    int strIndex[] = {0, -1};
-    int maxIndex = data.length() - 1;
-
-    for (int i = 0; i <= maxIndex && found <= index; i++)
-    {
-      if (data.charAt(i) == separator || i == maxIndex)
-      {
-        found++;
-        strIndex[0] = strIndex[1] + 1;
-        strIndex[1] = (i == maxIndex) ? i + 1 : i;
-      }
-    }
-    return found > index ? data.substring(strIndex[0], strIndex[1]) : "";
-  }
-};
\ No newline at end of file
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <ArduinoJson.h>
+#include "hal.h"
+#include "device_config.h"
+
+/**
+ * Parts of the running firmware derived from the configuration, each one
+ * rebuilt only when its fields changed.
+ */
+enum ConfigChange : uint8_t
+{
+    // Host or client id: the MQTT session is opened again
+    CONFIG_CHANGED_MQTT_SERVER = 1 << 0,
+    // Prefix, channels or encoding: the topics are subscribed again
+    CONFIG_CHANGED_MQTT_TOPICS = 1 << 1,
+    // Keepalive and timeout, set on the client
+    CONFIG_CHANGED_MQTT_OPTIONS = 1 << 2,
+    // The HTTP server listens on the new port
+    CONFIG_CHANGED_HTTP_PORT = 1 << 3,
+    // Publication periods and modes, state scan
+    CONFIG_CHANGED_TELEMETRY = 1 << 4,
+    // Sampled channels, deadband and oversampling
+    CONFIG_CHANGED_ANALOG = 1 << 5,
+    CONFIG_CHANGED_RULES = 1 << 6,
+};
+
+/**
+ * Live configuration updates, without a reboot.
+ *
+ * update() validates a partial configuration (the layout of importJson),
+ * merges it into the running one and persists it. The changes are only
+ * recorded: main.cpp takes them with takeChanges() at the start of the
+ * next loop(), outside of the MQTT and HTTP callbacks, and rebuilds the
+ * parts that depend on them. The values read on every use (retries,
+ * coalescing window, ...) apply right away.
+ */
+class ConfigReloader
+{
+private:
+    DeviceConfig &config;
+    DeviceConfigProvider &configProvider;
+    uint8_t pending = 0;
+
+public:
+    /**
+     * @param config The running configuration, updated in place
+     * @param configProvider Persists the updated configuration
+     */
+    ConfigReloader(DeviceConfig &config, DeviceConfigProvider &configProvider)
+        : config(config), configProvider(configProvider)
+    {
+    }
+
+    /**
+     * @return The ConfigChange bits of the fields that differ
+     */
+    static uint8_t diff(const DeviceConfig &current, const DeviceConfig &next)
+    {
+        uint8_t changes = 0;
+
+        if (strcmp(current.MQTT_SERVER_HOST, next.MQTT_SERVER_HOST) != 0 ||
+            strcmp(current.MQTT_DEVICE_ID, next.MQTT_DEVICE_ID) != 0)
+        {
+            changes |= CONFIG_CHANGED_MQTT_SERVER;
+        }
+
+        if (strcmp(current.MQTT_TOPIC_PREFIX, next.MQTT_TOPIC_PREFIX) != 0 ||
+            memcmp(current.MQTT_CHANNELS, next.MQTT_CHANNELS, sizeof(current.MQTT_CHANNELS)) != 0 ||
+            current.PAYLOAD_ENCODING != next.PAYLOAD_ENCODING)
+        {
+            changes |= CONFIG_CHANGED_MQTT_TOPICS;
+        }
+
+        if (current.MQTT_KEEPALIVE != next.MQTT_KEEPALIVE || current.MQTT_TIMEOUT != next.MQTT_TIMEOUT)
+        {
+            changes |= CONFIG_CHANGED_MQTT_OPTIONS;
+        }
+
+        if (current.HTTP_SERVER_PORT != next.HTTP_SERVER_PORT)
+        {
+            changes |= CONFIG_CHANGED_HTTP_PORT;
+        }
+
+        if (current.STATUS_INTERVAL != next.STATUS_INTERVAL || current.STATUS_ACTIVE_INTERVAL != next.STATUS_ACTIVE_INTERVAL ||
+            current.METRICS_INTERVAL != next.METRICS_INTERVAL || current.STATE_SCAN_INTERVAL != next.STATE_SCAN_INTERVAL ||
+            current.STATUS_MODE != next.STATUS_MODE || current.STATUS_KEYFRAME_INTERVAL != next.STATUS_KEYFRAME_INTERVAL ||
+            current.STATE_PUBLISH_MODE != next.STATE_PUBLISH_MODE)
+        {
+            changes |= CONFIG_CHANGED_TELEMETRY;
+        }
+
+        if (current.ANALOG_CHANNELS != next.ANALOG_CHANNELS || current.ANALOG_DEADBAND != next.ANALOG_DEADBAND ||
+            current.ANALOG_OVERSAMPLING != next.ANALOG_OVERSAMPLING)
+        {
+            changes |= CONFIG_CHANGED_ANALOG;
+        }
+
+        if (memcmp(current.RULES, next.RULES, sizeof(current.RULES)) != 0)
+        {
+            changes |= CONFIG_CHANGED_RULES;
+        }
+
+        return changes;
+    }
+
+    /**
+     * Validates and applies a partial configuration. Nothing changes if
+     * a field is invalid.
+     *
+     * @param json Only the fields present are changed
+     * @return false if the configuration was rejected
+     */
+    bool update(JsonVariantConst json)
+    {
+        DeviceConfig next = config;
+
+        if (!json.is<JsonObjectConst>() || !DeviceConfigProvider::importJson(json, next))
+        {
+            return false;
+        }
+
+        pending |= diff(config, next);
+        config = next;
+
+        // Writes nothing when no field changed
+        configProvider.saveConfig(config);
+
+        return true;
+    }
+
+    /**
+     * @return The changes recorded since the last call
+     */
+    uint8_t takeChanges()
+    {
+        uint8_t changes = pending;
+        pending = 0;
+        return changes;
+    }
+
+    bool hasChanges() const
+    {
+        return pending != 0;
+    }
+};
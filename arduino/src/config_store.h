@@ -0,0 +1,237 @@
+#pragma once
+
+#include "hal.h"
+#include "default_constants.h"
+
+#define CONFIG_RECORD_MAGIC 0xA7C5
+
+/**
+ * Header stored in front of every config record.
+ */
+struct __attribute__((packed)) ConfigRecordHeader
+{
+    uint16_t magic;
+    // Layout version of the payload (CONFIG_VERSION when it was written)
+    uint8_t version;
+    uint8_t reserved;
+    // Incremented on every save, the newest valid record wins
+    uint16_t sequence;
+    uint16_t length;
+    // CRC-16/CCITT of version, sequence, length and payload
+    uint16_t crc;
+};
+
+#define CONFIG_PAYLOAD_CAPACITY (CONFIG_SLOT_SIZE - sizeof(ConfigRecordHeader))
+
+/**
+ * Binary config records in EEPROM.
+ *
+ * The EEPROM area is split in CONFIG_SLOT_COUNT slots. Every save goes to
+ * the slot after the current one (wear leveling), and only the bytes that
+ * differ from what the slot already holds are written. Saving a record
+ * equal to the current one writes nothing at all.
+ *
+ * The header is written after the payload, and the CRC covers both, so a
+ * save interrupted by a reset leaves the previous record in use.
+ */
+class ConfigStore
+{
+private:
+    int8_t currentSlot = -1;
+    uint16_t currentSequence = 0;
+
+    static uint16_t crc16(uint16_t crc, uint8_t data)
+    {
+        crc ^= (uint16_t)data << 8;
+
+        for (uint8_t i = 0; i < 8; i++)
+        {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+
+        return crc;
+    }
+
+    static int slotAddress(uint8_t slot)
+    {
+        return CONFIG_EEPROM_START + slot * CONFIG_SLOT_SIZE;
+    }
+
+    static void readBytes(int address, uint8_t *data, size_t length)
+    {
+        for (size_t i = 0; i < length; i++)
+        {
+            data[i] = EEPROM.read(address + i);
+        }
+    }
+
+    /**
+     * Writes only the bytes that differ from the EEPROM content.
+     *
+     * @return The number of bytes actually written
+     */
+    static size_t updateBytes(int address, const uint8_t *data, size_t length)
+    {
+        size_t written = 0;
+
+        for (size_t i = 0; i < length; i++)
+        {
+            if (EEPROM.read(address + i) != data[i])
+            {
+                EEPROM.write(address + i, data[i]);
+                written++;
+            }
+        }
+
+        return written;
+    }
+
+    static uint16_t headerCrc(const ConfigRecordHeader &header)
+    {
+        uint16_t crc = 0xFFFF;
+
+        crc = crc16(crc, header.version);
+        crc = crc16(crc, header.sequence >> 8);
+        crc = crc16(crc, header.sequence & 0xFF);
+        crc = crc16(crc, header.length >> 8);
+        crc = crc16(crc, header.length & 0xFF);
+
+        return crc;
+    }
+
+    static bool readValidHeader(uint8_t slot, ConfigRecordHeader &header)
+    {
+        readBytes(slotAddress(slot), (uint8_t *)&header, sizeof(header));
+
+        if (header.magic != CONFIG_RECORD_MAGIC || header.length > CONFIG_PAYLOAD_CAPACITY)
+        {
+            return false;
+        }
+
+        uint16_t crc = headerCrc(header);
+        int address = slotAddress(slot) + sizeof(header);
+
+        for (uint16_t i = 0; i < header.length; i++)
+        {
+            crc = crc16(crc, EEPROM.read(address + i));
+        }
+
+        return crc == header.crc;
+    }
+
+    bool sameAsCurrent(const uint8_t *payload, uint16_t length, uint8_t version)
+    {
+        ConfigRecordHeader header;
+
+        if (currentSlot < 0 || !readValidHeader(currentSlot, header) || header.version != version || header.length != length)
+        {
+            return false;
+        }
+
+        int address = slotAddress(currentSlot) + sizeof(header);
+
+        for (uint16_t i = 0; i < length; i++)
+        {
+            if (EEPROM.read(address + i) != payload[i])
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+public:
+    /**
+     * Reads the newest valid record.
+     *
+     * @param payload Receives the record payload
+     * @param capacity Size of the payload buffer
+     * @param version Receives the layout version of the record
+     * @return The payload length, 0 if no valid record exists
+     */
+    uint16_t load(uint8_t *payload, uint16_t capacity, uint8_t &version)
+    {
+        ConfigRecordHeader newest = {};
+
+        currentSlot = -1;
+
+        for (uint8_t slot = 0; slot < CONFIG_SLOT_COUNT; slot++)
+        {
+            ConfigRecordHeader header;
+
+            if (!readValidHeader(slot, header))
+            {
+                continue;
+            }
+
+            if (currentSlot < 0 || (int16_t)(header.sequence - newest.sequence) > 0)
+            {
+                currentSlot = slot;
+                newest = header;
+            }
+        }
+
+        if (currentSlot < 0)
+        {
+            return 0;
+        }
+
+        uint16_t length = newest.length < capacity ? newest.length : capacity;
+
+        readBytes(slotAddress(currentSlot) + sizeof(ConfigRecordHeader), payload, length);
+        currentSequence = newest.sequence;
+        version = newest.version;
+
+        return length;
+    }
+
+    /**
+     * Stores a record in the next slot, unless it equals the current one.
+     *
+     * @return The number of EEPROM bytes written
+     */
+    size_t save(const uint8_t *payload, uint16_t length, uint8_t version)
+    {
+        if (length > CONFIG_PAYLOAD_CAPACITY)
+        {
+            return 0;
+        }
+
+        if (sameAsCurrent(payload, length, version))
+        {
+            return 0;
+        }
+
+        uint8_t slot = currentSlot < 0 ? 0 : (currentSlot + 1) % CONFIG_SLOT_COUNT;
+        ConfigRecordHeader header;
+
+        header.magic = CONFIG_RECORD_MAGIC;
+        header.version = version;
+        header.reserved = 0;
+        header.sequence = currentSequence + 1;
+        header.length = length;
+        header.crc = headerCrc(header);
+
+        for (uint16_t i = 0; i < length; i++)
+        {
+            header.crc = crc16(header.crc, payload[i]);
+        }
+
+        size_t written = updateBytes(slotAddress(slot) + sizeof(header), payload, length);
+        written += updateBytes(slotAddress(slot), (const uint8_t *)&header, sizeof(header));
+
+        currentSlot = slot;
+        currentSequence = header.sequence;
+
+        return written;
+    }
+
+    /**
+     * @return The slot holding the current record, -1 if none
+     */
+    int8_t getCurrentSlot() const
+    {
+        return currentSlot;
+    }
+};
@@ -2,7 +2,21 @@
 
 #ifndef VERSION
 #define VERSION 1
-#define CONFIG_VERSION 1
+#define CONFIG_VERSION 6
+#endif
+
+// Binary config records: CONFIG_SLOT_COUNT slots of CONFIG_SLOT_SIZE bytes,
+// used in turn for wear leveling (see ConfigStore)
+#ifndef CONFIG_SLOT_SIZE
+#define CONFIG_EEPROM_START 0
+#define CONFIG_SLOT_SIZE 256
+#define CONFIG_SLOT_COUNT 4
+#endif
+
+// Fixed sizes of the text fields of the stored configuration, null included
+#ifndef CONFIG_ID_SIZE
+#define CONFIG_ID_SIZE 24
+#define CONFIG_HOST_SIZE 48
 #endif
 
 #ifndef SERIAL_CONNECTION_SPEED
@@ -13,10 +27,238 @@
 #define DEFAULT_HTTP_SERVER_PORT 80
 #endif
 
+// Concurrent HTTP clients. The W5100 has 4 sockets: one is used by MQTT
+// and one has to stay listening for new connections.
+#ifndef HTTP_MAX_CONNECTIONS
+#define HTTP_MAX_CONNECTIONS 2
+#endif
+
+// Request line, routed headers and body of a single request
+#ifndef HTTP_REQUEST_BUFFER_SIZE
+#define HTTP_REQUEST_BUFFER_SIZE 320
+#endif
+
+// Path and query of a request, the longest route is /reset-to-default.
+// Longer URLs are answered 414.
+#ifndef HTTP_URL_BUFFER_SIZE
+#define HTTP_URL_BUFFER_SIZE 64
+#endif
+
+// Time budgets of an HTTP connection: receiving a whole request,
+// and idling between two requests of a keep-alive connection
+#ifndef HTTP_REQUEST_TIMEOUT
+#define HTTP_REQUEST_TIMEOUT 2000UL
+#define HTTP_KEEPALIVE_TIMEOUT 5000UL
+#define HTTP_KEEPALIVE_MAX_REQUESTS 100
+#endif
+
+// Wait for the FIN acknowledgment when a socket is closed after an error
+// (408, 413, 503...): the Ethernet default of a second would block loop()
+// on every vanished client. Served responses keep the default.
+#ifndef HTTP_CLOSE_TIMEOUT
+#define HTTP_CLOSE_TIMEOUT 5
+#endif
+
 #ifndef DEFAULT_MQTT_SERVER_HOST
 #define DEFAULT_MQTT_SERVER_HOST "192.168.2.145"
 #define DEFAULT_MQTT_CLIENT_ID "ardumi-test"
 #define DEFAULT_MQTT_KEEPALIVE 15
 #define DEFAULT_MQTT_TIMEOUT 30
-#define DEFAULT_MQTT_CONNECTION_RETRIES 2
-#endif
\ No newline at end of file
+// Reconnections with a growing backoff, 1s to 32s, before waiting MQTT_BACKOFF_MAX
+#define DEFAULT_MQTT_CONNECTION_RETRIES 6
+#endif
+
+// MQTT topics are <prefix>/<MQTT_DEVICE_ID>/<leaf> (see MqttTopics). Every
+// device also subscribes to MQTT_CHANNEL_COUNT configurable channels, the
+// group topics shared by several devices.
+#ifndef DEFAULT_MQTT_TOPIC_PREFIX
+#define DEFAULT_MQTT_TOPIC_PREFIX "ardu-test"
+#define CONFIG_PREFIX_SIZE 16
+#define CONFIG_CHANNEL_SIZE 20
+#define MQTT_CHANNEL_COUNT 2
+#endif
+
+// MQTT reconnection backoff bounds, and how often a live connection is checked
+#ifndef MQTT_BACKOFF_MIN
+#define MQTT_BACKOFF_MIN 1000UL
+#define MQTT_BACKOFF_MAX 60000UL
+#define MQTT_CONNECTION_CHECK_INTERVAL 1000UL
+#endif
+
+#ifndef DEFAULT_PAYLOAD_ENCODING
+// Encoding of the published payloads (see PayloadEncoding)
+#define DEFAULT_PAYLOAD_ENCODING 0
+#endif
+
+// Ring buffer of the serial command reader, also the longest accepted command
+#ifndef SERIAL_RING_BUFFER_SIZE
+#define SERIAL_RING_BUFFER_SIZE 128
+#endif
+
+#ifndef COMMAND_RESULT_SIZE
+#define COMMAND_RESULT_SIZE 80
+#endif
+
+// Correlation ids of MQTT commands, and replies waiting to be published
+#ifndef COMMAND_CORRELATION_ID_SIZE
+#define COMMAND_CORRELATION_ID_SIZE 24
+#endif
+
+#ifndef MQTT_REPLY_QUEUE_SIZE
+#define MQTT_REPLY_QUEUE_SIZE 4
+#endif
+
+// Commands in one batch message, one port of relays. The message must also
+// fit the buffer of its transport (MQTT_CLIENT_BUFFER_SIZE holds 8 compact
+// WRITE_DIGITAL commands, HTTP_REQUEST_BUFFER_SIZE and the serial port less)
+#ifndef COMMAND_BATCH_MAX
+#define COMMAND_BATCH_MAX 8
+#endif
+
+// Pool of ArduinoJson on the board for a batch of COMMAND_BATCH_MAX: about
+// 64 bytes per {"command":"WRITE_DIGITAL","arguments":"22:1"} (5 slots of
+// 6 bytes, the argument string, block headers and the slack of the pool
+// growth) and 192 for the root and the key strings, stored once
+#ifndef COMMAND_JSON_BOARD_POOL_SIZE
+#define COMMAND_JSON_BOARD_POOL_SIZE (192 + COMMAND_BATCH_MAX * 64)
+#endif
+
+// Fixed buffer used to parse incoming command messages without touching the heap.
+// Host slots and pools are several times larger, hence the native size.
+#ifndef COMMAND_JSON_POOL_SIZE
+#ifdef ARDUMI_NATIVE
+#define COMMAND_JSON_POOL_SIZE 8192
+#else
+#define COMMAND_JSON_POOL_SIZE COMMAND_JSON_BOARD_POOL_SIZE
+#endif
+#endif
+
+// Shared buffer holding the payload of outgoing MQTT messages
+#ifndef MQTT_PAYLOAD_BUFFER_SIZE
+#define MQTT_PAYLOAD_BUFFER_SIZE 512
+#endif
+
+// The MQTT client serializes whole packets (topic and payload) in its own buffer
+#ifndef MQTT_CLIENT_BUFFER_SIZE
+#define MQTT_CLIENT_BUFFER_SIZE (MQTT_PAYLOAD_BUFFER_SIZE + 64)
+#endif
+
+// Pins reported by the state scanner when they change ([first, last) range)
+#ifndef STATE_FIRST_WATCHED_PIN
+#define STATE_FIRST_WATCHED_PIN 30
+#define STATE_LAST_WATCHED_PIN (NUM_DIGITAL_PINS - NUM_ANALOG_INPUTS)
+#endif
+
+// Period of the state scan, in milliseconds
+#ifndef DEFAULT_STATE_SCAN_INTERVAL
+#define DEFAULT_STATE_SCAN_INTERVAL 50
+#endif
+
+// Pin changes publication (see StatePublishMode)
+#ifndef DEFAULT_STATE_PUBLISH_MODE
+#define DEFAULT_STATE_PUBLISH_MODE 1
+#define DEFAULT_STATE_COALESCE_WINDOW 0
+#endif
+
+#ifndef STATE_CHANGE_BATCH_SIZE
+#define STATE_CHANGE_BATCH_SIZE 12
+#endif
+
+#ifndef STATE_CHANGE_PAYLOAD_SIZE
+#define STATE_CHANGE_PAYLOAD_SIZE 256
+#endif
+
+// Status broadcast encoding (see StatusTelemetryMode), and the number
+// of deltas sent between two full keyframes
+#ifndef DEFAULT_STATUS_MODE
+#define DEFAULT_STATUS_MODE 0
+#define DEFAULT_STATUS_KEYFRAME_INTERVAL 10
+#endif
+
+// Background ADC sampling (see AdcSampler): bit mask of the monitored
+// channels (0 disables the engine), minimum change reported, and number
+// of conversions averaged into one sample
+#ifndef DEFAULT_ANALOG_CHANNELS
+#define DEFAULT_ANALOG_CHANNELS 0
+#define DEFAULT_ANALOG_DEADBAND 8
+#define DEFAULT_ANALOG_OVERSAMPLING 16
+#endif
+
+// The largest oversampling whose sum of 10 bit conversions fits an uint16_t
+#define ADC_MAX_OVERSAMPLING 64
+
+// Memory metrics (see MemoryMetricsProvider): publication period of the
+// metrics topic in seconds, and bytes below the stack pointer left unpainted at boot
+#ifndef DEFAULT_METRICS_INTERVAL
+#define DEFAULT_METRICS_INTERVAL 60
+#endif
+
+#ifndef STACK_PAINT_MARGIN
+#define STACK_PAINT_MARGIN 32
+#endif
+
+// Per-stage loop() profiler (see LoopProfiler). Set LOOP_PROFILER to 0
+// to compile the instrumentation out.
+#ifndef LOOP_PROFILER
+#define LOOP_PROFILER 1
+#endif
+
+#ifndef PROFILE_PUBLISH_INTERVAL
+#define PROFILE_PUBLISH_INTERVAL 60000UL
+#endif
+
+// Pin streaming (see PinStreamer) reserves ~470 bytes of SRAM for its
+// frame buffers, for a feature of test benches: set PIN_STREAMER to 1 to
+// compile the STREAM command in.
+#ifndef PIN_STREAMER
+#define PIN_STREAMER 0
+#endif
+
+// Pin streaming (see PinStreamer): pins and samples per frame, highest
+// sampling rate in Hz, and share of the measured MQTT link capacity a
+// stream may use, in percent
+#ifndef STREAM_MAX_PINS
+#define STREAM_MAX_PINS 8
+#define STREAM_SAMPLES_PER_FRAME 10
+#define STREAM_MAX_RATE 1000
+#define STREAM_LINK_BUDGET 50
+#endif
+
+// Link capacity assumed until frames have been published, in bytes per second
+#ifndef STREAM_DEFAULT_LINK_CAPACITY
+#define STREAM_DEFAULT_LINK_CAPACITY 8000UL
+#endif
+
+// Window over which the link capacity is measured, in milliseconds
+#ifndef STREAM_LINK_WINDOW
+#define STREAM_LINK_WINDOW 1000UL
+#endif
+
+// Edge rules stored in the configuration (see EdgeRules)
+#ifndef RULES_MAX
+#define RULES_MAX 6
+#endif
+
+// Status publication periods, in seconds: the regular one, and the faster
+// one used while pins are changing (0 keeps the regular one)
+#ifndef DEFAULT_STATUS_INTERVAL
+#define DEFAULT_STATUS_INTERVAL 30
+#define DEFAULT_STATUS_ACTIVE_INTERVAL 5
+#endif
+
+// Telemetry scheduling (see TelemetryScheduler): how long pins count as
+// active after a change (ms), the loop() latency above which publications
+// slow down (us), and the largest backoff, as a power of two of the period
+#ifndef TELEMETRY_ACTIVE_WINDOW
+#define TELEMETRY_ACTIVE_WINDOW 10000UL
+#define TELEMETRY_LATENCY_LIMIT 20000UL
+#define TELEMETRY_MAX_BACKOFF_SHIFT 3
+#endif
+
+// Pre-serialized payload parts (see PayloadFragment): device id and
+// version, http and mqtt sections of the status, whole advertise message
+#ifndef FRAGMENT_DEVICE_SIZE
+#define FRAGMENT_DEVICE_SIZE 64
+#define FRAGMENT_CONFIG_SIZE 200
+#define FRAGMENT_ADVERTISE_SIZE 160
+#endif
@@ -1,40 +1,275 @@
 #pragma once
 
-#include <Arduino.h>
-#include <ArduinoUniqueID.h>
-#include <EEPROM.h>
-#include <StreamUtils.h>
 #include <ArduinoJson.h>
+#include "hal.h"
 #include "default_constants.h"
-#include <TaskScheduler.h>
+#include "config_store.h"
+#include "json_writer.h"
+#include "state_changes.h"
+
+/**
+ * Event that fires an edge rule. Digital triggers follow the level of the
+ * source pin, analog ones the samples of the ADC engine crossing the
+ * threshold.
+ */
+enum RuleTrigger : uint8_t
+{
+    // Free entry of the rule table
+    RULE_UNUSED = 0,
+    RULE_RISING,
+    RULE_FALLING,
+    RULE_CHANGE,
+    RULE_ABOVE,
+    RULE_BELOW,
+};
+
+enum RuleAction : uint8_t
+{
+    // Writes value to the target pin
+    RULE_WRITE = 0,
+    // Publishes the source pin and its value on the rule topic
+    RULE_PUBLISH,
+    // Writes value to the target pin after delay milliseconds
+    RULE_SCHEDULE,
+};
+
+/**
+ * An edge rule, as stored in the configuration.
+ */
+struct __attribute__((packed)) EdgeRule
+{
+    uint8_t trigger;
+    uint8_t pin;
+    uint16_t threshold;
+    uint8_t action;
+    uint8_t target;
+    uint8_t value;
+    uint16_t delay;
+};
 
+// JSON names of the triggers and actions, in enum order
+const char ruleUnusedName[] PROGMEM = "";
+const char ruleRisingName[] PROGMEM = "rising";
+const char ruleFallingName[] PROGMEM = "falling";
+const char ruleChangeName[] PROGMEM = "change";
+const char ruleAboveName[] PROGMEM = "above";
+const char ruleBelowName[] PROGMEM = "below";
+const char *const ruleTriggerNames[] PROGMEM = {ruleUnusedName, ruleRisingName, ruleFallingName, ruleChangeName, ruleAboveName, ruleBelowName};
+
+const char ruleWriteName[] PROGMEM = "write";
+const char rulePublishName[] PROGMEM = "publish";
+const char ruleScheduleName[] PROGMEM = "schedule";
+const char *const ruleActionNames[] PROGMEM = {ruleWriteName, rulePublishName, ruleScheduleName};
+
+enum StatusTelemetryMode
+{
+    // Every broadcast carries the whole status document
+    FULL_STATUS = 0,
+    // Only the fields changed since the last broadcast, with periodic keyframes
+    DELTA_STATUS = 1,
+};
+
+/**
+ * The device configuration. Text fields are fixed buffers, so the
+ * configuration never touches the heap and is always passed by reference.
+ */
 struct DeviceConfig
 {
-    String DEVICE_UNIQUE_ID;
+    char DEVICE_UNIQUE_ID[CONFIG_ID_SIZE];
     int DEVICE_CONFIG_VERSION;
     int HTTP_SERVER_PORT;
-    String MQTT_SERVER_HOST;
-    String MQTT_DEVICE_ID;
+    char MQTT_SERVER_HOST[CONFIG_HOST_SIZE];
+    char MQTT_DEVICE_ID[CONFIG_ID_SIZE];
     int MQTT_KEEPALIVE;
     int MQTT_TIMEOUT;
     int MQTT_CONNECTION_RETRIES;
+    int PAYLOAD_ENCODING;
+    int STATE_PUBLISH_MODE;
+    int STATE_COALESCE_WINDOW;
+    int STATUS_MODE;
+    int STATUS_KEYFRAME_INTERVAL;
+    unsigned int ANALOG_CHANNELS;
+    int ANALOG_DEADBAND;
+    int ANALOG_OVERSAMPLING;
+    EdgeRule RULES[RULES_MAX];
+    char MQTT_TOPIC_PREFIX[CONFIG_PREFIX_SIZE];
+    // Empty entries are unused
+    char MQTT_CHANNELS[MQTT_CHANNEL_COUNT][CONFIG_CHANNEL_SIZE];
+    // Periods of the publications in seconds, of the state scan in milliseconds
+    int STATUS_INTERVAL;
+    int STATUS_ACTIVE_INTERVAL;
+    int METRICS_INTERVAL;
+    int STATE_SCAN_INTERVAL;
+};
+
+/**
+ * Binary layout of the configuration stored in EEPROM (version CONFIG_VERSION).
+ *
+ * When a field is added or changed, bump CONFIG_VERSION and add an entry
+ * to configMigrations that upgrades a record of the previous version.
+ */
+struct __attribute__((packed)) ConfigPayload
+{
+    char deviceUniqueId[CONFIG_ID_SIZE];
+    char mqttServerHost[CONFIG_HOST_SIZE];
+    char mqttDeviceId[CONFIG_ID_SIZE];
+    uint16_t httpServerPort;
+    uint16_t mqttKeepalive;
+    uint16_t mqttTimeout;
+    uint8_t mqttConnectionRetries;
+    uint8_t payloadEncoding;
+    uint8_t statePublishMode;
+    uint16_t stateCoalesceWindow;
+    uint8_t statusMode;
+    uint16_t statusKeyframeInterval;
+    // Version 3
+    uint16_t analogChannels;
+    uint16_t analogDeadband;
+    uint8_t analogOversampling;
+    // Version 4
+    EdgeRule rules[RULES_MAX];
+    // Version 5
+    char mqttTopicPrefix[CONFIG_PREFIX_SIZE];
+    char mqttChannels[MQTT_CHANNEL_COUNT][CONFIG_CHANNEL_SIZE];
+    // Version 6
+    uint16_t statusInterval;
+    uint16_t statusActiveInterval;
+    uint16_t metricsInterval;
+    uint16_t stateScanInterval;
+};
+
+static_assert(sizeof(ConfigPayload) <= CONFIG_PAYLOAD_CAPACITY, "ConfigPayload does not fit in CONFIG_SLOT_SIZE");
+
+/**
+ * Upgrades a payload stored with version fromVersion to the next version,
+ * in place.
+ *
+ * @param length Length of the stored payload, updated to the new length
+ * @return false if the record cannot be upgraded
+ */
+typedef bool (*ConfigMigrationFunction)(uint8_t *payload, uint16_t &length);
+
+struct ConfigMigration
+{
+    uint8_t fromVersion;
+    ConfigMigrationFunction migrate;
+};
+
+/**
+ * Version 2 to 3: background ADC sampling settings, disabled by default.
+ */
+inline bool migrateConfigFromVersion2(uint8_t *payload, uint16_t &length)
+{
+    if (length != offsetof(ConfigPayload, analogChannels))
+    {
+        return false;
+    }
+
+    ConfigPayload *upgraded = (ConfigPayload *)payload;
+
+    upgraded->analogChannels = DEFAULT_ANALOG_CHANNELS;
+    upgraded->analogDeadband = DEFAULT_ANALOG_DEADBAND;
+    upgraded->analogOversampling = DEFAULT_ANALOG_OVERSAMPLING;
+    length = offsetof(ConfigPayload, rules);
+
+    return true;
+}
+
+/**
+ * Version 3 to 4: edge rules, none by default.
+ */
+inline bool migrateConfigFromVersion3(uint8_t *payload, uint16_t &length)
+{
+    if (length != offsetof(ConfigPayload, rules))
+    {
+        return false;
+    }
+
+    memset(((ConfigPayload *)payload)->rules, 0, sizeof(ConfigPayload::rules));
+    length = offsetof(ConfigPayload, mqttTopicPrefix);
+
+    return true;
+}
+
+/**
+ * Version 4 to 5: topic prefix and channels. The prefix is the one of the
+ * topics used until then, so the existing backends keep working.
+ */
+inline bool migrateConfigFromVersion4(uint8_t *payload, uint16_t &length)
+{
+    if (length != offsetof(ConfigPayload, mqttTopicPrefix))
+    {
+        return false;
+    }
+
+    ConfigPayload *upgraded = (ConfigPayload *)payload;
+
+    strlcpy_P(upgraded->mqttTopicPrefix, PSTR(DEFAULT_MQTT_TOPIC_PREFIX), sizeof(upgraded->mqttTopicPrefix));
+    memset(upgraded->mqttChannels, 0, sizeof(upgraded->mqttChannels));
+    length = offsetof(ConfigPayload, statusInterval);
+
+    return true;
+}
+
+/**
+ * Version 5 to 6: publication and scan periods, the values that were
+ * compiled in until then.
+ */
+inline bool migrateConfigFromVersion5(uint8_t *payload, uint16_t &length)
+{
+    if (length != offsetof(ConfigPayload, statusInterval))
+    {
+        return false;
+    }
+
+    ConfigPayload *upgraded = (ConfigPayload *)payload;
+
+    upgraded->statusInterval = DEFAULT_STATUS_INTERVAL;
+    upgraded->statusActiveInterval = DEFAULT_STATUS_ACTIVE_INTERVAL;
+    upgraded->metricsInterval = DEFAULT_METRICS_INTERVAL;
+    upgraded->stateScanInterval = DEFAULT_STATE_SCAN_INTERVAL;
+    length = sizeof(ConfigPayload);
+
+    return true;
+}
+
+/**
+ * Every binary layout change, in order. Version 1 was the JSON text format,
+ * which is imported instead (see DeviceConfigProvider::importLegacyJson).
+ * The table ends with a null entry.
+ */
+const ConfigMigration configMigrations[] PROGMEM = {
+    {2, &migrateConfigFromVersion2},
+    {3, &migrateConfigFromVersion3},
+    {4, &migrateConfigFromVersion4},
+    {5, &migrateConfigFromVersion5},
+    {0, nullptr},
 };
 
+/**
+ * Called after a changed configuration was saved.
+ */
+typedef void (*ConfigSavedCallback)();
+
 class DeviceConfigProvider
 {
 private:
-    String getUniqueId()
-    {
-        String uniqueId = "";
+    ConfigStore store;
+    ConfigSavedCallback savedCallback = nullptr;
+
+    // Hex representation of the board unique id, computed on first use
+    char uniqueId[UniqueIDsize * 2 + 1] = {0};
+
+    static_assert(sizeof(uniqueId) <= CONFIG_ID_SIZE, "CONFIG_ID_SIZE cannot hold the unique id");
 
-        for (size_t i = 0; i < UniqueIDsize; i++)
+    const char *getUniqueId()
+    {
+        if (uniqueId[0] == 0)
         {
-            if (UniqueID[i] < 0x10)
+            for (size_t i = 0; i < UniqueIDsize; i++)
             {
-                uniqueId += "0";
+                snprintf_P(uniqueId + i * 2, 3, PSTR("%02x"), UniqueID[i]);
             }
-
-            uniqueId += String(UniqueID[i], HEX);
         }
 
         return uniqueId;
@@ -60,98 +295,595 @@ private:
 
     DeviceConfig getDefaultConfig()
     {
-        DeviceConfig defaultConfig = {
-            .DEVICE_UNIQUE_ID = getUniqueId(),
-            .DEVICE_CONFIG_VERSION = CONFIG_VERSION,
-            .HTTP_SERVER_PORT = DEFAULT_HTTP_SERVER_PORT,
-            .MQTT_SERVER_HOST = DEFAULT_MQTT_SERVER_HOST,
-            .MQTT_DEVICE_ID = getUniqueId(),
-            .MQTT_KEEPALIVE = DEFAULT_MQTT_KEEPALIVE,
-            .MQTT_TIMEOUT = DEFAULT_MQTT_TIMEOUT,
-            .MQTT_CONNECTION_RETRIES = DEFAULT_MQTT_CONNECTION_RETRIES,
-        };
+        // Assigned one by one: avr-gcc rejects designated initializers that skip a member
+        DeviceConfig defaultConfig = {};
+
+        defaultConfig.DEVICE_CONFIG_VERSION = CONFIG_VERSION;
+        defaultConfig.HTTP_SERVER_PORT = DEFAULT_HTTP_SERVER_PORT;
+        defaultConfig.MQTT_KEEPALIVE = DEFAULT_MQTT_KEEPALIVE;
+        defaultConfig.MQTT_TIMEOUT = DEFAULT_MQTT_TIMEOUT;
+        defaultConfig.MQTT_CONNECTION_RETRIES = DEFAULT_MQTT_CONNECTION_RETRIES;
+        defaultConfig.PAYLOAD_ENCODING = DEFAULT_PAYLOAD_ENCODING;
+        defaultConfig.STATE_PUBLISH_MODE = DEFAULT_STATE_PUBLISH_MODE;
+        defaultConfig.STATE_COALESCE_WINDOW = DEFAULT_STATE_COALESCE_WINDOW;
+        defaultConfig.STATUS_MODE = DEFAULT_STATUS_MODE;
+        defaultConfig.STATUS_KEYFRAME_INTERVAL = DEFAULT_STATUS_KEYFRAME_INTERVAL;
+        defaultConfig.ANALOG_CHANNELS = DEFAULT_ANALOG_CHANNELS;
+        defaultConfig.ANALOG_DEADBAND = DEFAULT_ANALOG_DEADBAND;
+        defaultConfig.ANALOG_OVERSAMPLING = DEFAULT_ANALOG_OVERSAMPLING;
+        defaultConfig.STATUS_INTERVAL = DEFAULT_STATUS_INTERVAL;
+        defaultConfig.STATUS_ACTIVE_INTERVAL = DEFAULT_STATUS_ACTIVE_INTERVAL;
+        defaultConfig.METRICS_INTERVAL = DEFAULT_METRICS_INTERVAL;
+        defaultConfig.STATE_SCAN_INTERVAL = DEFAULT_STATE_SCAN_INTERVAL;
+
+        strlcpy(defaultConfig.DEVICE_UNIQUE_ID, getUniqueId(), sizeof(defaultConfig.DEVICE_UNIQUE_ID));
+        strlcpy_P(defaultConfig.MQTT_SERVER_HOST, PSTR(DEFAULT_MQTT_SERVER_HOST), sizeof(defaultConfig.MQTT_SERVER_HOST));
+        strlcpy(defaultConfig.MQTT_DEVICE_ID, getUniqueId(), sizeof(defaultConfig.MQTT_DEVICE_ID));
+        strlcpy_P(defaultConfig.MQTT_TOPIC_PREFIX, PSTR(DEFAULT_MQTT_TOPIC_PREFIX), sizeof(defaultConfig.MQTT_TOPIC_PREFIX));
 
         return defaultConfig;
     };
 
+    /**
+     * Applies the migrations from version to CONFIG_VERSION.
+     *
+     * @return false if a step is missing or fails
+     */
+    static bool migrate(uint8_t *payload, uint16_t &length, uint8_t version)
+    {
+        while (version < CONFIG_VERSION)
+        {
+            ConfigMigrationFunction function = nullptr;
+
+            for (const ConfigMigration *entry = configMigrations;; entry++)
+            {
+                ConfigMigrationFunction entryFunction = (ConfigMigrationFunction)pgm_read_ptr(&entry->migrate);
+
+                if (entryFunction == nullptr)
+                {
+                    break;
+                }
+
+                if (pgm_read_byte(&entry->fromVersion) == version)
+                {
+                    function = entryFunction;
+                    break;
+                }
+            }
+
+            if (function == nullptr || !function(payload, length))
+            {
+                return false;
+            }
+
+            version++;
+        }
+
+        return true;
+    }
+
+    static DeviceConfig fromPayload(const ConfigPayload &payload)
+    {
+        DeviceConfig config = {};
+
+        config.DEVICE_CONFIG_VERSION = CONFIG_VERSION;
+        config.HTTP_SERVER_PORT = payload.httpServerPort;
+        config.MQTT_KEEPALIVE = payload.mqttKeepalive;
+        config.MQTT_TIMEOUT = payload.mqttTimeout;
+        config.MQTT_CONNECTION_RETRIES = payload.mqttConnectionRetries;
+        config.PAYLOAD_ENCODING = payload.payloadEncoding;
+        config.STATE_PUBLISH_MODE = payload.statePublishMode;
+        config.STATE_COALESCE_WINDOW = payload.stateCoalesceWindow;
+        config.STATUS_MODE = payload.statusMode;
+        config.STATUS_KEYFRAME_INTERVAL = payload.statusKeyframeInterval;
+        config.ANALOG_CHANNELS = payload.analogChannels;
+        config.ANALOG_DEADBAND = payload.analogDeadband;
+        config.ANALOG_OVERSAMPLING = payload.analogOversampling;
+        config.STATUS_INTERVAL = payload.statusInterval;
+        config.STATUS_ACTIVE_INTERVAL = payload.statusActiveInterval;
+        config.METRICS_INTERVAL = payload.metricsInterval;
+        config.STATE_SCAN_INTERVAL = payload.stateScanInterval;
+
+        // The stored buffers are null terminated by toPayload
+        strlcpy(config.DEVICE_UNIQUE_ID, payload.deviceUniqueId, sizeof(config.DEVICE_UNIQUE_ID));
+        strlcpy(config.MQTT_SERVER_HOST, payload.mqttServerHost, sizeof(config.MQTT_SERVER_HOST));
+        strlcpy(config.MQTT_DEVICE_ID, payload.mqttDeviceId, sizeof(config.MQTT_DEVICE_ID));
+        memcpy(config.RULES, payload.rules, sizeof(config.RULES));
+        strlcpy(config.MQTT_TOPIC_PREFIX, payload.mqttTopicPrefix, sizeof(config.MQTT_TOPIC_PREFIX));
+
+        for (uint8_t i = 0; i < MQTT_CHANNEL_COUNT; i++)
+        {
+            strlcpy(config.MQTT_CHANNELS[i], payload.mqttChannels[i], sizeof(config.MQTT_CHANNELS[i]));
+        }
+
+        return config;
+    }
+
+    static void toPayload(const DeviceConfig &config, ConfigPayload &payload)
+    {
+        memset(&payload, 0, sizeof(payload));
+
+        strlcpy(payload.deviceUniqueId, config.DEVICE_UNIQUE_ID, sizeof(payload.deviceUniqueId));
+        strlcpy(payload.mqttServerHost, config.MQTT_SERVER_HOST, sizeof(payload.mqttServerHost));
+        strlcpy(payload.mqttDeviceId, config.MQTT_DEVICE_ID, sizeof(payload.mqttDeviceId));
+        payload.httpServerPort = config.HTTP_SERVER_PORT;
+        payload.mqttKeepalive = config.MQTT_KEEPALIVE;
+        payload.mqttTimeout = config.MQTT_TIMEOUT;
+        payload.mqttConnectionRetries = config.MQTT_CONNECTION_RETRIES;
+        payload.payloadEncoding = config.PAYLOAD_ENCODING;
+        payload.statePublishMode = config.STATE_PUBLISH_MODE;
+        payload.stateCoalesceWindow = config.STATE_COALESCE_WINDOW;
+        payload.statusMode = config.STATUS_MODE;
+        payload.statusKeyframeInterval = config.STATUS_KEYFRAME_INTERVAL;
+        payload.analogChannels = config.ANALOG_CHANNELS;
+        payload.analogDeadband = config.ANALOG_DEADBAND;
+        payload.analogOversampling = config.ANALOG_OVERSAMPLING;
+        memcpy(payload.rules, config.RULES, sizeof(payload.rules));
+        payload.statusInterval = config.STATUS_INTERVAL;
+        payload.statusActiveInterval = config.STATUS_ACTIVE_INTERVAL;
+        payload.metricsInterval = config.METRICS_INTERVAL;
+        payload.stateScanInterval = config.STATE_SCAN_INTERVAL;
+        strlcpy(payload.mqttTopicPrefix, config.MQTT_TOPIC_PREFIX, sizeof(payload.mqttTopicPrefix));
+
+        for (uint8_t i = 0; i < MQTT_CHANNEL_COUNT; i++)
+        {
+            strlcpy(payload.mqttChannels[i], config.MQTT_CHANNELS[i], sizeof(payload.mqttChannels[i]));
+        }
+    }
+
+    /**
+     * @return The position of name in a table of PROGMEM strings, -1 if absent
+     */
+    static int8_t findName(const char *name, const char *const *names, uint8_t count)
+    {
+        for (uint8_t i = 0; name != nullptr && i < count; i++)
+        {
+            if (strcmp_P(name, (const char *)pgm_read_ptr(&names[i])) == 0)
+            {
+                return i;
+            }
+        }
+
+        return -1;
+    }
+
+    /**
+     * Replaces the rules with the entries of a JSON array, e.g.
+     * {"on":"rising","pin":30,"do":"schedule","target":13,"value":1,"delay":500}
+     *
+     * @return false if an entry is invalid or there are more than RULES_MAX
+     */
+    static bool importRules(JsonArrayConst json, DeviceConfig &config)
+    {
+        if (json.size() > RULES_MAX)
+        {
+            return false;
+        }
+
+        memset(config.RULES, 0, sizeof(config.RULES));
+
+        uint8_t index = 0;
+
+        for (JsonVariantConst entry : json)
+        {
+            EdgeRule &rule = config.RULES[index++];
+            int8_t trigger = findName(entry[F("on")] | (const char *)nullptr, ruleTriggerNames, sizeof(ruleTriggerNames) / sizeof(ruleTriggerNames[0]));
+            int8_t action = findName(entry[F("do")] | "write", ruleActionNames, sizeof(ruleActionNames) / sizeof(ruleActionNames[0]));
+            int pin = entry[F("pin")] | -1;
+            int target = entry[F("target")] | -1;
+            // Locals, a packed field cannot be bound to a reference
+            uint16_t threshold = 0;
+            uint16_t delay = 0;
+
+            if (!importNumber(entry[F("threshold")], threshold) || !importNumber(entry[F("delay")], delay))
+            {
+                return false;
+            }
+
+            // Entry 0 of the trigger names is the unused marker, not a trigger
+            if (trigger <= RULE_UNUSED || action < 0 || pin < 0 || pin >= NUM_DIGITAL_PINS)
+            {
+                return false;
+            }
+
+            if (action != RULE_PUBLISH && (target < 0 || target >= NUM_DIGITAL_PINS))
+            {
+                return false;
+            }
+
+            rule.trigger = trigger;
+            rule.pin = pin;
+            rule.threshold = threshold;
+            rule.action = action;
+            rule.target = action != RULE_PUBLISH ? target : 0;
+            rule.value = (entry[F("value")] | 0) ? HIGH : LOW;
+            rule.delay = delay;
+        }
+
+        return true;
+    }
+
+    /**
+     * Replaces the channels with the topics of a JSON array. The channels
+     * left over are cleared.
+     *
+     * @return false if a topic does not fit or there are more than MQTT_CHANNEL_COUNT
+     */
+    static bool importChannels(JsonArrayConst json, DeviceConfig &config)
+    {
+        if (json.size() > MQTT_CHANNEL_COUNT)
+        {
+            return false;
+        }
+
+        memset(config.MQTT_CHANNELS, 0, sizeof(config.MQTT_CHANNELS));
+
+        uint8_t index = 0;
+
+        for (JsonVariantConst entry : json)
+        {
+            if (!importString(entry, config.MQTT_CHANNELS[index++], CONFIG_CHANNEL_SIZE))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * @return true if a topic level may be built from text: no separator
+     * and no wildcard
+     */
+    static bool isTopicLevel(const char *text)
+    {
+        return strpbrk(text, "/+#") == nullptr;
+    }
+
+    /**
+     * Copies a JSON string into a fixed config buffer, if present.
+     *
+     * @return false if the string does not fit
+     */
+    static bool importString(JsonVariantConst value, char *destination, size_t size)
+    {
+        const char *str = value | (const char *)nullptr;
+
+        if (str == nullptr)
+        {
+            return true;
+        }
+
+        return strlcpy(destination, str, size) < size;
+    }
+
+    /**
+     * Copies a JSON integer into a config field, if present. Unlike the |
+     * operator, which keeps the current value, a number that the field
+     * cannot hold (40000 in a 16-bit int) or a value of another type is
+     * reported.
+     *
+     * @return false if the value is present but is not a T
+     */
+    template <typename T>
+    static bool importNumber(JsonVariantConst value, T &destination)
+    {
+        if (value.isNull())
+        {
+            return true;
+        }
+
+        if (!value.is<T>())
+        {
+            return false;
+        }
+
+        destination = value.as<T>();
+        return true;
+    }
+
+    /**
+     * Reads a configuration saved by the firmware versions that stored
+     * it as JSON text at the start of the EEPROM.
+     *
+     * @return false if the EEPROM does not contain a JSON configuration
+     */
+    bool importLegacyJson(DeviceConfig &config)
+    {
+        if (EEPROM.read(CONFIG_EEPROM_START) != '{')
+        {
+            return false;
+        }
+
+        JsonDocument jsonConfig;
+
+        EepromStream eepromStream(CONFIG_EEPROM_START, EEPROM.length() - CONFIG_EEPROM_START);
+        DeserializationError error = deserializeJson(jsonConfig, eepromStream);
+
+        if (error)
+        {
+            return false;
+        }
+
+        config = getDefaultConfig();
+
+        return importJson(jsonConfig.as<JsonVariantConst>(), config);
+    }
+
 public:
     /**
-     * This function tries to read the device configuration from the EEPROM.
-     * If some error occurs, it resets every blank in the EEPROM to the default configuration.
-     * It returns the fresh configuration from the EEPROM.
+     * This function reads the device configuration from the newest valid
+     * record in EEPROM, upgrading it if it was written by an older version.
+     * If no record can be used, the default configuration is saved.
+     * Records are binary, so no JSON is parsed on a normal boot.
      *
      * @return DeviceConfig
      */
     DeviceConfig readFromEEprom()
     {
+        ConfigPayload payload;
+        uint8_t version = 0;
+
+        memset(&payload, 0, sizeof(payload));
+
         EEPROM.begin();
+        uint16_t length = store.load((uint8_t *)&payload, sizeof(payload), version);
+        EEPROM.end();
 
-        JsonDocument jsonConfig;
+        if (length > 0 && migrate((uint8_t *)&payload, length, version) && length == sizeof(payload))
+        {
+            DeviceConfig config = fromPayload(payload);
 
-        // Read the EEPROM content
-        EepromStream eepromStream(0, EEPROM.length());
-        DeserializationError error = deserializeJson(jsonConfig, eepromStream);
+            if (version != CONFIG_VERSION)
+            {
+                Serial.println(F("Upgrading the configuration to the current version"));
+                saveConfig(config);
+            }
 
-        EEPROM.end();
+            return config;
+        }
 
-        // Parse the configuration with the default values in case there are some blanks
-        DeviceConfig parsedConfig = {
-            .DEVICE_UNIQUE_ID = jsonConfig[F("device")][F("id")] | getUniqueId(),
-            .DEVICE_CONFIG_VERSION = jsonConfig[F("device")][F("cf-version")] | CONFIG_VERSION,
-            .HTTP_SERVER_PORT = jsonConfig[F("http")][F("port")] | DEFAULT_HTTP_SERVER_PORT,
-            .MQTT_SERVER_HOST = jsonConfig[F("mqtt")][F("host")] | DEFAULT_MQTT_SERVER_HOST,
-            .MQTT_DEVICE_ID = jsonConfig[F("mqtt")][F("id")] | getUniqueId(),
-            .MQTT_KEEPALIVE = jsonConfig[F("mqtt")][F("keepalive")] | DEFAULT_MQTT_KEEPALIVE,
-            .MQTT_TIMEOUT = jsonConfig[F("mqtt")][F("timeout")] | DEFAULT_MQTT_TIMEOUT,
-            .MQTT_CONNECTION_RETRIES = jsonConfig[F("mqtt")][F("conn_retries")] | DEFAULT_MQTT_CONNECTION_RETRIES,
-        };
+        DeviceConfig config;
 
-        if (error)
+        if (importLegacyJson(config))
         {
-            Serial.println(F("ERROR: Unable to read from EEPROM correctly. Overwriting configuration with possibly default values"));
+            Serial.println(F("Converting the JSON configuration to the binary format"));
+        }
+        else
+        {
+            Serial.println(F("ERROR: Unable to read from EEPROM correctly. Overwriting configuration with default values"));
 
-            saveConfig(parsedConfig);
+            config = getDefaultConfig();
         }
 
-        return parsedConfig;
+        saveConfig(config);
+
+        return config;
     };
 
     /**
-     * This function overrites everything inside the EEPROM (from EEPROM_START to EEPROM_END)
-     * and saves the config passed as a parameter.
+     * This function saves the config passed as a parameter in the next
+     * EEPROM slot. Only the bytes that changed are written, and nothing
+     * is written if the configuration did not change.
      *
      * @param newConfig
+     * @return The number of EEPROM bytes written
      */
-    void saveConfig(DeviceConfig newConfig)
+    size_t saveConfig(const DeviceConfig &newConfig)
     {
-        Serial.println(F("Saving a new configuration to EEPROM"));
+        ConfigPayload payload;
+        toPayload(newConfig, payload);
 
-        // Clear the content of the EEPROM
-        // clearEEPROM();
+        EEPROM.begin();
+        size_t written = store.save((const uint8_t *)&payload, sizeof(payload), CONFIG_VERSION);
+        EEPROM.end();
 
-        JsonDocument jsonConfig;
+        if (written > 0)
+        {
+            Serial.print(F("Saved configuration in EEPROM slot "));
+            Serial.print(store.getCurrentSlot());
+            Serial.print(F(", bytes written: "));
+            Serial.println(written);
 
-        jsonConfig[F("device")][F("id")] = newConfig.DEVICE_UNIQUE_ID;
-        jsonConfig[F("device")][F("cf-version")] = newConfig.DEVICE_CONFIG_VERSION;
+            if (savedCallback != nullptr)
+            {
+                savedCallback();
+            }
+        }
 
-        jsonConfig[F("http")][F("port")] = newConfig.HTTP_SERVER_PORT;
+        return written;
+    };
 
-        jsonConfig[F("mqtt")][F("host")] = newConfig.MQTT_SERVER_HOST;
-        jsonConfig[F("mqtt")][F("id")] = newConfig.DEVICE_UNIQUE_ID;
-        jsonConfig[F("mqtt")][F("keepalive")] = newConfig.MQTT_KEEPALIVE;
-        jsonConfig[F("mqtt")][F("timeout")] = newConfig.MQTT_TIMEOUT;
-        jsonConfig[F("mqtt")][F("conn_retries")] = newConfig.MQTT_CONNECTION_RETRIES;
+    /**
+     * Registers the function called after every save that changed the
+     * configuration, to drop what was derived from the previous one.
+     */
+    void onSaved(ConfigSavedCallback callback)
+    {
+        savedCallback = callback;
+    }
 
-        // Write inside the EEPROM
-        EEPROM.begin();
+    /**
+     * @return true if a value is stored in a field of at most max without wrapping
+     */
+    static bool fitsField(long value, long max)
+    {
+        return value >= 0 && value <= max;
+    }
 
-        EepromStream eepromStream(0, EEPROM.length());
-        serializeJson(jsonConfig, eepromStream);
+    /**
+     * Overrides the fields present in a JSON configuration (same layout as
+     * config-example.json). Missing fields keep their current value.
+     *
+     * @param json The JSON configuration
+     * @param config The configuration to update
+     * @return false if a field is invalid, config may then be partially updated
+     */
+    static bool importJson(JsonVariantConst json, DeviceConfig &config)
+    {
+        bool valid = importString(json[F("device")][F("id")], config.DEVICE_UNIQUE_ID, sizeof(config.DEVICE_UNIQUE_ID)) &&
+                     importString(json[F("mqtt")][F("host")], config.MQTT_SERVER_HOST, sizeof(config.MQTT_SERVER_HOST)) &&
+                     importString(json[F("mqtt")][F("id")], config.MQTT_DEVICE_ID, sizeof(config.MQTT_DEVICE_ID)) &&
+                     importString(json[F("mqtt")][F("prefix")], config.MQTT_TOPIC_PREFIX, sizeof(config.MQTT_TOPIC_PREFIX));
+
+        valid = importNumber(json[F("http")][F("port")], config.HTTP_SERVER_PORT) &&
+                importNumber(json[F("mqtt")][F("keepalive")], config.MQTT_KEEPALIVE) &&
+                importNumber(json[F("mqtt")][F("timeout")], config.MQTT_TIMEOUT) &&
+                importNumber(json[F("mqtt")][F("conn_retries")], config.MQTT_CONNECTION_RETRIES) &&
+                importNumber(json[F("mqtt")][F("encoding")], config.PAYLOAD_ENCODING) &&
+                importNumber(json[F("state")][F("mode")], config.STATE_PUBLISH_MODE) &&
+                importNumber(json[F("state")][F("window")], config.STATE_COALESCE_WINDOW) &&
+                importNumber(json[F("status")][F("mode")], config.STATUS_MODE) &&
+                importNumber(json[F("status")][F("keyframe")], config.STATUS_KEYFRAME_INTERVAL) &&
+                importNumber(json[F("status")][F("interval")], config.STATUS_INTERVAL) &&
+                importNumber(json[F("status")][F("active")], config.STATUS_ACTIVE_INTERVAL) &&
+                importNumber(json[F("metrics")][F("interval")], config.METRICS_INTERVAL) &&
+                importNumber(json[F("state")][F("scan")], config.STATE_SCAN_INTERVAL) &&
+                importNumber(json[F("analog")][F("channels")], config.ANALOG_CHANNELS) &&
+                importNumber(json[F("analog")][F("deadband")], config.ANALOG_DEADBAND) &&
+                importNumber(json[F("analog")][F("oversampling")], config.ANALOG_OVERSAMPLING) &&
+                valid;
+
+        if (json[F("rules")].is<JsonArrayConst>())
+        {
+            valid = importRules(json[F("rules")].as<JsonArrayConst>(), config) && valid;
+        }
 
-        EEPROM.end();
+        if (json[F("mqtt")][F("channels")].is<JsonArrayConst>())
+        {
+            valid = importChannels(json[F("mqtt")][F("channels")].as<JsonArrayConst>(), config) && valid;
+        }
 
-        Serial.println(F("Successfully saved configuration in EEPROM"));
-    };
+        // Oversampling is a power of two, so the decimation is a shift
+        bool validOversampling = config.ANALOG_OVERSAMPLING >= 1 && config.ANALOG_OVERSAMPLING <= ADC_MAX_OVERSAMPLING &&
+                                 (config.ANALOG_OVERSAMPLING & (config.ANALOG_OVERSAMPLING - 1)) == 0;
+
+        // The payload stores these fields in 8 or 16 bits, a value that
+        // does not fit would run live and come back different after a reboot
+        bool validRanges = fitsField(config.PAYLOAD_ENCODING, MSGPACK_ENCODING) &&
+                           fitsField(config.STATE_PUBLISH_MODE, BATCHED) &&
+                           fitsField(config.STATUS_MODE, DELTA_STATUS) &&
+                           fitsField(config.MQTT_CONNECTION_RETRIES, UINT8_MAX) &&
+                           fitsField(config.STATE_COALESCE_WINDOW, UINT16_MAX) &&
+                           fitsField(config.STATUS_KEYFRAME_INTERVAL, UINT16_MAX);
+
+        return valid && validOversampling && validRanges &&
+               config.ANALOG_DEADBAND >= 0 &&
+               config.STATUS_INTERVAL > 0 && config.STATUS_ACTIVE_INTERVAL >= 0 &&
+               config.METRICS_INTERVAL > 0 && config.STATE_SCAN_INTERVAL > 0 &&
+               config.MQTT_DEVICE_ID[0] != 0 && isTopicLevel(config.MQTT_DEVICE_ID) &&
+               config.MQTT_TOPIC_PREFIX[0] != 0 && isTopicLevel(config.MQTT_TOPIC_PREFIX) &&
+               config.MQTT_SERVER_HOST[0] != 0 &&
+               config.HTTP_SERVER_PORT > 0 &&
+               config.MQTT_KEEPALIVE > 0 && config.MQTT_TIMEOUT > 0;
+    }
+
+    /**
+     * Streams the configuration as JSON, in the layout read by importJson.
+     *
+     * @return The number of bytes written
+     */
+    static size_t exportJson(Print &out, const DeviceConfig &config)
+    {
+        JsonWriter json(out);
+
+        json.beginObject();
+
+        json.key(F("device"));
+        json.beginObject();
+        json.member(F("id"), config.DEVICE_UNIQUE_ID);
+        json.member(F("cf-version"), config.DEVICE_CONFIG_VERSION);
+        json.endObject();
+
+        json.key(F("http"));
+        json.beginObject();
+        json.member(F("port"), config.HTTP_SERVER_PORT);
+        json.endObject();
+
+        json.key(F("mqtt"));
+        json.beginObject();
+        json.member(F("host"), config.MQTT_SERVER_HOST);
+        json.member(F("id"), config.MQTT_DEVICE_ID);
+        json.member(F("keepalive"), config.MQTT_KEEPALIVE);
+        json.member(F("timeout"), config.MQTT_TIMEOUT);
+        json.member(F("conn_retries"), config.MQTT_CONNECTION_RETRIES);
+        json.member(F("encoding"), config.PAYLOAD_ENCODING);
+        json.member(F("prefix"), config.MQTT_TOPIC_PREFIX);
+        json.key(F("channels"));
+        json.beginArray();
+        for (uint8_t i = 0; i < MQTT_CHANNEL_COUNT; i++)
+        {
+            if (config.MQTT_CHANNELS[i][0] != 0)
+            {
+                json.value(config.MQTT_CHANNELS[i]);
+            }
+        }
+        json.endArray();
+        json.endObject();
+
+        json.key(F("state"));
+        json.beginObject();
+        json.member(F("mode"), config.STATE_PUBLISH_MODE);
+        json.member(F("window"), config.STATE_COALESCE_WINDOW);
+        json.member(F("scan"), config.STATE_SCAN_INTERVAL);
+        json.endObject();
+
+        json.key(F("status"));
+        json.beginObject();
+        json.member(F("mode"), config.STATUS_MODE);
+        json.member(F("keyframe"), config.STATUS_KEYFRAME_INTERVAL);
+        json.member(F("interval"), config.STATUS_INTERVAL);
+        json.member(F("active"), config.STATUS_ACTIVE_INTERVAL);
+        json.endObject();
+
+        json.key(F("metrics"));
+        json.beginObject();
+        json.member(F("interval"), config.METRICS_INTERVAL);
+        json.endObject();
+
+        json.key(F("analog"));
+        json.beginObject();
+        json.member(F("channels"), config.ANALOG_CHANNELS);
+        json.member(F("deadband"), config.ANALOG_DEADBAND);
+        json.member(F("oversampling"), config.ANALOG_OVERSAMPLING);
+        json.endObject();
+
+        json.key(F("rules"));
+        json.beginArray();
+        for (uint8_t i = 0; i < RULES_MAX; i++)
+        {
+            const EdgeRule &rule = config.RULES[i];
+
+            if (rule.trigger == RULE_UNUSED)
+            {
+                continue;
+            }
+
+            json.beginObject();
+            json.member(F("on"), (const __FlashStringHelper *)pgm_read_ptr(&ruleTriggerNames[rule.trigger]));
+            json.member(F("pin"), (int)rule.pin);
+            if (rule.trigger == RULE_ABOVE || rule.trigger == RULE_BELOW)
+            {
+                json.member(F("threshold"), (unsigned int)rule.threshold);
+            }
+            json.member(F("do"), (const __FlashStringHelper *)pgm_read_ptr(&ruleActionNames[rule.action]));
+            if (rule.action != RULE_PUBLISH)
+            {
+                json.member(F("target"), (int)rule.target);
+                json.member(F("value"), (int)rule.value);
+            }
+            if (rule.action == RULE_SCHEDULE)
+            {
+                json.member(F("delay"), (unsigned int)rule.delay);
+            }
+            json.endObject();
+        }
+        json.endArray();
+
+        json.endObject();
+
+        return json.size();
+    }
 
     /**
      * This function allows to reset the EEPROM inside the device.
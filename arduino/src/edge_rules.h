@@ -0,0 +1,318 @@
+#pragma once
+
+#include <MQTT.h>
+#include "hal.h"
+#include "device_config.h"
+#include "json_writer.h"
+#include "msgpack_writer.h"
+#include "payload_encoding.h"
+#include "mqtt_topics.h"
+
+#define RULE_PAYLOAD_SIZE 48
+
+static_assert(RULES_MAX <= 8, "The pending writes of EdgeRules are an uint8_t bit set");
+
+/**
+ * A rule resolved to registers at load time, so evaluating it costs a
+ * few comparisons.
+ */
+struct CompiledRule
+{
+    uint8_t index;
+    uint8_t trigger;
+    uint8_t action;
+    uint8_t pin;
+    // Port and bit of a digital source, ADC channel of an analog one
+    uint8_t port;
+    uint8_t bitMask;
+    uint16_t threshold;
+    volatile uint8_t *output;
+    uint8_t outputMask;
+    uint8_t value;
+    uint16_t delay;
+};
+
+/**
+ * On-device reactions to pin changes, without a round trip to the broker.
+ *
+ * The rules of the configuration ("on pin X rising, write pin Y") are
+ * compiled into a table by compile(). The state scan then hands every
+ * port that changed to onPortChange() and every analog change to
+ * onAnalogChange(): writes happen in the same scan, and still work while
+ * the broker is down. Scheduled writes are kept with their due time,
+ * runDue() applies them (main.cpp drives it with a TaskScheduler task).
+ */
+class EdgeRules
+{
+private:
+    CompiledRule rules[RULES_MAX];
+    uint8_t count = 0;
+
+    // Ports and ADC channels that are the source of a rule
+    uint16_t sourcePorts = 0;
+    uint16_t sourceChannels = 0;
+
+    // Pending scheduled writes, one bit per compiled rule
+    uint8_t scheduled = 0;
+    unsigned long dueAt[RULES_MAX];
+
+    // Publish actions use TOPIC_RULE
+    const MqttTopics &topics;
+
+    static bool isAnalog(uint8_t trigger)
+    {
+        return trigger == RULE_ABOVE || trigger == RULE_BELOW;
+    }
+
+    static void writeOutput(const CompiledRule &rule)
+    {
+        noInterrupts();
+        if (rule.value)
+        {
+            *rule.output |= rule.outputMask;
+        }
+        else
+        {
+            *rule.output &= ~rule.outputMask;
+        }
+        interrupts();
+    }
+
+    template <typename TWriter>
+    static void writeRuleMessage(TWriter &writer, const CompiledRule &rule, int value)
+    {
+        writer.beginObject(3);
+        writer.member(F("rule"), (int)rule.index);
+        writer.member(F("pin"), (int)rule.pin);
+        writer.member(F("value"), value);
+        writer.endObject();
+    }
+
+    void publish(MQTTClient &mqtt, const DeviceConfig &config, const CompiledRule &rule, int value)
+    {
+        char payload[RULE_PAYLOAD_SIZE];
+        BufferPrint out(payload, sizeof(payload));
+
+        if (config.PAYLOAD_ENCODING == PayloadEncoding::MSGPACK_ENCODING)
+        {
+            MsgPackWriter writer(out);
+            writeRuleMessage(writer, rule, value);
+        }
+        else
+        {
+            JsonWriter writer(out);
+            writeRuleMessage(writer, rule, value);
+        }
+
+        mqtt.publish(topics.get(TOPIC_RULE), out.c_str(), out.length());
+    }
+
+    void fire(MQTTClient &mqtt, const DeviceConfig &config, uint8_t slot, int value, unsigned long now)
+    {
+        const CompiledRule &rule = rules[slot];
+
+        switch (rule.action)
+        {
+        case RULE_WRITE:
+            writeOutput(rule);
+            break;
+        case RULE_PUBLISH:
+            publish(mqtt, config, rule, value);
+            break;
+        case RULE_SCHEDULE:
+            // A new edge postpones a pending write
+            scheduled |= (1 << slot);
+            dueAt[slot] = now + rule.delay;
+            break;
+        }
+    }
+
+public:
+    /**
+     * @param topics The topics of the device, built on connection
+     */
+    EdgeRules(const MqttTopics &topics) : topics(topics)
+    {
+    }
+
+    /**
+     * Builds the rule table from the configuration, replacing the
+     * previous one and its pending writes.
+     *
+     * @return The number of rules compiled
+     */
+    uint8_t compile(const DeviceConfig &config)
+    {
+        count = 0;
+        sourcePorts = 0;
+        sourceChannels = 0;
+        scheduled = 0;
+
+        for (uint8_t i = 0; i < RULES_MAX; i++)
+        {
+            const EdgeRule &stored = config.RULES[i];
+
+            if (stored.trigger == RULE_UNUSED || stored.trigger > RULE_BELOW || stored.action > RULE_SCHEDULE)
+            {
+                continue;
+            }
+
+            CompiledRule &rule = rules[count];
+
+            rule.index = i;
+            rule.trigger = stored.trigger;
+            rule.action = stored.action;
+            rule.pin = stored.pin;
+            rule.threshold = stored.threshold;
+            rule.value = stored.value;
+            rule.delay = stored.delay;
+
+            if (stored.action != RULE_PUBLISH)
+            {
+                uint8_t targetPort = digitalPinToPort(stored.target);
+
+                if (targetPort == NOT_A_PORT)
+                {
+                    continue;
+                }
+
+                rule.output = portOutputRegister(targetPort);
+                rule.outputMask = digitalPinToBitMask(stored.target);
+            }
+
+            if (isAnalog(stored.trigger))
+            {
+                if (stored.pin < PIN_A0 || stored.pin - PIN_A0 >= NUM_ANALOG_INPUTS)
+                {
+                    continue;
+                }
+
+                rule.port = stored.pin - PIN_A0;
+                sourceChannels |= (1U << rule.port);
+            }
+            else
+            {
+                rule.port = digitalPinToPort(stored.pin);
+                rule.bitMask = digitalPinToBitMask(stored.pin);
+
+                if (rule.port == NOT_A_PORT)
+                {
+                    continue;
+                }
+
+                sourcePorts |= (1U << rule.port);
+            }
+
+            count++;
+        }
+
+        return count;
+    }
+
+    /**
+     * @return true if a rule watches a pin of the port, the only ports
+     * worth passing to onPortChange()
+     */
+    bool watchesPort(uint8_t port) const
+    {
+        return sourcePorts & (1U << port);
+    }
+
+    /**
+     * Fires the digital rules of the pins that changed on a port.
+     */
+    void onPortChange(MQTTClient &mqtt, const DeviceConfig &config, uint8_t port, uint8_t previous, uint8_t current, unsigned long now)
+    {
+        uint8_t changed = previous ^ current;
+
+        for (uint8_t slot = 0; slot < count; slot++)
+        {
+            const CompiledRule &rule = rules[slot];
+
+            if (rule.port != port || isAnalog(rule.trigger) || !(changed & rule.bitMask))
+            {
+                continue;
+            }
+
+            bool high = current & rule.bitMask;
+
+            if (rule.trigger == RULE_CHANGE || (rule.trigger == RULE_RISING) == high)
+            {
+                fire(mqtt, config, slot, high ? 1 : 0, now);
+            }
+        }
+    }
+
+    /**
+     * Fires the analog rules whose threshold was crossed.
+     */
+    void onAnalogChange(MQTTClient &mqtt, const DeviceConfig &config, uint8_t channel, uint16_t previous, uint16_t current, unsigned long now)
+    {
+        if (!(sourceChannels & (1U << channel)))
+        {
+            return;
+        }
+
+        for (uint8_t slot = 0; slot < count; slot++)
+        {
+            const CompiledRule &rule = rules[slot];
+
+            if (rule.port != channel || !isAnalog(rule.trigger))
+            {
+                continue;
+            }
+
+            bool crossedAbove = previous <= rule.threshold && current > rule.threshold;
+            bool crossedBelow = previous >= rule.threshold && current < rule.threshold;
+
+            if ((rule.trigger == RULE_ABOVE && crossedAbove) || (rule.trigger == RULE_BELOW && crossedBelow))
+            {
+                fire(mqtt, config, slot, current, now);
+            }
+        }
+    }
+
+    /**
+     * Applies the scheduled writes that are due.
+     *
+     * @return Milliseconds until the next pending write, -1 if none is left
+     */
+    long runDue(unsigned long now)
+    {
+        long next = -1;
+
+        for (uint8_t slot = 0; slot < count; slot++)
+        {
+            if (!(scheduled & (1 << slot)))
+            {
+                continue;
+            }
+
+            long remaining = (long)(dueAt[slot] - now);
+
+            if (remaining <= 0)
+            {
+                scheduled &= ~(1 << slot);
+                writeOutput(rules[slot]);
+                continue;
+            }
+
+            if (next < 0 || remaining < next)
+            {
+                next = remaining;
+            }
+        }
+
+        return next;
+    }
+
+    bool hasScheduled() const
+    {
+        return scheduled != 0;
+    }
+
+    uint8_t size() const
+    {
+        return count;
+    }
+};
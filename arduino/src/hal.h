@@ -0,0 +1,42 @@
+#pragma once
+
+/**
+ * @file hal.h
+ * @brief Hardware abstraction layer for the firmware core.
+ *
+ * The core headers (device_config.h, state.h, commands.h) include this file
+ * instead of the Arduino libraries. It covers pins, EEPROM, clock, serial
+ * and the network client.
+ *
+ * On the board every name resolves to the real Arduino core and libraries.
+ * On the native environment (ARDUMI_NATIVE) the same names are served by the
+ * in-memory mocks inside native/, and HalMock gives tests and benchmarks
+ * control over the simulated board.
+ */
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <StreamUtils.h>
+#include <MQTT.h>
+#include <ArduinoUniqueID.h>
+#include <MemoryFree.h>
+
+#ifdef ARDUMI_NATIVE
+#include "hal_mock.h"
+#endif
+
+/**
+ * @return FNV-1a hash of the board unique id, the same on every boot and
+ * different on every board
+ */
+inline unsigned long uniqueIdHash()
+{
+    unsigned long hash = 2166136261UL;
+
+    for (size_t i = 0; i < UniqueIDsize; i++)
+    {
+        hash = (hash ^ UniqueID[i]) * 16777619UL;
+    }
+
+    return hash;
+}
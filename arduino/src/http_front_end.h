@@ -0,0 +1,492 @@
+#pragma once
+
+#include "hal.h"
+#include "default_constants.h"
+
+enum HttpConnectionPhase : uint8_t
+{
+    // Slot not in use
+    HTTP_FREE,
+    // Reading the request line and the headers, line by line
+    HTTP_HEAD,
+    // Reading Content-Length bytes of body
+    HTTP_BODY,
+    // Keep-alive connection waiting for the next request
+    HTTP_IDLE,
+};
+
+/**
+ * Stream handed to the request router: reads replay the buffered request,
+ * writes go straight to the client socket.
+ */
+class HttpRequestStream : public Stream
+{
+private:
+    const char *request;
+    size_t length;
+    size_t position = 0;
+    Stream &client;
+
+public:
+    HttpRequestStream(const char *request, size_t length, Stream &client)
+        : request(request), length(length), client(client)
+    {
+    }
+
+    int available() override { return (int)(length - position); }
+    int read() override { return position < length ? (uint8_t)request[position++] : -1; }
+    int peek() override { return position < length ? (uint8_t)request[position] : -1; }
+    void flush() override { client.flush(); }
+
+    size_t write(uint8_t c) override { return client.write(c); }
+    size_t write(const uint8_t *buffer, size_t size) override { return client.write(buffer, size); }
+
+    using Print::write;
+};
+
+/**
+ * State of one client socket.
+ *
+ * Only the request line, the headers the router needs (Content-Length,
+ * Content-Type, Accept and Connection) and the body are stored, so a browser sending a kilobyte of headers
+ * still fits in HTTP_REQUEST_BUFFER_SIZE.
+ */
+template <typename TClient>
+struct HttpConnection
+{
+    TClient client;
+    HttpConnectionPhase phase;
+    char request[HTTP_REQUEST_BUFFER_SIZE];
+    uint16_t length;
+    uint16_t lineStart;
+    uint16_t contentLength;
+    bool skippingLine;
+    bool keepAlive;
+    uint8_t served;
+    unsigned long deadline;
+};
+
+/**
+ * Concurrent HTTP front end.
+ *
+ * Several client sockets are tracked at once and each poll() only reads
+ * the bytes already received, so a slow client never stalls the loop.
+ * Once a request is complete it is dispatched to the handler (the aWOT
+ * router) through an HttpRequestStream. Persistent connections are kept
+ * open up to HTTP_KEEPALIVE_MAX_REQUESTS requests.
+ *
+ * Time budgets per connection:
+ *   - HTTP_REQUEST_TIMEOUT to receive a whole request once it started
+ *   - HTTP_KEEPALIVE_TIMEOUT of idle time between two requests
+ */
+template <typename TClient>
+class HttpFrontEnd
+{
+public:
+    /**
+     * Writes the whole response. Returns false when the response cannot be
+     * followed by another one on the same connection (no Content-Length),
+     * true otherwise; keepAlive tells whether the client may be kept at all.
+     */
+    typedef bool (*RequestHandler)(HttpRequestStream &request, TClient &client, bool keepAlive);
+
+private:
+    HttpConnection<TClient> connections[HTTP_MAX_CONNECTIONS];
+    RequestHandler handler;
+
+    // Round robin start, so a busy connection does not always go first
+    uint8_t nextConnection = 0;
+
+    static char lowerCase(char c)
+    {
+        return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+
+    /**
+     * Case-insensitive comparison of a header line name with a PROGMEM name.
+     */
+    static bool isHeader(const char *line, size_t lineLength, PGM_P name)
+    {
+        size_t i = 0;
+        char c;
+
+        while ((c = pgm_read_byte(name + i)) != 0)
+        {
+            if (i >= lineLength || lowerCase(line[i]) != lowerCase(c))
+            {
+                return false;
+            }
+
+            i++;
+        }
+
+        return i < lineLength && line[i] == ':';
+    }
+
+    static const char *headerValue(const char *line, size_t lineLength)
+    {
+        const char *value = (const char *)memchr(line, ':', lineLength) + 1;
+
+        while (*value == ' ')
+        {
+            value++;
+        }
+
+        return value;
+    }
+
+    /**
+     * @return The length, or UINT16_MAX if it is not a number or does not
+     * fit the request buffer, which is then rejected with a 413
+     */
+    static uint16_t parseContentLength(const char *value)
+    {
+        char *end;
+        unsigned long length = strtoul(value, &end, 10);
+
+        while (*end == ' ')
+        {
+            end++;
+        }
+
+        if (end == value || *end != 0 || length > HTTP_REQUEST_BUFFER_SIZE)
+        {
+            return UINT16_MAX;
+        }
+
+        return (uint16_t)length;
+    }
+
+    static bool containsToken(const char *value, PGM_P token)
+    {
+        size_t tokenLength = strlen_P(token);
+
+        for (; *value != 0; value++)
+        {
+            size_t i = 0;
+
+            while (i < tokenLength && lowerCase(value[i]) == pgm_read_byte(token + i))
+            {
+                i++;
+            }
+
+            if (i == tokenLength)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    static void sendError(TClient &client, const __FlashStringHelper *statusLine)
+    {
+        client.print(F("HTTP/1.1 "));
+        client.print(statusLine);
+        client.print(F("\r\nConnection: close\r\nContent-Length: 0\r\n\r\n"));
+    }
+
+    void close(HttpConnection<TClient> &connection)
+    {
+        connection.client.stop();
+        connection.phase = HTTP_FREE;
+    }
+
+    /**
+     * Sends an error and closes without waiting for the FIN acknowledgment
+     * of a client that may be gone. Served responses keep the library
+     * timeout, so they are not cut on a slow link.
+     */
+    void reject(HttpConnection<TClient> &connection, const __FlashStringHelper *statusLine)
+    {
+        sendError(connection.client, statusLine);
+        connection.client.setConnectionTimeout(HTTP_CLOSE_TIMEOUT);
+        close(connection);
+    }
+
+    void startRequest(HttpConnection<TClient> &connection)
+    {
+        connection.phase = HTTP_HEAD;
+        connection.length = 0;
+        connection.lineStart = 0;
+        connection.contentLength = 0;
+        connection.skippingLine = false;
+        connection.keepAlive = false;
+        connection.deadline = millis() + HTTP_REQUEST_TIMEOUT;
+    }
+
+    /**
+     * Handles a complete line of the request head, stored in the buffer
+     * from lineStart (included) to length (excluded, newline removed).
+     *
+     * @return false if the request is invalid and the connection was rejected
+     */
+    bool endOfLine(HttpConnection<TClient> &connection)
+    {
+        char *line = connection.request + connection.lineStart;
+        size_t lineLength = connection.length - connection.lineStart;
+
+        if (lineLength > 0 && line[lineLength - 1] == '\r')
+        {
+            lineLength--;
+        }
+
+        // Request line: HTTP/1.1 connections are persistent by default
+        if (connection.lineStart == 0)
+        {
+            if (lineLength == 0)
+            {
+                // Tolerate empty lines before the request
+                connection.length = 0;
+                return true;
+            }
+
+            connection.keepAlive = lineLength >= 8 && memcmp_P(line + lineLength - 8, PSTR("HTTP/1.1"), 8) == 0;
+        }
+        // Empty line: end of the head
+        else if (lineLength == 0)
+        {
+            connection.phase = HTTP_BODY;
+        }
+        else
+        {
+            line[lineLength] = 0;
+
+            if (isHeader(line, lineLength, PSTR("content-length")))
+            {
+                connection.contentLength = parseContentLength(headerValue(line, lineLength));
+            }
+            else if (isHeader(line, lineLength, PSTR("connection")))
+            {
+                const char *value = headerValue(line, lineLength);
+
+                if (containsToken(value, PSTR("close")))
+                {
+                    connection.keepAlive = false;
+                }
+                else if (containsToken(value, PSTR("keep-alive")))
+                {
+                    connection.keepAlive = true;
+                }
+            }
+            else if (!isHeader(line, lineLength, PSTR("content-type")) && !isHeader(line, lineLength, PSTR("accept")))
+            {
+                // Not needed by the router: forget it
+                connection.length = connection.lineStart;
+                return true;
+            }
+        }
+
+        // Normalize the stored line ending to CRLF
+        connection.length = connection.lineStart + lineLength;
+
+        if ((size_t)connection.length + 2 > sizeof(connection.request))
+        {
+            reject(connection, F("431 Request Header Fields Too Large"));
+            return false;
+        }
+
+        connection.request[connection.length++] = '\r';
+        connection.request[connection.length++] = '\n';
+        connection.lineStart = connection.length;
+
+        if (connection.phase == HTTP_BODY && (size_t)connection.length + connection.contentLength > sizeof(connection.request))
+        {
+            reject(connection, F("413 Payload Too Large"));
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Reads the bytes already received by the socket.
+     *
+     * @return true once the request is complete
+     */
+    bool receive(HttpConnection<TClient> &connection)
+    {
+        while (connection.client.available() > 0)
+        {
+            if (connection.phase == HTTP_IDLE)
+            {
+                startRequest(connection);
+            }
+
+            if (connection.phase == HTTP_BODY)
+            {
+                if (connection.length - connection.lineStart >= connection.contentLength)
+                {
+                    return true;
+                }
+
+                connection.request[connection.length++] = (char)connection.client.read();
+                continue;
+            }
+
+            char c = (char)connection.client.read();
+
+            if (c == '\n')
+            {
+                connection.skippingLine = false;
+
+                if (!endOfLine(connection))
+                {
+                    return false;
+                }
+
+                continue;
+            }
+
+            if (connection.skippingLine)
+            {
+                continue;
+            }
+
+            if ((size_t)connection.length + 1 >= sizeof(connection.request))
+            {
+                if (connection.lineStart == 0)
+                {
+                    reject(connection, F("414 URI Too Long"));
+                    return false;
+                }
+
+                // A long header line: it can only be one the router does not need
+                connection.length = connection.lineStart;
+                connection.skippingLine = true;
+                continue;
+            }
+
+            connection.request[connection.length++] = c;
+        }
+
+        return connection.phase == HTTP_BODY && connection.length - connection.lineStart >= connection.contentLength;
+    }
+
+    void dispatch(HttpConnection<TClient> &connection)
+    {
+        connection.served++;
+
+        bool keepAlive = connection.keepAlive && connection.served < HTTP_KEEPALIVE_MAX_REQUESTS;
+        HttpRequestStream stream(connection.request, connection.length, connection.client);
+
+        // A response without a length only ends when the connection closes
+        keepAlive = handler(stream, connection.client, keepAlive) && keepAlive;
+
+        if (!keepAlive || !connection.client.connected())
+        {
+            close(connection);
+            return;
+        }
+
+        connection.phase = HTTP_IDLE;
+        connection.deadline = millis() + HTTP_KEEPALIVE_TIMEOUT;
+    }
+
+    void poll(HttpConnection<TClient> &connection)
+    {
+        if (!connection.client.connected() && connection.client.available() == 0)
+        {
+            close(connection);
+            return;
+        }
+
+        if (receive(connection))
+        {
+            dispatch(connection);
+            return;
+        }
+
+        if (connection.phase == HTTP_FREE || (long)(millis() - connection.deadline) < 0)
+        {
+            return;
+        }
+
+        if (connection.phase == HTTP_IDLE)
+        {
+            close(connection);
+        }
+        else
+        {
+            reject(connection, F("408 Request Timeout"));
+        }
+    }
+
+public:
+    explicit HttpFrontEnd(RequestHandler handler) : handler(handler)
+    {
+        for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+        {
+            connections[i].phase = HTTP_FREE;
+        }
+    }
+
+    /**
+     * Takes ownership of a newly accepted client socket.
+     *
+     * @return false if every slot is busy; the client then receives a 503
+     */
+    bool accept(TClient client)
+    {
+        for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+        {
+            if (connections[i].phase == HTTP_FREE)
+            {
+                connections[i].client = client;
+                connections[i].served = 0;
+                startRequest(connections[i]);
+                return true;
+            }
+        }
+
+        sendError(client, F("503 Service Unavailable"));
+        client.setConnectionTimeout(HTTP_CLOSE_TIMEOUT);
+        client.stop();
+
+        return false;
+    }
+
+    /**
+     * Advances every open connection, dispatching at most one request each.
+     */
+    void poll()
+    {
+        for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+        {
+            HttpConnection<TClient> &connection = connections[(nextConnection + i) % HTTP_MAX_CONNECTIONS];
+
+            if (connection.phase != HTTP_FREE)
+            {
+                poll(connection);
+            }
+        }
+
+        nextConnection = (nextConnection + 1) % HTTP_MAX_CONNECTIONS;
+    }
+
+    /**
+     * Closes every connection, e.g. before a reboot.
+     */
+    void stopAll()
+    {
+        for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+        {
+            if (connections[i].phase != HTTP_FREE)
+            {
+                close(connections[i]);
+            }
+        }
+    }
+
+    uint8_t openConnections() const
+    {
+        uint8_t count = 0;
+
+        for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+        {
+            count += connections[i].phase != HTTP_FREE;
+        }
+
+        return count;
+    }
+};
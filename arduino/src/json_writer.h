@@ -0,0 +1,321 @@
+#pragma once
+
+#include "hal.h"
+
+/**
+ * Print that only counts the bytes written to it.
+ * Used to know the length of a payload before streaming it.
+ */
+class CountingPrint : public Print
+{
+private:
+    size_t count = 0;
+
+public:
+    size_t write(uint8_t c) override
+    {
+        count++;
+        return 1;
+    }
+
+    size_t write(const uint8_t *buffer, size_t size) override
+    {
+        count += size;
+        return size;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    using Print::write;
+};
+
+/**
+ * Print writing into a caller-provided fixed buffer, always null terminated.
+ * Bytes that do not fit are dropped and the overflow is reported.
+ */
+class BufferPrint : public Print
+{
+private:
+    char *buffer;
+    size_t capacity;
+    size_t used = 0;
+    bool overflow = false;
+
+public:
+    BufferPrint(char *buffer, size_t capacity) : buffer(buffer), capacity(capacity)
+    {
+        if (capacity > 0)
+        {
+            buffer[0] = 0;
+        }
+    }
+
+    size_t write(uint8_t c) override
+    {
+        if (used + 1 >= capacity)
+        {
+            overflow = true;
+            return 0;
+        }
+
+        buffer[used++] = (char)c;
+        buffer[used] = 0;
+        return 1;
+    }
+
+    /**
+     * Copies a whole block at once, e.g. a cached payload fragment.
+     */
+    size_t write(const uint8_t *bytes, size_t size) override
+    {
+        size_t room = capacity > used ? capacity - used - 1 : 0;
+
+        if (size > room)
+        {
+            overflow = true;
+            size = room;
+        }
+
+        memcpy(buffer + used, bytes, size);
+        used += size;
+        buffer[used] = 0;
+        return size;
+    }
+
+    const char *c_str() const
+    {
+        return buffer;
+    }
+
+    size_t length() const
+    {
+        return used;
+    }
+
+    bool overflowed() const
+    {
+        return overflow;
+    }
+
+    using Print::write;
+};
+
+/**
+ * Minimal streaming JSON serializer.
+ *
+ * Values are written straight to the underlying Print as they are produced,
+ * so no JsonDocument nor intermediate String is needed. The writer only keeps
+ * track of where commas go (up to 16 nesting levels).
+ *
+ * The overloads taking an element count mirror MsgPackWriter, so templated
+ * payload builders work with both; JSON does not need the count.
+ */
+class JsonWriter
+{
+private:
+    Print &out;
+    uint8_t depth = 0;
+    uint16_t hasMembers = 0;
+    bool afterKey = false;
+    size_t written = 0;
+
+    void separator()
+    {
+        if (afterKey)
+        {
+            afterKey = false;
+            return;
+        }
+
+        if (hasMembers & (1U << depth))
+        {
+            written += out.write(',');
+        }
+
+        hasMembers |= (1U << depth);
+    }
+
+    void open(char bracket)
+    {
+        separator();
+        written += out.write(bracket);
+        depth++;
+        hasMembers &= ~(1U << depth);
+    }
+
+    void close(char bracket)
+    {
+        depth--;
+        written += out.write(bracket);
+    }
+
+    void writeChar(char c)
+    {
+        switch (c)
+        {
+        case '"':
+            written += out.write("\\\"");
+            break;
+        case '\\':
+            written += out.write("\\\\");
+            break;
+        case '\n':
+            written += out.write("\\n");
+            break;
+        case '\r':
+            written += out.write("\\r");
+            break;
+        case '\t':
+            written += out.write("\\t");
+            break;
+        default:
+            if ((uint8_t)c < 0x20)
+            {
+                // Other control characters are not expected in our payloads
+                written += out.write('?');
+            }
+            else
+            {
+                written += out.write(c);
+            }
+            break;
+        }
+    }
+
+    void writeString(const char *str)
+    {
+        written += out.write('"');
+
+        while (*str != 0)
+        {
+            writeChar(*str++);
+        }
+
+        written += out.write('"');
+    }
+
+    void writeString(const __FlashStringHelper *str)
+    {
+        const char *ptr = reinterpret_cast<const char *>(str);
+        char c;
+
+        written += out.write('"');
+
+        while ((c = pgm_read_byte(ptr++)) != 0)
+        {
+            writeChar(c);
+        }
+
+        written += out.write('"');
+    }
+
+public:
+    explicit JsonWriter(Print &out) : out(out)
+    {
+    }
+
+    void beginObject() { open('{'); }
+    void endObject() { close('}'); }
+    void beginArray() { open('['); }
+    void endArray() { close(']'); }
+    void beginObject(size_t members) { beginObject(); }
+    void beginArray(size_t elements) { beginArray(); }
+
+    void key(const __FlashStringHelper *name)
+    {
+        separator();
+        writeString(name);
+        written += out.write(':');
+        afterKey = true;
+    }
+
+    void key(const char *name)
+    {
+        separator();
+        writeString(name);
+        written += out.write(':');
+        afterKey = true;
+    }
+
+    void value(const char *str)
+    {
+        separator();
+        writeString(str);
+    }
+
+    void value(const __FlashStringHelper *str)
+    {
+        separator();
+        writeString(str);
+    }
+
+    void value(bool boolean)
+    {
+        separator();
+        written += out.print(boolean ? F("true") : F("false"));
+    }
+
+    void value(int number)
+    {
+        separator();
+        written += out.print(number);
+    }
+
+    void value(unsigned int number)
+    {
+        separator();
+        written += out.print(number);
+    }
+
+    void value(long number)
+    {
+        separator();
+        written += out.print(number);
+    }
+
+    void value(unsigned long number)
+    {
+        separator();
+        written += out.print(number);
+    }
+
+    /**
+     * Printable values (e.g. IPAddress) are written as strings.
+     */
+    void value(const Printable &printable)
+    {
+        separator();
+        written += out.write('"');
+        written += out.print(printable);
+        written += out.write('"');
+    }
+
+    template <typename TKey, typename TValue>
+    void member(TKey name, const TValue &memberValue)
+    {
+        key(name);
+        value(memberValue);
+    }
+
+    /**
+     * Splices members serialized by another JsonWriter at its top level
+     * (comma separated key/value pairs, or a whole value), as one member
+     * of the current container.
+     */
+    void raw(const char *bytes, size_t length)
+    {
+        separator();
+        written += out.write((const uint8_t *)bytes, length);
+    }
+
+    /**
+     * @return The number of bytes written so far
+     */
+    size_t size() const
+    {
+        return written;
+    }
+};
@@ -0,0 +1,223 @@
+#pragma once
+
+#include "hal.h"
+#include "default_constants.h"
+#include "json_writer.h"
+#include "msgpack_writer.h"
+#include "payload_encoding.h"
+
+#define LOOP_PROFILER_BUCKETS 8
+
+/**
+ * The stages of loop(), in execution order.
+ */
+enum LoopStage : uint8_t
+{
+    // tasksRunner.execute(): state scan, status broadcast, MQTT connection
+    STAGE_TASKS,
+    STAGE_SERIAL,
+    // Ethernet.maintain()
+    STAGE_DHCP,
+    STAGE_HTTP,
+    // mqttClient.loop()
+    STAGE_MQTT,
+    // The whole loop() pass
+    STAGE_LOOP,
+    LOOP_STAGE_COUNT,
+};
+
+/**
+ * Latency statistics of one stage.
+ */
+struct LoopStageStats
+{
+    uint32_t count;
+    uint32_t max;
+    // Bucket i counts the durations below 64 << (2 * i) us, the last one everything else
+    uint16_t histogram[LOOP_PROFILER_BUCKETS];
+};
+
+/**
+ * Per-stage latency profiler of loop().
+ *
+ * Each stage is timed with micros() and recorded in a fixed-bucket
+ * histogram (64us, 256us, 1ms, 4ms, 16ms, 65ms, 262ms, above), along with
+ * its maximum and count. When a bucket would overflow, every bucket of the
+ * stage is halved, so the histogram keeps the shape of the distribution.
+ *
+ * The report is one array per stage, [count, max, histogram...]:
+ *
+ *   {"bucket_us":[64,256,1024,4096,16384,65536,262144],
+ *    "stages":{"tasks":[1200,2300,1100,80,20,0,0,0,0,0],...}}
+ *
+ * With LOOP_PROFILER set to 0 the PROFILE_* macros expand to nothing, so
+ * loop() carries no instrumentation at all.
+ */
+class LoopProfiler
+{
+private:
+    LoopStageStats stages[LOOP_STAGE_COUNT];
+
+    static uint8_t bucketOf(unsigned long elapsed)
+    {
+        uint8_t bucket = 0;
+        unsigned long limit = 64;
+
+        while (bucket < LOOP_PROFILER_BUCKETS - 1 && elapsed >= limit)
+        {
+            bucket++;
+            limit <<= 2;
+        }
+
+        return bucket;
+    }
+
+    static const __FlashStringHelper *stageName(uint8_t stage)
+    {
+        switch (stage)
+        {
+        case STAGE_TASKS:
+            return F("tasks");
+        case STAGE_SERIAL:
+            return F("serial");
+        case STAGE_DHCP:
+            return F("dhcp");
+        case STAGE_HTTP:
+            return F("http");
+        case STAGE_MQTT:
+            return F("mqtt");
+        default:
+            return F("loop");
+        }
+    }
+
+public:
+    LoopProfiler()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        memset(stages, 0, sizeof(stages));
+    }
+
+    void record(LoopStage stage, unsigned long elapsed)
+    {
+        LoopStageStats &stats = stages[stage];
+        uint8_t bucket = bucketOf(elapsed);
+
+        if (stats.histogram[bucket] == UINT16_MAX)
+        {
+            for (uint8_t i = 0; i < LOOP_PROFILER_BUCKETS; i++)
+            {
+                stats.histogram[i] >>= 1;
+            }
+        }
+
+        stats.histogram[bucket]++;
+        stats.count++;
+
+        if (elapsed > stats.max)
+        {
+            stats.max = elapsed;
+        }
+    }
+
+    /**
+     * Records the time elapsed since the previous lap.
+     *
+     * @param since micros() at the start of the stage
+     * @return micros() at the end of the stage, the start of the next one
+     */
+    unsigned long lap(LoopStage stage, unsigned long since)
+    {
+        unsigned long now = micros();
+
+        record(stage, now - since);
+
+        return now;
+    }
+
+    const LoopStageStats &getStats(LoopStage stage) const
+    {
+        return stages[stage];
+    }
+
+    /**
+     * Streams the profile into any Print (HTTP response, MQTT payload buffer, ...).
+     *
+     * @return The number of bytes written
+     */
+    size_t writeProfile(Print &out, PayloadEncoding encoding)
+    {
+        if (encoding == PayloadEncoding::MSGPACK_ENCODING)
+        {
+            MsgPackWriter writer(out);
+            return writeProfile(writer);
+        }
+
+        JsonWriter writer(out);
+        return writeProfile(writer);
+    }
+
+    template <typename TWriter>
+    size_t writeProfile(TWriter &writer)
+    {
+        writer.beginObject(2);
+
+        writer.key(F("bucket_us"));
+        writer.beginArray(LOOP_PROFILER_BUCKETS - 1);
+        for (uint8_t i = 0; i < LOOP_PROFILER_BUCKETS - 1; i++)
+        {
+            writer.value(64UL << (2 * i));
+        }
+        writer.endArray();
+
+        writer.key(F("stages"));
+        writer.beginObject(LOOP_STAGE_COUNT);
+        for (uint8_t stage = 0; stage < LOOP_STAGE_COUNT; stage++)
+        {
+            const LoopStageStats &stats = stages[stage];
+
+            writer.key(stageName(stage));
+            writer.beginArray(2 + LOOP_PROFILER_BUCKETS);
+            writer.value((unsigned long)stats.count);
+            writer.value((unsigned long)stats.max);
+            for (uint8_t i = 0; i < LOOP_PROFILER_BUCKETS; i++)
+            {
+                writer.value((unsigned int)stats.histogram[i]);
+            }
+            writer.endArray();
+        }
+        writer.endObject();
+
+        writer.endObject();
+
+        return writer.size();
+    }
+
+    /**
+     * @return The length of the payload written by writeProfile
+     */
+    size_t measureProfile(PayloadEncoding encoding)
+    {
+        CountingPrint counter;
+        return writeProfile(counter, encoding);
+    }
+};
+
+#if LOOP_PROFILER
+// Starts timing the stages of a function
+#define PROFILE_START()                    \
+    unsigned long profileStart = micros(); \
+    unsigned long profileMark = profileStart
+// Records the time since the previous mark as the given stage
+#define PROFILE_STAGE(profiler, stage) profileMark = (profiler).lap(stage, profileMark)
+// Records the time since PROFILE_START() as the given stage
+#define PROFILE_TOTAL(profiler, stage) (profiler).record(stage, micros() - profileStart)
+#else
+#define PROFILE_START()
+#define PROFILE_STAGE(profiler, stage)
+#define PROFILE_TOTAL(profiler, stage)
+#endif
@@ -1,273 +1,416 @@
 #include "config.h"
 #include "device_config.h"
+#include "config_reload.h"
 #include "state.h"
+#include "telemetry.h"
+#include "payload_encoding.h"
+#include "commands.h"
+#include "command_replies.h"
+#include "mqtt_connection.h"
+#include "serial_reader.h"
+#include "http_front_end.h"
+#include "memory_metrics.h"
+#include "loop_profiler.h"
+#include "telemetry_scheduler.h"
+#include <TaskScheduler.h>
 #include <avr/wdt.h>
 
 Application restApp;
-MQTTClient mqttClient;
-// TODO: Verify how to change this with the configuration value
+MQTTClient mqttClient(MQTT_CLIENT_BUFFER_SIZE);
+// Bound to the configured port in setup(), then by rebindHttpServer()
 EthernetServer ethServer(DEFAULT_HTTP_SERVER_PORT);
 EthernetClient mqttEthClient;
-EthernetClient httpEthClient;
 
 DeviceConfig deviceConfig;
 DeviceConfigProvider deviceConfigProvider;
+ConfigReloader configReloader(deviceConfig, deviceConfigProvider);
 
-GlobalStateProvider stateProvider;
+/**
+ * Topics of this device, built by mqttConnection on every connection.
+ *
+ */
+MqttTopics mqttTopics;
+
+GlobalStateProvider stateProvider(mqttTopics);
+StatusTelemetry statusTelemetry;
+MemoryMetricsProvider memoryMetrics;
+AdcSampler adcSampler;
+PinStreamer pinStreamer(adcSampler);
+EdgeRules edgeRules(mqttTopics);
+TelemetryScheduler telemetryScheduler;
+
+#if LOOP_PROFILER
+LoopProfiler loopProfiler;
+#endif
+
+/**
+ * This variable signals when the device needs
+ * to be rebooted pragmatically.
+ *
+ */
+bool rebootOnNextLoop = false;
+
+CommandsProvider commandsProvider(deviceConfigProvider, configReloader, statusTelemetry, adcSampler, pinStreamer, rebootOnNextLoop);
+SerialCommandReader serialReader;
+CommandReplyQueue commandReplies;
+
+/**
+ * Outgoing MQTT payloads are serialized here instead of
+ * in a temporary String. HTTP responses are buffered here too:
+ * routes never publish, so the two never overlap.
+ *
+ */
+char payloadBuffer[MQTT_PAYLOAD_BUFFER_SIZE];
+
+void mqttAdvertisePresence();
+
+MqttConnectionProvider mqttConnection(mqttClient, mqttTopics, &mqttAdvertisePresence);
 
 Scheduler tasksRunner;
 
 void parseStateChanges();
 void broadcastMQTTStatus();
+void broadcastMQTTMetrics();
+#if LOOP_PROFILER
+void broadcastMQTTProfile();
+#endif
+void mqttConnectionStep();
+void runScheduledRules();
+
+// The telemetry tasks are paced by telemetryScheduler, their intervals are only the defaults
+Task tParseStateChanges(DEFAULT_STATE_SCAN_INTERVAL, TASK_FOREVER, &parseStateChanges);
+Task tBroadcastMQTTStatus(DEFAULT_STATUS_INTERVAL * 1000UL, TASK_FOREVER, &broadcastMQTTStatus);
+Task tMqttConnection(MQTT_CONNECTION_CHECK_INTERVAL, TASK_FOREVER, &mqttConnectionStep);
+Task tRunScheduledRules(TASK_IMMEDIATE, TASK_ONCE, &runScheduledRules);
+Task tBroadcastMQTTMetrics(DEFAULT_METRICS_INTERVAL * 1000UL, TASK_FOREVER, &broadcastMQTTMetrics);
+#if LOOP_PROFILER
+Task tBroadcastMQTTProfile(PROFILE_PUBLISH_INTERVAL, TASK_FOREVER, &broadcastMQTTProfile);
+#endif
 
-Task tParseStateChanges(2000, TASK_FOREVER, &parseStateChanges);
-Task tBroadcastMQTTStatus(30000, TASK_FOREVER, &broadcastMQTTStatus);
+/**
+ * Value of the Accept header of the current HTTP request,
+ * used to negotiate the payload encoding.
+ *
+ */
+char httpAcceptHeader[48];
 
 /**
- * This variable signals when the device needs
- * to be rebooted pragmatically.
+ * Value of the Content-Type header of the current HTTP request,
+ * telling the encoding of a command body.
  *
  */
-bool rebootOnNextLoop = false;
+char httpContentTypeHeader[48];
 
 void restFillContext(Request &req, Response &res)
 {
   RestContext *ctx = (RestContext *)req.context;
   ctx->method = req.method();
-  strlcpy(ctx->path, req.path(), strlen(req.path()));
+
+  // Until a route sets a Content-Length: sendStatus() and the 404 of aWOT
+  // end their response by closing the connection
+  strcpy_P(ctx->connection, PSTR("close"));
+  res.set("Connection", ctx->connection);
 }
 
+/**
+ * Sets the Content-Length of the response, which lets the connection
+ * serve the next request when the client asked for it.
+ */
+void setContentLength(Request &req, Response &res, size_t length)
+{
+  RestContext *ctx = (RestContext *)req.context;
+
+  snprintf_P(ctx->contentLength, sizeof(ctx->contentLength), PSTR("%u"), (unsigned int)length);
+  res.set("Content-Length", ctx->contentLength);
+
+  if (ctx->keepAlive)
+  {
+    strcpy_P(ctx->connection, PSTR("keep-alive"));
+  }
+
+  ctx->lengthSet = true;
+}
+
+bool httpProcessRequest(HttpRequestStream &request, EthernetClient &client, bool keepAlive)
+{
+  // Initialize a context in order to handle the current request
+  RestContext httpEthContext = {
+    ip : client.remoteIP(),
+  };
+  httpEthContext.keepAlive = keepAlive;
+
+  Serial.print(F("Received an HTTP request from "));
+  Serial.println(httpEthContext.ip);
+
+  // aWOT would put a 512 byte URL buffer and a 1 KB output buffer on the
+  // stack. The whole request is already buffered, so this only runs the route.
+  char urlBuffer[HTTP_URL_BUFFER_SIZE];
+  restApp.process(&request, urlBuffer, sizeof(urlBuffer), (uint8_t *)payloadBuffer, sizeof(payloadBuffer), &httpEthContext);
+
+  return httpEthContext.lengthSet;
+}
+
+HttpFrontEnd<EthernetClient> httpFrontEnd(&httpProcessRequest);
+
 void restStatus(Request &req, Response &response)
 {
-  response.set("Content-Type", "application/json");
-  response.println(stateProvider.generateJsonState(deviceConfig, Ethernet.localIP()));
+  // Sample the dynamic values once, so the measured length matches the body
+  IPAddress localIp = Ethernet.localIP();
+  int freeBytes = freeMemory();
+  PayloadEncoding encoding = encodingFromMediaType(req.get("Accept"));
+
+  response.set("Content-Type", encoding == PayloadEncoding::MSGPACK_ENCODING ? MSGPACK_CONTENT_TYPE : JSON_CONTENT_TYPE);
+  setContentLength(req, response, stateProvider.measureState(encoding, deviceConfig, localIp, freeBytes));
+  stateProvider.writeState(response, encoding, deviceConfig, localIp, freeBytes);
 }
 
-void restResetToDefault(Request &req, Response &response)
+/**
+ * @return The memory metrics, with the counters of the analog engine
+ */
+MemorySnapshot sampleMetrics()
 {
-  deviceConfigProvider.resetToDefault();
+  MemorySnapshot snapshot = memoryMetrics.sample();
 
-  rebootOnNextLoop = true;
+  snapshot.adcOverruns = adcSampler.droppedSamples();
 
-  response.set("Content-type", "text/plain");
-  response.sendStatus(200);
+  return snapshot;
 }
 
-void restReboot(Request &req, Response &response)
+void restMetrics(Request &req, Response &response)
 {
-  rebootOnNextLoop = true;
+  // Sample once, so the measured length matches the body
+  MemorySnapshot snapshot = sampleMetrics();
+  PayloadEncoding encoding = encodingFromMediaType(req.get("Accept"));
+
+  response.set("Content-Type", encoding == PayloadEncoding::MSGPACK_ENCODING ? MSGPACK_CONTENT_TYPE : JSON_CONTENT_TYPE);
+  setContentLength(req, response, memoryMetrics.measureMetrics(encoding, snapshot));
+  memoryMetrics.writeMetrics(response, encoding, snapshot);
+}
+
+#if LOOP_PROFILER
+void restProfile(Request &req, Response &response)
+{
+  PayloadEncoding encoding = encodingFromMediaType(req.get("Accept"));
+
+  response.set("Content-Type", encoding == PayloadEncoding::MSGPACK_ENCODING ? MSGPACK_CONTENT_TYPE : JSON_CONTENT_TYPE);
+  setContentLength(req, response, loopProfiler.measureProfile(encoding));
+
+  // Nothing runs between the measure and the write, so the lengths match
+  loopProfiler.writeProfile(response, encoding);
+}
+#endif
+
+void restGetConfig(Request &req, Response &response)
+{
+  CountingPrint counter;
+
+  response.set("Content-Type", JSON_CONTENT_TYPE);
+  setContentLength(req, response, DeviceConfigProvider::exportJson(counter, deviceConfig));
+  DeviceConfigProvider::exportJson(response, deviceConfig);
+}
+
+void restPostConfig(Request &req, Response &response)
+{
+  JsonDocument json;
+
+  // Only the fields present in the body are changed, the next loop() applies them
+  if (deserializeJson(json, req) || !configReloader.update(json.as<JsonVariantConst>()))
+  {
+    response.set("Content-type", "text/plain");
+    response.sendStatus(400);
+    return;
+  }
 
   response.set("Content-type", "text/plain");
   response.sendStatus(200);
 }
 
-String handleCommand(String argument, Commands command)
+void restResetToDefault(Request &req, Response &response)
 {
-  // Prevent cross initialization inside switch
-  String data = "";
-  int pinIndex = -1;
-  int pinValue = -1;
+  deviceConfigProvider.resetToDefault();
 
-  switch (command)
-  {
-  case Commands::READ_ANALOG:
-    return String(analogRead(argument.toInt()));
-    break;
-  case Commands::READ_DIGITAL:
-    return String(digitalRead(argument.toInt()));
-    break;
-  case Commands::WRITE_DIGITAL:
-    data = StringsHelper::semiSplit(argument, ':', 0);
+  rebootOnNextLoop = true;
 
-    if (data == "")
-    {
-      return String(F("ERROR: Invalid digital write pin. Assure the number is an integer"));
-    }
+  response.set("Content-type", "text/plain");
+  response.sendStatus(200);
+}
 
-    // Handle the builtin led
-    if (data == F("LED_BUILTIN"))
-    {
-      pinIndex = LED_BUILTIN;
-    }
-    else
-    {
-      pinIndex = data.toInt();
-    }
+void restCommands(Request &req, Response &response)
+{
+  char result[COMMAND_RESULT_SIZE];
 
-    data = StringsHelper::semiSplit(argument, ':', 1);
+  // A single command or a batch, parsed straight from the request body
+  bool success = commandsProvider.processIncomingMessage("HTTP", req, encodingFromMediaType(req.get("Content-Type")), result, sizeof(result));
 
-    if (data == "")
-    {
-      return String(F("ERROR: Invalid digital write value. Assure the number is either 0 or 1"));
-    }
+  response.status(success ? 200 : 400);
+  response.set("Content-Type", "text/plain");
+  setContentLength(req, response, strlen(result));
+  response.print(result);
+}
 
-    pinValue = data.toInt();
+void restReboot(Request &req, Response &response)
+{
+  rebootOnNextLoop = true;
 
-    switch (pinValue)
-    {
-    case 0:
-      digitalWrite(pinIndex, LOW);
-      break;
-    case 1:
-      digitalWrite(pinIndex, HIGH);
-      break;
-    default:
-      return String(F("ERROR: Invalid digital write value. Assure the number is either 0 or 1"));
-      break;
-    }
+  response.set("Content-type", "text/plain");
+  response.sendStatus(200);
+}
 
-    break;
-  case Commands::WRITE_ANALOG:
-    data = StringsHelper::semiSplit(argument, ':', 0);
+void mqttProcessMessage(MQTTClient *client, char topic[], char bytes[], int length)
+{
+  CommandReply reply;
 
-    if (data == "")
-    {
-      return String(F("ERROR: Invalid analog write pin. Assure the number is an integer"));
-    }
+  // The encoding of incoming commands is chosen by the sender through the topic
+  PayloadEncoding encoding = isMsgPackTopic(topic) ? PayloadEncoding::MSGPACK_ENCODING : PayloadEncoding::JSON_ENCODING;
 
-    pinIndex = data.toInt();
+  commandsProvider.processIncomingMessage(topic, bytes, length, encoding, reply);
 
-    data = StringsHelper::semiSplit(argument, ':', 1);
+  // Published after mqttClient.loop() returns
+  if (!commandReplies.push(reply))
+  {
+    Serial.println(F("ERROR: Command reply dropped, MQTT_REPLY_QUEUE_SIZE is full"));
+  }
+}
 
-    if (data == "")
-    {
-      return String(F("ERROR: Invalid analog write value. Assure the number is either 0 or 1"));
-    }
+void serialProcessMessage(const char *payload, size_t length, PayloadEncoding encoding)
+{
+  char result[COMMAND_RESULT_SIZE];
 
-    pinValue = data.toInt();
+  commandsProvider.processIncomingMessage("SERIAL", payload, length, encoding, result, sizeof(result));
+  Serial.println(result);
+}
 
-    analogWrite(pinIndex, pinValue);
+void mqttAdvertisePresence()
+{
+  BufferPrint payload(payloadBuffer, sizeof(payloadBuffer));
+  stateProvider.writeAdvertise(payload, (PayloadEncoding)deviceConfig.PAYLOAD_ENCODING, deviceConfig, Ethernet.localIP());
 
-    break;
-  case Commands::REBOOT:
-    rebootOnNextLoop = true;
-    break;
-  case Commands::RESET:
-    deviceConfigProvider.resetToDefault();
-    rebootOnNextLoop = true;
-    break;
-  default:
-    return String(F("ERROR: Invalid command"));
-    break;
-  }
+  mqttClient.publish(mqttTopics.get(TOPIC_ADVERTISE), payload.c_str(), payload.length());
 
-  return String(F("Success"));
+  // The publishes that failed while disconnected say nothing about the new connection
+  telemetryScheduler.resetBackoff();
 }
 
 /**
- * This function handles all the logic for parsing incoming commands to the device.
+ * The cached payload fragments hold configuration values.
  *
- * @param topic The topic on which the message was sent
- * @param payload The content of the message
  */
-String processIncomingMessage(String topic, String payload)
+void configSaved()
 {
-  // Print some basic informations
-  Serial.print(F("Received message from topic "));
-  Serial.print(topic);
-  Serial.print(F(" - content: "));
-  Serial.println(payload);
-
-  JsonDocument json;
-
-  DeserializationError error = deserializeJson(json, payload);
+  stateProvider.invalidateFragments();
+}
 
-  if (error)
-  {
-    return String(F("ERROR: Invalid json received"));
-  }
+/**
+ * Records the outcome of a telemetry publish and schedules the next run
+ * of its task.
+ *
+ */
+void scheduleTelemetry(Task &task, TelemetryTask telemetry, bool success)
+{
+  telemetryScheduler.published(telemetry, success);
+  task.delay(telemetryScheduler.nextDelay(telemetry, millis()));
+}
 
-  String command = json[F("command")];
-  String arguments = json[F("arguments")];
+void mqttConnectionStep()
+{
+  unsigned long nextStep = mqttConnection.step(deviceConfig);
 
-  if (command == F("READ_DIGITAL"))
-  {
-    return handleCommand(arguments, Commands::READ_DIGITAL);
-  }
-  else if (command == F("READ_ANALOG"))
-  {
-    return handleCommand(arguments, Commands::READ_ANALOG);
-  }
-  else if (command == F("WRITE_DIGITAL"))
-  {
-    return handleCommand(arguments, Commands::WRITE_DIGITAL);
-  }
-  else if (command == F("WRITE_ANALOG"))
-  {
-    return handleCommand(arguments, Commands::WRITE_ANALOG);
-  }
-  else if (command == F("RESET"))
-  {
-    return handleCommand(arguments, Commands::RESET);
-  }
-  else if (command == F("REBOOT"))
+  // Task::delay(0) would wait a whole interval, so ask for the next pass explicitly
+  if (nextStep == 0)
   {
-    return handleCommand(arguments, Commands::REBOOT);
+    tMqttConnection.forceNextIteration();
   }
   else
   {
-    return String(F("ERROR: Invalid command"));
+    tMqttConnection.delay(nextStep);
   }
 }
 
-void mqttProcessMessage(String &topic, String &payload)
+/**
+ * Moves the HTTP server to the configured port. The connections already
+ * accepted are served until they close.
+ *
+ */
+void rebindHttpServer()
 {
-  processIncomingMessage(String(topic), String(payload));
-}
+  // Accepted sockets are released by accept(), only the listening ones are left
+  for (uint8_t socket = 0; socket < MAX_SOCK_NUM; socket++)
+  {
+    if (EthernetServer::server_port[socket] != 0)
+    {
+      EthernetClient listener(socket);
 
-void mqttAdvertisePresence()
-{
-  mqttClient.publish(
-      "ardu-test/advertise",
-      stateProvider.generateJsonAdvertise(deviceConfig, Ethernet.localIP()));
+      // Close at once, a listening socket never acknowledges a FIN
+      listener.setConnectionTimeout(0);
+      listener.stop();
+      EthernetServer::server_port[socket] = 0;
+    }
+  }
+
+  ethServer = EthernetServer(deviceConfig.HTTP_SERVER_PORT);
+  ethServer.begin();
+
+  Serial.print(F("Web server now listening on port "));
+  Serial.println(deviceConfig.HTTP_SERVER_PORT);
 }
 
-void mqttConnect()
+/**
+ * Rebuilds what depends on the configuration fields that changed,
+ * without a reboot.
+ *
+ */
+void applyConfigChanges(uint8_t changes)
 {
-  // Print some basic informations
-  Serial.print("Connecting to MQTT Host ");
-  Serial.println(deviceConfig.MQTT_SERVER_HOST);
+  Serial.print(F("Applying the new configuration, changes 0x"));
+  Serial.println(changes, HEX);
 
-  // Connect to the MQTT host with the specified client id
-  int maxRetries = deviceConfig.MQTT_CONNECTION_RETRIES;
-
-  while (!mqttClient.connect(deviceConfig.MQTT_DEVICE_ID.c_str()) && maxRetries > 0)
+  if (changes & CONFIG_CHANGED_MQTT_OPTIONS)
   {
-    maxRetries--;
-
-    Serial.print(F("ERROR: MQTT was unable to connect to "));
-    Serial.println(deviceConfig.MQTT_SERVER_HOST);
-    Serial.print(F("ERROR: MQTT code "));
-    Serial.println(mqttClient.lastError());
-    Serial.println(F("Retrying in 2s"));
-
-    delay(2000);
+    // The timeout applies to the next packet, the keepalive is sent with the next CONNECT
+    mqttClient.setKeepAlive(deviceConfig.MQTT_KEEPALIVE);
+    mqttClient.setTimeout(deviceConfig.MQTT_TIMEOUT);
   }
 
-  if (mqttClient.connected())
+  // Only a new broker or client id needs a new session
+  if (changes & CONFIG_CHANGED_MQTT_SERVER)
   {
-    Serial.print(F("MQTT successfully connected with client id "));
-    Serial.println(deviceConfig.MQTT_DEVICE_ID);
+    mqttConnection.reconnect();
+    mqttClient.begin(deviceConfig.MQTT_SERVER_HOST, mqttEthClient);
+    tMqttConnection.forceNextIteration();
+  }
+  else if (changes & CONFIG_CHANGED_MQTT_TOPICS)
+  {
+    mqttConnection.resubscribe();
+    tMqttConnection.forceNextIteration();
+  }
 
-    delay(500);
+  if (changes & CONFIG_CHANGED_HTTP_PORT)
+  {
+    rebindHttpServer();
+  }
 
-    // Subscribe to the necessary channels
-    Serial.println(F("Subscribing to MQTT channels"));
+  if (changes & CONFIG_CHANGED_TELEMETRY)
+  {
+    telemetryScheduler.configure(deviceConfig);
+    tParseStateChanges.setInterval(telemetryScheduler.getScanInterval());
 
-    mqttClient.subscribe("ardu-test/receive");
+    // Do not wait for the end of a period of the previous configuration
+    tBroadcastMQTTStatus.delay(telemetryScheduler.nextDelay(TELEMETRY_STATUS, millis()));
+    tBroadcastMQTTMetrics.delay(telemetryScheduler.nextDelay(TELEMETRY_METRICS, millis()));
 
-    Serial.println(F("Successfully subscribed to MQTT channels"));
+    // The status mode may have changed
+    statusTelemetry.requestKeyframe();
+  }
 
-    // Advertise presence
-    mqttAdvertisePresence();
+  if (changes & CONFIG_CHANGED_ANALOG)
+  {
+    adcSampler.begin(deviceConfig);
   }
-  else
+
+  if (changes & CONFIG_CHANGED_RULES)
   {
-    Serial.print(F("ERROR: MQTT was unable to connect to "));
-    Serial.print(deviceConfig.MQTT_SERVER_HOST);
-    Serial.print(F(" in "));
-    Serial.print(deviceConfig.MQTT_CONNECTION_RETRIES);
-    Serial.println(F(" retries"));
+    Serial.print(F("Edge rules loaded: "));
+    Serial.println(edgeRules.compile(deviceConfig));
   }
 }
 
@@ -286,11 +429,7 @@ void reboot()
     mqttClient.disconnect();
   }
 
-  if (httpEthClient.available())
-  {
-    httpEthClient.flush();
-    httpEthClient.stop();
-  }
+  httpFrontEnd.stopAll();
 
   ethServer.flush();
 
@@ -303,6 +442,9 @@ void reboot()
 
 void setup()
 {
+  // Mark the free RAM before the stack grows, for the stack watermark
+  MemoryMetricsProvider::paintStack();
+
   // Enable the builtin led
   pinMode(LED_BUILTIN, OUTPUT);
 
@@ -322,6 +464,7 @@ void setup()
 
   // Read device configuration from EEPROM
   Serial.println(F("Reading device configuration"));
+  deviceConfigProvider.onSaved(&configSaved);
   deviceConfig = deviceConfigProvider.readFromEEprom();
   Serial.println(F("Configuration loaded successfully"));
 
@@ -330,6 +473,14 @@ void setup()
   Serial.print(F("Device configuration version: "));
   Serial.println(deviceConfig.DEVICE_CONFIG_VERSION);
 
+  // Start the background sampling of the monitored analog inputs
+  adcSampler.begin(deviceConfig);
+
+  Serial.print(F("Edge rules loaded: "));
+  Serial.println(edgeRules.compile(deviceConfig));
+
+  telemetryScheduler.configure(deviceConfig);
+
   // Initialize ethernet with DHCP
   delay(500);
   Serial.println(F("Initializing ethernet with dhcp"));
@@ -359,10 +510,20 @@ void setup()
   // Initialize the web server
   Serial.println(F("Initializing the web server"));
 
+  restApp.header("Accept", httpAcceptHeader, sizeof(httpAcceptHeader));
+  restApp.header("Content-Type", httpContentTypeHeader, sizeof(httpContentTypeHeader));
   restApp.use(&restFillContext);
   restApp.get("/status", &restStatus);
+  restApp.get("/metrics", &restMetrics);
+#if LOOP_PROFILER
+  restApp.get("/profile", &restProfile);
+#endif
+  restApp.get("/config", &restGetConfig);
+  restApp.post("/config", &restPostConfig);
+  restApp.post("/commands", &restCommands);
   restApp.post("/reboot", &restReboot);
   restApp.post("/reset-to-default", &restResetToDefault);
+  ethServer = EthernetServer(deviceConfig.HTTP_SERVER_PORT);
   ethServer.begin();
 
   Serial.print(F("Web server initialized correctly on port "));
@@ -372,32 +533,137 @@ void setup()
   Serial.print(F("Initializing the MQTT connection to "));
   Serial.println(deviceConfig.MQTT_SERVER_HOST);
 
-  mqttClient.begin(deviceConfig.MQTT_SERVER_HOST.c_str(), mqttEthClient);
+  mqttClient.begin(deviceConfig.MQTT_SERVER_HOST, mqttEthClient);
   mqttClient.setKeepAlive(deviceConfig.MQTT_KEEPALIVE);
   mqttClient.setCleanSession(true);
   mqttClient.setTimeout(deviceConfig.MQTT_TIMEOUT);
   mqttClient.dropOverflow(true);
-  mqttClient.onMessage(mqttProcessMessage);
+  mqttClient.onMessageAdvanced(mqttProcessMessage);
+
+  MqttConnectionProvider::seedJitter();
 
   Serial.println(F("MQTT connection initialized"));
 
+  tasksRunner.addTask(tMqttConnection);
+  tMqttConnection.enable();
   tasksRunner.addTask(tParseStateChanges);
+  tParseStateChanges.setInterval(telemetryScheduler.getScanInterval());
   tParseStateChanges.enable();
+  tasksRunner.addTask(tRunScheduledRules);
+  // Spread the first publications of devices booting together over a whole period
   tasksRunner.addTask(tBroadcastMQTTStatus);
-  tBroadcastMQTTStatus.enable();
+  tBroadcastMQTTStatus.enableDelayed(telemetryScheduler.phase(TELEMETRY_STATUS));
+  tasksRunner.addTask(tBroadcastMQTTMetrics);
+  tBroadcastMQTTMetrics.enableDelayed(telemetryScheduler.phase(TELEMETRY_METRICS));
+#if LOOP_PROFILER
+  tasksRunner.addTask(tBroadcastMQTTProfile);
+  tBroadcastMQTTProfile.enableDelayed(telemetryScheduler.phase(TELEMETRY_PROFILE));
+#endif
 }
 
+ISR(ADC_vect)
+{
+  adcSampler.onConversion(ADC);
+}
+
+#if PIN_STREAMER
+ISR(TIMER3_COMPA_vect)
+{
+  pinStreamer.onTick(micros());
+}
+#endif
+
 void parseStateChanges()
 {
   // Parse all the state changes
-  // stateProvider.computeStateChanges(mqttClient, deviceConfig);
+  uint8_t changes = stateProvider.computeStateChanges(mqttClient, deviceConfig, &edgeRules);
+  changes += stateProvider.publishAnalogChanges(mqttClient, deviceConfig, adcSampler, &edgeRules);
+
+  // Pins started changing, switch the status to the faster cadence now
+  if (changes > 0 && telemetryScheduler.onPinActivity(millis()))
+  {
+    tBroadcastMQTTStatus.delay(telemetryScheduler.nextDelay(TELEMETRY_STATUS, millis()));
+  }
+
+  // A rule may have scheduled a write
+  if (edgeRules.hasScheduled())
+  {
+    runScheduledRules();
+  }
+}
+
+void runScheduledRules()
+{
+  long next = edgeRules.runDue(millis());
+
+  if (next >= 0)
+  {
+    tRunScheduledRules.restartDelayed(next);
+  }
 }
 
 void broadcastMQTTStatus()
 {
-  mqttClient.publish("ardu-test/status", stateProvider.generateJsonState(deviceConfig, Ethernet.localIP()));
+  BufferPrint payload(payloadBuffer, sizeof(payloadBuffer));
+  PayloadEncoding encoding = (PayloadEncoding)deviceConfig.PAYLOAD_ENCODING;
+
+  if (deviceConfig.STATUS_MODE == StatusTelemetryMode::DELTA_STATUS)
+  {
+    statusTelemetry.writeStatus(payload, encoding, stateProvider, deviceConfig, Ethernet.localIP(), freeMemory());
+  }
+  else
+  {
+    stateProvider.writeState(payload, encoding, deviceConfig, Ethernet.localIP(), freeMemory());
+  }
+
+  if (payload.overflowed())
+  {
+    Serial.println(F("ERROR: MQTT status does not fit in MQTT_PAYLOAD_BUFFER_SIZE"));
+    statusTelemetry.published(false);
+    // Not a link failure, a longer period would not help
+    scheduleTelemetry(tBroadcastMQTTStatus, TELEMETRY_STATUS, true);
+    return;
+  }
+
+  bool success = mqttClient.publish(mqttTopics.get(TOPIC_STATUS), payload.c_str(), payload.length());
+
+  if (deviceConfig.STATUS_MODE == StatusTelemetryMode::DELTA_STATUS)
+  {
+    statusTelemetry.published(success);
+  }
+
+  scheduleTelemetry(tBroadcastMQTTStatus, TELEMETRY_STATUS, success);
+}
+
+void broadcastMQTTMetrics()
+{
+  BufferPrint payload(payloadBuffer, sizeof(payloadBuffer));
+  memoryMetrics.writeMetrics(payload, (PayloadEncoding)deviceConfig.PAYLOAD_ENCODING, sampleMetrics());
+
+  bool success = mqttClient.publish(mqttTopics.get(TOPIC_METRICS), payload.c_str(), payload.length());
+
+  scheduleTelemetry(tBroadcastMQTTMetrics, TELEMETRY_METRICS, success);
 }
 
+#if LOOP_PROFILER
+void broadcastMQTTProfile()
+{
+  BufferPrint payload(payloadBuffer, sizeof(payloadBuffer));
+  loopProfiler.writeProfile(payload, (PayloadEncoding)deviceConfig.PAYLOAD_ENCODING);
+
+  if (payload.overflowed())
+  {
+    Serial.println(F("ERROR: Loop profile does not fit in MQTT_PAYLOAD_BUFFER_SIZE"));
+    scheduleTelemetry(tBroadcastMQTTProfile, TELEMETRY_PROFILE, true);
+    return;
+  }
+
+  bool success = mqttClient.publish(mqttTopics.get(TOPIC_PROFILE), payload.c_str(), payload.length());
+
+  scheduleTelemetry(tBroadcastMQTTProfile, TELEMETRY_PROFILE, success);
+}
+#endif
+
 void loop()
 {
   // Check if we need to reboot the device
@@ -406,15 +672,23 @@ void loop()
     reboot();
   }
 
+  // Apply the configuration received by the previous loop()
+  if (configReloader.hasChanges())
+  {
+    applyConfigChanges(configReloader.takeChanges());
+  }
+
+  unsigned long loopStarted = micros();
+
+  PROFILE_START();
+
   // Check if there are tasks that need to be runned
   tasksRunner.execute();
+  PROFILE_STAGE(loopProfiler, STAGE_TASKS);
 
-  // Check if we have any serial message incoming
-  if (Serial.available() > 0)
-  {
-    String serialData = Serial.readString();
-    Serial.println(processIncomingMessage("SERIAL", serialData).c_str());
-  }
+  // Dispatch the serial commands received so far, without waiting for the rest
+  serialReader.poll(Serial, &serialProcessMessage);
+  PROFILE_STAGE(loopProfiler, STAGE_SERIAL);
 
   // Check if we need to renew the DHCP address
   switch (Ethernet.maintain())
@@ -428,6 +702,8 @@ void loop()
   case DHCP_CHECK_REBIND_OK:
     Serial.print(F("Ethernet DHCP changed ip: "));
     Serial.println(Ethernet.localIP());
+    // The ip is part of the cached advertise and status fragments
+    stateProvider.invalidateFragments();
     break;
   default:
     // Something went wrong with the renewal of DHCP
@@ -440,38 +716,36 @@ void loop()
     break;
   }
 
-  // Receive any HTTP incoming requests
-  httpEthClient = ethServer.available();
+  PROFILE_STAGE(loopProfiler, STAGE_DHCP);
+
+  // Accept new HTTP clients, then advance every open connection
+  // with the bytes received so far
+  EthernetClient newHttpClient = ethServer.accept();
 
-  if (httpEthClient.connected())
+  if (newHttpClient)
   {
-    // Initialize a context in order to handle the current request
-    RestContext httpEthContext = {
-      ip : httpEthClient.remoteIP(),
-    };
+    httpFrontEnd.accept(newHttpClient);
+  }
 
-    Serial.print(F("Received an HTTP request from "));
-    Serial.print(httpEthContext.ip);
-    Serial.print(F(" for path "));
-    Serial.print(httpEthContext.path);
-    Serial.println(F(" - processing now"));
+  httpFrontEnd.poll();
+  PROFILE_STAGE(loopProfiler, STAGE_HTTP);
 
-    // Process the request
-    restApp.process(&httpEthClient, &httpEthContext);
+  // Receive any MQTT incoming messages. The connection itself
+  // is handled by the tMqttConnection task.
+  if (mqttClient.connected())
+  {
+    mqttClient.loop();
 
-    Serial.println(F("Done processing HTTP request"));
+    // Acknowledge the commands received by this loop
+    commandReplies.flush(mqttClient, mqttTopics, payloadBuffer, sizeof(payloadBuffer));
 
-    // Close the connection
-    httpEthClient.stop();
+    // Publish the frame of a running STREAM, if one is complete
+    pinStreamer.flush(mqttClient, mqttEthClient, mqttTopics.get(TOPIC_STREAM), payloadBuffer, sizeof(payloadBuffer));
   }
 
-  // Connect the MQTT client in case we are not connected
-  if (!mqttClient.connected())
-  {
-    Serial.println(F("MQTT is not connected. Initializing MQTT connection process"));
-    mqttConnect();
-  }
+  PROFILE_STAGE(loopProfiler, STAGE_MQTT);
+  PROFILE_TOTAL(loopProfiler, STAGE_LOOP);
 
-  // Receive any MQTT incoming messages
-  mqttClient.loop();
+  // A slow loop() slows the telemetry down
+  telemetryScheduler.recordLoop(micros() - loopStarted);
 }
\ No newline at end of file
@@ -0,0 +1,52 @@
+/**
+ * @file memory_hooks.cpp
+ * @brief Allocator hooks feeding the heap counters of MemoryMetricsProvider.
+ *
+ * The board build links with -Wl,--wrap=malloc,--wrap=free (platformio.ini),
+ * so every call to malloc() and free(), including operator new and the
+ * String class, goes through the functions below. A realloc() is counted
+ * when it moves the block, as avr-libc then calls malloc() and free().
+ */
+
+#ifndef ARDUMI_NATIVE
+
+#include "memory_metrics.h"
+
+HeapCounters heapCounters;
+
+extern "C" void *__real_malloc(size_t size);
+extern "C" void __real_free(void *ptr);
+
+extern "C" void *__wrap_malloc(size_t size)
+{
+    void *ptr = __real_malloc(size);
+
+    if (ptr == 0)
+    {
+        heapCounters.failures++;
+        return ptr;
+    }
+
+    heapCounters.allocations++;
+
+    size_t heapUsed = (__brkval != 0 ? __brkval : &__heap_start) - &__heap_start;
+
+    if (heapUsed > heapCounters.highWater)
+    {
+        heapCounters.highWater = heapUsed;
+    }
+
+    return ptr;
+}
+
+extern "C" void __wrap_free(void *ptr)
+{
+    if (ptr != 0)
+    {
+        heapCounters.frees++;
+    }
+
+    __real_free(ptr);
+}
+
+#endif
@@ -0,0 +1,248 @@
+#pragma once
+
+#include "hal.h"
+#include "default_constants.h"
+#include "json_writer.h"
+#include "msgpack_writer.h"
+#include "payload_encoding.h"
+
+// Pattern painted over the free RAM at boot: bytes still holding it were never reached by the stack
+#define STACK_PAINT_BYTE 0xC5
+
+/**
+ * Heap activity counters, updated by the allocator hooks: memory_hooks.cpp
+ * on the board (linker --wrap), the allocation interposer of native.cpp
+ * on the native environment.
+ */
+struct HeapCounters
+{
+    uint32_t allocations;
+    uint32_t frees;
+    // Allocations that returned NULL
+    uint32_t failures;
+    // Highest heap size seen, in bytes
+    size_t highWater;
+};
+
+extern HeapCounters heapCounters;
+
+#ifndef ARDUMI_NATIVE
+// Memory layout symbols of avr-libc
+extern char __heap_start;
+extern char *__brkval;
+extern size_t __malloc_margin;
+
+// Node of the malloc free list (avr-libc stdlib_private.h)
+struct __freelist
+{
+    size_t sz;
+    struct __freelist *nx;
+};
+
+extern struct __freelist *__flp;
+#endif
+
+/**
+ * Memory figures sampled at one instant.
+ */
+struct MemorySnapshot
+{
+    int freeMemory;
+    size_t heapUsed;
+    size_t heapHighWater;
+    // Biggest block malloc() can return right now, a fragmentation indicator
+    size_t largestFreeBlock;
+    // Deepest stack use since boot
+    size_t stackMax;
+    // Smallest gap ever seen between the heap and the stack
+    size_t stackHeadroom;
+    uint32_t allocations;
+    uint32_t frees;
+    uint32_t allocationFailures;
+    // Analog samples replaced before the scan read them, filled by the
+    // caller from AdcSampler::droppedSamples()
+    uint32_t adcOverruns;
+};
+
+/**
+ * Runtime memory instrumentation.
+ *
+ * freeMemory() only tells how much RAM is free right now. This provider
+ * also reports the trend that leads to an out of memory crash:
+ *   - heap high-water mark and number of allocations, frees and failures
+ *   - the largest free block: a heap full of holes can fail an allocation
+ *     even with plenty of free bytes
+ *   - the stack watermark: the free RAM is painted with STACK_PAINT_BYTE
+ *     at boot, the bytes that lost the pattern were reached by the stack
+ *
+ *   {"free_memory":1520,"heap":{"used":310,"high_water":420,"largest_free":1392},
+ *    "stack":{"max":640,"headroom":1210},"allocations":{"count":12,"frees":9,"failed":0},
+ *    "adc":{"overruns":0}}
+ */
+class MemoryMetricsProvider
+{
+private:
+#ifdef ARDUMI_NATIVE
+    // The simulated RAM of HalMock stands in for the AVR memory layout
+    static uint8_t *heapStart() { return HalMock::board().ram.bytes + HalMock::board().ram.heapStart; }
+    static uint8_t *heapEnd() { return HalMock::board().ram.bytes + HalMock::board().ram.heapEnd; }
+    static uint8_t *stackPointer() { return HalMock::board().ram.bytes + HalMock::board().ram.stackPointer; }
+    static uint8_t *ramEnd() { return HalMock::board().ram.bytes + MOCK_RAM_SIZE - 1; }
+    static size_t mallocMargin() { return MOCK_MALLOC_MARGIN; }
+
+    static size_t largestFreeListBlock()
+    {
+        const MockRam &ram = HalMock::board().ram;
+        size_t largest = 0;
+
+        for (uint8_t i = 0; i < ram.freeBlockCount; i++)
+        {
+            largest = ram.freeBlocks[i] > largest ? ram.freeBlocks[i] : largest;
+        }
+
+        return largest;
+    }
+#else
+    static uint8_t *heapStart() { return (uint8_t *)&__heap_start; }
+    static uint8_t *heapEnd() { return __brkval != 0 ? (uint8_t *)__brkval : heapStart(); }
+    static uint8_t *stackPointer() { return (uint8_t *)SP; }
+    static uint8_t *ramEnd() { return (uint8_t *)RAMEND; }
+    static size_t mallocMargin() { return __malloc_margin; }
+
+    static size_t largestFreeListBlock()
+    {
+        size_t largest = 0;
+
+        for (struct __freelist *block = __flp; block != 0; block = block->nx)
+        {
+            largest = block->sz > largest ? block->sz : largest;
+        }
+
+        return largest;
+    }
+#endif
+
+    /**
+     * @return The number of painted bytes above the heap, never used by the stack
+     */
+    static size_t untouchedStack()
+    {
+        uint8_t *end = stackPointer();
+        size_t untouched = 0;
+
+        // Scanning from the current end of the heap: a heap that shrank
+        // leaves used bytes here, so the result can only be conservative
+        for (uint8_t *p = heapEnd(); p < end && *p == STACK_PAINT_BYTE; p++)
+        {
+            untouched++;
+        }
+
+        return untouched;
+    }
+
+public:
+    /**
+     * Fills the RAM between the heap and the stack with STACK_PAINT_BYTE.
+     * Call it first thing in setup(), before the stack grows.
+     */
+    static void paintStack()
+    {
+        uint8_t *end = stackPointer() - STACK_PAINT_MARGIN;
+
+        for (uint8_t *p = heapEnd(); p < end; p++)
+        {
+            *p = STACK_PAINT_BYTE;
+        }
+    }
+
+    MemorySnapshot sample()
+    {
+        MemorySnapshot snapshot;
+        size_t heapUsed = heapEnd() - heapStart();
+        size_t untouched = untouchedStack();
+        size_t gap = stackPointer() - heapEnd();
+
+        if (heapUsed > heapCounters.highWater)
+        {
+            heapCounters.highWater = heapUsed;
+        }
+
+        // Above the heap malloc() keeps __malloc_margin bytes for the stack
+        gap = gap > mallocMargin() ? gap - mallocMargin() : 0;
+
+        snapshot.freeMemory = freeMemory();
+        snapshot.heapUsed = heapUsed;
+        snapshot.heapHighWater = heapCounters.highWater;
+        snapshot.largestFreeBlock = largestFreeListBlock() > gap ? largestFreeListBlock() : gap;
+        snapshot.stackMax = ramEnd() - (heapEnd() + untouched) + 1;
+        snapshot.stackHeadroom = untouched;
+        snapshot.allocations = heapCounters.allocations;
+        snapshot.frees = heapCounters.frees;
+        snapshot.allocationFailures = heapCounters.failures;
+        snapshot.adcOverruns = 0;
+
+        return snapshot;
+    }
+
+    /**
+     * Streams the metrics into any Print (HTTP response, MQTT payload buffer, ...).
+     *
+     * @return The number of bytes written
+     */
+    size_t writeMetrics(Print &out, PayloadEncoding encoding, const MemorySnapshot &snapshot)
+    {
+        if (encoding == PayloadEncoding::MSGPACK_ENCODING)
+        {
+            MsgPackWriter writer(out);
+            return writeMetrics(writer, snapshot);
+        }
+
+        JsonWriter writer(out);
+        return writeMetrics(writer, snapshot);
+    }
+
+    template <typename TWriter>
+    size_t writeMetrics(TWriter &writer, const MemorySnapshot &snapshot)
+    {
+        writer.beginObject(5);
+        writer.member(F("free_memory"), snapshot.freeMemory);
+
+        writer.key(F("heap"));
+        writer.beginObject(3);
+        writer.member(F("used"), snapshot.heapUsed);
+        writer.member(F("high_water"), snapshot.heapHighWater);
+        writer.member(F("largest_free"), snapshot.largestFreeBlock);
+        writer.endObject();
+
+        writer.key(F("stack"));
+        writer.beginObject(2);
+        writer.member(F("max"), snapshot.stackMax);
+        writer.member(F("headroom"), snapshot.stackHeadroom);
+        writer.endObject();
+
+        writer.key(F("allocations"));
+        writer.beginObject(3);
+        writer.member(F("count"), (unsigned long)snapshot.allocations);
+        writer.member(F("frees"), (unsigned long)snapshot.frees);
+        writer.member(F("failed"), (unsigned long)snapshot.allocationFailures);
+        writer.endObject();
+
+        writer.key(F("adc"));
+        writer.beginObject(1);
+        writer.member(F("overruns"), (unsigned long)snapshot.adcOverruns);
+        writer.endObject();
+
+        writer.endObject();
+
+        return writer.size();
+    }
+
+    /**
+     * @return The length of the payload written by writeMetrics with the same arguments
+     */
+    size_t measureMetrics(PayloadEncoding encoding, const MemorySnapshot &snapshot)
+    {
+        CountingPrint counter;
+        return writeMetrics(counter, encoding, snapshot);
+    }
+};
@@ -0,0 +1,277 @@
+#pragma once
+
+#include "hal.h"
+#include "device_config.h"
+#include "default_constants.h"
+#include "mqtt_topics.h"
+
+enum MqttConnectionState : uint8_t
+{
+    // Waiting for the backoff delay to expire
+    MQTT_DISCONNECTED,
+    // Opening the socket and sending CONNECT
+    MQTT_CONNECTING,
+    // Leaving the previous topics, one per step, before subscribing the new ones
+    MQTT_UNSUBSCRIBING,
+    // Subscribing to one channel per step
+    MQTT_SUBSCRIBING,
+    // Publishing the advertise message
+    MQTT_ADVERTISING,
+    // Only checking that the connection is still alive
+    MQTT_CONNECTED,
+};
+
+typedef void (*MqttAdvertiseCallback)();
+
+/**
+ * Non-blocking MQTT connection management.
+ *
+ * Every call to step() performs at most one socket operation (connect,
+ * one (un)subscribe or the advertise publish) and returns how long the caller
+ * should wait before the next step, so loop() never sleeps while the
+ * broker is down. Failed connections are retried with a jittered
+ * exponential backoff, between MQTT_BACKOFF_MIN and MQTT_BACKOFF_MAX.
+ * After MQTT_CONNECTION_RETRIES failed retries the delay stays at
+ * MQTT_BACKOFF_MAX.
+ */
+class MqttConnectionProvider
+{
+private:
+    MQTTClient &client;
+    MqttTopics &topics;
+    MqttAdvertiseCallback advertise;
+
+    MqttConnectionState state = MQTT_DISCONNECTED;
+    uint8_t nextTopic = 0;
+    uint8_t failedAttempts = 0;
+    unsigned long nextAttemptAt = 0;
+
+    /**
+     * Exponential backoff with "equal jitter": half of the delay is fixed,
+     * the other half random, so a fleet of devices does not reconnect in
+     * lockstep after a broker restart.
+     *
+     * @param retries Failed attempts retried with a growing delay, the next
+     * ones wait MQTT_BACKOFF_MAX
+     */
+    unsigned long backoffDelay(int retries) const
+    {
+        unsigned long delay = MQTT_BACKOFF_MAX;
+        uint8_t exponent = failedAttempts > 0 ? failedAttempts - 1 : 0;
+
+        if (failedAttempts <= retries && exponent < 16 && (MQTT_BACKOFF_MIN << exponent) < MQTT_BACKOFF_MAX)
+        {
+            delay = MQTT_BACKOFF_MIN << exponent;
+        }
+
+        return delay / 2 + random(delay / 2 + 1);
+    }
+
+    unsigned long connectionLost()
+    {
+        Serial.println(F("ERROR: MQTT connection lost"));
+
+        state = MQTT_DISCONNECTED;
+        nextAttemptAt = millis();
+
+        return 0;
+    }
+
+    unsigned long connect(const DeviceConfig &config)
+    {
+        // Built here rather than at boot, so a new prefix or id applies on the next connection
+        topics.build(config);
+
+        if (client.connect(config.MQTT_DEVICE_ID))
+        {
+            Serial.print(F("MQTT successfully connected with client id "));
+            Serial.println(config.MQTT_DEVICE_ID);
+
+            failedAttempts = 0;
+            nextTopic = 0;
+            state = MQTT_SUBSCRIBING;
+
+            return 0;
+        }
+
+        if (failedAttempts < 255)
+        {
+            failedAttempts++;
+        }
+
+        unsigned long delay = backoffDelay(config.MQTT_CONNECTION_RETRIES);
+
+        Serial.print(F("ERROR: MQTT was unable to connect to "));
+        Serial.print(config.MQTT_SERVER_HOST);
+        Serial.print(F(", code "));
+        Serial.print(client.lastError());
+        Serial.print(F(". Retrying in "));
+        Serial.print(delay);
+        Serial.println(F("ms"));
+
+        if (failedAttempts == config.MQTT_CONNECTION_RETRIES + 1)
+        {
+            Serial.print(F("ERROR: MQTT still unreachable after "));
+            Serial.print(config.MQTT_CONNECTION_RETRIES);
+            Serial.println(F(" retries, now retrying at the longest backoff"));
+        }
+
+        state = MQTT_DISCONNECTED;
+        nextAttemptAt = millis() + delay;
+
+        return delay;
+    }
+
+public:
+    /**
+     * @param client The MQTT client, already initialized with begin()
+     * @param topics Topics of the device, rebuilt from the configuration on every connection
+     * @param advertise Called once the subscriptions are done
+     */
+    MqttConnectionProvider(MQTTClient &client, MqttTopics &topics, MqttAdvertiseCallback advertise)
+        : client(client), topics(topics), advertise(advertise)
+    {
+    }
+
+    /**
+     * Seeds the backoff jitter with the board unique id, so devices
+     * booting at the same time still pick different delays.
+     */
+    static void seedJitter()
+    {
+        randomSeed(uniqueIdHash() ^ micros());
+    }
+
+    /**
+     * Advances the connection by one step.
+     *
+     * @return Milliseconds to wait before the next step, 0 to run it as soon as possible
+     */
+    unsigned long step(const DeviceConfig &config)
+    {
+        switch (state)
+        {
+        case MQTT_DISCONNECTED:
+        {
+            long remaining = (long)(nextAttemptAt - millis());
+
+            if (remaining > 0)
+            {
+                return remaining;
+            }
+
+            Serial.print(F("Connecting to MQTT Host "));
+            Serial.println(config.MQTT_SERVER_HOST);
+
+            state = MQTT_CONNECTING;
+            return 0;
+        }
+        case MQTT_CONNECTING:
+            return connect(config);
+        case MQTT_UNSUBSCRIBING:
+            if (!client.connected())
+            {
+                return connectionLost();
+            }
+
+            if (nextTopic < topics.subscriptionCount())
+            {
+                client.unsubscribe(topics.subscription(nextTopic++));
+                return 0;
+            }
+
+            // The previous topics are left, switch to the new ones
+            topics.build(config);
+            nextTopic = 0;
+            state = MQTT_SUBSCRIBING;
+
+            return 0;
+        case MQTT_SUBSCRIBING:
+            if (!client.connected())
+            {
+                return connectionLost();
+            }
+
+            if (nextTopic < topics.subscriptionCount())
+            {
+                client.subscribe(topics.subscription(nextTopic++));
+            }
+
+            if (nextTopic >= topics.subscriptionCount())
+            {
+                Serial.println(F("Successfully subscribed to MQTT channels"));
+                state = MQTT_ADVERTISING;
+            }
+
+            return 0;
+        case MQTT_ADVERTISING:
+            if (!client.connected())
+            {
+                return connectionLost();
+            }
+
+            if (advertise != nullptr)
+            {
+                advertise();
+            }
+
+            state = MQTT_CONNECTED;
+            return MQTT_CONNECTION_CHECK_INTERVAL;
+        case MQTT_CONNECTED:
+            if (!client.connected())
+            {
+                return connectionLost();
+            }
+
+            return MQTT_CONNECTION_CHECK_INTERVAL;
+        }
+
+        return MQTT_CONNECTION_CHECK_INTERVAL;
+    }
+
+    /**
+     * Closes the session, the next step opens a new one with the current
+     * host and client id.
+     */
+    void reconnect()
+    {
+        if (client.connected())
+        {
+            client.disconnect();
+        }
+
+        failedAttempts = 0;
+        state = MQTT_DISCONNECTED;
+        nextAttemptAt = millis();
+    }
+
+    /**
+     * Moves an open session to the current prefix, channels and encoding:
+     * the previous topics are unsubscribed, the new ones subscribed and
+     * the device advertised again, without reconnecting. A session not
+     * open yet builds the new topics when it connects.
+     */
+    void resubscribe()
+    {
+        if (state == MQTT_DISCONNECTED || state == MQTT_CONNECTING)
+        {
+            return;
+        }
+
+        nextTopic = 0;
+        state = MQTT_UNSUBSCRIBING;
+    }
+
+    MqttConnectionState getState() const
+    {
+        return state;
+    }
+
+    /**
+     * @return true once the subscriptions and the advertise are done
+     */
+    bool isReady() const
+    {
+        return state == MQTT_CONNECTED;
+    }
+};
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "hal.h"
+#include "default_constants.h"
+#include "device_config.h"
+#include "payload_encoding.h"
+
+// <prefix>/<id>/, the longest leaf ("advertise") and MSGPACK_TOPIC_SUFFIX, null included
+#define MQTT_TOPIC_SIZE (CONFIG_PREFIX_SIZE + CONFIG_ID_SIZE + 18)
+
+/**
+ * Topics of a device, the leaf of <prefix>/<MQTT_DEVICE_ID>/<leaf>.
+ */
+enum MqttTopic : uint8_t
+{
+    // Commands, subscribed in both encodings
+    TOPIC_RECEIVE,
+    TOPIC_RECEIVE_MSGPACK,
+    // Command replies, in the encoding of the command
+    TOPIC_RESPONSE,
+    TOPIC_RESPONSE_MSGPACK,
+    // Published in the configured PAYLOAD_ENCODING
+    TOPIC_ADVERTISE,
+    TOPIC_STATUS,
+    TOPIC_PUBLISH,
+    TOPIC_METRICS,
+    TOPIC_PROFILE,
+    TOPIC_RULE,
+    // Binary frames, no encoding
+    TOPIC_STREAM,
+    MQTT_TOPIC_COUNT,
+};
+
+// Leaves of the topics, in enum order. The msgpack variants reuse the JSON leaf.
+const char topicReceiveLeaf[] PROGMEM = "receive";
+const char topicResponseLeaf[] PROGMEM = "response";
+const char topicAdvertiseLeaf[] PROGMEM = "advertise";
+const char topicStatusLeaf[] PROGMEM = "status";
+const char topicPublishLeaf[] PROGMEM = "publish";
+const char topicMetricsLeaf[] PROGMEM = "metrics";
+const char topicProfileLeaf[] PROGMEM = "profile";
+const char topicRuleLeaf[] PROGMEM = "rule";
+const char topicStreamLeaf[] PROGMEM = "stream";
+const char *const topicLeaves[] PROGMEM = {
+    topicReceiveLeaf, topicReceiveLeaf, topicResponseLeaf, topicResponseLeaf,
+    topicAdvertiseLeaf, topicStatusLeaf, topicPublishLeaf, topicMetricsLeaf,
+    topicProfileLeaf, topicRuleLeaf, topicStreamLeaf};
+
+static_assert(sizeof(topicLeaves) / sizeof(topicLeaves[0]) == MQTT_TOPIC_COUNT, "topicLeaves must name every MqttTopic");
+
+/**
+ * The MQTT topics of the device, built once per connection.
+ *
+ * Each device has its own topics, <prefix>/<MQTT_DEVICE_ID>/<leaf>, so
+ * a broker shared by a fleet routes commands to one device instead of all
+ * of them, and the backend tells the devices apart from the topic alone
+ * (subscribing to <prefix>/+/status for instance). The configured
+ * channels are subscribed as they are: a channel shared by several
+ * devices addresses a group.
+ *
+ * build() keeps the <prefix>/<id>/ base only, and get() appends the leaf
+ * into a single buffer: resident copies of every topic would cost the
+ * Mega about 640 bytes of its 8 KB.
+ */
+class MqttTopics
+{
+private:
+    // <prefix>/<id>/, null included
+    char base[CONFIG_PREFIX_SIZE + CONFIG_ID_SIZE + 1];
+    uint8_t baseLength = 0;
+    bool msgpack = false;
+    // The topic returned by the last get()
+    mutable char topic[MQTT_TOPIC_SIZE];
+    char channels[MQTT_CHANNEL_COUNT][CONFIG_CHANNEL_SIZE];
+    uint8_t channelCount = 0;
+
+    static bool isEncoded(uint8_t topic)
+    {
+        return topic >= TOPIC_ADVERTISE && topic <= TOPIC_RULE;
+    }
+
+public:
+    MqttTopics()
+    {
+        memset(base, 0, sizeof(base));
+        memset(topic, 0, sizeof(topic));
+        memset(channels, 0, sizeof(channels));
+    }
+
+    /**
+     * Keeps the topics of a configuration. An empty prefix leaves the
+     * topics at <MQTT_DEVICE_ID>/<leaf>.
+     */
+    void build(const DeviceConfig &config)
+    {
+        msgpack = config.PAYLOAD_ENCODING == PayloadEncoding::MSGPACK_ENCODING;
+        // The base fits the longest prefix and id, the length never exceeds it
+        baseLength = snprintf_P(base, sizeof(base), PSTR("%s%s%s/"), config.MQTT_TOPIC_PREFIX,
+                                config.MQTT_TOPIC_PREFIX[0] != 0 ? "/" : "", config.MQTT_DEVICE_ID);
+
+        channelCount = 0;
+
+        for (uint8_t i = 0; i < MQTT_CHANNEL_COUNT; i++)
+        {
+            if (config.MQTT_CHANNELS[i][0] != 0)
+            {
+                strlcpy(channels[channelCount++], config.MQTT_CHANNELS[i], CONFIG_CHANNEL_SIZE);
+            }
+        }
+    }
+
+    /**
+     * @return The topic, valid until the next call of get() or
+     * subscription(): publish it before asking for another one
+     */
+    const char *get(MqttTopic leaf) const
+    {
+        bool suffixed = leaf == TOPIC_RECEIVE_MSGPACK || leaf == TOPIC_RESPONSE_MSGPACK || (msgpack && isEncoded(leaf));
+        size_t length = baseLength;
+
+        memcpy(topic, base, baseLength);
+        length += strlcpy_P(topic + length, (const char *)pgm_read_ptr(&topicLeaves[leaf]), MQTT_TOPIC_SIZE - length);
+
+        if (suffixed)
+        {
+            strlcpy_P(topic + length, PSTR(MSGPACK_TOPIC_SUFFIX), MQTT_TOPIC_SIZE - length);
+        }
+
+        return topic;
+    }
+
+    /**
+     * @return The number of topics to subscribe: the commands topics in
+     * both encodings, then the channels
+     */
+    uint8_t subscriptionCount() const
+    {
+        return 2 + channelCount;
+    }
+
+    const char *subscription(uint8_t index) const
+    {
+        return index < 2 ? get((MqttTopic)(TOPIC_RECEIVE + index)) : channels[index - 2];
+    }
+};
@@ -0,0 +1,192 @@
+#pragma once
+
+#include "hal.h"
+#include "json_writer.h"
+
+/**
+ * Minimal streaming MessagePack serializer, with the same interface as
+ * JsonWriter so the payload builders can produce either encoding.
+ *
+ * MessagePack prefixes maps and arrays with their number of elements, so
+ * beginObject() and beginArray() take the count; JsonWriter ignores it.
+ * Every number uses the smallest encoding that holds it.
+ */
+class MsgPackWriter
+{
+private:
+    Print &out;
+    size_t written = 0;
+
+    void writeByte(uint8_t byte)
+    {
+        written += out.write(byte);
+    }
+
+    void writeBigEndian(uint32_t value, uint8_t bytes)
+    {
+        while (bytes > 0)
+        {
+            bytes--;
+            writeByte((uint8_t)(value >> (bytes * 8)));
+        }
+    }
+
+    void writeContainerHeader(size_t count, uint8_t fixMarker, uint8_t maxFixCount, uint8_t marker16)
+    {
+        if (count <= maxFixCount)
+        {
+            writeByte(fixMarker | (uint8_t)count);
+        }
+        else
+        {
+            writeByte(marker16);
+            writeBigEndian(count, 2);
+        }
+    }
+
+    void writeStringHeader(size_t length)
+    {
+        if (length < 32)
+        {
+            writeByte(0xa0 | (uint8_t)length);
+        }
+        else if (length <= 0xff)
+        {
+            writeByte(0xd9);
+            writeByte((uint8_t)length);
+        }
+        else
+        {
+            writeByte(0xda);
+            writeBigEndian(length, 2);
+        }
+    }
+
+    void writeString(const char *str)
+    {
+        size_t length = strlen(str);
+
+        writeStringHeader(length);
+        written += out.write((const uint8_t *)str, length);
+    }
+
+    void writeString(const __FlashStringHelper *str)
+    {
+        const char *ptr = reinterpret_cast<const char *>(str);
+        char c;
+
+        writeStringHeader(strlen_P(ptr));
+
+        while ((c = pgm_read_byte(ptr++)) != 0)
+        {
+            writeByte((uint8_t)c);
+        }
+    }
+
+    void writeUnsigned(unsigned long number)
+    {
+        if (number <= 0x7f)
+        {
+            writeByte((uint8_t)number);
+        }
+        else if (number <= 0xff)
+        {
+            writeByte(0xcc);
+            writeByte((uint8_t)number);
+        }
+        else if (number <= 0xffff)
+        {
+            writeByte(0xcd);
+            writeBigEndian(number, 2);
+        }
+        else
+        {
+            writeByte(0xce);
+            writeBigEndian(number, 4);
+        }
+    }
+
+    void writeSigned(long number)
+    {
+        if (number >= 0)
+        {
+            writeUnsigned((unsigned long)number);
+        }
+        else if (number >= -32)
+        {
+            writeByte((uint8_t)(int8_t)number);
+        }
+        else if (number >= -128)
+        {
+            writeByte(0xd0);
+            writeByte((uint8_t)(int8_t)number);
+        }
+        else if (number >= -32768L)
+        {
+            writeByte(0xd1);
+            writeBigEndian((uint16_t)(int16_t)number, 2);
+        }
+        else
+        {
+            writeByte(0xd2);
+            writeBigEndian((uint32_t)number, 4);
+        }
+    }
+
+public:
+    explicit MsgPackWriter(Print &out) : out(out)
+    {
+    }
+
+    void beginObject(size_t members) { writeContainerHeader(members, 0x80, 15, 0xde); }
+    void endObject() {}
+    void beginArray(size_t elements) { writeContainerHeader(elements, 0x90, 15, 0xdc); }
+    void endArray() {}
+
+    void key(const __FlashStringHelper *name) { writeString(name); }
+    void key(const char *name) { writeString(name); }
+
+    void value(const char *str) { writeString(str); }
+    void value(const __FlashStringHelper *str) { writeString(str); }
+    void value(bool boolean) { writeByte(boolean ? 0xc3 : 0xc2); }
+    void value(int number) { writeSigned(number); }
+    void value(unsigned int number) { writeUnsigned(number); }
+    void value(long number) { writeSigned(number); }
+    void value(unsigned long number) { writeUnsigned(number); }
+
+    /**
+     * Printable values (e.g. IPAddress) are written as strings.
+     */
+    void value(const Printable &printable)
+    {
+        CountingPrint counter;
+        counter.print(printable);
+
+        writeStringHeader(counter.size());
+        written += out.print(printable);
+    }
+
+    template <typename TKey, typename TValue>
+    void member(TKey name, const TValue &memberValue)
+    {
+        key(name);
+        value(memberValue);
+    }
+
+    /**
+     * Splices elements serialized by another MsgPackWriter. They count
+     * in the size given to beginObject() or beginArray().
+     */
+    void raw(const char *bytes, size_t length)
+    {
+        written += out.write((const uint8_t *)bytes, length);
+    }
+
+    /**
+     * @return The number of bytes written so far
+     */
+    size_t size() const
+    {
+        return written;
+    }
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "json_writer.h"
+#include "msgpack_writer.h"
+
+/**
+ * Wire format of the payloads exchanged with the backend.
+ */
+enum PayloadEncoding
+{
+    JSON_ENCODING = 0,
+    MSGPACK_ENCODING = 1,
+};
+
+// MessagePack payloads use the JSON topic followed by this suffix
+#define MSGPACK_TOPIC_SUFFIX "/msgpack"
+
+/**
+ * @return The encoding produced by a writer, for the templated payload builders
+ */
+inline PayloadEncoding encodingOf(const JsonWriter &writer) { return JSON_ENCODING; }
+inline PayloadEncoding encodingOf(const MsgPackWriter &writer) { return MSGPACK_ENCODING; }
+
+#define JSON_CONTENT_TYPE "application/json"
+#define MSGPACK_CONTENT_TYPE "application/msgpack"
+
+/**
+ * Picks the encoding requested by an HTTP Accept or Content-Type header.
+ * Both the registered "application/msgpack" and the older
+ * "application/x-msgpack" are recognized; anything else means JSON.
+ */
+inline PayloadEncoding encodingFromMediaType(const char *mediaType)
+{
+    if (mediaType != nullptr && (strstr_P(mediaType, PSTR("application/msgpack")) != nullptr ||
+                                 strstr_P(mediaType, PSTR("application/x-msgpack")) != nullptr))
+    {
+        return MSGPACK_ENCODING;
+    }
+
+    return JSON_ENCODING;
+}
+
+/**
+ * @return true if the topic ends with MSGPACK_TOPIC_SUFFIX
+ */
+inline bool isMsgPackTopic(const char *topic)
+{
+    size_t topicLength = strlen(topic);
+    size_t suffixLength = strlen_P(PSTR(MSGPACK_TOPIC_SUFFIX));
+
+    return topicLength >= suffixLength && strcmp_P(topic + topicLength - suffixLength, PSTR(MSGPACK_TOPIC_SUFFIX)) == 0;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "hal.h"
+#include "json_writer.h"
+#include "payload_encoding.h"
+
+/**
+ * Pre-serialized bytes of a payload part that only changes with the
+ * configuration or the ip address, e.g. the "http" and "mqtt" sections of
+ * the status.
+ *
+ * The first write() renders the part into the fragment, the next ones
+ * splice the bytes with the writer's raw() until invalidate() is called.
+ * Only the configured encoding is cached: a payload in the other encoding
+ * (an HTTP client asking for it) is rendered as before, so the two never
+ * evict each other.
+ */
+template <size_t Capacity>
+class PayloadFragment
+{
+private:
+    char bytes[Capacity];
+    uint16_t length = 0;
+    bool cached = false;
+    PayloadEncoding cachedEncoding = JSON_ENCODING;
+
+public:
+    void invalidate()
+    {
+        cached = false;
+    }
+
+    bool isCached() const
+    {
+        return cached;
+    }
+
+    /**
+     * Writes the part, from the cached bytes when possible.
+     *
+     * @param writer The writer of the payload
+     * @param configuredEncoding The only encoding worth caching
+     * @param render Writes the part with the TWriter it receives
+     */
+    template <typename TWriter, typename TRender>
+    void write(TWriter &writer, int configuredEncoding, TRender render)
+    {
+        PayloadEncoding encoding = encodingOf(writer);
+
+        if (encoding != configuredEncoding)
+        {
+            render(writer);
+            return;
+        }
+
+        if (!cached || cachedEncoding != encoding)
+        {
+            BufferPrint out(bytes, Capacity);
+            TWriter fragmentWriter(out);
+
+            render(fragmentWriter);
+
+            if (out.overflowed())
+            {
+                Serial.println(F("ERROR: Payload fragment does not fit in its buffer"));
+                cached = false;
+                render(writer);
+                return;
+            }
+
+            length = out.length();
+            cachedEncoding = encoding;
+            cached = true;
+        }
+
+        writer.raw(bytes, length);
+    }
+};
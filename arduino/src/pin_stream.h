@@ -0,0 +1,477 @@
+#pragma once
+
+#include <MQTT.h>
+#include "hal.h"
+#include "default_constants.h"
+#include "adc_sampler.h"
+
+// Timer3 counts at 16MHz / 64 = 250kHz, its 16 bit compare register sets the lowest rate
+#define STREAM_TIMER_FREQUENCY 250000UL
+#define STREAM_MIN_RATE 4
+
+// First byte of every frame
+#define STREAM_FRAME_MARKER 0x53
+#define STREAM_FRAME_HEADER_SIZE 8
+
+#if PIN_STREAMER
+
+/**
+ * One tick of the sampling timer.
+ */
+struct StreamSample
+{
+    unsigned long timestamp;
+    // Bit i is the level of the digital pin in slot i
+    uint8_t digital;
+    uint16_t analog[STREAM_MAX_PINS];
+};
+
+/**
+ * STREAM_SAMPLES_PER_FRAME samples, published as one frame.
+ */
+struct StreamBuffer
+{
+    StreamSample samples[STREAM_SAMPLES_PER_FRAME];
+    volatile uint8_t count;
+};
+
+/**
+ * High rate sampling of a few pins, published as packed binary frames.
+ *
+ * A timer interrupt samples the pins into one buffer while the frame of
+ * the other one is published from loop() (double buffering). When both
+ * buffers are full, the samples are dropped and counted.
+ *
+ * Analog samples come from the AdcSampler, so only the channels it
+ * monitors are streamed as analog values: any other pin, A0-A15
+ * included, is streamed as a digital level.
+ *
+ * Frames are little endian:
+ *
+ *   header   0x53, sequence, pin count, sample count, analog slot mask,
+ *            uint8 pad, uint16 samples dropped since the stream started
+ *   pins     pin count bytes, the pin of each slot
+ *   samples  uint32 micros(), uint8 digital levels (bit i = slot i),
+ *            uint16 value of every analog slot
+ *
+ * The rate granted to a stream is capped by the measured capacity of
+ * the MQTT link, of which a stream may only use STREAM_LINK_BUDGET
+ * percent. publish() only copies a frame into the socket buffer of the
+ * Ethernet chip, so its duration says nothing of the network. The link
+ * is measured instead over windows of STREAM_LINK_WINDOW: the bytes
+ * published, minus the growth of the socket buffer backlog, are the
+ * bytes the peer acknowledged (availableForWrite() of the client).
+ * A client that does not report its free space (availableForWrite()
+ * returns 0) only lets the capacity grow with the published rate.
+ */
+class PinStreamer
+{
+private:
+    AdcSampler &adcSampler;
+
+    uint8_t pins[STREAM_MAX_PINS];
+    uint8_t pinCount = 0;
+    uint8_t analogSlots = 0;
+    uint16_t requestedRate = 0;
+    uint16_t rate = 0;
+
+    // Port input register and bit of every digital slot, ADC channel of every analog one
+    volatile uint8_t *registers[STREAM_MAX_PINS];
+    uint8_t bitMasks[STREAM_MAX_PINS];
+
+    StreamBuffer buffers[2];
+    // Buffer written by the interrupt, the other one is published when ready is set
+    volatile uint8_t filling = 0;
+    volatile bool ready = false;
+    volatile uint16_t dropped = 0;
+    uint8_t sequence = 0;
+
+    // Measured link throughput, in bytes per second
+    unsigned long linkCapacity = STREAM_DEFAULT_LINK_CAPACITY;
+    // Current measure window: start, bytes published, free socket buffer at the start (-1 before the first frame)
+    unsigned long windowStart = 0;
+    unsigned long windowBytes = 0;
+    int windowSpace = -1;
+    // Set once the client reported free space: 0 then means a full buffer, not an unknown one
+    bool spaceReported = false;
+
+    static void startTimer(uint16_t rate)
+    {
+#ifndef ARDUMI_NATIVE
+        noInterrupts();
+        // CTC mode on OCR3A, prescaler 64
+        TCCR3A = 0;
+        TCCR3B = _BV(WGM32) | _BV(CS31) | _BV(CS30);
+        OCR3A = STREAM_TIMER_FREQUENCY / rate - 1;
+        TCNT3 = 0;
+        TIMSK3 = _BV(OCIE3A);
+        interrupts();
+#else
+        (void)rate;
+#endif
+    }
+
+    static void stopTimer()
+    {
+#ifndef ARDUMI_NATIVE
+        noInterrupts();
+        TIMSK3 = 0;
+        // Back to the 8 bit phase correct PWM set by the Arduino core (pins 2, 3 and 5)
+        TCCR3A = _BV(WGM30);
+        TCCR3B = _BV(CS31) | _BV(CS30);
+        interrupts();
+#endif
+    }
+
+    uint8_t analogCount() const
+    {
+        uint8_t count = 0;
+
+        for (uint8_t slot = 0; slot < pinCount; slot++)
+        {
+            count += (analogSlots >> slot) & 1;
+        }
+
+        return count;
+    }
+
+    /**
+     * @return The highest rate the link can carry for the current pins
+     */
+    uint16_t linkRate() const
+    {
+        unsigned long budget = linkCapacity / 100 * STREAM_LINK_BUDGET;
+        unsigned long limit = budget * STREAM_SAMPLES_PER_FRAME / frameSize(STREAM_SAMPLES_PER_FRAME);
+
+        return limit > STREAM_MAX_RATE ? STREAM_MAX_RATE : limit;
+    }
+
+    /**
+     * Applies the lowest of the requested rate and the link rate.
+     */
+    void updateRate()
+    {
+        uint16_t granted = requestedRate < linkRate() ? requestedRate : linkRate();
+
+        if (granted < STREAM_MIN_RATE)
+        {
+            granted = STREAM_MIN_RATE;
+        }
+
+        if (granted != rate)
+        {
+            rate = granted;
+            startTimer(rate);
+        }
+    }
+
+    void startWindow(Client &link)
+    {
+        windowStart = millis();
+        windowBytes = 0;
+        windowSpace = link.availableForWrite();
+        spaceReported = spaceReported || windowSpace > 0;
+    }
+
+    /**
+     * Accounts a published frame, and updates the link capacity at the end
+     * of a window. When the backlog of the socket buffer grew by more than
+     * a frame, or the buffer is full, the link is the bottleneck: the bytes
+     * it carried are the new measure. Otherwise the link kept up and
+     * carries at least the measured rate.
+     */
+    void measureLink(Client &link, size_t length, bool sent)
+    {
+        if (!sent)
+        {
+            linkCapacity /= 2;
+            startWindow(link);
+            return;
+        }
+
+        windowBytes += length;
+
+        unsigned long elapsed = millis() - windowStart;
+
+        if (elapsed < STREAM_LINK_WINDOW)
+        {
+            return;
+        }
+
+        int space = link.availableForWrite();
+        long backlogGrowth = (long)windowSpace - space;
+        unsigned long carried = backlogGrowth >= (long)windowBytes ? 0 : windowBytes - backlogGrowth;
+        unsigned long measured = carried * 1000UL / elapsed;
+
+        if (backlogGrowth > (long)length || (spaceReported && (size_t)space < length))
+        {
+            // Moving average, a quarter of the new measure
+            linkCapacity = linkCapacity - linkCapacity / 4 + measured / 4;
+        }
+        else if (measured > linkCapacity)
+        {
+            linkCapacity = measured;
+        }
+
+        startWindow(link);
+    }
+
+public:
+    PinStreamer(AdcSampler &adcSampler) : adcSampler(adcSampler)
+    {
+        buffers[0].count = 0;
+        buffers[1].count = 0;
+    }
+
+    /**
+     * Starts streaming pins, replacing the previous stream.
+     *
+     * @param requested Sampling rate in Hz, 0 stops the stream
+     * @return The granted rate, 0 if the stream is stopped
+     */
+    uint16_t start(uint16_t requested, const uint8_t *streamPins, uint8_t count)
+    {
+        stop();
+
+        if (requested == 0 || count == 0 || count > STREAM_MAX_PINS)
+        {
+            return 0;
+        }
+
+        for (uint8_t slot = 0; slot < count; slot++)
+        {
+            uint8_t pin = streamPins[slot];
+
+            pins[slot] = pin;
+
+            if (pin >= PIN_A0 && adcSampler.isMonitored(pin - PIN_A0))
+            {
+                analogSlots |= (1 << slot);
+                bitMasks[slot] = pin - PIN_A0;
+                continue;
+            }
+
+            registers[slot] = portInputRegister(digitalPinToPort(pin));
+            bitMasks[slot] = digitalPinToBitMask(pin);
+        }
+
+        pinCount = count;
+        requestedRate = requested;
+        updateRate();
+
+        return rate;
+    }
+
+    void stop()
+    {
+        if (rate != 0)
+        {
+            stopTimer();
+        }
+
+        rate = 0;
+        requestedRate = 0;
+        pinCount = 0;
+        analogSlots = 0;
+        buffers[0].count = 0;
+        buffers[1].count = 0;
+        filling = 0;
+        ready = false;
+        dropped = 0;
+        sequence = 0;
+        windowSpace = -1;
+    }
+
+    bool isStreaming() const
+    {
+        return rate != 0;
+    }
+
+    uint16_t getRate() const
+    {
+        return rate;
+    }
+
+    unsigned long getLinkCapacity() const
+    {
+        return linkCapacity;
+    }
+
+    /**
+     * Samples every pin. Called from ISR(TIMER3_COMPA_vect).
+     */
+    void onTick(unsigned long now)
+    {
+        if (buffers[filling].count == STREAM_SAMPLES_PER_FRAME)
+        {
+            // The previous frame is still being published
+            if (ready)
+            {
+                dropped++;
+                return;
+            }
+
+            ready = true;
+            filling ^= 1;
+        }
+
+        StreamBuffer &buffer = buffers[filling];
+        StreamSample &sample = buffer.samples[buffer.count];
+
+        sample.timestamp = now;
+        sample.digital = 0;
+
+        for (uint8_t slot = 0; slot < pinCount; slot++)
+        {
+            if (analogSlots & (1 << slot))
+            {
+                sample.analog[slot] = adcSampler.latest(bitMasks[slot]);
+            }
+            else if (*registers[slot] & bitMasks[slot])
+            {
+                sample.digital |= (1 << slot);
+            }
+        }
+
+        if (++buffer.count == STREAM_SAMPLES_PER_FRAME && !ready)
+        {
+            ready = true;
+            filling ^= 1;
+        }
+    }
+
+    /**
+     * @return The length of a frame of sampleCount samples
+     */
+    size_t frameSize(uint8_t sampleCount) const
+    {
+        return STREAM_FRAME_HEADER_SIZE + pinCount + sampleCount * (5 + 2 * analogCount());
+    }
+
+    /**
+     * Writes the frame of a full buffer.
+     *
+     * @return The frame length, 0 if it does not fit
+     */
+    size_t writeFrame(const StreamBuffer &buffer, uint8_t *frame, size_t size)
+    {
+        size_t length = frameSize(buffer.count);
+
+        if (length > size)
+        {
+            return 0;
+        }
+
+        uint8_t *out = frame;
+
+        noInterrupts();
+        uint16_t droppedSamples = dropped;
+        interrupts();
+
+        *out++ = STREAM_FRAME_MARKER;
+        *out++ = sequence++;
+        *out++ = pinCount;
+        *out++ = buffer.count;
+        *out++ = analogSlots;
+        *out++ = 0;
+        *out++ = droppedSamples & 0xFF;
+        *out++ = droppedSamples >> 8;
+
+        memcpy(out, pins, pinCount);
+        out += pinCount;
+
+        for (uint8_t i = 0; i < buffer.count; i++)
+        {
+            const StreamSample &sample = buffer.samples[i];
+
+            for (uint8_t shift = 0; shift < 32; shift += 8)
+            {
+                *out++ = (sample.timestamp >> shift) & 0xFF;
+            }
+
+            *out++ = sample.digital;
+
+            for (uint8_t slot = 0; slot < pinCount; slot++)
+            {
+                if (analogSlots & (1 << slot))
+                {
+                    *out++ = sample.analog[slot] & 0xFF;
+                    *out++ = sample.analog[slot] >> 8;
+                }
+            }
+        }
+
+        return length;
+    }
+
+    /**
+     * Publishes the frame of the buffer filled last, if any, and adapts
+     * the rate to the measured link capacity. Call it on every loop().
+     *
+     * @param link Network client of the MQTT client, for the link measure
+     * @param buffer Scratch buffer receiving the frame
+     * @return true if a frame was published
+     */
+    bool flush(MQTTClient &client, Client &link, const char *topic, char *buffer, size_t size)
+    {
+        if (!ready)
+        {
+            return false;
+        }
+
+        StreamBuffer &full = buffers[filling ^ 1];
+        size_t length = writeFrame(full, (uint8_t *)buffer, size);
+        bool sent = false;
+
+        full.count = 0;
+        ready = false;
+
+        if (length > 0 && client.connected())
+        {
+            if (windowSpace < 0)
+            {
+                startWindow(link);
+            }
+
+            sent = client.publish(topic, buffer, length);
+            measureLink(link, length, sent);
+            updateRate();
+        }
+
+        return sent;
+    }
+};
+
+#else
+
+/**
+ * Stand-in compiled when PIN_STREAMER is 0: no frame buffer is reserved
+ * and every stream is refused.
+ */
+class PinStreamer
+{
+public:
+    PinStreamer(AdcSampler &adcSampler)
+    {
+        (void)adcSampler;
+    }
+
+    uint16_t start(uint16_t requested, const uint8_t *streamPins, uint8_t count)
+    {
+        return 0;
+    }
+
+    void stop() {}
+
+    bool isStreaming() const
+    {
+        return false;
+    }
+
+    bool flush(MQTTClient &client, Client &link, const char *topic, char *buffer, size_t size)
+    {
+        return false;
+    }
+};
+
+#endif
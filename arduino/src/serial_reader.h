@@ -0,0 +1,195 @@
+#pragma once
+
+#include "hal.h"
+#include "default_constants.h"
+#include "payload_encoding.h"
+
+// First byte of a length-prefixed frame: 0x02, <length high>, <length low>, <MessagePack payload>
+#define SERIAL_FRAME_START 0x02
+
+typedef void (*SerialMessageHandler)(const char *payload, size_t length, PayloadEncoding encoding);
+
+/**
+ * Incremental reader of the serial command channel.
+ *
+ * Every poll() moves the bytes already received by the UART into a fixed
+ * ring buffer, and dispatches each complete message. Two framings are
+ * accepted on the same port:
+ *   - a JSON command terminated by a newline ("\n" or "\r\n")
+ *   - a MessagePack command prefixed by SERIAL_FRAME_START and its length
+ *
+ * poll() never waits for missing bytes, an incomplete message simply stays
+ * in the ring buffer until the next call.
+ */
+class SerialCommandReader
+{
+private:
+    static_assert((SERIAL_RING_BUFFER_SIZE & (SERIAL_RING_BUFFER_SIZE - 1)) == 0, "SERIAL_RING_BUFFER_SIZE must be a power of two");
+    static_assert(SERIAL_RING_BUFFER_SIZE <= 256, "SERIAL_RING_BUFFER_SIZE must fit 8 bit indexes");
+
+    uint8_t ring[SERIAL_RING_BUFFER_SIZE];
+    uint8_t head = 0;
+    uint8_t tail = 0;
+    uint16_t count = 0;
+
+    // Bytes already checked for a newline, so a long line is not rescanned on every poll
+    uint16_t scanned = 0;
+
+    // Set when a line overflowed the buffer: its remaining bytes are dropped up to the newline
+    bool discarding = false;
+
+    // A complete message is copied here, contiguous and null terminated, before dispatch
+    char message[SERIAL_RING_BUFFER_SIZE + 1];
+
+    uint8_t peekAt(uint16_t offset) const
+    {
+        return ring[(uint8_t)(tail + offset) & (SERIAL_RING_BUFFER_SIZE - 1)];
+    }
+
+    void consume(uint16_t bytes)
+    {
+        tail = (uint8_t)(tail + bytes) & (SERIAL_RING_BUFFER_SIZE - 1);
+        count -= bytes;
+        scanned = 0;
+    }
+
+    size_t copyMessage(uint16_t offset, uint16_t length)
+    {
+        for (uint16_t i = 0; i < length; i++)
+        {
+            message[i] = (char)peekAt(offset + i);
+        }
+
+        message[length] = 0;
+
+        return length;
+    }
+
+    /**
+     * Dispatches the message at the start of the ring buffer, if it is complete.
+     *
+     * @return false when more bytes are needed
+     */
+    bool dispatchNext(SerialMessageHandler handler)
+    {
+        if (count == 0)
+        {
+            return false;
+        }
+
+        if (discarding)
+        {
+            while (count > 0)
+            {
+                uint8_t c = peekAt(0);
+                consume(1);
+
+                if (c == '\n')
+                {
+                    discarding = false;
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        if (peekAt(0) == SERIAL_FRAME_START)
+        {
+            if (count < 3)
+            {
+                return false;
+            }
+
+            uint16_t length = ((uint16_t)peekAt(1) << 8) | peekAt(2);
+
+            if (length > SERIAL_RING_BUFFER_SIZE - 3)
+            {
+                Serial.println(F("ERROR: Serial frame larger than SERIAL_RING_BUFFER_SIZE"));
+
+                // Drop the start byte and look for the next message
+                consume(1);
+                return true;
+            }
+
+            if (count < 3 + length)
+            {
+                return false;
+            }
+
+            copyMessage(3, length);
+            consume(3 + length);
+
+            handler(message, length, PayloadEncoding::MSGPACK_ENCODING);
+            return true;
+        }
+
+        while (scanned < count && peekAt(scanned) != '\n')
+        {
+            scanned++;
+        }
+
+        if (scanned == count)
+        {
+            if (count == SERIAL_RING_BUFFER_SIZE)
+            {
+                Serial.println(F("ERROR: Serial command larger than SERIAL_RING_BUFFER_SIZE"));
+
+                consume(count);
+                discarding = true;
+            }
+
+            return false;
+        }
+
+        uint16_t length = scanned;
+
+        if (length > 0 && peekAt(length - 1) == '\r')
+        {
+            length--;
+        }
+
+        copyMessage(0, length);
+        consume(scanned + 1);
+
+        if (length > 0)
+        {
+            handler(message, length, PayloadEncoding::JSON_ENCODING);
+        }
+
+        return true;
+    }
+
+public:
+    /**
+     * Reads the bytes available on the stream without waiting, then
+     * dispatches every complete message.
+     *
+     * @param in Usually Serial
+     * @param handler Receives each message, null terminated
+     * @return The number of bytes read from the stream
+     */
+    size_t poll(Stream &in, SerialMessageHandler handler)
+    {
+        size_t received = 0;
+
+        do
+        {
+            while (count < SERIAL_RING_BUFFER_SIZE && in.available() > 0)
+            {
+                ring[head] = (uint8_t)in.read();
+                head = (uint8_t)(head + 1) & (SERIAL_RING_BUFFER_SIZE - 1);
+                count++;
+                received++;
+            }
+
+            while (dispatchNext(handler))
+            {
+            }
+
+            // Freeing space may allow reading the rest of a burst in the same pass
+        } while (count < SERIAL_RING_BUFFER_SIZE && in.available() > 0);
+
+        return received;
+    }
+};
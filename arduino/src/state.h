@@ -1,12 +1,22 @@
 #pragma once
 
 #include <ArduinoJson.h>
+#include "hal.h"
 #include "device_config.h"
-#include <MemoryFree.h>
+#include "payload_encoding.h"
+#include "state_changes.h"
+#include "adc_sampler.h"
+#include "edge_rules.h"
+#include "mqtt_topics.h"
+#include "payload_fragments.h"
+
+// Port ids returned by digitalPinToPort go from 1 (PA) to 12 (PL) on the Mega
+#define STATE_PORT_COUNT 13
 
 struct GlobalState_t
 {
-    int digitalPinsValues[NUM_DIGITAL_PINS];
+    // Input register (PINA..PINL) of every port, one bit per pin
+    uint8_t ports[STATE_PORT_COUNT];
 };
 
 enum GlobalStateChangeType
@@ -20,120 +30,487 @@ class GlobalStateProvider
 private:
     GlobalState_t state;
 
-    void sendMqttStateChangeMessage(
-        MQTTClient client,
-        String mqttTopic,
+    // Bits of each port that are reported when they change
+    uint8_t watchedPins[STATE_PORT_COUNT];
+
+    // Bits of each port wired to an Arduino pin, the others float
+    uint8_t mappedPins[STATE_PORT_COUNT];
+
+    // One bit per port id that exists on this board
+    uint16_t existingPorts;
+
+    StateChangeBatch pendingChanges;
+
+    // Changes are published on TOPIC_PUBLISH
+    const MqttTopics &topics;
+
+    // Parts of the status and advertise payloads that only change with the
+    // configuration or the ip address, see invalidateFragments()
+    PayloadFragment<FRAGMENT_DEVICE_SIZE> deviceFragment;
+    PayloadFragment<FRAGMENT_CONFIG_SIZE> configFragment;
+    PayloadFragment<FRAGMENT_ADVERTISE_SIZE> advertiseFragment;
+
+    template <typename TWriter>
+    static void writeStateChangeMessage(
+        TWriter &writer,
         GlobalStateChangeType changeType,
         int pinId,
         int previousValue,
         int currentValue)
     {
-        JsonDocument json;
-
-        json[F("pin")] = pinId;
-        json[F("previous")] = previousValue;
-        json[F("current")] = currentValue;
+        writer.beginObject(4);
+        writer.member(F("pin"), pinId);
+        writer.member(F("previous"), previousValue);
+        writer.member(F("current"), currentValue);
 
         switch (changeType)
         {
         case DIGITAL:
-            json[F("type")] = 1;
+            writer.member(F("type"), 1);
             break;
         case ANALOG:
-            json[F("t")] = 2;
+            writer.member(F("type"), 2);
             break;
         }
 
-        String jsonData = "";
-        serializeJson(json, jsonData);
+        writer.endObject();
+    }
+
+    void sendMqttStateChangeMessage(
+        MQTTClient &client,
+        const DeviceConfig &config,
+        GlobalStateChangeType changeType,
+        int pinId,
+        int previousValue,
+        int currentValue)
+    {
+        char payload[STATE_CHANGE_PAYLOAD_SIZE];
+        BufferPrint out(payload, sizeof(payload));
+
+        if (config.PAYLOAD_ENCODING == PayloadEncoding::MSGPACK_ENCODING)
+        {
+            MsgPackWriter writer(out);
+            writeStateChangeMessage(writer, changeType, pinId, previousValue, currentValue);
+        }
+        else
+        {
+            JsonWriter writer(out);
+            writeStateChangeMessage(writer, changeType, pinId, previousValue, currentValue);
+        }
+
+        client.publish(topics.get(TOPIC_PUBLISH), out.c_str(), out.length());
+    }
 
-        client.publish(mqttTopic, jsonData);
+    /**
+     * Publishes every pending change in a single message and empties the batch.
+     */
+    void flushStateChanges(MQTTClient &client, const DeviceConfig &config)
+    {
+        if (pendingChanges.isEmpty())
+        {
+            return;
+        }
+
+        char payload[STATE_CHANGE_PAYLOAD_SIZE];
+        BufferPrint out(payload, sizeof(payload));
+
+        if (config.PAYLOAD_ENCODING == PayloadEncoding::MSGPACK_ENCODING)
+        {
+            MsgPackWriter writer(out);
+            pendingChanges.write(writer);
+        }
+        else
+        {
+            JsonWriter writer(out);
+            pendingChanges.write(writer);
+        }
+
+        pendingChanges.clear();
+
+        if (out.overflowed())
+        {
+            Serial.println(F("ERROR: State changes do not fit in STATE_CHANGE_PAYLOAD_SIZE"));
+            return;
+        }
+
+        client.publish(topics.get(TOPIC_PUBLISH), out.c_str(), out.length());
     }
 
 public:
     /**
-     * Initializes the state with empty values to avoid null errors
+     * Finds the pin wired to a bit of a port. Only used when a change
+     * has been detected, so the scan itself never walks the pins.
      *
+     * @return The pin number, or -1 if no pin matches
      */
-    GlobalStateProvider()
+    int pinFromPort(uint8_t port, uint8_t bitMask)
     {
-        for (int i = 0; i < NUM_DIGITAL_PINS; i++)
+        for (int pin = 0; pin < NUM_DIGITAL_PINS; pin++)
+        {
+            if (digitalPinToPort(pin) == port && digitalPinToBitMask(pin) == bitMask)
+            {
+                return pin;
+            }
+        }
+
+        return -1;
+    }
+
+    /**
+     * Initializes the state with empty values to avoid null errors,
+     * and computes the port masks of the watched pins.
+     *
+     * @param topics The topics of the device, built on connection
+     */
+    GlobalStateProvider(const MqttTopics &topics) : topics(topics)
+    {
+        existingPorts = 0;
+
+        for (int i = 0; i < STATE_PORT_COUNT; i++)
+        {
+            state.ports[i] = 0;
+            watchedPins[i] = 0;
+            mappedPins[i] = 0;
+        }
+
+        for (int pin = 0; pin < NUM_DIGITAL_PINS; pin++)
+        {
+            uint8_t port = digitalPinToPort(pin);
+
+            if (port == NOT_A_PORT || port >= STATE_PORT_COUNT)
+            {
+                continue;
+            }
+
+            existingPorts |= (1U << port);
+            mappedPins[port] |= digitalPinToBitMask(pin);
+
+            if (pin >= STATE_FIRST_WATCHED_PIN && pin < STATE_LAST_WATCHED_PIN)
+            {
+                watchedPins[port] |= digitalPinToBitMask(pin);
+            }
+        }
+    }
+
+    /**
+     * @return The bits of a port that map to a digital pin
+     */
+    uint8_t mappedPinMask(uint8_t port) const
+    {
+        return port < STATE_PORT_COUNT ? mappedPins[port] : 0;
+    }
+
+    /**
+     * @return The last scanned value of a digital pin (0 or 1)
+     */
+    int digitalPinValue(int pin)
+    {
+        uint8_t port = digitalPinToPort(pin);
+
+        if (port == NOT_A_PORT || port >= STATE_PORT_COUNT)
         {
-            state.digitalPinsValues[i] = 0;
+            return 0;
         }
+
+        return (state.ports[port] & digitalPinToBitMask(pin)) ? 1 : 0;
     }
 
     /**
-     * This functions checks for any state changes, and sends
-     * a massage for each difference in the state.
+     * This functions checks for any state changes, and publishes them
+     * according to the configured STATE_PUBLISH_MODE: either a massage
+     * for each difference in the state, or one message for all the changes
+     * found during the coalescing window.
+     *
+     * Every port input register is read once, and the changed pins are
+     * found with a XOR against the previous scan. Edge rules run before
+     * anything is published, on every pin, watched or not.
      *
      * @param mqtt
+     * @param config
+     * @param rules The edge rules to evaluate, if any
+     * @return The number of watched pins that changed
      */
-    void computeStateChanges(MQTTClient mqtt, DeviceConfig config)
+    uint8_t computeStateChanges(MQTTClient &mqtt, const DeviceConfig &config, EdgeRules *rules = nullptr)
     {
-        // Check for changes in the pins
-        for (int i = 30; i < NUM_DIGITAL_PINS - NUM_ANALOG_INPUTS; i++)
+        unsigned long now = millis();
+        uint8_t changes = 0;
+
+        for (uint8_t port = 0; port < STATE_PORT_COUNT; port++)
+        {
+            if (!(existingPorts & (1U << port)))
+            {
+                continue;
+            }
+
+            uint8_t previous = state.ports[port];
+            uint8_t current = *portInputRegister(port);
+            uint8_t changed = (previous ^ current) & watchedPins[port];
+
+            state.ports[port] = current;
+
+            if (rules != nullptr && previous != current && rules->watchesPort(port))
+            {
+                rules->onPortChange(mqtt, config, port, previous, current, now);
+            }
+
+            // Nothing to report on this port, which is the common case
+            if (changed == 0)
+            {
+                continue;
+            }
+
+            for (uint8_t bitMask = 1; bitMask != 0; bitMask <<= 1)
+            {
+                if (!(changed & bitMask))
+                {
+                    continue;
+                }
+
+                int pin = pinFromPort(port, bitMask);
+                int previousValue = (previous & bitMask) ? 1 : 0;
+                int currentValue = (current & bitMask) ? 1 : 0;
+
+                changes++;
+
+                if (config.STATE_PUBLISH_MODE == StatePublishMode::PER_PIN)
+                {
+                    sendMqttStateChangeMessage(
+                        mqtt,
+                        config,
+                        GlobalStateChangeType::DIGITAL,
+                        pin,
+                        previousValue,
+                        currentValue);
+
+                    continue;
+                }
+
+                if (pendingChanges.isFull())
+                {
+                    flushStateChanges(mqtt, config);
+                }
+
+                pendingChanges.add(pin, currentValue, now);
+            }
+        }
+
+        if (pendingChanges.isDue(now, config.STATE_COALESCE_WINDOW))
         {
-            int pinPreviousValue = state.digitalPinsValues[i];
-            int pinCurrentValue = digitalRead(i);
+            flushStateChanges(mqtt, config);
+        }
 
-            Serial.println(freeMemory());
+        return changes;
+    }
+
+    /**
+     * Publishes the analog inputs that moved by more than the deadband
+     * since the last report, one message per change: batches only carry
+     * digital values.
+     *
+     * @param rules The edge rules to evaluate, if any
+     * @return The number of changes published
+     */
+    uint8_t publishAnalogChanges(MQTTClient &mqtt, const DeviceConfig &config, AdcSampler &sampler, EdgeRules *rules = nullptr)
+    {
+        AdcChange change;
+        uint8_t published = 0;
 
-            if (pinCurrentValue != pinPreviousValue)
+        while (sampler.nextChange(change))
+        {
+            if (rules != nullptr)
             {
-                sendMqttStateChangeMessage(
-                    mqtt,
-                    "ardu-test/publish",
-                    GlobalStateChangeType::DIGITAL,
-                    i,
-                    state.digitalPinsValues[i],
-                    pinCurrentValue);
+                rules->onAnalogChange(mqtt, config, change.channel, change.previous, change.current, millis());
             }
 
-            state.digitalPinsValues[i] = pinCurrentValue;
+            sendMqttStateChangeMessage(
+                mqtt,
+                config,
+                GlobalStateChangeType::ANALOG,
+                AdcSampler::channelPin(change.channel),
+                change.previous,
+                change.current);
+
+            published++;
         }
+
+        return published;
     }
 
-    String generateJsonState(DeviceConfig deviceConfig, IPAddress localIp)
+    /**
+     * Drops the pre-serialized payload parts. Call it whenever the
+     * configuration is saved or the ip address changes: the parts are
+     * rendered again by the next payload.
+     */
+    void invalidateFragments()
     {
-        JsonDocument json;
+        deviceFragment.invalidate();
+        configFragment.invalidate();
+        advertiseFragment.invalidate();
+    }
 
-        json[F("device")][F("free_memory")] = freeMemory();
-        json[F("device")][F("id")] = deviceConfig.DEVICE_UNIQUE_ID;
-        json[F("device")][F("version")] = VERSION;
-        json[F("device")][F("free_memory")] = freeMemory();
+    /**
+     * @return The last scanned state of every port
+     */
+    const GlobalState_t &getState() const
+    {
+        return state;
+    }
+
+    template <typename TWriter>
+    void writeDeviceSection(TWriter &writer, const DeviceConfig &deviceConfig, int freeBytes)
+    {
+        writer.key(F("device"));
+        writer.beginObject(3);
+        writer.member(F("free_memory"), freeBytes);
+        deviceFragment.write(writer, deviceConfig.PAYLOAD_ENCODING, [&deviceConfig](TWriter &fragment)
+                             {
+                                 fragment.member(F("id"), deviceConfig.DEVICE_UNIQUE_ID);
+                                 fragment.member(F("version"), VERSION); });
+        writer.endObject();
+    }
+
+    template <typename TWriter>
+    void writeHttpSection(TWriter &writer, const DeviceConfig &deviceConfig, IPAddress localIp)
+    {
+        writer.key(F("http"));
+        writer.beginObject(2);
+        writer.member(F("ip"), localIp);
+        writer.member(F("port"), deviceConfig.HTTP_SERVER_PORT);
+        writer.endObject();
+    }
+
+    template <typename TWriter>
+    void writeMqttSection(TWriter &writer, const DeviceConfig &deviceConfig)
+    {
+        writer.key(F("mqtt"));
+        writer.beginObject(4);
+        writer.member(F("host"), deviceConfig.MQTT_SERVER_HOST);
+        writer.member(F("id"), deviceConfig.MQTT_DEVICE_ID);
+        writer.member(F("keepalive"), deviceConfig.MQTT_KEEPALIVE);
+        writer.member(F("timeout"), deviceConfig.MQTT_TIMEOUT);
+        writer.endObject();
+    }
 
-        json[F("http")][F("ip")] = localIp;
-        json[F("http")][F("port")] = deviceConfig.HTTP_SERVER_PORT;
+    /**
+     * Writes the "http" and "mqtt" sections, from the cached fragment when possible.
+     */
+    template <typename TWriter>
+    void writeConfigSections(TWriter &writer, const DeviceConfig &deviceConfig, IPAddress localIp)
+    {
+        configFragment.write(writer, deviceConfig.PAYLOAD_ENCODING, [this, &deviceConfig, &localIp](TWriter &fragment)
+                             {
+                                 writeHttpSection(fragment, deviceConfig, localIp);
+                                 writeMqttSection(fragment, deviceConfig); });
+    }
 
-        json[F("mqtt")][F("host")] = deviceConfig.MQTT_SERVER_HOST;
-        json[F("mqtt")][F("id")] = deviceConfig.MQTT_DEVICE_ID;
-        json[F("mqtt")][F("keepalive")] = deviceConfig.MQTT_KEEPALIVE;
-        json[F("mqtt")][F("timeout")] = deviceConfig.MQTT_TIMEOUT;
+    template <typename TWriter>
+    void writeDigitalSection(TWriter &writer)
+    {
+        writer.key(F("digital"));
+        writer.beginObject(1);
+        writer.key(F("values"));
+        writer.beginArray(NUM_DIGITAL_PINS);
 
         for (int i = 0; i < NUM_DIGITAL_PINS; i++)
         {
-            json[F("digital")][F("values")][i] = state.digitalPinsValues[i];
+            writer.value(digitalPinValue(i));
+        }
+
+        writer.endArray();
+        writer.endObject();
+    }
+
+    /**
+     * Streams the device status into any Print (HTTP response, MQTT
+     * payload buffer, ...), without building a JsonDocument nor a String.
+     *
+     * @param out Destination of the payload
+     * @param encoding JSON or MessagePack
+     * @param deviceConfig The current device configuration
+     * @param localIp The current ip address
+     * @param freeBytes Free memory sampled by the caller, so a measure and a write report the same value
+     * @return The number of bytes written
+     */
+    size_t writeState(Print &out, PayloadEncoding encoding, const DeviceConfig &deviceConfig, IPAddress localIp, int freeBytes)
+    {
+        if (encoding == PayloadEncoding::MSGPACK_ENCODING)
+        {
+            MsgPackWriter writer(out);
+            return writeState(writer, deviceConfig, localIp, freeBytes);
+        }
+
+        JsonWriter writer(out);
+        return writeState(writer, deviceConfig, localIp, freeBytes);
+    }
+
+    template <typename TWriter>
+    size_t writeState(TWriter &writer, const DeviceConfig &deviceConfig, IPAddress localIp, int freeBytes)
+    {
+        writer.beginObject(4);
+        writeDeviceSection(writer, deviceConfig, freeBytes);
+        writeConfigSections(writer, deviceConfig, localIp);
+        writeDigitalSection(writer);
+        writer.endObject();
+
+        return writer.size();
+    }
+
+    size_t writeJsonState(Print &out, const DeviceConfig &deviceConfig, IPAddress localIp, int freeBytes)
+    {
+        return writeState(out, PayloadEncoding::JSON_ENCODING, deviceConfig, localIp, freeBytes);
+    }
+
+    /**
+     * @return The length of the payload written by writeState with the same arguments
+     */
+    size_t measureState(PayloadEncoding encoding, const DeviceConfig &deviceConfig, IPAddress localIp, int freeBytes)
+    {
+        CountingPrint counter;
+        return writeState(counter, encoding, deviceConfig, localIp, freeBytes);
+    }
+
+    size_t measureJsonState(const DeviceConfig &deviceConfig, IPAddress localIp, int freeBytes)
+    {
+        return measureState(PayloadEncoding::JSON_ENCODING, deviceConfig, localIp, freeBytes);
+    }
+
+    /**
+     * Streams the advertise message into any Print.
+     *
+     * @return The number of bytes written
+     */
+    size_t writeAdvertise(Print &out, PayloadEncoding encoding, const DeviceConfig &deviceConfig, IPAddress localIp)
+    {
+        if (encoding == PayloadEncoding::MSGPACK_ENCODING)
+        {
+            MsgPackWriter writer(out);
+            return writeAdvertise(writer, deviceConfig, localIp);
         }
 
-        String jsonData = "";
-        serializeJson(json, jsonData);
-        return jsonData;
+        JsonWriter writer(out);
+        return writeAdvertise(writer, deviceConfig, localIp);
     }
 
-    String generateJsonAdvertise(DeviceConfig deviceConfig, IPAddress localIp)
+    template <typename TWriter>
+    size_t writeAdvertise(TWriter &writer, const DeviceConfig &deviceConfig, IPAddress localIp)
     {
-        JsonDocument json;
+        // Nothing in the advertise message is dynamic, the whole message is a fragment
+        advertiseFragment.write(writer, deviceConfig.PAYLOAD_ENCODING, [&deviceConfig, &localIp](TWriter &fragment)
+                                {
+                                    fragment.beginObject(6);
+                                    fragment.member(F("id"), deviceConfig.DEVICE_UNIQUE_ID);
+                                    fragment.member(F("fw_version"), VERSION);
+                                    fragment.member(F("cf_version"), deviceConfig.DEVICE_CONFIG_VERSION);
+                                    fragment.member(F("serial_speed"), (unsigned long)SERIAL_CONNECTION_SPEED);
+                                    fragment.member(F("ip"), localIp);
+                                    fragment.member(F("http_port"), deviceConfig.HTTP_SERVER_PORT);
+                                    fragment.endObject(); });
 
-        json[F("id")] = deviceConfig.DEVICE_UNIQUE_ID;
-        json[F("fw_version")] = VERSION;
-        json[F("cf_version")] = deviceConfig.DEVICE_CONFIG_VERSION;
-        json[F("serial_speed")] = SERIAL_CONNECTION_SPEED;
-        json[F("ip")] = localIp;
-        json[F("http_port")] = deviceConfig.HTTP_SERVER_PORT;
+        return writer.size();
+    }
 
-        String jsonData = "";
-        serializeJson(json, jsonData);
-        return jsonData;
+    size_t writeJsonAdvertise(Print &out, const DeviceConfig &deviceConfig, IPAddress localIp)
+    {
+        return writeAdvertise(out, PayloadEncoding::JSON_ENCODING, deviceConfig, localIp);
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "hal.h"
+#include "payload_encoding.h"
+
+enum StatePublishMode
+{
+    // One MQTT message per changed pin
+    PER_PIN = 0,
+    // Changes collected during a scan (or a coalescing window) in a single message
+    BATCHED = 1,
+};
+
+struct StateChange
+{
+    uint8_t pin;
+    uint8_t value;
+    unsigned long timestamp;
+};
+
+/**
+ * Fixed-capacity collection of the pin changes waiting to be published.
+ */
+class StateChangeBatch
+{
+private:
+    StateChange changes[STATE_CHANGE_BATCH_SIZE];
+    uint8_t count = 0;
+
+public:
+    /**
+     * @return false if the batch is full and must be flushed first
+     */
+    bool add(uint8_t pin, uint8_t value, unsigned long timestamp)
+    {
+        if (count >= STATE_CHANGE_BATCH_SIZE)
+        {
+            return false;
+        }
+
+        changes[count].pin = pin;
+        changes[count].value = value;
+        changes[count].timestamp = timestamp;
+        count++;
+
+        return true;
+    }
+
+    bool isEmpty() const
+    {
+        return count == 0;
+    }
+
+    bool isFull() const
+    {
+        return count >= STATE_CHANGE_BATCH_SIZE;
+    }
+
+    /**
+     * The batch is due once the oldest change is older than the coalescing window.
+     * A window of 0 flushes at the end of every scan.
+     */
+    bool isDue(unsigned long now, unsigned long window) const
+    {
+        return count > 0 && now - changes[0].timestamp >= window;
+    }
+
+    void clear()
+    {
+        count = 0;
+    }
+
+    /**
+     * Writes the batch as {"type":1,"changes":[[pin,value,millis],...]}
+     * with a JsonWriter or a MsgPackWriter.
+     *
+     * @return The number of bytes written
+     */
+    template <typename TWriter>
+    size_t write(TWriter &writer) const
+    {
+        writer.beginObject(2);
+        writer.member(F("type"), 1);
+        writer.key(F("changes"));
+        writer.beginArray(count);
+
+        for (uint8_t i = 0; i < count; i++)
+        {
+            writer.beginArray(3);
+            writer.value((int)changes[i].pin);
+            writer.value((int)changes[i].value);
+            writer.value(changes[i].timestamp);
+            writer.endArray();
+        }
+
+        writer.endArray();
+        writer.endObject();
+
+        return writer.size();
+    }
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <ArduinoJson.h>
+#include "hal.h"
+
+/**
+ * ArduinoJson allocator backed by a fixed buffer instead of the heap.
+ *
+ * Blocks are handed out sequentially (bump allocation). Only the most recent
+ * block can be grown, shrunk or released in place, which matches the way a
+ * JsonDocument uses its memory while parsing a single message. Call reset()
+ * once the document has been destroyed to reuse the whole buffer.
+ *
+ * When the buffer is exhausted allocate() returns nullptr and ArduinoJson
+ * reports DeserializationError::NoMemory.
+ */
+template <size_t CAPACITY>
+class StaticPoolAllocator : public ArduinoJson::Allocator
+{
+private:
+    // Every block is preceded by its size, so it can be copied when it moves
+    struct BlockHeader
+    {
+        size_t size;
+    };
+
+    static const size_t ALIGNMENT = sizeof(void *);
+
+    alignas(void *) uint8_t pool[CAPACITY];
+    size_t used = 0;
+    uint8_t *lastBlock = nullptr;
+
+    static size_t align(size_t size)
+    {
+        return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    static BlockHeader *headerOf(void *ptr)
+    {
+        return reinterpret_cast<BlockHeader *>(static_cast<uint8_t *>(ptr) - align(sizeof(BlockHeader)));
+    }
+
+public:
+    void *allocate(size_t size) override
+    {
+        size_t required = align(sizeof(BlockHeader)) + align(size);
+
+        if (used + required > CAPACITY)
+        {
+            return nullptr;
+        }
+
+        uint8_t *block = pool + used + align(sizeof(BlockHeader));
+        reinterpret_cast<BlockHeader *>(pool + used)->size = size;
+
+        used += required;
+        lastBlock = block;
+
+        return block;
+    }
+
+    void deallocate(void *ptr) override
+    {
+        // Only the last block can be given back, the rest is freed by reset()
+        if (ptr != nullptr && ptr == lastBlock)
+        {
+            used = static_cast<uint8_t *>(ptr) - pool - align(sizeof(BlockHeader));
+            lastBlock = nullptr;
+        }
+    }
+
+    void *reallocate(void *ptr, size_t newSize) override
+    {
+        if (ptr == nullptr)
+        {
+            return allocate(newSize);
+        }
+
+        BlockHeader *header = headerOf(ptr);
+
+        // The last block can be resized in place
+        if (ptr == lastBlock)
+        {
+            size_t blockStart = static_cast<uint8_t *>(ptr) - pool;
+
+            if (blockStart + align(newSize) > CAPACITY)
+            {
+                return nullptr;
+            }
+
+            header->size = newSize;
+            used = blockStart + align(newSize);
+            return ptr;
+        }
+
+        void *moved = allocate(newSize);
+
+        if (moved != nullptr)
+        {
+            memcpy(moved, ptr, header->size < newSize ? header->size : newSize);
+        }
+
+        return moved;
+    }
+
+    /**
+     * Releases every block at once.
+     */
+    void reset()
+    {
+        used = 0;
+        lastBlock = nullptr;
+    }
+
+    size_t size() const
+    {
+        return used;
+    }
+};
@@ -0,0 +1,252 @@
+#pragma once
+
+#include "hal.h"
+#include "device_config.h"
+#include "state.h"
+#include "payload_encoding.h"
+
+/**
+ * Values of the last published status, used to compute the next delta.
+ */
+struct StatusSnapshot
+{
+    uint8_t ports[STATE_PORT_COUNT];
+    int freeMemory;
+    IPAddress ip;
+    uint32_t configFingerprint;
+};
+
+/**
+ * Delta-encoded status telemetry.
+ *
+ * Every message carries a sequence number ("seq") so consumers can detect
+ * gaps, and a "keyframe" flag. A keyframe contains the whole status; a delta
+ * only the sections that changed since the last published message:
+ *
+ *   {"seq":12,"keyframe":false,"device":{"free_memory":1520},"digital":{"changes":[[31,1]]}}
+ *
+ * A keyframe is sent every STATUS_KEYFRAME_INTERVAL messages, after a failed
+ * publish, or when a consumer asks for one (STATUS_KEYFRAME command).
+ */
+class StatusTelemetry
+{
+private:
+    StatusSnapshot lastPublished;
+    StatusSnapshot pending;
+    bool hasSnapshot = false;
+    bool keyframeRequested = false;
+    bool pendingKeyframe = false;
+    uint32_t sequence = 0;
+    int messagesSinceKeyframe = 0;
+
+    static uint32_t hashBytes(uint32_t hash, const char *str)
+    {
+        while (*str != 0)
+        {
+            hash = (hash ^ (uint8_t)*str++) * 16777619UL;
+        }
+
+        return hash;
+    }
+
+    /**
+     * FNV-1a over the config fields reported in the status, used to detect
+     * a configuration change without keeping a copy of it.
+     */
+    static uint32_t fingerprint(const DeviceConfig &config)
+    {
+        uint32_t hash = 2166136261UL;
+        int values[] = {config.HTTP_SERVER_PORT, config.MQTT_KEEPALIVE, config.MQTT_TIMEOUT};
+
+        hash = hashBytes(hash, config.MQTT_SERVER_HOST);
+        hash = hashBytes(hash, config.MQTT_DEVICE_ID);
+
+        for (int value : values)
+        {
+            hash = (hash ^ (uint32_t)value) * 16777619UL;
+        }
+
+        return hash;
+    }
+
+    /**
+     * @return The number of pins that changed since the last published
+     * status, the port bits without a pin are ignored
+     */
+    size_t countDigitalChanges(const GlobalStateProvider &stateProvider) const
+    {
+        size_t count = 0;
+
+        for (uint8_t port = 0; port < STATE_PORT_COUNT; port++)
+        {
+            uint8_t changed = (pending.ports[port] ^ lastPublished.ports[port]) & stateProvider.mappedPinMask(port);
+
+            for (; changed != 0; changed &= changed - 1)
+            {
+                count++;
+            }
+        }
+
+        return count;
+    }
+
+    template <typename TWriter>
+    void writeDigitalChanges(TWriter &writer, GlobalStateProvider &stateProvider, size_t changes)
+    {
+        writer.key(F("digital"));
+        writer.beginObject(1);
+        writer.key(F("changes"));
+        writer.beginArray(changes);
+
+        for (uint8_t port = 0; port < STATE_PORT_COUNT; port++)
+        {
+            uint8_t changed = (pending.ports[port] ^ lastPublished.ports[port]) & stateProvider.mappedPinMask(port);
+
+            for (uint8_t bitMask = 1; changed != 0 && bitMask != 0; bitMask <<= 1)
+            {
+                if (!(changed & bitMask))
+                {
+                    continue;
+                }
+
+                writer.beginArray(2);
+                writer.value(stateProvider.pinFromPort(port, bitMask));
+                writer.value((pending.ports[port] & bitMask) ? 1 : 0);
+                writer.endArray();
+            }
+        }
+
+        writer.endArray();
+        writer.endObject();
+    }
+
+    template <typename TWriter>
+    size_t writeStatus(
+        TWriter &writer,
+        GlobalStateProvider &stateProvider,
+        const DeviceConfig &deviceConfig,
+        IPAddress localIp,
+        int freeBytes)
+    {
+        bool memoryChanged = pending.freeMemory != lastPublished.freeMemory;
+        bool configChanged = pending.configFingerprint != lastPublished.configFingerprint;
+        bool httpChanged = !(pending.ip == lastPublished.ip) || configChanged;
+        size_t digitalChanges = countDigitalChanges(stateProvider);
+
+        if (pendingKeyframe)
+        {
+            writer.beginObject(6);
+            writer.member(F("seq"), (unsigned long)sequence);
+            writer.member(F("keyframe"), true);
+            stateProvider.writeDeviceSection(writer, deviceConfig, freeBytes);
+            stateProvider.writeConfigSections(writer, deviceConfig, localIp);
+            stateProvider.writeDigitalSection(writer);
+            writer.endObject();
+
+            return writer.size();
+        }
+
+        writer.beginObject(2 + memoryChanged + httpChanged + configChanged + (digitalChanges > 0));
+        writer.member(F("seq"), (unsigned long)sequence);
+        writer.member(F("keyframe"), false);
+
+        if (memoryChanged)
+        {
+            writer.key(F("device"));
+            writer.beginObject(1);
+            writer.member(F("free_memory"), freeBytes);
+            writer.endObject();
+        }
+
+        if (httpChanged)
+        {
+            stateProvider.writeHttpSection(writer, deviceConfig, localIp);
+        }
+
+        if (configChanged)
+        {
+            stateProvider.writeMqttSection(writer, deviceConfig);
+        }
+
+        if (digitalChanges > 0)
+        {
+            writeDigitalChanges(writer, stateProvider, digitalChanges);
+        }
+
+        writer.endObject();
+
+        return writer.size();
+    }
+
+public:
+    /**
+     * Forces the next message to be a keyframe.
+     */
+    void requestKeyframe()
+    {
+        keyframeRequested = true;
+    }
+
+    /**
+     * Writes the next status message (keyframe or delta) into the Print.
+     * The snapshot is only updated once the caller confirms the publish
+     * through published().
+     *
+     * @return The number of bytes written
+     */
+    size_t writeStatus(
+        Print &out,
+        PayloadEncoding encoding,
+        GlobalStateProvider &stateProvider,
+        const DeviceConfig &deviceConfig,
+        IPAddress localIp,
+        int freeBytes)
+    {
+        memcpy(pending.ports, stateProvider.getState().ports, sizeof(pending.ports));
+        pending.freeMemory = freeBytes;
+        pending.ip = localIp;
+        pending.configFingerprint = fingerprint(deviceConfig);
+
+        pendingKeyframe = !hasSnapshot ||
+                          keyframeRequested ||
+                          messagesSinceKeyframe >= deviceConfig.STATUS_KEYFRAME_INTERVAL;
+
+        if (encoding == PayloadEncoding::MSGPACK_ENCODING)
+        {
+            MsgPackWriter writer(out);
+            return writeStatus(writer, stateProvider, deviceConfig, localIp, freeBytes);
+        }
+
+        JsonWriter writer(out);
+        return writeStatus(writer, stateProvider, deviceConfig, localIp, freeBytes);
+    }
+
+    /**
+     * Commits the message written by writeStatus.
+     *
+     * @param success Whether the message reached the broker. On failure the
+     *                next message is a keyframe, so consumers resynchronize.
+     */
+    void published(bool success)
+    {
+        if (!success)
+        {
+            keyframeRequested = true;
+            return;
+        }
+
+        lastPublished = pending;
+        hasSnapshot = true;
+        sequence++;
+
+        if (pendingKeyframe)
+        {
+            keyframeRequested = false;
+            messagesSinceKeyframe = 0;
+        }
+        else
+        {
+            messagesSinceKeyframe++;
+        }
+    }
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include "hal.h"
+#include "default_constants.h"
+#include "device_config.h"
+
+/**
+ * The periodic publications paced by the TelemetryScheduler.
+ */
+enum TelemetryTask : uint8_t
+{
+    TELEMETRY_STATUS,
+    TELEMETRY_METRICS,
+    TELEMETRY_PROFILE,
+    TELEMETRY_TASK_COUNT,
+};
+
+/**
+ * Periods of the telemetry tasks, so a fleet does not publish in lockstep
+ * and a struggling device or link is not pushed harder.
+ *
+ * The tasks stay TaskScheduler tasks: main.cpp enables each one after
+ * phase() and, once it ran, delays it by nextDelay(). On top of the
+ * configured period:
+ *
+ * - the first run is offset by a phase derived from the board unique id,
+ *   so devices powered up together spread over a whole period, and every
+ *   period gets a random jitter of +/- 1/16 so they do not line up again;
+ * - every failed publish doubles the period of the task, up to
+ *   TELEMETRY_MAX_BACKOFF_SHIFT, and a success restores it;
+ * - while the average loop() duration stays above TELEMETRY_LATENCY_LIMIT
+ *   every period is doubled (quadrupled above 4 times the limit);
+ * - the status uses STATUS_ACTIVE_INTERVAL for TELEMETRY_ACTIVE_WINDOW
+ *   after a pin changed.
+ */
+class TelemetryScheduler
+{
+private:
+    // Configured periods, in milliseconds
+    unsigned long intervals[TELEMETRY_TASK_COUNT];
+    unsigned long activeInterval = 0;
+    unsigned long scanInterval = DEFAULT_STATE_SCAN_INTERVAL;
+
+    uint8_t failures[TELEMETRY_TASK_COUNT];
+
+    // Moving average of the loop() duration, in microseconds
+    unsigned long loopLatency = 0;
+
+    bool active = false;
+    unsigned long lastActivity = 0;
+
+    uint8_t loadShift() const
+    {
+        if (loopLatency >= 4 * TELEMETRY_LATENCY_LIMIT)
+        {
+            return 2;
+        }
+
+        return loopLatency >= TELEMETRY_LATENCY_LIMIT ? 1 : 0;
+    }
+
+public:
+    TelemetryScheduler()
+    {
+        intervals[TELEMETRY_STATUS] = DEFAULT_STATUS_INTERVAL * 1000UL;
+        intervals[TELEMETRY_METRICS] = DEFAULT_METRICS_INTERVAL * 1000UL;
+        intervals[TELEMETRY_PROFILE] = PROFILE_PUBLISH_INTERVAL;
+        memset(failures, 0, sizeof(failures));
+    }
+
+    /**
+     * Applies the periods of a configuration. The tasks pick them up
+     * at their next run.
+     */
+    void configure(const DeviceConfig &config)
+    {
+        intervals[TELEMETRY_STATUS] = config.STATUS_INTERVAL * 1000UL;
+        intervals[TELEMETRY_METRICS] = config.METRICS_INTERVAL * 1000UL;
+        activeInterval = config.STATUS_ACTIVE_INTERVAL * 1000UL;
+        scanInterval = config.STATE_SCAN_INTERVAL;
+    }
+
+    /**
+     * @return The delay before the first run of a task, between 0 and its
+     * period, the same on every boot of the board
+     */
+    unsigned long phase(TelemetryTask task) const
+    {
+        return ((uniqueIdHash() ^ task) * 16777619UL) % intervals[task];
+    }
+
+    /**
+     * @return The delay before the next run of a task that just ran
+     */
+    unsigned long nextDelay(TelemetryTask task, unsigned long now)
+    {
+        unsigned long period = intervals[task];
+
+        if (task == TELEMETRY_STATUS && activeInterval > 0 && activeInterval < period && isActive(now))
+        {
+            period = activeInterval;
+        }
+
+        uint8_t shift = failures[task] + loadShift();
+
+        period <<= shift < TELEMETRY_MAX_BACKOFF_SHIFT ? shift : TELEMETRY_MAX_BACKOFF_SHIFT;
+
+        return period - period / 16 + random(period / 8 + 1);
+    }
+
+    /**
+     * Records the outcome of a publish of the task.
+     */
+    void published(TelemetryTask task, bool success)
+    {
+        if (success)
+        {
+            failures[task] = 0;
+        }
+        else if (failures[task] < TELEMETRY_MAX_BACKOFF_SHIFT)
+        {
+            failures[task]++;
+        }
+    }
+
+    /**
+     * Forgets the failed publishes, once the connection is back.
+     */
+    void resetBackoff()
+    {
+        memset(failures, 0, sizeof(failures));
+    }
+
+    /**
+     * Records the duration of a loop() pass.
+     */
+    void recordLoop(unsigned long elapsed)
+    {
+        // Moving average, an eighth of the new measure
+        loopLatency = loopLatency - loopLatency / 8 + elapsed / 8;
+    }
+
+    /**
+     * Records that pins changed.
+     *
+     * @return true if the pins were idle until then, the status task
+     * should then be rescheduled with nextDelay()
+     */
+    bool onPinActivity(unsigned long now)
+    {
+        bool started = !isActive(now);
+
+        active = true;
+        lastActivity = now;
+
+        return started && activeInterval > 0;
+    }
+
+    bool isActive(unsigned long now)
+    {
+        if (active && now - lastActivity >= TELEMETRY_ACTIVE_WINDOW)
+        {
+            active = false;
+        }
+
+        return active;
+    }
+
+    /**
+     * @return The period of the state scan, in milliseconds
+     */
+    unsigned long getScanInterval() const
+    {
+        return scanInterval;
+    }
+
+    unsigned long getLoopLatency() const
+    {
+        return loopLatency;
+    }
+};
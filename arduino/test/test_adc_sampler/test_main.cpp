@@ -0,0 +1,138 @@
+#include <unity.h>
+#include "hal.h"
+#include "state.h"
+#include "adc_sampler.h"
+
+AdcSampler sampler;
+MqttTopics topics;
+DeviceConfig deviceConfig;
+
+void setUp(void)
+{
+    HalMock::reset();
+
+    memset(&deviceConfig, 0, sizeof(deviceConfig));
+    deviceConfig.PAYLOAD_ENCODING = PayloadEncoding::JSON_ENCODING;
+    // A0 and A2, 4 conversions per sample
+    deviceConfig.ANALOG_CHANNELS = 0x05;
+    deviceConfig.ANALOG_DEADBAND = 8;
+    deviceConfig.ANALOG_OVERSAMPLING = 4;
+    strlcpy(deviceConfig.MQTT_TOPIC_PREFIX, "fleet", sizeof(deviceConfig.MQTT_TOPIC_PREFIX));
+    strlcpy(deviceConfig.MQTT_DEVICE_ID, "dev", sizeof(deviceConfig.MQTT_DEVICE_ID));
+    topics.build(deviceConfig);
+    sampler.begin(deviceConfig);
+
+    // Discarded, like the first conversion of A0 on the board
+    sampler.onConversion(0);
+}
+
+void tearDown(void)
+{
+}
+
+/**
+ * Simulates the interrupts of the conversions of every monitored channel,
+ * the conversion values being (in order) the ones of A0 and A2.
+ */
+void convert(uint16_t a0, uint16_t a2)
+{
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        sampler.onConversion(a0);
+        sampler.onConversion(a2);
+    }
+}
+
+void test_conversions_are_decimated_per_channel(void)
+{
+    // A0 alternates 100 and 104, the average of 4 conversions is 102
+    for (uint8_t i = 0; i < 2; i++)
+    {
+        sampler.onConversion(100);
+        sampler.onConversion(500);
+        sampler.onConversion(104);
+        sampler.onConversion(500);
+    }
+
+    TEST_ASSERT_EQUAL_INT(102, sampler.read(0));
+    TEST_ASSERT_EQUAL_INT(500, sampler.read(PIN_A0 + 2));
+}
+
+void test_changes_within_deadband_are_ignored(void)
+{
+    AdcChange change;
+
+    // The first samples are the baseline
+    convert(100, 500);
+    TEST_ASSERT_FALSE(sampler.nextChange(change));
+
+    convert(108, 495);
+    TEST_ASSERT_FALSE(sampler.nextChange(change));
+
+    convert(109, 495);
+    TEST_ASSERT_TRUE(sampler.nextChange(change));
+    TEST_ASSERT_EQUAL_UINT(0, change.channel);
+    TEST_ASSERT_EQUAL_UINT(100, change.previous);
+    TEST_ASSERT_EQUAL_UINT(109, change.current);
+    TEST_ASSERT_FALSE(sampler.nextChange(change));
+}
+
+void test_only_the_newest_sample_is_compared(void)
+{
+    AdcChange change;
+
+    convert(100, 500);
+    TEST_ASSERT_FALSE(sampler.nextChange(change));
+    TEST_ASSERT_EQUAL_UINT32(0, sampler.droppedSamples());
+
+    // Three samples per channel before the next scan, two are replaced
+    convert(300, 500);
+    convert(200, 500);
+    convert(104, 500);
+
+    TEST_ASSERT_EQUAL_UINT32(4, sampler.droppedSamples());
+    TEST_ASSERT_FALSE(sampler.nextChange(change));
+
+    convert(120, 500);
+    TEST_ASSERT_TRUE(sampler.nextChange(change));
+    TEST_ASSERT_EQUAL_UINT(100, change.previous);
+    TEST_ASSERT_EQUAL_UINT(120, change.current);
+}
+
+void test_unmonitored_channel_is_read_directly(void)
+{
+    HalMock::setAnalogInput(1, 321);
+
+    TEST_ASSERT_EQUAL_INT(321, sampler.read(1));
+}
+
+void test_analog_changes_are_published(void)
+{
+    GlobalStateProvider stateProvider(topics);
+    MQTTClient mqtt;
+    MockClient netClient;
+
+    mqtt.begin("broker", netClient);
+    mqtt.connect("test");
+
+    // The first scan reads the baseline
+    convert(100, 500);
+    TEST_ASSERT_EQUAL_UINT(0, stateProvider.publishAnalogChanges(mqtt, deviceConfig, sampler));
+
+    convert(100, 600);
+
+    TEST_ASSERT_EQUAL_UINT(1, stateProvider.publishAnalogChanges(mqtt, deviceConfig, sampler));
+    TEST_ASSERT_EQUAL_STRING("fleet/dev/publish", mqtt.lastTopic);
+    TEST_ASSERT_EQUAL_STRING("{\"pin\":56,\"previous\":500,\"current\":600,\"type\":2}", mqtt.lastPayload);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_conversions_are_decimated_per_channel);
+    RUN_TEST(test_changes_within_deadband_are_ignored);
+    RUN_TEST(test_only_the_newest_sample_is_compared);
+    RUN_TEST(test_unmonitored_channel_is_read_directly);
+    RUN_TEST(test_analog_changes_are_published);
+    return UNITY_END();
+}
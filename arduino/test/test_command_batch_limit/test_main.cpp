@@ -0,0 +1,88 @@
+// Same ArduinoJson layout as on the board: 1-byte slot ids, 16-slot pools
+#define ARDUINOJSON_SLOT_ID_SIZE 1
+#define ARDUINOJSON_POOL_CAPACITY 16
+// The pool of the board, scaled to the host pointers: slots, string nodes
+// and block headers are made of pointers and size_t
+#define COMMAND_JSON_POOL_SIZE (COMMAND_JSON_BOARD_POOL_SIZE * sizeof(void *) / 2)
+
+#include <unity.h>
+#include "hal.h"
+#include "commands.h"
+
+DeviceConfigProvider deviceConfigProvider;
+DeviceConfig deviceConfig;
+ConfigReloader configReloader(deviceConfig, deviceConfigProvider);
+StatusTelemetry statusTelemetry;
+AdcSampler adcSampler;
+PinStreamer pinStreamer(adcSampler);
+bool rebootOnNextLoop = false;
+CommandsProvider commandsProvider(deviceConfigProvider, configReloader, statusTelemetry, adcSampler, pinStreamer, rebootOnNextLoop);
+
+/**
+ * Atomic batch switching on the relays of pins 22 and up, in compact JSON.
+ */
+size_t relayBatch(char *payload, size_t size, unsigned int count)
+{
+    size_t length = snprintf(payload, size, "{\"atomic\":true,\"commands\":[");
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        length += snprintf(payload + length, size - length, "%s{\"command\":\"WRITE_DIGITAL\",\"arguments\":\"%u:1\"}",
+                           i > 0 ? "," : "", 22 + i);
+    }
+
+    length += snprintf(payload + length, size - length, "]}");
+
+    return length;
+}
+
+void setUp(void)
+{
+    HalMock::reset();
+}
+
+void tearDown(void)
+{
+}
+
+void test_largest_batch_fits_the_board(void)
+{
+    char payload[1024];
+    char result[COMMAND_RESULT_SIZE];
+    char expected[COMMAND_RESULT_SIZE];
+    size_t length = relayBatch(payload, sizeof(payload), COMMAND_BATCH_MAX);
+
+    snprintf(expected, sizeof(expected), "%u/%u Success", COMMAND_BATCH_MAX, COMMAND_BATCH_MAX);
+
+    // With the topic and the packet header
+    TEST_ASSERT_TRUE(length + 64 <= MQTT_CLIENT_BUFFER_SIZE);
+
+    TEST_ASSERT_TRUE(commandsProvider.processIncomingMessage(
+        "ardu-test/receive", payload, length, PayloadEncoding::JSON_ENCODING, result, sizeof(result)));
+    TEST_ASSERT_EQUAL_STRING(expected, result);
+
+    for (unsigned int i = 0; i < COMMAND_BATCH_MAX; i++)
+    {
+        TEST_ASSERT_EQUAL_INT(HIGH, HalMock::digitalOutput(22 + i));
+    }
+}
+
+void test_longer_batch_is_rejected(void)
+{
+    char payload[1024];
+    char result[COMMAND_RESULT_SIZE];
+    size_t length = relayBatch(payload, sizeof(payload), COMMAND_BATCH_MAX + 1);
+
+    TEST_ASSERT_FALSE(commandsProvider.processIncomingMessage(
+        "ardu-test/receive", payload, length, PayloadEncoding::JSON_ENCODING, result, sizeof(result)));
+    TEST_ASSERT_EQUAL_STRING("ERROR: Batch larger than COMMAND_BATCH_MAX", result);
+    TEST_ASSERT_EQUAL_INT(LOW, HalMock::digitalOutput(22));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_largest_batch_fits_the_board);
+    RUN_TEST(test_longer_batch_is_rejected);
+    return UNITY_END();
+}
@@ -0,0 +1,123 @@
+#include <unity.h>
+#include "hal.h"
+#include "command_replies.h"
+
+DeviceConfigProvider deviceConfigProvider;
+DeviceConfig deviceConfig;
+ConfigReloader configReloader(deviceConfig, deviceConfigProvider);
+StatusTelemetry statusTelemetry;
+AdcSampler adcSampler;
+PinStreamer pinStreamer(adcSampler);
+bool rebootOnNextLoop = false;
+CommandsProvider commandsProvider(deviceConfigProvider, configReloader, statusTelemetry, adcSampler, pinStreamer, rebootOnNextLoop);
+MQTTClient mqttClient;
+MqttTopics topics;
+char payloadBuffer[MQTT_PAYLOAD_BUFFER_SIZE];
+
+void setUp(void)
+{
+    HalMock::reset();
+    mqttClient.connect("dev");
+
+    strlcpy(deviceConfig.MQTT_TOPIC_PREFIX, "ardu-test", sizeof(deviceConfig.MQTT_TOPIC_PREFIX));
+    strlcpy(deviceConfig.MQTT_DEVICE_ID, "dev", sizeof(deviceConfig.MQTT_DEVICE_ID));
+    topics.build(deviceConfig);
+}
+
+void tearDown(void)
+{
+}
+
+static void receive(CommandReplyQueue &queue, const char *topic, const char *payload, size_t length, PayloadEncoding encoding)
+{
+    CommandReply reply;
+
+    commandsProvider.processIncomingMessage(topic, payload, length, encoding, reply);
+    queue.push(reply);
+}
+
+static void receive(CommandReplyQueue &queue, const char *payload)
+{
+    receive(queue, "ardu-test/receive", payload, strlen(payload), PayloadEncoding::JSON_ENCODING);
+}
+
+void test_reply_echoes_the_correlation_id(void)
+{
+    CommandReplyQueue queue;
+
+    receive(queue, "{\"id\":\"a1\",\"command\":\"WRITE_DIGITAL\",\"arguments\":\"2:1\"}");
+    receive(queue, "{\"id\":7,\"command\":\"UNKNOWN\"}");
+
+    TEST_ASSERT_EQUAL_UINT(2, queue.pending());
+    TEST_ASSERT_EQUAL_UINT(2, queue.flush(mqttClient, topics, payloadBuffer, sizeof(payloadBuffer)));
+
+    // The last reply published, the first one is checked through the counters
+    TEST_ASSERT_EQUAL_STRING("ardu-test/dev/response", mqttClient.lastTopic);
+    TEST_ASSERT_EQUAL_STRING("{\"id\":7,\"ok\":false,\"result\":\"ERROR: Invalid command\"}", mqttClient.lastPayload);
+    TEST_ASSERT_EQUAL_UINT(2, mqttClient.publishedMessages);
+    TEST_ASSERT_EQUAL_INT(HIGH, HalMock::digitalOutput(2));
+}
+
+void test_messages_without_id_get_no_reply(void)
+{
+    CommandReplyQueue queue;
+
+    receive(queue, "{\"command\":\"WRITE_DIGITAL\",\"arguments\":\"2:1\"}");
+
+    TEST_ASSERT_EQUAL_UINT(0, queue.pending());
+    TEST_ASSERT_EQUAL_UINT(0, queue.flush(mqttClient, topics, payloadBuffer, sizeof(payloadBuffer)));
+}
+
+void test_msgpack_command_gets_msgpack_reply(void)
+{
+    CommandReplyQueue queue;
+    // {"id":"b","command":"REBOOT"}
+    const char payload[] =
+        "\x82"
+        "\xa2" "id" "\xa1" "b"
+        "\xa7" "command" "\xa6" "REBOOT";
+    // {"id":"b","ok":true,"result":"Success"}
+    const char expected[] =
+        "\x83"
+        "\xa2" "id" "\xa1" "b"
+        "\xa2" "ok" "\xc3"
+        "\xa6" "result" "\xa7" "Success";
+
+    receive(queue, "ardu-test/receive/msgpack", payload, sizeof(payload) - 1, PayloadEncoding::MSGPACK_ENCODING);
+    queue.flush(mqttClient, topics, payloadBuffer, sizeof(payloadBuffer));
+
+    TEST_ASSERT_EQUAL_STRING("ardu-test/dev/response/msgpack", mqttClient.lastTopic);
+    TEST_ASSERT_EQUAL_UINT(sizeof(expected) - 1, mqttClient.lastPayloadLength);
+    TEST_ASSERT_EQUAL_MEMORY(expected, mqttClient.lastPayload, sizeof(expected) - 1);
+}
+
+void test_replies_wait_for_the_connection(void)
+{
+    CommandReplyQueue queue;
+
+    for (int i = 0; i < MQTT_REPLY_QUEUE_SIZE + 1; i++)
+    {
+        receive(queue, "{\"id\":\"c\",\"command\":\"REBOOT\"}");
+    }
+
+    TEST_ASSERT_EQUAL_UINT(MQTT_REPLY_QUEUE_SIZE, queue.pending());
+    TEST_ASSERT_EQUAL_UINT(1, queue.droppedReplies());
+
+    mqttClient.disconnect();
+    TEST_ASSERT_EQUAL_UINT(0, queue.flush(mqttClient, topics, payloadBuffer, sizeof(payloadBuffer)));
+    TEST_ASSERT_EQUAL_UINT(MQTT_REPLY_QUEUE_SIZE, queue.pending());
+
+    mqttClient.connect("dev");
+    TEST_ASSERT_EQUAL_UINT(MQTT_REPLY_QUEUE_SIZE, queue.flush(mqttClient, topics, payloadBuffer, sizeof(payloadBuffer)));
+    TEST_ASSERT_EQUAL_UINT(0, queue.pending());
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_reply_echoes_the_correlation_id);
+    RUN_TEST(test_messages_without_id_get_no_reply);
+    RUN_TEST(test_msgpack_command_gets_msgpack_reply);
+    RUN_TEST(test_replies_wait_for_the_connection);
+    return UNITY_END();
+}
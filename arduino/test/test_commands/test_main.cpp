@@ -0,0 +1,250 @@
+#include <unity.h>
+#include "hal.h"
+#include "commands.h"
+
+DeviceConfigProvider deviceConfigProvider;
+DeviceConfig deviceConfig;
+ConfigReloader configReloader(deviceConfig, deviceConfigProvider);
+StatusTelemetry statusTelemetry;
+AdcSampler adcSampler;
+PinStreamer pinStreamer(adcSampler);
+bool rebootOnNextLoop = false;
+CommandsProvider commandsProvider(deviceConfigProvider, configReloader, statusTelemetry, adcSampler, pinStreamer, rebootOnNextLoop);
+
+void setUp(void)
+{
+    HalMock::reset();
+    rebootOnNextLoop = false;
+}
+
+void tearDown(void)
+{
+}
+
+void test_parse_int(void)
+{
+    const char *cursor = "42:1";
+    int value = 0;
+
+    TEST_ASSERT_TRUE(CommandParser::parseInt(cursor, value));
+    TEST_ASSERT_EQUAL_INT(42, value);
+    TEST_ASSERT_EQUAL_CHAR(':', *cursor);
+
+    cursor = "-7";
+    TEST_ASSERT_TRUE(CommandParser::parseInt(cursor, value));
+    TEST_ASSERT_EQUAL_INT(-7, value);
+
+    const char *invalid = "abc";
+    cursor = invalid;
+    TEST_ASSERT_FALSE(CommandParser::parseInt(cursor, value));
+    TEST_ASSERT_EQUAL_PTR(invalid, cursor);
+}
+
+void test_parse_pin(void)
+{
+    const char *cursor = "LED_BUILTIN:1";
+    int pin = -1;
+
+    TEST_ASSERT_TRUE(CommandParser::parsePin(cursor, pin));
+    TEST_ASSERT_EQUAL_INT(LED_BUILTIN, pin);
+    TEST_ASSERT_TRUE(CommandParser::expect(cursor, ':'));
+
+    cursor = "512";
+    TEST_ASSERT_FALSE(CommandParser::parsePin(cursor, pin));
+}
+
+void test_write_digital(void)
+{
+    char result[COMMAND_RESULT_SIZE];
+
+    TEST_ASSERT_TRUE(commandsProvider.handleCommand("WRITE_DIGITAL", "30:1", result, sizeof(result)));
+    TEST_ASSERT_EQUAL_STRING("Success", result);
+    TEST_ASSERT_EQUAL_INT(HIGH, HalMock::digitalOutput(30));
+
+    TEST_ASSERT_FALSE(commandsProvider.handleCommand("WRITE_DIGITAL", "30:2", result, sizeof(result)));
+    TEST_ASSERT_FALSE(commandsProvider.handleCommand("WRITE_DIGITAL", "30", result, sizeof(result)));
+    TEST_ASSERT_FALSE(commandsProvider.handleCommand("WRITE_DIGITAL", "x:1", result, sizeof(result)));
+}
+
+void test_read_analog(void)
+{
+    char result[COMMAND_RESULT_SIZE];
+
+    HalMock::setAnalogInput(3, 517);
+
+    TEST_ASSERT_TRUE(commandsProvider.handleCommand("READ_ANALOG", "3", result, sizeof(result)));
+    TEST_ASSERT_EQUAL_STRING("517", result);
+}
+
+void test_dispatch(void)
+{
+    char result[COMMAND_RESULT_SIZE];
+
+    TEST_ASSERT_FALSE(commandsProvider.handleCommand("UNKNOWN", "", result, sizeof(result)));
+    TEST_ASSERT_EQUAL_STRING("ERROR: Invalid command", result);
+
+    TEST_ASSERT_TRUE(commandsProvider.handleCommand("REBOOT", "", result, sizeof(result)));
+    TEST_ASSERT_TRUE(rebootOnNextLoop);
+}
+
+void test_commands_do_not_allocate(void)
+{
+    char result[COMMAND_RESULT_SIZE];
+
+    HalMock::resetAllocations();
+
+    commandsProvider.handleCommand("WRITE_DIGITAL", "LED_BUILTIN:1", result, sizeof(result));
+    commandsProvider.handleCommand("WRITE_ANALOG", "5:128", result, sizeof(result));
+    commandsProvider.handleCommand("READ_DIGITAL", "13", result, sizeof(result));
+    commandsProvider.handleCommand("READ_ANALOG", "3", result, sizeof(result));
+    commandsProvider.handleCommand("REBOOT", "", result, sizeof(result));
+
+    TEST_ASSERT_EQUAL_UINT(0, HalMock::allocations());
+}
+
+void test_process_message_does_not_allocate(void)
+{
+    char result[COMMAND_RESULT_SIZE];
+
+    HalMock::resetAllocations();
+
+    TEST_ASSERT_TRUE(commandsProvider.processIncomingMessage(
+        "SERIAL", "{\"command\":\"WRITE_DIGITAL\",\"arguments\":\"LED_BUILTIN:1\"}", result, sizeof(result)));
+    TEST_ASSERT_FALSE(commandsProvider.processIncomingMessage("SERIAL", "{not json", result, sizeof(result)));
+
+    TEST_ASSERT_EQUAL_UINT(0, HalMock::allocations());
+    TEST_ASSERT_EQUAL_INT(HIGH, HalMock::digitalOutput(LED_BUILTIN));
+}
+
+void test_process_msgpack_message(void)
+{
+    char result[COMMAND_RESULT_SIZE];
+    // {"command":"WRITE_DIGITAL","arguments":"LED_BUILTIN:1"}
+    const char payload[] =
+        "\x82"
+        "\xa7" "command" "\xad" "WRITE_DIGITAL"
+        "\xa9" "arguments" "\xad" "LED_BUILTIN:1";
+
+    HalMock::resetAllocations();
+
+    TEST_ASSERT_TRUE(commandsProvider.processIncomingMessage(
+        "ardu-test/receive/msgpack", payload, sizeof(payload) - 1, PayloadEncoding::MSGPACK_ENCODING, result, sizeof(result)));
+
+    TEST_ASSERT_EQUAL_UINT(0, HalMock::allocations());
+    TEST_ASSERT_EQUAL_INT(HIGH, HalMock::digitalOutput(LED_BUILTIN));
+}
+
+void test_batch_runs_in_order(void)
+{
+    char result[COMMAND_RESULT_SIZE];
+
+    HalMock::setAnalogInput(3, 512);
+
+    TEST_ASSERT_TRUE(commandsProvider.processIncomingMessage(
+        "SERIAL",
+        "[{\"command\":\"WRITE_DIGITAL\",\"arguments\":\"2:1\"},"
+        "{\"command\":\"READ_DIGITAL\",\"arguments\":\"2\"},"
+        "{\"command\":\"READ_ANALOG\",\"arguments\":\"3\"}]",
+        result, sizeof(result)));
+
+    TEST_ASSERT_EQUAL_STRING("3/3 Success;1;512", result);
+}
+
+void test_batch_stops_at_first_failure(void)
+{
+    char result[COMMAND_RESULT_SIZE];
+
+    TEST_ASSERT_FALSE(commandsProvider.processIncomingMessage(
+        "SERIAL",
+        "{\"commands\":[{\"command\":\"WRITE_DIGITAL\",\"arguments\":\"2:1\"},"
+        "{\"command\":\"UNKNOWN\"},"
+        "{\"command\":\"WRITE_DIGITAL\",\"arguments\":\"3:1\"}]}",
+        result, sizeof(result)));
+
+    TEST_ASSERT_EQUAL_STRING("1/3 Success;ERROR: Invalid command", result);
+    TEST_ASSERT_EQUAL_INT(HIGH, HalMock::digitalOutput(2));
+    TEST_ASSERT_EQUAL_INT(LOW, HalMock::digitalOutput(3));
+}
+
+void test_atomic_batch_applies_all_or_nothing(void)
+{
+    char result[COMMAND_RESULT_SIZE];
+
+    HalMock::setDigitalInput(4, HIGH);
+
+    TEST_ASSERT_FALSE(commandsProvider.processIncomingMessage(
+        "SERIAL",
+        "{\"atomic\":true,\"commands\":[{\"command\":\"WRITE_DIGITAL\",\"arguments\":\"2:1\"},"
+        "{\"command\":\"WRITE_DIGITAL\",\"arguments\":\"3:7\"}]}",
+        result, sizeof(result)));
+
+    TEST_ASSERT_EQUAL_STRING("0/2 ERROR: Invalid digital write value. Assure the number is either 0 or 1", result);
+    TEST_ASSERT_EQUAL_INT(LOW, HalMock::digitalOutput(2));
+
+    TEST_ASSERT_TRUE(commandsProvider.processIncomingMessage(
+        "SERIAL",
+        "{\"atomic\":true,\"commands\":[{\"command\":\"WRITE_DIGITAL\",\"arguments\":\"2:1\"},"
+        "{\"command\":\"WRITE_DIGITAL\",\"arguments\":\"4:0\"},"
+        "{\"command\":\"WRITE_DIGITAL\",\"arguments\":\"LED_BUILTIN:1\"}]}",
+        result, sizeof(result)));
+
+    TEST_ASSERT_EQUAL_STRING("3/3 Success", result);
+    TEST_ASSERT_EQUAL_INT(HIGH, HalMock::digitalOutput(2));
+    TEST_ASSERT_EQUAL_INT(LOW, HalMock::digitalOutput(4));
+    TEST_ASSERT_EQUAL_INT(HIGH, HalMock::digitalOutput(LED_BUILTIN));
+}
+
+void test_stream_command(void)
+{
+    char result[COMMAND_RESULT_SIZE];
+
+    TEST_ASSERT_TRUE(commandsProvider.handleCommand("STREAM", "200:13,LED_BUILTIN,30", result, sizeof(result)));
+    TEST_ASSERT_EQUAL_STRING("200", result);
+    TEST_ASSERT_TRUE(pinStreamer.isStreaming());
+
+    TEST_ASSERT_TRUE(commandsProvider.handleCommand("STREAM", "0", result, sizeof(result)));
+    TEST_ASSERT_FALSE(pinStreamer.isStreaming());
+
+    TEST_ASSERT_FALSE(commandsProvider.handleCommand("STREAM", "200:13,", result, sizeof(result)));
+    TEST_ASSERT_FALSE(commandsProvider.handleCommand("STREAM", "200", result, sizeof(result)));
+    TEST_ASSERT_FALSE(commandsProvider.handleCommand("STREAM", "200:1,2,3,4,5,6,7,8,9", result, sizeof(result)));
+}
+
+void test_config_message(void)
+{
+    char result[COMMAND_RESULT_SIZE];
+
+    deviceConfig = deviceConfigProvider.readFromEEprom();
+    configReloader.takeChanges();
+
+    TEST_ASSERT_TRUE(commandsProvider.processIncomingMessage(
+        "SERIAL", "{\"config\":{\"mqtt\":{\"keepalive\":45}}}", result, sizeof(result)));
+    TEST_ASSERT_EQUAL_STRING("Success", result);
+    TEST_ASSERT_EQUAL_INT(45, deviceConfig.MQTT_KEEPALIVE);
+    TEST_ASSERT_EQUAL_UINT(CONFIG_CHANGED_MQTT_OPTIONS, configReloader.takeChanges());
+    TEST_ASSERT_FALSE(rebootOnNextLoop);
+
+    TEST_ASSERT_FALSE(commandsProvider.processIncomingMessage(
+        "SERIAL", "{\"config\":{\"mqtt\":{\"timeout\":0}}}", result, sizeof(result)));
+    TEST_ASSERT_EQUAL_STRING("ERROR: Invalid configuration", result);
+    TEST_ASSERT_FALSE(configReloader.hasChanges());
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_parse_int);
+    RUN_TEST(test_parse_pin);
+    RUN_TEST(test_write_digital);
+    RUN_TEST(test_read_analog);
+    RUN_TEST(test_dispatch);
+    RUN_TEST(test_commands_do_not_allocate);
+    RUN_TEST(test_process_message_does_not_allocate);
+    RUN_TEST(test_process_msgpack_message);
+    RUN_TEST(test_batch_runs_in_order);
+    RUN_TEST(test_batch_stops_at_first_failure);
+    RUN_TEST(test_atomic_batch_applies_all_or_nothing);
+    RUN_TEST(test_stream_command);
+    RUN_TEST(test_config_message);
+    return UNITY_END();
+}
@@ -0,0 +1,256 @@
+#include <unity.h>
+#include "hal.h"
+#include "device_config.h"
+
+DeviceConfigProvider provider;
+
+void setUp(void)
+{
+    HalMock::reset();
+
+    // A new provider per test, like after a reboot
+    provider = DeviceConfigProvider();
+}
+
+void tearDown(void)
+{
+}
+
+void test_blank_eeprom_gets_defaults(void)
+{
+    DeviceConfig config = provider.readFromEEprom();
+
+    TEST_ASSERT_EQUAL_INT(CONFIG_VERSION, config.DEVICE_CONFIG_VERSION);
+    TEST_ASSERT_EQUAL_INT(DEFAULT_HTTP_SERVER_PORT, config.HTTP_SERVER_PORT);
+    TEST_ASSERT_EQUAL_STRING(DEFAULT_MQTT_SERVER_HOST, config.MQTT_SERVER_HOST);
+    TEST_ASSERT_TRUE(HalMock::eepromWrites() > 0);
+}
+
+void test_saved_config_is_read_back(void)
+{
+    DeviceConfig config = provider.readFromEEprom();
+
+    strlcpy(config.MQTT_SERVER_HOST, "broker.local", sizeof(config.MQTT_SERVER_HOST));
+    config.MQTT_KEEPALIVE = 42;
+    provider.saveConfig(config);
+
+    DeviceConfigProvider afterReboot;
+    DeviceConfig loaded = afterReboot.readFromEEprom();
+
+    TEST_ASSERT_EQUAL_STRING("broker.local", loaded.MQTT_SERVER_HOST);
+    TEST_ASSERT_EQUAL_INT(42, loaded.MQTT_KEEPALIVE);
+    TEST_ASSERT_EQUAL_STRING(config.MQTT_DEVICE_ID, loaded.MQTT_DEVICE_ID);
+}
+
+void test_unchanged_config_is_not_written(void)
+{
+    DeviceConfig config = provider.readFromEEprom();
+    size_t writes = HalMock::eepromWrites();
+
+    TEST_ASSERT_EQUAL_UINT(0, provider.saveConfig(config));
+    provider.resetToDefault();
+
+    TEST_ASSERT_EQUAL_UINT(writes, HalMock::eepromWrites());
+}
+
+void test_saves_rotate_slots_and_write_only_changes(void)
+{
+    DeviceConfig config = provider.readFromEEprom();
+
+    // Fill every slot once
+    for (int i = 1; i < CONFIG_SLOT_COUNT; i++)
+    {
+        config.MQTT_TIMEOUT = i;
+        provider.saveConfig(config);
+    }
+
+    // Back on the first slot, only the changed field and the header differ
+    config.MQTT_TIMEOUT = 100;
+
+    size_t written = provider.saveConfig(config);
+
+    TEST_ASSERT_TRUE(written > 0);
+    TEST_ASSERT_TRUE(written <= 2 + sizeof(ConfigRecordHeader));
+}
+
+void test_corrupted_record_falls_back_to_previous(void)
+{
+    DeviceConfig config = provider.readFromEEprom();
+
+    config.MQTT_KEEPALIVE = 11;
+    provider.saveConfig(config);
+    config.MQTT_KEEPALIVE = 22;
+    provider.saveConfig(config);
+
+    // Flip a payload byte of the newest record (slot 2)
+    HalMock::board().eeprom[CONFIG_EEPROM_START + 2 * CONFIG_SLOT_SIZE + sizeof(ConfigRecordHeader)] ^= 0xFF;
+
+    DeviceConfigProvider afterReboot;
+    DeviceConfig loaded = afterReboot.readFromEEprom();
+
+    TEST_ASSERT_EQUAL_INT(11, loaded.MQTT_KEEPALIVE);
+}
+
+void test_version_2_record_is_upgraded(void)
+{
+    DeviceConfig config = provider.readFromEEprom();
+    ConfigPayload payload;
+    ConfigStore store;
+    uint8_t version;
+
+    // A version 2 record is the current payload without the analog settings
+    config.MQTT_KEEPALIVE = 33;
+    provider.saveConfig(config);
+    store.load((uint8_t *)&payload, sizeof(payload), version);
+    store.save((uint8_t *)&payload, offsetof(ConfigPayload, analogChannels), 2);
+
+    DeviceConfigProvider afterReboot;
+    DeviceConfig loaded = afterReboot.readFromEEprom();
+
+    TEST_ASSERT_EQUAL_INT(33, loaded.MQTT_KEEPALIVE);
+    TEST_ASSERT_EQUAL_UINT(DEFAULT_ANALOG_CHANNELS, loaded.ANALOG_CHANNELS);
+    TEST_ASSERT_EQUAL_INT(DEFAULT_ANALOG_OVERSAMPLING, loaded.ANALOG_OVERSAMPLING);
+    TEST_ASSERT_EQUAL_STRING(DEFAULT_MQTT_TOPIC_PREFIX, loaded.MQTT_TOPIC_PREFIX);
+
+    // The upgraded record was saved with the current version
+    store.load((uint8_t *)&payload, sizeof(payload), version);
+    TEST_ASSERT_EQUAL_UINT(CONFIG_VERSION, version);
+}
+
+void test_config_exported_as_json(void)
+{
+    char buffer[768];
+    BufferPrint out(buffer, sizeof(buffer));
+    DeviceConfig config = provider.readFromEEprom();
+    const char *expectedPrefix = "{\"device\":{\"id\":\"";
+
+    strlcpy(config.MQTT_SERVER_HOST, "broker", sizeof(config.MQTT_SERVER_HOST));
+
+    CountingPrint counter;
+    size_t measured = DeviceConfigProvider::exportJson(counter, config);
+    size_t written = DeviceConfigProvider::exportJson(out, config);
+
+    TEST_ASSERT_EQUAL_UINT(measured, written);
+    TEST_ASSERT_EQUAL_INT(0, strncmp(expectedPrefix, buffer, strlen(expectedPrefix)));
+    TEST_ASSERT_NOT_NULL(strstr(buffer, "\"mqtt\":{\"host\":\"broker\""));
+}
+
+void test_rules_imported_and_exported(void)
+{
+    char buffer[768];
+    BufferPrint out(buffer, sizeof(buffer));
+    DeviceConfig config = provider.readFromEEprom();
+    JsonDocument json;
+    const char *rules = "[{\"on\":\"rising\",\"pin\":30,\"do\":\"schedule\",\"target\":13,\"value\":1,\"delay\":500},"
+                        "{\"on\":\"above\",\"pin\":54,\"threshold\":600,\"do\":\"publish\"}]";
+
+    snprintf(buffer, sizeof(buffer), "{\"rules\":%s}", rules);
+    deserializeJson(json, buffer);
+
+    TEST_ASSERT_TRUE(DeviceConfigProvider::importJson(json.as<JsonVariantConst>(), config));
+    TEST_ASSERT_EQUAL_UINT(RULE_SCHEDULE, config.RULES[0].action);
+    TEST_ASSERT_EQUAL_UINT(600, config.RULES[1].threshold);
+    TEST_ASSERT_EQUAL_UINT(RULE_UNUSED, config.RULES[2].trigger);
+
+    DeviceConfigProvider::exportJson(out, config);
+
+    TEST_ASSERT_NOT_NULL(strstr(buffer, rules));
+
+    // Unknown trigger
+    deserializeJson(json, "{\"rules\":[{\"on\":\"sometimes\",\"pin\":30,\"target\":13}]}");
+    TEST_ASSERT_FALSE(DeviceConfigProvider::importJson(json.as<JsonVariantConst>(), config));
+}
+
+void test_topics_imported_and_exported(void)
+{
+    char buffer[768];
+    BufferPrint out(buffer, sizeof(buffer));
+    DeviceConfig config = provider.readFromEEprom();
+    JsonDocument json;
+
+    deserializeJson(json, "{\"mqtt\":{\"prefix\":\"plant\",\"channels\":[\"plant/all\"]}}");
+
+    TEST_ASSERT_TRUE(DeviceConfigProvider::importJson(json.as<JsonVariantConst>(), config));
+    TEST_ASSERT_EQUAL_STRING("plant", config.MQTT_TOPIC_PREFIX);
+    TEST_ASSERT_EQUAL_STRING("plant/all", config.MQTT_CHANNELS[0]);
+    TEST_ASSERT_EQUAL_STRING("", config.MQTT_CHANNELS[1]);
+
+    DeviceConfigProvider::exportJson(out, config);
+
+    TEST_ASSERT_NOT_NULL(strstr(buffer, "\"prefix\":\"plant\",\"channels\":[\"plant/all\"]"));
+
+    // The prefix and the id are single topic levels
+    deserializeJson(json, "{\"mqtt\":{\"prefix\":\"plant/+\"}}");
+    TEST_ASSERT_FALSE(DeviceConfigProvider::importJson(json.as<JsonVariantConst>(), config));
+
+    deserializeJson(json, "{\"mqtt\":{\"prefix\":\"plant\",\"channels\":[\"a\",\"b\",\"c\"]}}");
+    TEST_ASSERT_FALSE(DeviceConfigProvider::importJson(json.as<JsonVariantConst>(), config));
+}
+
+void test_unrepresentable_numbers_are_rejected(void)
+{
+    DeviceConfig config = provider.readFromEEprom();
+    JsonDocument json;
+    const char *invalidConfigs[] = {
+        // Out of an int, the | operator would keep the current value
+        "{\"http\":{\"port\":3000000000}}",
+        "{\"analog\":{\"channels\":-1}}",
+        "{\"status\":{\"interval\":\"10\"}}",
+        "{\"rules\":[{\"on\":\"rising\",\"pin\":2,\"target\":3,\"delay\":70000}]}",
+    };
+
+    for (const char *invalidConfig : invalidConfigs)
+    {
+        DeviceConfig next = config;
+
+        deserializeJson(json, invalidConfig);
+        TEST_ASSERT_FALSE_MESSAGE(DeviceConfigProvider::importJson(json.as<JsonVariantConst>(), next), invalidConfig);
+    }
+
+    deserializeJson(json, "{\"http\":{\"port\":8080}}");
+    TEST_ASSERT_TRUE(DeviceConfigProvider::importJson(json.as<JsonVariantConst>(), config));
+    TEST_ASSERT_EQUAL_INT(8080, config.HTTP_SERVER_PORT);
+}
+
+void test_out_of_range_fields_are_rejected(void)
+{
+    DeviceConfig config = provider.readFromEEprom();
+    JsonDocument json;
+    const char *invalidConfigs[] = {
+        // Would be saved as 1, MessagePack after a reboot
+        "{\"mqtt\":{\"encoding\":257}}",
+        "{\"mqtt\":{\"conn_retries\":-1}}",
+        "{\"state\":{\"mode\":2}}",
+        "{\"state\":{\"window\":-1}}",
+        "{\"status\":{\"mode\":-1}}",
+        "{\"status\":{\"keyframe\":-5}}",
+    };
+
+    for (const char *invalidConfig : invalidConfigs)
+    {
+        DeviceConfig next = config;
+
+        deserializeJson(json, invalidConfig);
+        TEST_ASSERT_FALSE_MESSAGE(DeviceConfigProvider::importJson(json.as<JsonVariantConst>(), next), invalidConfig);
+    }
+
+    deserializeJson(json, "{\"mqtt\":{\"encoding\":1},\"state\":{\"mode\":1,\"window\":250},\"status\":{\"mode\":1}}");
+    TEST_ASSERT_TRUE(DeviceConfigProvider::importJson(json.as<JsonVariantConst>(), config));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_blank_eeprom_gets_defaults);
+    RUN_TEST(test_saved_config_is_read_back);
+    RUN_TEST(test_unchanged_config_is_not_written);
+    RUN_TEST(test_saves_rotate_slots_and_write_only_changes);
+    RUN_TEST(test_corrupted_record_falls_back_to_previous);
+    RUN_TEST(test_version_2_record_is_upgraded);
+    RUN_TEST(test_config_exported_as_json);
+    RUN_TEST(test_rules_imported_and_exported);
+    RUN_TEST(test_topics_imported_and_exported);
+    RUN_TEST(test_out_of_range_fields_are_rejected);
+    RUN_TEST(test_unrepresentable_numbers_are_rejected);
+    return UNITY_END();
+}
@@ -0,0 +1,130 @@
+#include <unity.h>
+#include "hal.h"
+#include "config_reload.h"
+
+DeviceConfigProvider provider;
+DeviceConfig deviceConfig;
+ConfigReloader reloader(deviceConfig, provider);
+unsigned int saves = 0;
+
+void configSaved()
+{
+    saves++;
+}
+
+void setUp(void)
+{
+    HalMock::reset();
+
+    provider = DeviceConfigProvider();
+    deviceConfig = provider.readFromEEprom();
+    provider.onSaved(&configSaved);
+    reloader.takeChanges();
+    saves = 0;
+}
+
+void tearDown(void)
+{
+}
+
+/**
+ * Parses a JSON configuration and hands it to the reloader.
+ */
+bool update(const char *body)
+{
+    JsonDocument json;
+
+    if (deserializeJson(json, body))
+    {
+        return false;
+    }
+
+    return reloader.update(json.as<JsonVariantConst>());
+}
+
+void test_diff_flags_only_the_changed_parts(void)
+{
+    DeviceConfig next = deviceConfig;
+
+    TEST_ASSERT_EQUAL_UINT(0, ConfigReloader::diff(deviceConfig, next));
+
+    next.MQTT_KEEPALIVE = 99;
+    TEST_ASSERT_EQUAL_UINT(CONFIG_CHANGED_MQTT_OPTIONS, ConfigReloader::diff(deviceConfig, next));
+
+    next = deviceConfig;
+    strlcpy(next.MQTT_DEVICE_ID, "other", sizeof(next.MQTT_DEVICE_ID));
+    TEST_ASSERT_EQUAL_UINT(CONFIG_CHANGED_MQTT_SERVER, ConfigReloader::diff(deviceConfig, next));
+
+    next = deviceConfig;
+    strlcpy(next.MQTT_CHANNELS[0], "fleet/all", sizeof(next.MQTT_CHANNELS[0]));
+    next.HTTP_SERVER_PORT = 8080;
+    TEST_ASSERT_EQUAL_UINT(CONFIG_CHANGED_MQTT_TOPICS | CONFIG_CHANGED_HTTP_PORT, ConfigReloader::diff(deviceConfig, next));
+
+    next = deviceConfig;
+    next.STATE_SCAN_INTERVAL += 10;
+    next.ANALOG_DEADBAND++;
+    next.RULES[0].value ^= 1;
+    TEST_ASSERT_EQUAL_UINT(CONFIG_CHANGED_TELEMETRY | CONFIG_CHANGED_ANALOG | CONFIG_CHANGED_RULES, ConfigReloader::diff(deviceConfig, next));
+}
+
+void test_partial_update_is_applied_and_persisted(void)
+{
+    TEST_ASSERT_TRUE(update("{\"mqtt\":{\"host\":\"broker.local\",\"timeout\":500}}"));
+
+    TEST_ASSERT_EQUAL_STRING("broker.local", deviceConfig.MQTT_SERVER_HOST);
+    TEST_ASSERT_EQUAL_INT(500, deviceConfig.MQTT_TIMEOUT);
+    TEST_ASSERT_EQUAL_UINT(1, saves);
+    TEST_ASSERT_EQUAL_UINT(CONFIG_CHANGED_MQTT_SERVER | CONFIG_CHANGED_MQTT_OPTIONS, reloader.takeChanges());
+    TEST_ASSERT_FALSE(reloader.hasChanges());
+
+    DeviceConfigProvider afterReboot;
+    DeviceConfig loaded = afterReboot.readFromEEprom();
+
+    TEST_ASSERT_EQUAL_STRING("broker.local", loaded.MQTT_SERVER_HOST);
+    TEST_ASSERT_EQUAL_INT(500, loaded.MQTT_TIMEOUT);
+}
+
+void test_changes_accumulate_until_taken(void)
+{
+    TEST_ASSERT_TRUE(update("{\"http\":{\"port\":8080}}"));
+    TEST_ASSERT_TRUE(update("{\"status\":{\"interval\":10}}"));
+
+    TEST_ASSERT_EQUAL_UINT(CONFIG_CHANGED_HTTP_PORT | CONFIG_CHANGED_TELEMETRY, reloader.takeChanges());
+}
+
+void test_invalid_update_changes_nothing(void)
+{
+    DeviceConfig before = deviceConfig;
+
+    // The valid host would be applied by importJson alone
+    TEST_ASSERT_FALSE(update("{\"mqtt\":{\"host\":\"broker.local\",\"keepalive\":0}}"));
+    TEST_ASSERT_FALSE(update("[1,2]"));
+
+    TEST_ASSERT_EQUAL_MEMORY(&before, &deviceConfig, sizeof(before));
+    TEST_ASSERT_EQUAL_UINT(0, saves);
+    TEST_ASSERT_FALSE(reloader.hasChanges());
+}
+
+void test_unchanged_update_writes_nothing(void)
+{
+    char body[48];
+    size_t writes = HalMock::eepromWrites();
+
+    snprintf(body, sizeof(body), "{\"mqtt\":{\"keepalive\":%d}}", deviceConfig.MQTT_KEEPALIVE);
+
+    TEST_ASSERT_TRUE(update(body));
+    TEST_ASSERT_EQUAL_UINT(writes, HalMock::eepromWrites());
+    TEST_ASSERT_EQUAL_UINT(0, saves);
+    TEST_ASSERT_FALSE(reloader.hasChanges());
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_diff_flags_only_the_changed_parts);
+    RUN_TEST(test_partial_update_is_applied_and_persisted);
+    RUN_TEST(test_changes_accumulate_until_taken);
+    RUN_TEST(test_invalid_update_changes_nothing);
+    RUN_TEST(test_unchanged_update_writes_nothing);
+    return UNITY_END();
+}
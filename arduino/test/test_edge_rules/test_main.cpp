@@ -0,0 +1,106 @@
+#include <unity.h>
+#include "hal.h"
+#include "state.h"
+#include "edge_rules.h"
+
+MqttTopics topics;
+EdgeRules rules(topics);
+DeviceConfig deviceConfig;
+MQTTClient mqtt;
+
+void setUp(void)
+{
+    HalMock::reset();
+
+    memset(&deviceConfig, 0, sizeof(deviceConfig));
+    deviceConfig.PAYLOAD_ENCODING = PayloadEncoding::JSON_ENCODING;
+    deviceConfig.STATE_PUBLISH_MODE = StatePublishMode::PER_PIN;
+    strlcpy(deviceConfig.MQTT_TOPIC_PREFIX, "fleet", sizeof(deviceConfig.MQTT_TOPIC_PREFIX));
+    strlcpy(deviceConfig.MQTT_DEVICE_ID, "dev", sizeof(deviceConfig.MQTT_DEVICE_ID));
+    topics.build(deviceConfig);
+
+    mqtt = MQTTClient();
+}
+
+void tearDown(void)
+{
+}
+
+void test_unused_and_invalid_rules_are_not_compiled(void)
+{
+    deviceConfig.RULES[1] = {RULE_RISING, 30, 0, RULE_WRITE, 13, HIGH, 0};
+    // An analog trigger needs an analog pin
+    deviceConfig.RULES[2] = {RULE_ABOVE, 30, 500, RULE_PUBLISH, 0, 0, 0};
+
+    TEST_ASSERT_EQUAL_UINT(1, rules.compile(deviceConfig));
+}
+
+void test_edge_writes_pin_during_scan_without_broker(void)
+{
+    GlobalStateProvider stateProvider(topics);
+
+    deviceConfig.RULES[0] = {RULE_RISING, 30, 0, RULE_WRITE, 13, HIGH, 0};
+    deviceConfig.RULES[1] = {RULE_FALLING, 30, 0, RULE_WRITE, 12, HIGH, 0};
+    rules.compile(deviceConfig);
+
+    HalMock::setDigitalInput(30, HIGH);
+    stateProvider.computeStateChanges(mqtt, deviceConfig, &rules);
+
+    TEST_ASSERT_EQUAL_INT(HIGH, HalMock::digitalOutput(13));
+    TEST_ASSERT_EQUAL_INT(LOW, HalMock::digitalOutput(12));
+    TEST_ASSERT_EQUAL_UINT(0, mqtt.publishedMessages);
+
+    HalMock::setDigitalInput(30, LOW);
+    stateProvider.computeStateChanges(mqtt, deviceConfig, &rules);
+
+    TEST_ASSERT_EQUAL_INT(HIGH, HalMock::digitalOutput(12));
+}
+
+void test_scheduled_write_runs_when_due(void)
+{
+    deviceConfig.RULES[0] = {RULE_CHANGE, 30, 0, RULE_SCHEDULE, 13, HIGH, 500};
+    rules.compile(deviceConfig);
+
+    uint8_t port = digitalPinToPort(30);
+    rules.onPortChange(mqtt, deviceConfig, port, 0, digitalPinToBitMask(30), millis());
+
+    TEST_ASSERT_TRUE(rules.hasScheduled());
+    TEST_ASSERT_EQUAL_INT(500, rules.runDue(millis()));
+    TEST_ASSERT_EQUAL_INT(LOW, HalMock::digitalOutput(13));
+
+    HalMock::advanceMillis(500);
+
+    TEST_ASSERT_EQUAL_INT(-1, rules.runDue(millis()));
+    TEST_ASSERT_EQUAL_INT(HIGH, HalMock::digitalOutput(13));
+    TEST_ASSERT_FALSE(rules.hasScheduled());
+}
+
+void test_threshold_crossing_publishes(void)
+{
+    MockClient netClient;
+
+    mqtt.begin("broker", netClient);
+    mqtt.connect("test");
+
+    deviceConfig.RULES[0] = {RULE_ABOVE, PIN_A0 + 1, 600, RULE_PUBLISH, 0, 0, 0};
+    rules.compile(deviceConfig);
+
+    // Staying above the threshold does not fire again
+    rules.onAnalogChange(mqtt, deviceConfig, 1, 500, 700, millis());
+    rules.onAnalogChange(mqtt, deviceConfig, 1, 700, 800, millis());
+    rules.onAnalogChange(mqtt, deviceConfig, 0, 500, 700, millis());
+
+    TEST_ASSERT_EQUAL_UINT(1, mqtt.publishedMessages);
+    TEST_ASSERT_EQUAL_STRING("fleet/dev/rule", mqtt.lastTopic);
+    TEST_ASSERT_EQUAL_STRING("{\"rule\":0,\"pin\":55,\"value\":700}", mqtt.lastPayload);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_unused_and_invalid_rules_are_not_compiled);
+    RUN_TEST(test_edge_writes_pin_during_scan_without_broker);
+    RUN_TEST(test_scheduled_write_runs_when_due);
+    RUN_TEST(test_threshold_crossing_publishes);
+    return UNITY_END();
+}
@@ -0,0 +1,197 @@
+#include <unity.h>
+#include "hal.h"
+#include "http_front_end.h"
+
+typedef MockClientHandle ClientHandle;
+
+char lastRequest[HTTP_REQUEST_BUFFER_SIZE + 1];
+unsigned int requests = 0;
+bool lastKeepAlive = false;
+bool lengthKnown = true;
+
+bool handleRequest(HttpRequestStream &request, ClientHandle &client, bool keepAlive)
+{
+    size_t length = 0;
+
+    while (request.available() > 0)
+    {
+        lastRequest[length++] = (char)request.read();
+    }
+
+    lastRequest[length] = 0;
+    lastKeepAlive = keepAlive;
+    requests++;
+
+    if (!lengthKnown)
+    {
+        // Like sendStatus() and the 404 of aWOT: the body ends with the connection
+        client.print(F("HTTP/1.1 404 Not Found\r\nConnection: close\r\n\r\nNot Found"));
+        return false;
+    }
+
+    client.print(F("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n"));
+    return true;
+}
+
+void setUp(void)
+{
+    HalMock::reset();
+    requests = 0;
+    lengthKnown = true;
+}
+
+void tearDown(void)
+{
+}
+
+void test_request_is_assembled_across_polls(void)
+{
+    HttpFrontEnd<ClientHandle> frontEnd(&handleRequest);
+    MockClient socket;
+
+    socket.inject("GET /status HTTP/1.1\r\nHost: 10.0.0.2\r\nUser-Agent: a very long user agent");
+    frontEnd.accept(ClientHandle(&socket));
+    frontEnd.poll();
+
+    TEST_ASSERT_EQUAL_UINT(0, requests);
+
+    socket.inject("\r\nAccept: application/msgpack\r\n\r\n");
+    frontEnd.poll();
+
+    // Only the headers used by the router are kept
+    TEST_ASSERT_EQUAL_UINT(1, requests);
+    TEST_ASSERT_EQUAL_STRING("GET /status HTTP/1.1\r\nAccept: application/msgpack\r\n\r\n", lastRequest);
+    TEST_ASSERT_TRUE(lastKeepAlive);
+    TEST_ASSERT_EQUAL_UINT(1, frontEnd.openConnections());
+}
+
+void test_keep_alive_serves_several_requests(void)
+{
+    HttpFrontEnd<ClientHandle> frontEnd(&handleRequest);
+    MockClient socket;
+
+    socket.inject("POST /reboot HTTP/1.1\r\nContent-Length: 4\r\n\r\nbody");
+    socket.inject("GET /status HTTP/1.1\r\nConnection: close\r\n\r\n");
+    frontEnd.accept(ClientHandle(&socket));
+
+    frontEnd.poll();
+    TEST_ASSERT_EQUAL_UINT(1, requests);
+    TEST_ASSERT_EQUAL_STRING("POST /reboot HTTP/1.1\r\nContent-Length: 4\r\n\r\nbody", lastRequest);
+
+    frontEnd.poll();
+    TEST_ASSERT_EQUAL_UINT(2, requests);
+    TEST_ASSERT_FALSE(lastKeepAlive);
+    TEST_ASSERT_EQUAL_UINT(0, frontEnd.openConnections());
+    // A graceful close waits for the client
+    TEST_ASSERT_EQUAL_UINT16(1000, socket.connectionTimeout);
+}
+
+void test_response_without_length_closes(void)
+{
+    HttpFrontEnd<ClientHandle> frontEnd(&handleRequest);
+    MockClient socket;
+
+    lengthKnown = false;
+    socket.inject("GET /missing HTTP/1.1\r\n\r\n");
+    socket.inject("GET /status HTTP/1.1\r\n\r\n");
+    frontEnd.accept(ClientHandle(&socket));
+
+    frontEnd.poll();
+    TEST_ASSERT_EQUAL_UINT(1, requests);
+    TEST_ASSERT_TRUE(lastKeepAlive);
+    // The client only sees the end of the body when the connection closes
+    TEST_ASSERT_EQUAL_UINT(0, frontEnd.openConnections());
+
+    frontEnd.poll();
+    TEST_ASSERT_EQUAL_UINT(1, requests);
+}
+
+void test_stalled_client_times_out(void)
+{
+    HttpFrontEnd<ClientHandle> frontEnd(&handleRequest);
+    MockClient stalled;
+    MockClient active;
+
+    stalled.inject("GET /sta");
+    frontEnd.accept(ClientHandle(&stalled));
+    active.inject("GET /status HTTP/1.0\r\n\r\n");
+    frontEnd.accept(ClientHandle(&active));
+
+    // The stalled client does not delay the other one
+    frontEnd.poll();
+    TEST_ASSERT_EQUAL_UINT(1, requests);
+    TEST_ASSERT_FALSE(lastKeepAlive);
+
+    HalMock::advanceMillis(HTTP_REQUEST_TIMEOUT + 1);
+    frontEnd.poll();
+
+    TEST_ASSERT_EQUAL_UINT(0, frontEnd.openConnections());
+    TEST_ASSERT_EQUAL_INT(0, strncmp("HTTP/1.1 408", stalled.tx, 12));
+    // Closing does not wait a second for a client that is gone
+    TEST_ASSERT_EQUAL_UINT16(HTTP_CLOSE_TIMEOUT, stalled.connectionTimeout);
+}
+
+void test_busy_slots_reject_new_clients(void)
+{
+    HttpFrontEnd<ClientHandle> frontEnd(&handleRequest);
+    MockClient sockets[HTTP_MAX_CONNECTIONS + 1];
+
+    for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+    {
+        sockets[i].inject("GET");
+        TEST_ASSERT_TRUE(frontEnd.accept(ClientHandle(&sockets[i])));
+    }
+
+    sockets[HTTP_MAX_CONNECTIONS].inject("GET");
+    TEST_ASSERT_FALSE(frontEnd.accept(ClientHandle(&sockets[HTTP_MAX_CONNECTIONS])));
+    TEST_ASSERT_EQUAL_INT(0, strncmp("HTTP/1.1 503", sockets[HTTP_MAX_CONNECTIONS].tx, 12));
+}
+
+void test_oversized_body_is_rejected(void)
+{
+    HttpFrontEnd<ClientHandle> frontEnd(&handleRequest);
+    MockClient socket;
+
+    socket.inject("POST /config HTTP/1.1\r\nContent-Length: 4000\r\n\r\n");
+    frontEnd.accept(ClientHandle(&socket));
+    frontEnd.poll();
+
+    TEST_ASSERT_EQUAL_UINT(0, requests);
+    TEST_ASSERT_EQUAL_INT(0, strncmp("HTTP/1.1 413", socket.tx, 12));
+}
+
+void test_invalid_content_length_is_rejected(void)
+{
+    const char *invalidRequests[] = {
+        // 65540 would wrap to 4 in 16 bits
+        "POST /config HTTP/1.1\r\nContent-Length: 65540\r\n\r\nbody",
+        "POST /config HTTP/1.1\r\nContent-Length: -1\r\n\r\nbody",
+        "POST /config HTTP/1.1\r\nContent-Length: four\r\n\r\nbody",
+    };
+
+    for (const char *request : invalidRequests)
+    {
+        HttpFrontEnd<ClientHandle> frontEnd(&handleRequest);
+        MockClient socket;
+
+        socket.inject(request);
+        frontEnd.accept(ClientHandle(&socket));
+        frontEnd.poll();
+
+        TEST_ASSERT_EQUAL_UINT(0, requests);
+        TEST_ASSERT_EQUAL_INT(0, strncmp("HTTP/1.1 413", socket.tx, 12));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_request_is_assembled_across_polls);
+    RUN_TEST(test_keep_alive_serves_several_requests);
+    RUN_TEST(test_response_without_length_closes);
+    RUN_TEST(test_stalled_client_times_out);
+    RUN_TEST(test_busy_slots_reject_new_clients);
+    RUN_TEST(test_oversized_body_is_rejected);
+    RUN_TEST(test_invalid_content_length_is_rejected);
+    return UNITY_END();
+}
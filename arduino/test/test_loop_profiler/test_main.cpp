@@ -0,0 +1,92 @@
+#include <unity.h>
+#include "hal.h"
+#include "loop_profiler.h"
+
+LoopProfiler profiler;
+
+void setUp(void)
+{
+    HalMock::reset();
+    profiler.reset();
+}
+
+void tearDown(void)
+{
+}
+
+void test_durations_fall_in_their_bucket(void)
+{
+    profiler.record(STAGE_SERIAL, 10);
+    profiler.record(STAGE_SERIAL, 64);
+    profiler.record(STAGE_SERIAL, 1500);
+    profiler.record(STAGE_SERIAL, 5000000);
+
+    const LoopStageStats &stats = profiler.getStats(STAGE_SERIAL);
+
+    TEST_ASSERT_EQUAL_UINT(4, stats.count);
+    TEST_ASSERT_EQUAL_UINT(5000000, stats.max);
+    TEST_ASSERT_EQUAL_UINT(1, stats.histogram[0]);
+    TEST_ASSERT_EQUAL_UINT(1, stats.histogram[1]);
+    TEST_ASSERT_EQUAL_UINT(1, stats.histogram[3]);
+    TEST_ASSERT_EQUAL_UINT(1, stats.histogram[LOOP_PROFILER_BUCKETS - 1]);
+}
+
+void test_full_bucket_halves_the_histogram(void)
+{
+    profiler.record(STAGE_TASKS, 100);
+    profiler.record(STAGE_TASKS, 100);
+
+    for (uint32_t i = 0; i < UINT16_MAX; i++)
+    {
+        profiler.record(STAGE_TASKS, 10);
+    }
+
+    profiler.record(STAGE_TASKS, 10);
+
+    const LoopStageStats &stats = profiler.getStats(STAGE_TASKS);
+
+    TEST_ASSERT_EQUAL_UINT(UINT16_MAX + 3UL, stats.count);
+    TEST_ASSERT_EQUAL_UINT(UINT16_MAX / 2 + 1, stats.histogram[0]);
+    TEST_ASSERT_EQUAL_UINT(1, stats.histogram[1]);
+}
+
+void test_stages_are_timed_with_micros(void)
+{
+    PROFILE_START();
+
+    HalMock::advanceMicros(500);
+    PROFILE_STAGE(profiler, STAGE_HTTP);
+    HalMock::advanceMicros(20000);
+    PROFILE_STAGE(profiler, STAGE_MQTT);
+    PROFILE_TOTAL(profiler, STAGE_LOOP);
+
+    TEST_ASSERT_EQUAL_UINT(500, profiler.getStats(STAGE_HTTP).max);
+    TEST_ASSERT_EQUAL_UINT(20000, profiler.getStats(STAGE_MQTT).max);
+    TEST_ASSERT_EQUAL_UINT(20500, profiler.getStats(STAGE_LOOP).max);
+}
+
+void test_profile_payload(void)
+{
+    char buffer[512];
+    BufferPrint out(buffer, sizeof(buffer));
+    const char *expectedPrefix = "{\"bucket_us\":[64,256,1024,4096,16384,65536,262144],\"stages\":{\"tasks\":[1,200,0,1,0,0,0,0,0,0],";
+
+    profiler.record(STAGE_TASKS, 200);
+
+    size_t written = profiler.writeProfile(out, PayloadEncoding::JSON_ENCODING);
+
+    TEST_ASSERT_EQUAL_INT(0, strncmp(expectedPrefix, buffer, strlen(expectedPrefix)));
+    TEST_ASSERT_NOT_NULL(strstr(buffer, "\"loop\":[0,0,0,0,0,0,0,0,0,0]}}"));
+    TEST_ASSERT_EQUAL_UINT(written, profiler.measureProfile(PayloadEncoding::JSON_ENCODING));
+    TEST_ASSERT_TRUE(profiler.measureProfile(PayloadEncoding::MSGPACK_ENCODING) < written);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_durations_fall_in_their_bucket);
+    RUN_TEST(test_full_bucket_halves_the_histogram);
+    RUN_TEST(test_stages_are_timed_with_micros);
+    RUN_TEST(test_profile_payload);
+    return UNITY_END();
+}
@@ -0,0 +1,105 @@
+#include <unity.h>
+#include "hal.h"
+#include "memory_metrics.h"
+
+MemoryMetricsProvider metrics;
+
+void setUp(void)
+{
+    HalMock::reset();
+    memset(&heapCounters, 0, sizeof(heapCounters));
+}
+
+void tearDown(void)
+{
+}
+
+void test_stack_watermark_survives_stack_unwinding(void)
+{
+    MockRam &ram = HalMock::board().ram;
+
+    MemoryMetricsProvider::paintStack();
+
+    // A deep call chain used 200 bytes below the stack pointer, then returned
+    memset(ram.bytes + ram.stackPointer - 200, 0x11, 200);
+
+    MemorySnapshot snapshot = metrics.sample();
+
+    TEST_ASSERT_EQUAL_UINT(MOCK_STACK_START - 200 - MOCK_HEAP_START, snapshot.stackHeadroom);
+    TEST_ASSERT_EQUAL_UINT(MOCK_RAM_SIZE - (MOCK_STACK_START - 200), snapshot.stackMax);
+}
+
+void test_heap_high_water_and_largest_free_block(void)
+{
+    MockRam &ram = HalMock::board().ram;
+
+    ram.heapEnd += 600;
+    metrics.sample();
+    ram.heapEnd -= 400;
+
+    // The stack is right above the heap: only the free list can serve an allocation
+    ram.stackPointer = ram.heapEnd + 100;
+    ram.freeBlocks[0] = 64;
+    ram.freeBlocks[1] = 96;
+    ram.freeBlockCount = 2;
+
+    MemorySnapshot snapshot = metrics.sample();
+
+    TEST_ASSERT_EQUAL_UINT(200, snapshot.heapUsed);
+    TEST_ASSERT_EQUAL_UINT(600, snapshot.heapHighWater);
+    TEST_ASSERT_EQUAL_UINT(96, snapshot.largestFreeBlock);
+
+    ram.stackPointer = MOCK_STACK_START;
+    snapshot = metrics.sample();
+
+    TEST_ASSERT_EQUAL_UINT(MOCK_STACK_START - ram.heapEnd - MOCK_MALLOC_MARGIN, snapshot.largestFreeBlock);
+}
+
+void test_allocations_are_counted(void)
+{
+    void *volatile block = malloc(16);
+    free(block);
+
+    MemorySnapshot snapshot = metrics.sample();
+
+    TEST_ASSERT_EQUAL_UINT(1, snapshot.allocations);
+    TEST_ASSERT_EQUAL_UINT(1, snapshot.frees);
+    TEST_ASSERT_EQUAL_UINT(0, snapshot.allocationFailures);
+}
+
+void test_metrics_payload(void)
+{
+    char buffer[256];
+    BufferPrint out(buffer, sizeof(buffer));
+    MemorySnapshot snapshot = {
+        .freeMemory = 1520,
+        .heapUsed = 310,
+        .heapHighWater = 420,
+        .largestFreeBlock = 1392,
+        .stackMax = 640,
+        .stackHeadroom = 1210,
+        .allocations = 12,
+        .frees = 9,
+        .allocationFailures = 0,
+        .adcOverruns = 3,
+    };
+
+    size_t written = metrics.writeMetrics(out, PayloadEncoding::JSON_ENCODING, snapshot);
+
+    TEST_ASSERT_EQUAL_STRING("{\"free_memory\":1520,\"heap\":{\"used\":310,\"high_water\":420,\"largest_free\":1392},"
+                             "\"stack\":{\"max\":640,\"headroom\":1210},\"allocations\":{\"count\":12,\"frees\":9,\"failed\":0},"
+                             "\"adc\":{\"overruns\":3}}",
+                             out.c_str());
+    TEST_ASSERT_EQUAL_UINT(written, metrics.measureMetrics(PayloadEncoding::JSON_ENCODING, snapshot));
+    TEST_ASSERT_TRUE(metrics.measureMetrics(PayloadEncoding::MSGPACK_ENCODING, snapshot) < written);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_stack_watermark_survives_stack_unwinding);
+    RUN_TEST(test_heap_high_water_and_largest_free_block);
+    RUN_TEST(test_allocations_are_counted);
+    RUN_TEST(test_metrics_payload);
+    return UNITY_END();
+}
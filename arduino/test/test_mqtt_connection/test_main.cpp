@@ -0,0 +1,224 @@
+#include <unity.h>
+#include "hal.h"
+#include "mqtt_connection.h"
+
+DeviceConfig deviceConfig = {"abc", 1, 80, "broker", "dev", 15, 30, 2, 0, 1, 0, 0, 10};
+MqttTopics topics;
+unsigned int advertisements = 0;
+
+void advertise()
+{
+    advertisements++;
+}
+
+void setUp(void)
+{
+    HalMock::reset();
+    advertisements = 0;
+
+    strlcpy(deviceConfig.MQTT_TOPIC_PREFIX, "fleet", sizeof(deviceConfig.MQTT_TOPIC_PREFIX));
+    memset(deviceConfig.MQTT_CHANNELS, 0, sizeof(deviceConfig.MQTT_CHANNELS));
+    deviceConfig.MQTT_CONNECTION_RETRIES = 2;
+}
+
+void tearDown(void)
+{
+}
+
+/**
+ * Runs steps until the next one is not immediate, like the scheduler would.
+ */
+unsigned long runUntilIdle(MqttConnectionProvider &connection)
+{
+    unsigned long wait = 0;
+
+    for (int i = 0; i < 10 && wait == 0; i++)
+    {
+        wait = connection.step(deviceConfig);
+    }
+
+    return wait;
+}
+
+void test_connects_subscribes_and_advertises(void)
+{
+    MQTTClient mqtt;
+    MockClient netClient;
+    MqttConnectionProvider connection(mqtt, topics, &advertise);
+
+    mqtt.begin("broker", netClient);
+
+    TEST_ASSERT_EQUAL_UINT(MQTT_CONNECTION_CHECK_INTERVAL, runUntilIdle(connection));
+    TEST_ASSERT_TRUE(connection.isReady());
+    TEST_ASSERT_EQUAL_UINT(2, mqtt.subscriptions);
+    TEST_ASSERT_EQUAL_UINT(1, advertisements);
+}
+
+void test_backoff_grows_with_jitter_and_never_blocks(void)
+{
+    MQTTClient mqtt;
+    MockClient netClient;
+    MqttConnectionProvider connection(mqtt, topics, &advertise);
+    unsigned long previousCeiling = 0;
+
+    // More retries than needed to reach MQTT_BACKOFF_MAX
+    deviceConfig.MQTT_CONNECTION_RETRIES = 10;
+    mqtt.begin("broker", netClient);
+    mqtt.setBrokerAvailable(false);
+
+    for (int attempt = 1; attempt <= 10; attempt++)
+    {
+        unsigned long start = millis();
+        unsigned long wait = runUntilIdle(connection);
+        unsigned long ceiling = MQTT_BACKOFF_MIN << (attempt - 1);
+
+        if (ceiling > MQTT_BACKOFF_MAX)
+        {
+            ceiling = MQTT_BACKOFF_MAX;
+        }
+
+        // The steps themselves never sleep
+        TEST_ASSERT_EQUAL_UINT(start, millis());
+        TEST_ASSERT_GREATER_OR_EQUAL_UINT(ceiling / 2, wait);
+        TEST_ASSERT_LESS_OR_EQUAL_UINT(ceiling, wait);
+        TEST_ASSERT_GREATER_OR_EQUAL_UINT(previousCeiling, ceiling);
+        TEST_ASSERT_EQUAL_INT(MQTT_DISCONNECTED, connection.getState());
+
+        // Steps before the deadline only report the remaining time
+        HalMock::advanceMillis(wait / 2);
+        TEST_ASSERT_EQUAL_UINT(wait - wait / 2, connection.step(deviceConfig));
+
+        HalMock::advanceMillis(wait - wait / 2);
+        previousCeiling = ceiling;
+    }
+
+    mqtt.setBrokerAvailable(true);
+    runUntilIdle(connection);
+
+    TEST_ASSERT_TRUE(connection.isReady());
+}
+
+void test_backoff_is_pinned_after_the_configured_retries(void)
+{
+    MQTTClient mqtt;
+    MockClient netClient;
+    MqttConnectionProvider connection(mqtt, topics, &advertise);
+
+    deviceConfig.MQTT_CONNECTION_RETRIES = 2;
+    mqtt.begin("broker", netClient);
+    mqtt.setBrokerAvailable(false);
+
+    for (int attempt = 1; attempt <= 4; attempt++)
+    {
+        unsigned long wait = runUntilIdle(connection);
+        unsigned long ceiling = attempt <= 2 ? MQTT_BACKOFF_MIN << (attempt - 1) : MQTT_BACKOFF_MAX;
+
+        TEST_ASSERT_GREATER_OR_EQUAL_UINT(ceiling / 2, wait);
+        TEST_ASSERT_LESS_OR_EQUAL_UINT(ceiling, wait);
+
+        HalMock::advanceMillis(wait);
+    }
+}
+
+void test_reconnects_after_connection_loss(void)
+{
+    MQTTClient mqtt;
+    MockClient netClient;
+    MqttConnectionProvider connection(mqtt, topics, &advertise);
+
+    mqtt.begin("broker", netClient);
+    runUntilIdle(connection);
+
+    mqtt.disconnect();
+    runUntilIdle(connection);
+
+    TEST_ASSERT_TRUE(connection.isReady());
+    TEST_ASSERT_EQUAL_UINT(4, mqtt.subscriptions);
+    TEST_ASSERT_EQUAL_UINT(2, advertisements);
+}
+
+void test_subscribes_channels_and_rebuilds_topics_on_connection(void)
+{
+    MQTTClient mqtt;
+    MockClient netClient;
+    MqttConnectionProvider connection(mqtt, topics, &advertise);
+
+    strlcpy(deviceConfig.MQTT_CHANNELS[1], "fleet/all", sizeof(deviceConfig.MQTT_CHANNELS[1]));
+
+    mqtt.begin("broker", netClient);
+    runUntilIdle(connection);
+
+    TEST_ASSERT_EQUAL_UINT(3, mqtt.subscriptions);
+    TEST_ASSERT_EQUAL_STRING("fleet/all", mqtt.lastSubscription);
+    TEST_ASSERT_EQUAL_STRING("fleet/dev/status", topics.get(TOPIC_STATUS));
+
+    strlcpy(deviceConfig.MQTT_TOPIC_PREFIX, "plant", sizeof(deviceConfig.MQTT_TOPIC_PREFIX));
+    mqtt.disconnect();
+    runUntilIdle(connection);
+
+    TEST_ASSERT_EQUAL_STRING("plant/dev/status", topics.get(TOPIC_STATUS));
+}
+
+void test_resubscribes_new_topics_without_reconnecting(void)
+{
+    MQTTClient mqtt;
+    MockClient netClient;
+    MqttConnectionProvider connection(mqtt, topics, &advertise);
+
+    mqtt.begin("broker", netClient);
+    runUntilIdle(connection);
+
+    strlcpy(deviceConfig.MQTT_TOPIC_PREFIX, "plant", sizeof(deviceConfig.MQTT_TOPIC_PREFIX));
+    connection.resubscribe();
+
+    // One socket operation per step, the previous topics are used until they are left
+    TEST_ASSERT_EQUAL_UINT(0, connection.step(deviceConfig));
+    TEST_ASSERT_EQUAL_STRING("fleet/dev/status", topics.get(TOPIC_STATUS));
+
+    runUntilIdle(connection);
+
+    TEST_ASSERT_TRUE(connection.isReady());
+    TEST_ASSERT_EQUAL_UINT(1, mqtt.connections);
+    TEST_ASSERT_EQUAL_UINT(2, mqtt.unsubscriptions);
+    TEST_ASSERT_EQUAL_UINT(4, mqtt.subscriptions);
+    TEST_ASSERT_EQUAL_STRING("plant/dev/receive/msgpack", mqtt.lastSubscription);
+    TEST_ASSERT_EQUAL_STRING("plant/dev/status", topics.get(TOPIC_STATUS));
+    TEST_ASSERT_EQUAL_UINT(2, advertisements);
+}
+
+void test_reconnect_opens_a_new_session(void)
+{
+    MQTTClient mqtt;
+    MockClient netClient;
+    MqttConnectionProvider connection(mqtt, topics, &advertise);
+
+    // Not connected yet, the topics are built on connection anyway
+    connection.resubscribe();
+    TEST_ASSERT_EQUAL_INT(MQTT_DISCONNECTED, connection.getState());
+
+    mqtt.begin("broker", netClient);
+    runUntilIdle(connection);
+
+    connection.reconnect();
+    TEST_ASSERT_FALSE(mqtt.connected());
+
+    runUntilIdle(connection);
+
+    TEST_ASSERT_TRUE(connection.isReady());
+    TEST_ASSERT_EQUAL_UINT(2, mqtt.connections);
+    TEST_ASSERT_EQUAL_UINT(0, mqtt.unsubscriptions);
+    TEST_ASSERT_EQUAL_UINT(2, advertisements);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_connects_subscribes_and_advertises);
+    RUN_TEST(test_backoff_grows_with_jitter_and_never_blocks);
+    RUN_TEST(test_backoff_is_pinned_after_the_configured_retries);
+    RUN_TEST(test_reconnects_after_connection_loss);
+    RUN_TEST(test_subscribes_channels_and_rebuilds_topics_on_connection);
+    RUN_TEST(test_resubscribes_new_topics_without_reconnecting);
+    RUN_TEST(test_reconnect_opens_a_new_session);
+    return UNITY_END();
+}
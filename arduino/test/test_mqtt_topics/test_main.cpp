@@ -0,0 +1,78 @@
+#include <unity.h>
+#include "hal.h"
+#include "mqtt_topics.h"
+
+MqttTopics topics;
+DeviceConfig deviceConfig;
+
+void setUp(void)
+{
+    memset(&deviceConfig, 0, sizeof(deviceConfig));
+    deviceConfig.PAYLOAD_ENCODING = PayloadEncoding::JSON_ENCODING;
+    strlcpy(deviceConfig.MQTT_TOPIC_PREFIX, "fleet", sizeof(deviceConfig.MQTT_TOPIC_PREFIX));
+    strlcpy(deviceConfig.MQTT_DEVICE_ID, "dev", sizeof(deviceConfig.MQTT_DEVICE_ID));
+}
+
+void tearDown(void)
+{
+}
+
+void test_topics_are_per_device(void)
+{
+    topics.build(deviceConfig);
+
+    TEST_ASSERT_EQUAL_STRING("fleet/dev/status", topics.get(TOPIC_STATUS));
+    TEST_ASSERT_EQUAL_STRING("fleet/dev/advertise", topics.get(TOPIC_ADVERTISE));
+    TEST_ASSERT_EQUAL_STRING("fleet/dev/response/msgpack", topics.get(TOPIC_RESPONSE_MSGPACK));
+    TEST_ASSERT_EQUAL_STRING("fleet/dev/stream", topics.get(TOPIC_STREAM));
+
+    // No prefix
+    deviceConfig.MQTT_TOPIC_PREFIX[0] = 0;
+    topics.build(deviceConfig);
+
+    TEST_ASSERT_EQUAL_STRING("dev/publish", topics.get(TOPIC_PUBLISH));
+}
+
+void test_msgpack_encoding_suffixes_published_topics(void)
+{
+    deviceConfig.PAYLOAD_ENCODING = PayloadEncoding::MSGPACK_ENCODING;
+    topics.build(deviceConfig);
+
+    TEST_ASSERT_EQUAL_STRING("fleet/dev/status/msgpack", topics.get(TOPIC_STATUS));
+    TEST_ASSERT_EQUAL_STRING("fleet/dev/rule/msgpack", topics.get(TOPIC_RULE));
+    // Replies follow the encoding of the command, frames have none
+    TEST_ASSERT_EQUAL_STRING("fleet/dev/response", topics.get(TOPIC_RESPONSE));
+    TEST_ASSERT_EQUAL_STRING("fleet/dev/stream", topics.get(TOPIC_STREAM));
+}
+
+void test_subscriptions_include_channels(void)
+{
+    strlcpy(deviceConfig.MQTT_CHANNELS[1], "fleet/all", sizeof(deviceConfig.MQTT_CHANNELS[1]));
+    topics.build(deviceConfig);
+
+    TEST_ASSERT_EQUAL_UINT(3, topics.subscriptionCount());
+    TEST_ASSERT_EQUAL_STRING("fleet/dev/receive", topics.subscription(0));
+    TEST_ASSERT_EQUAL_STRING("fleet/dev/receive/msgpack", topics.subscription(1));
+    TEST_ASSERT_EQUAL_STRING("fleet/all", topics.subscription(2));
+}
+
+void test_longest_topic_fits(void)
+{
+    memset(deviceConfig.MQTT_TOPIC_PREFIX, 'p', sizeof(deviceConfig.MQTT_TOPIC_PREFIX) - 1);
+    memset(deviceConfig.MQTT_DEVICE_ID, 'd', sizeof(deviceConfig.MQTT_DEVICE_ID) - 1);
+    deviceConfig.PAYLOAD_ENCODING = PayloadEncoding::MSGPACK_ENCODING;
+    topics.build(deviceConfig);
+
+    TEST_ASSERT_EQUAL_UINT(MQTT_TOPIC_SIZE - 1, strlen(topics.get(TOPIC_ADVERTISE)));
+    TEST_ASSERT_EQUAL_STRING(MSGPACK_TOPIC_SUFFIX, topics.get(TOPIC_ADVERTISE) + MQTT_TOPIC_SIZE - 1 - strlen(MSGPACK_TOPIC_SUFFIX));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_topics_are_per_device);
+    RUN_TEST(test_msgpack_encoding_suffixes_published_topics);
+    RUN_TEST(test_subscriptions_include_channels);
+    RUN_TEST(test_longest_topic_fits);
+    return UNITY_END();
+}
@@ -0,0 +1,156 @@
+#include <unity.h>
+#include "hal.h"
+#include "pin_stream.h"
+
+AdcSampler adcSampler;
+PinStreamer streamer(adcSampler);
+DeviceConfig deviceConfig;
+MQTTClient mqtt;
+MockClient netClient;
+char payloadBuffer[MQTT_PAYLOAD_BUFFER_SIZE];
+
+void setUp(void)
+{
+    HalMock::reset();
+    streamer.stop();
+
+    // A0 is sampled by the ADC engine
+    memset(&deviceConfig, 0, sizeof(deviceConfig));
+    deviceConfig.ANALOG_CHANNELS = 0x01;
+    deviceConfig.ANALOG_OVERSAMPLING = 1;
+    adcSampler.begin(deviceConfig);
+    adcSampler.onConversion(0);
+    adcSampler.onConversion(700);
+
+    mqtt = MQTTClient();
+    netClient.writeSpace = 2048;
+    mqtt.begin("broker", netClient);
+    mqtt.connect("test");
+}
+
+void tearDown(void)
+{
+}
+
+void fillFrame(void)
+{
+    for (uint8_t i = 0; i < STREAM_SAMPLES_PER_FRAME; i++)
+    {
+        streamer.onTick(1000UL * i);
+    }
+}
+
+void test_frame_layout(void)
+{
+    const uint8_t pins[] = {30, PIN_A0, 31};
+
+    TEST_ASSERT_EQUAL_UINT(100, streamer.start(100, pins, 3));
+
+    HalMock::setDigitalInput(31, HIGH);
+    fillFrame();
+
+    TEST_ASSERT_TRUE(streamer.flush(mqtt, netClient, "ardu-test/stream", payloadBuffer, sizeof(payloadBuffer)));
+    TEST_ASSERT_EQUAL_STRING("ardu-test/stream", mqtt.lastTopic);
+    TEST_ASSERT_EQUAL_UINT(STREAM_FRAME_HEADER_SIZE + 3 + STREAM_SAMPLES_PER_FRAME * 7, mqtt.lastPayloadLength);
+
+    const uint8_t *frame = (const uint8_t *)mqtt.lastPayload;
+    const uint8_t expectedHeader[] = {STREAM_FRAME_MARKER, 0, 3, STREAM_SAMPLES_PER_FRAME, 0x02, 0, 0, 0, 30, PIN_A0, 31};
+    // Second sample: micros() 1000, pin 31 (slot 2) high, A0 at 700
+    const uint8_t expectedSample[] = {0xE8, 0x03, 0, 0, 0x04, 0xBC, 0x02};
+
+    TEST_ASSERT_EQUAL_MEMORY(expectedHeader, frame, sizeof(expectedHeader));
+    TEST_ASSERT_EQUAL_MEMORY(expectedSample, frame + sizeof(expectedHeader) + sizeof(expectedSample), sizeof(expectedSample));
+}
+
+void test_double_buffer_drops_when_both_are_full(void)
+{
+    const uint8_t pins[] = {30};
+
+    streamer.start(100, pins, 1);
+
+    // The first frame waits for loop(), the second buffer fills up, then samples are lost
+    fillFrame();
+    fillFrame();
+    streamer.onTick(0);
+    streamer.onTick(0);
+
+    TEST_ASSERT_TRUE(streamer.flush(mqtt, netClient, "ardu-test/stream", payloadBuffer, sizeof(payloadBuffer)));
+    TEST_ASSERT_EQUAL_UINT8(0, (uint8_t)mqtt.lastPayload[1]);
+
+    // The next tick switches to the emptied buffer
+    streamer.onTick(0);
+    TEST_ASSERT_TRUE(streamer.flush(mqtt, netClient, "ardu-test/stream", payloadBuffer, sizeof(payloadBuffer)));
+    TEST_ASSERT_EQUAL_UINT8(1, (uint8_t)mqtt.lastPayload[1]);
+    TEST_ASSERT_EQUAL_UINT8(2, (uint8_t)mqtt.lastPayload[6]);
+
+    TEST_ASSERT_FALSE(streamer.flush(mqtt, netClient, "ardu-test/stream", payloadBuffer, sizeof(payloadBuffer)));
+}
+
+void test_rate_is_capped_by_link_capacity(void)
+{
+    const uint8_t pins[] = {30, PIN_A0};
+
+    TEST_ASSERT_EQUAL_UINT(200, streamer.start(200, pins, 2));
+
+    int frameLength = STREAM_FRAME_HEADER_SIZE + 2 + STREAM_SAMPLES_PER_FRAME * 7;
+    unsigned long capacity = streamer.getLinkCapacity();
+
+    // 200Hz is 1.6KB/s, the link only carries 1KB/s. publish() returns at
+    // once while the 2KB socket buffer has room, then waits for the peer.
+    for (unsigned long elapsed = 0; elapsed < 30000;)
+    {
+        int period = 1000 * STREAM_SAMPLES_PER_FRAME / streamer.getRate();
+        // One byte acknowledged per millisecond
+        int space = netClient.writeSpace + period > 2048 ? 2048 : netClient.writeSpace + period;
+
+        if (space < frameLength)
+        {
+            period += frameLength - space;
+            space = frameLength;
+        }
+
+        netClient.writeSpace = space - frameLength;
+        HalMock::advanceMillis(period);
+        elapsed += period;
+
+        fillFrame();
+        streamer.flush(mqtt, netClient, "ardu-test/stream", payloadBuffer, sizeof(payloadBuffer));
+    }
+
+    // The granted stream fits the link, with the backlog drained
+    TEST_ASSERT_TRUE(streamer.getLinkCapacity() < capacity);
+    TEST_ASSERT_TRUE(streamer.getRate() < 200);
+    TEST_ASSERT_TRUE(streamer.getRate() * frameLength / STREAM_SAMPLES_PER_FRAME <= 1000);
+    TEST_ASSERT_TRUE(netClient.writeSpace > 2048 - 2 * frameLength);
+}
+
+void test_link_keeping_up_raises_capacity(void)
+{
+    const uint8_t pins[] = {30, PIN_A0};
+
+    streamer.start(STREAM_MAX_RATE, pins, 2);
+
+    size_t frameLength = STREAM_FRAME_HEADER_SIZE + 2 + STREAM_SAMPLES_PER_FRAME * 7;
+    unsigned long capacity = streamer.getLinkCapacity();
+
+    // A frame every 5ms is 16KB/s, all of it acknowledged at once
+    for (uint8_t i = 0; i < 250; i++)
+    {
+        HalMock::advanceMillis(5);
+        fillFrame();
+        streamer.flush(mqtt, netClient, "ardu-test/stream", payloadBuffer, sizeof(payloadBuffer));
+    }
+
+    TEST_ASSERT_TRUE(streamer.getLinkCapacity() > capacity);
+    TEST_ASSERT_UINT_WITHIN(frameLength * 2, frameLength * 200, streamer.getLinkCapacity());
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_frame_layout);
+    RUN_TEST(test_double_buffer_drops_when_both_are_full);
+    RUN_TEST(test_rate_is_capped_by_link_capacity);
+    RUN_TEST(test_link_keeping_up_raises_capacity);
+    return UNITY_END();
+}
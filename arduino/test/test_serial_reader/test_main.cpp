@@ -0,0 +1,88 @@
+#include <unity.h>
+#include "hal.h"
+#include "serial_reader.h"
+
+SerialCommandReader reader;
+unsigned int messages = 0;
+char lastMessage[SERIAL_RING_BUFFER_SIZE + 1];
+size_t lastLength = 0;
+PayloadEncoding lastEncoding;
+
+void recordMessage(const char *payload, size_t length, PayloadEncoding encoding)
+{
+    messages++;
+    memcpy(lastMessage, payload, length);
+    lastMessage[length] = 0;
+    lastLength = length;
+    lastEncoding = encoding;
+}
+
+void setUp(void)
+{
+    HalMock::reset();
+    reader = SerialCommandReader();
+    messages = 0;
+}
+
+void tearDown(void)
+{
+}
+
+void test_line_is_dispatched_once_complete(void)
+{
+    HalMock::feedSerial("{\"command\":\"REBOOT\"");
+    reader.poll(Serial, &recordMessage);
+
+    // No newline yet: nothing is dispatched and poll() did not wait
+    TEST_ASSERT_EQUAL_UINT(0, messages);
+    TEST_ASSERT_EQUAL_UINT(0, millis());
+
+    HalMock::feedSerial("}\r\n{\"command\":\"RESET\"}\n");
+    reader.poll(Serial, &recordMessage);
+
+    TEST_ASSERT_EQUAL_UINT(2, messages);
+    TEST_ASSERT_EQUAL_STRING("{\"command\":\"RESET\"}", lastMessage);
+    TEST_ASSERT_EQUAL_INT(PayloadEncoding::JSON_ENCODING, lastEncoding);
+}
+
+void test_length_prefixed_frame(void)
+{
+    // 0x02, length 5, then a binary payload containing a null byte
+    const char frame[] = {SERIAL_FRAME_START, 0x00, 0x05, (char)0x81, (char)0xa1, 'a', 0x00, '\n'};
+
+    HalMock::feedSerial(frame, 4);
+    reader.poll(Serial, &recordMessage);
+    TEST_ASSERT_EQUAL_UINT(0, messages);
+
+    HalMock::feedSerial(frame + 4, sizeof(frame) - 4);
+    reader.poll(Serial, &recordMessage);
+
+    TEST_ASSERT_EQUAL_UINT(1, messages);
+    TEST_ASSERT_EQUAL_UINT(5, lastLength);
+    TEST_ASSERT_EQUAL_INT(PayloadEncoding::MSGPACK_ENCODING, lastEncoding);
+    TEST_ASSERT_EQUAL_MEMORY(frame + 3, lastMessage, 5);
+}
+
+void test_overlong_line_is_dropped(void)
+{
+    char line[SERIAL_RING_BUFFER_SIZE + 20];
+
+    memset(line, 'x', sizeof(line) - 1);
+    line[sizeof(line) - 1] = 0;
+
+    HalMock::feedSerial(line);
+    HalMock::feedSerial("\nok\n");
+    reader.poll(Serial, &recordMessage);
+
+    TEST_ASSERT_EQUAL_UINT(1, messages);
+    TEST_ASSERT_EQUAL_STRING("ok", lastMessage);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_line_is_dispatched_once_complete);
+    RUN_TEST(test_length_prefixed_frame);
+    RUN_TEST(test_overlong_line_is_dropped);
+    return UNITY_END();
+}
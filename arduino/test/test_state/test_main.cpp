@@ -0,0 +1,314 @@
+#include <unity.h>
+#include "hal.h"
+#include "state.h"
+#include "telemetry.h"
+
+MqttTopics topics;
+GlobalStateProvider stateProvider(topics);
+DeviceConfig deviceConfig = {"abc", 1, 80, "broker", "dev", 15, 30, 2, PayloadEncoding::JSON_ENCODING, StatePublishMode::PER_PIN, 0, StatusTelemetryMode::DELTA_STATUS, 3};
+char payloadBuffer[MQTT_PAYLOAD_BUFFER_SIZE];
+
+void setUp(void)
+{
+    HalMock::reset();
+}
+
+void tearDown(void)
+{
+}
+
+void test_json_writer(void)
+{
+    BufferPrint payload(payloadBuffer, sizeof(payloadBuffer));
+    JsonWriter json(payload);
+
+    json.beginObject();
+    json.member(F("name"), "a\"b");
+    json.key(F("list"));
+    json.beginArray();
+    json.value(1);
+    json.value(-2);
+    json.beginObject();
+    json.endObject();
+    json.endArray();
+    json.member(F("ok"), true);
+    json.endObject();
+
+    TEST_ASSERT_EQUAL_STRING("{\"name\":\"a\\\"b\",\"list\":[1,-2,{}],\"ok\":true}", payload.c_str());
+    TEST_ASSERT_EQUAL_UINT(payload.length(), json.size());
+}
+
+void test_buffer_overflow(void)
+{
+    char small[8];
+    BufferPrint payload(small, sizeof(small));
+
+    payload.print(F("0123456789"));
+
+    TEST_ASSERT_TRUE(payload.overflowed());
+    TEST_ASSERT_EQUAL_STRING("0123456", payload.c_str());
+}
+
+void test_state_is_streamed_without_allocations(void)
+{
+    const char *expectedPrefix =
+        "{\"device\":{\"free_memory\":1000,\"id\":\"abc\",\"version\":1},"
+        "\"http\":{\"ip\":\"10.0.0.2\",\"port\":80},"
+        "\"mqtt\":{\"host\":\"broker\",\"id\":\"dev\",\"keepalive\":15,\"timeout\":30},"
+        "\"digital\":{\"values\":[0,0,";
+    IPAddress localIp(10, 0, 0, 2);
+    BufferPrint payload(payloadBuffer, sizeof(payloadBuffer));
+
+    HalMock::resetAllocations();
+
+    size_t measured = stateProvider.measureJsonState(deviceConfig, localIp, 1000);
+    size_t written = stateProvider.writeJsonState(payload, deviceConfig, localIp, 1000);
+
+    TEST_ASSERT_EQUAL_UINT(0, HalMock::allocations());
+    TEST_ASSERT_FALSE(payload.overflowed());
+    TEST_ASSERT_EQUAL_UINT(measured, written);
+    TEST_ASSERT_EQUAL_UINT(written, payload.length());
+    TEST_ASSERT_EQUAL_INT(0, strncmp(expectedPrefix, payload.c_str(), strlen(expectedPrefix)));
+}
+
+void test_fragments_are_cached_until_invalidated(void)
+{
+    GlobalStateProvider provider(topics);
+    DeviceConfig config = deviceConfig;
+    IPAddress localIp(10, 0, 0, 2);
+    char expected[MQTT_PAYLOAD_BUFFER_SIZE];
+    BufferPrint first(expected, sizeof(expected));
+    BufferPrint payload(payloadBuffer, sizeof(payloadBuffer));
+
+    provider.writeAdvertise(first, PayloadEncoding::JSON_ENCODING, config, localIp);
+    TEST_ASSERT_EQUAL_STRING("{\"id\":\"abc\",\"fw_version\":1,\"cf_version\":1,\"serial_speed\":115200,\"ip\":\"10.0.0.2\",\"http_port\":80}", expected);
+
+    // Served from the fragment, which does not see the change yet
+    config.HTTP_SERVER_PORT = 8080;
+    provider.writeAdvertise(payload, PayloadEncoding::JSON_ENCODING, config, localIp);
+    TEST_ASSERT_EQUAL_STRING(expected, payload.c_str());
+
+    // The other encoding is not cached
+    BufferPrint msgPack(payloadBuffer, sizeof(payloadBuffer));
+    MsgPackWriter writer(msgPack);
+    provider.writeAdvertise(writer, config, localIp);
+    TEST_ASSERT_EQUAL_UINT(8080 >> 8, (uint8_t)payloadBuffer[msgPack.length() - 2]);
+
+    provider.invalidateFragments();
+
+    BufferPrint updated(payloadBuffer, sizeof(payloadBuffer));
+    provider.writeAdvertise(updated, PayloadEncoding::JSON_ENCODING, config, localIp);
+    TEST_ASSERT_NOT_NULL(strstr(updated.c_str(), "\"http_port\":8080}"));
+
+    BufferPrint state(payloadBuffer, sizeof(payloadBuffer));
+    provider.writeJsonState(state, config, localIp, 900);
+    TEST_ASSERT_NOT_NULL(strstr(state.c_str(), "{\"device\":{\"free_memory\":900,\"id\":\"abc\",\"version\":1},\"http\":{\"ip\":\"10.0.0.2\",\"port\":8080},\"mqtt\""));
+}
+
+void test_scan_reports_only_changed_watched_pins(void)
+{
+    GlobalStateProvider provider(topics);
+    MQTTClient mqtt;
+    MockClient netClient;
+
+    mqtt.begin("broker", netClient);
+    mqtt.connect("test");
+
+    HalMock::setDigitalInput(31, HIGH);
+    HalMock::setDigitalInput(40, HIGH);
+    HalMock::setDigitalInput(10, HIGH);
+
+    provider.computeStateChanges(mqtt, deviceConfig);
+
+    TEST_ASSERT_EQUAL_UINT(2, mqtt.publishedMessages);
+    TEST_ASSERT_EQUAL_INT(1, provider.digitalPinValue(31));
+    TEST_ASSERT_EQUAL_INT(1, provider.digitalPinValue(10));
+    TEST_ASSERT_EQUAL_INT(0, provider.digitalPinValue(32));
+
+    // A second scan without changes publishes nothing
+    provider.computeStateChanges(mqtt, deviceConfig);
+    TEST_ASSERT_EQUAL_UINT(2, mqtt.publishedMessages);
+
+    HalMock::setDigitalInput(40, LOW);
+    provider.computeStateChanges(mqtt, deviceConfig);
+    TEST_ASSERT_EQUAL_UINT(3, mqtt.publishedMessages);
+}
+
+void test_batched_changes_are_coalesced(void)
+{
+    GlobalStateProvider provider(topics);
+    DeviceConfig batchedConfig = deviceConfig;
+    MQTTClient mqtt;
+    MockClient netClient;
+
+    batchedConfig.STATE_PUBLISH_MODE = StatePublishMode::BATCHED;
+    batchedConfig.STATE_COALESCE_WINDOW = 100;
+
+    mqtt.begin("broker", netClient);
+    mqtt.connect("test");
+
+    HalMock::advanceMillis(1000);
+    HalMock::setDigitalInput(31, HIGH);
+    HalMock::setDigitalInput(40, HIGH);
+    provider.computeStateChanges(mqtt, batchedConfig);
+
+    HalMock::advanceMillis(50);
+    HalMock::setDigitalInput(41, HIGH);
+    provider.computeStateChanges(mqtt, batchedConfig);
+
+    // Still inside the coalescing window
+    TEST_ASSERT_EQUAL_UINT(0, mqtt.publishedMessages);
+
+    HalMock::advanceMillis(50);
+    provider.computeStateChanges(mqtt, batchedConfig);
+
+    TEST_ASSERT_EQUAL_UINT(1, mqtt.publishedMessages);
+    TEST_ASSERT_EQUAL_STRING("{\"type\":1,\"changes\":[[31,1,1000],[40,1,1000],[41,1,1050]]}", mqtt.lastPayload);
+}
+
+void test_status_deltas_only_carry_changes(void)
+{
+    GlobalStateProvider provider(topics);
+    StatusTelemetry telemetry;
+    MQTTClient mqtt;
+    MockClient netClient;
+    IPAddress localIp(10, 0, 0, 2);
+    const char *keyframePrefix = "{\"seq\":0,\"keyframe\":true,\"device\":";
+    const char *resyncPrefix = "{\"seq\":3,\"keyframe\":true,";
+
+    mqtt.begin("broker", netClient);
+    mqtt.connect("test");
+
+    // The first message is always a keyframe
+    BufferPrint keyframe(payloadBuffer, sizeof(payloadBuffer));
+    telemetry.writeStatus(keyframe, PayloadEncoding::JSON_ENCODING, provider, deviceConfig, localIp, 1000);
+    telemetry.published(true);
+
+    TEST_ASSERT_EQUAL_INT(0, strncmp(keyframePrefix, keyframe.c_str(), strlen(keyframePrefix)));
+
+    // Nothing changed: an empty delta
+    BufferPrint empty(payloadBuffer, sizeof(payloadBuffer));
+    telemetry.writeStatus(empty, PayloadEncoding::JSON_ENCODING, provider, deviceConfig, localIp, 1000);
+    telemetry.published(true);
+
+    TEST_ASSERT_EQUAL_STRING("{\"seq\":1,\"keyframe\":false}", empty.c_str());
+
+    HalMock::setDigitalInput(31, HIGH);
+    provider.computeStateChanges(mqtt, deviceConfig);
+
+    BufferPrint delta(payloadBuffer, sizeof(payloadBuffer));
+    telemetry.writeStatus(delta, PayloadEncoding::JSON_ENCODING, provider, deviceConfig, localIp, 900);
+    telemetry.published(true);
+
+    TEST_ASSERT_EQUAL_STRING("{\"seq\":2,\"keyframe\":false,\"device\":{\"free_memory\":900},\"digital\":{\"changes\":[[31,1]]}}", delta.c_str());
+
+    // A failed publish is followed by a keyframe
+    BufferPrint lost(payloadBuffer, sizeof(payloadBuffer));
+    telemetry.writeStatus(lost, PayloadEncoding::JSON_ENCODING, provider, deviceConfig, localIp, 900);
+    telemetry.published(false);
+
+    BufferPrint resync(payloadBuffer, sizeof(payloadBuffer));
+    telemetry.writeStatus(resync, PayloadEncoding::JSON_ENCODING, provider, deviceConfig, localIp, 900);
+
+    TEST_ASSERT_EQUAL_INT(0, strncmp(resyncPrefix, resync.c_str(), strlen(resyncPrefix)));
+}
+
+void test_status_deltas_ignore_unmapped_port_bits(void)
+{
+    GlobalStateProvider provider(topics);
+    StatusTelemetry telemetry;
+    MQTTClient mqtt;
+    MockClient netClient;
+    IPAddress localIp(10, 0, 0, 2);
+    // Pins 64 to 69 use the low bits of the last port, bit 7 floats
+    uint8_t port = digitalPinToPort(NUM_DIGITAL_PINS - 1);
+
+    mqtt.begin("broker", netClient);
+    mqtt.connect("test");
+
+    BufferPrint keyframe(payloadBuffer, sizeof(payloadBuffer));
+    telemetry.writeStatus(keyframe, PayloadEncoding::JSON_ENCODING, provider, deviceConfig, localIp, 1000);
+    telemetry.published(true);
+
+    TEST_ASSERT_EQUAL_UINT8(0, provider.mappedPinMask(port) & 0x80);
+
+    HalMock::board().portInputs[port] |= 0x80;
+    provider.computeStateChanges(mqtt, deviceConfig);
+
+    BufferPrint delta(payloadBuffer, sizeof(payloadBuffer));
+    telemetry.writeStatus(delta, PayloadEncoding::JSON_ENCODING, provider, deviceConfig, localIp, 1000);
+
+    TEST_ASSERT_EQUAL_STRING("{\"seq\":1,\"keyframe\":false}", delta.c_str());
+}
+
+void test_msgpack_writer(void)
+{
+    BufferPrint payload(payloadBuffer, sizeof(payloadBuffer));
+    MsgPackWriter writer(payload);
+    const uint8_t expected[] = {
+        0x83,                   // map of 3
+        0xa1, 'a', 0x05,        // "a": 5
+        0xa1, 'b', 0x93,        // "b": [
+        0xff,                   //   -1,
+        0xcd, 0x03, 0xe8,       //   1000,
+        0xd0, 0x9c,             //   -100]
+        0xa1, 'c', 0xc3};       // "c": true
+
+    writer.beginObject(3);
+    writer.member(F("a"), 5);
+    writer.key("b");
+    writer.beginArray(3);
+    writer.value(-1);
+    writer.value(1000);
+    writer.value(-100);
+    writer.endArray();
+    writer.member(F("c"), true);
+    writer.endObject();
+
+    TEST_ASSERT_EQUAL_UINT(sizeof(expected), payload.length());
+    TEST_ASSERT_EQUAL_UINT(payload.length(), writer.size());
+    TEST_ASSERT_EQUAL_MEMORY(expected, payload.c_str(), sizeof(expected));
+}
+
+void test_msgpack_state_is_smaller(void)
+{
+    IPAddress localIp(10, 0, 0, 2);
+    BufferPrint payload(payloadBuffer, sizeof(payloadBuffer));
+
+    size_t measured = stateProvider.measureState(PayloadEncoding::MSGPACK_ENCODING, deviceConfig, localIp, 1000);
+    size_t written = stateProvider.writeState(payload, PayloadEncoding::MSGPACK_ENCODING, deviceConfig, localIp, 1000);
+
+    TEST_ASSERT_EQUAL_UINT(measured, written);
+    TEST_ASSERT_LESS_THAN_UINT(stateProvider.measureJsonState(deviceConfig, localIp, 1000), written);
+    // Map of 4 sections, the first one being "device"
+    TEST_ASSERT_EQUAL_HEX8(0x84, (uint8_t)payload.c_str()[0]);
+    TEST_ASSERT_EQUAL_HEX8(0xa6, (uint8_t)payload.c_str()[1]);
+}
+
+void test_encoding_negotiation(void)
+{
+    TEST_ASSERT_EQUAL_INT(PayloadEncoding::MSGPACK_ENCODING, encodingFromMediaType("application/msgpack"));
+    TEST_ASSERT_EQUAL_INT(PayloadEncoding::MSGPACK_ENCODING, encodingFromMediaType("application/x-msgpack, */*"));
+    TEST_ASSERT_EQUAL_INT(PayloadEncoding::JSON_ENCODING, encodingFromMediaType("application/json"));
+    TEST_ASSERT_EQUAL_INT(PayloadEncoding::JSON_ENCODING, encodingFromMediaType(nullptr));
+
+    TEST_ASSERT_TRUE(isMsgPackTopic("ardu-test/receive/msgpack"));
+    TEST_ASSERT_FALSE(isMsgPackTopic("ardu-test/receive"));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_json_writer);
+    RUN_TEST(test_buffer_overflow);
+    RUN_TEST(test_state_is_streamed_without_allocations);
+    RUN_TEST(test_fragments_are_cached_until_invalidated);
+    RUN_TEST(test_scan_reports_only_changed_watched_pins);
+    RUN_TEST(test_batched_changes_are_coalesced);
+    RUN_TEST(test_status_deltas_only_carry_changes);
+    RUN_TEST(test_status_deltas_ignore_unmapped_port_bits);
+    RUN_TEST(test_msgpack_writer);
+    RUN_TEST(test_msgpack_state_is_smaller);
+    RUN_TEST(test_encoding_negotiation);
+    return UNITY_END();
+}
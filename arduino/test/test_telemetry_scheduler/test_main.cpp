@@ -0,0 +1,127 @@
+#include <unity.h>
+#include "hal.h"
+#include "telemetry_scheduler.h"
+
+TelemetryScheduler scheduler;
+DeviceConfig deviceConfig;
+
+void setUp(void)
+{
+    HalMock::reset();
+
+    memset(&deviceConfig, 0, sizeof(deviceConfig));
+    deviceConfig.STATUS_INTERVAL = 32;
+    deviceConfig.STATUS_ACTIVE_INTERVAL = 4;
+    deviceConfig.METRICS_INTERVAL = 64;
+    deviceConfig.STATE_SCAN_INTERVAL = 25;
+
+    scheduler = TelemetryScheduler();
+    scheduler.configure(deviceConfig);
+}
+
+void tearDown(void)
+{
+}
+
+/**
+ * Asserts that a delay is the period with at most 1/16 of jitter.
+ */
+void assertPeriod(unsigned long period, unsigned long delay)
+{
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT(period - period / 16, delay);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT(period + period / 16, delay);
+}
+
+void test_phase_depends_on_the_board(void)
+{
+    unsigned long phase = scheduler.phase(TELEMETRY_STATUS);
+
+    TEST_ASSERT_LESS_THAN_UINT(32000, phase);
+    TEST_ASSERT_EQUAL_UINT(phase, scheduler.phase(TELEMETRY_STATUS));
+
+    uint8_t saved = UniqueID[UniqueIDsize - 1];
+    UniqueID[UniqueIDsize - 1] ^= 0x5A;
+
+    TEST_ASSERT_NOT_EQUAL(phase, scheduler.phase(TELEMETRY_STATUS));
+
+    UniqueID[UniqueIDsize - 1] = saved;
+}
+
+void test_failed_publishes_back_off(void)
+{
+    assertPeriod(64000, scheduler.nextDelay(TELEMETRY_METRICS, millis()));
+
+    scheduler.published(TELEMETRY_METRICS, false);
+    assertPeriod(128000, scheduler.nextDelay(TELEMETRY_METRICS, millis()));
+
+    for (uint8_t i = 0; i < 10; i++)
+    {
+        scheduler.published(TELEMETRY_METRICS, false);
+    }
+
+    assertPeriod(64000UL << TELEMETRY_MAX_BACKOFF_SHIFT, scheduler.nextDelay(TELEMETRY_METRICS, millis()));
+    // The other tasks keep their period
+    assertPeriod(32000, scheduler.nextDelay(TELEMETRY_STATUS, millis()));
+
+    scheduler.published(TELEMETRY_METRICS, true);
+    assertPeriod(64000, scheduler.nextDelay(TELEMETRY_METRICS, millis()));
+
+    scheduler.published(TELEMETRY_STATUS, false);
+    scheduler.resetBackoff();
+    assertPeriod(32000, scheduler.nextDelay(TELEMETRY_STATUS, millis()));
+}
+
+void test_slow_loop_backs_off(void)
+{
+    for (uint8_t i = 0; i < 64; i++)
+    {
+        scheduler.recordLoop(2 * TELEMETRY_LATENCY_LIMIT);
+    }
+
+    assertPeriod(64000, scheduler.nextDelay(TELEMETRY_STATUS, millis()));
+
+    for (uint8_t i = 0; i < 64; i++)
+    {
+        scheduler.recordLoop(100);
+    }
+
+    assertPeriod(32000, scheduler.nextDelay(TELEMETRY_STATUS, millis()));
+}
+
+void test_pin_activity_speeds_up_status(void)
+{
+    TEST_ASSERT_TRUE(scheduler.onPinActivity(millis()));
+    TEST_ASSERT_FALSE(scheduler.onPinActivity(millis()));
+
+    assertPeriod(4000, scheduler.nextDelay(TELEMETRY_STATUS, millis()));
+    assertPeriod(64000, scheduler.nextDelay(TELEMETRY_METRICS, millis()));
+
+    HalMock::advanceMillis(TELEMETRY_ACTIVE_WINDOW);
+
+    assertPeriod(32000, scheduler.nextDelay(TELEMETRY_STATUS, millis()));
+    TEST_ASSERT_TRUE(scheduler.onPinActivity(millis()));
+
+    // No faster cadence configured
+    deviceConfig.STATUS_ACTIVE_INTERVAL = 0;
+    scheduler.configure(deviceConfig);
+    HalMock::advanceMillis(TELEMETRY_ACTIVE_WINDOW);
+
+    TEST_ASSERT_FALSE(scheduler.onPinActivity(millis()));
+    assertPeriod(32000, scheduler.nextDelay(TELEMETRY_STATUS, millis()));
+}
+
+void test_scan_interval_is_configured(void)
+{
+    TEST_ASSERT_EQUAL_UINT(25, scheduler.getScanInterval());
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_phase_depends_on_the_board);
+    RUN_TEST(test_failed_publishes_back_off);
+    RUN_TEST(test_slow_loop_backs_off);
+    RUN_TEST(test_pin_activity_speeds_up_status);
+    RUN_TEST(test_scan_interval_is_configured);
+    return UNITY_END();
+}